@@ -227,6 +227,16 @@ let
       nix = build.x86_64-linux; system = "x86_64-linux";
     });
 
+    tests.s3-binary-cache-store = (import ./tests/s3-binary-cache-store.nix rec {
+      inherit nixpkgs;
+      nix = build.x86_64-linux; system = "x86_64-linux";
+    });
+
+    tests.resume-download = (import ./tests/resume-download.nix rec {
+      inherit nixpkgs;
+      nix = build.x86_64-linux; system = "x86_64-linux";
+    });
+
     tests.setuid = pkgs.lib.genAttrs
       ["i686-linux" "x86_64-linux"]
       (system:
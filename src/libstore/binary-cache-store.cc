@@ -1,6 +1,7 @@
 #include "archive.hh"
 #include "binary-cache-store.hh"
 #include "compression.hh"
+#include "download.hh"
 #include "derivations.hh"
 #include "fs-accessor.hh"
 #include "globals.hh"
@@ -9,11 +10,19 @@
 #include "remote-fs-accessor.hh"
 #include "nar-info-disk-cache.hh"
 #include "nar-accessor.hh"
+#include "pathlocks.hh"
 #include "json.hh"
+#include "chunker.hh"
+#include "thread-pool.hh"
 
+#include <algorithm>
 #include <chrono>
+#include <deque>
 
+#include <fcntl.h>
+#include <fstream>
 #include <future>
+#include <sys/time.h>
 
 namespace nix {
 
@@ -22,10 +31,6 @@ BinaryCacheStore::BinaryCacheStore(const Params & params)
 {
     if (secretKeyFile != "")
         secretKey = std::unique_ptr<SecretKey>(new SecretKey(readFile(secretKeyFile)));
-
-    StringSink sink;
-    sink << narVersionMagic1;
-    narMagic = *sink.s;
 }
 
 void BinaryCacheStore::init()
@@ -49,11 +54,30 @@ void BinaryCacheStore::init()
                 wantMassQuery_ = value == "1";
             } else if (name == "Priority") {
                 string2Int(value, priority);
-            }
+            } else
+                setExtraCacheInfo({{name, value}});
         }
     }
 }
 
+StringMap BinaryCacheStore::getExtraCacheInfo()
+{
+    StringMap info;
+    if (narInfoBundleFile != "") info["NarInfoBundle"] = narInfoBundleFile;
+    if (cacheIndexFile != "") info["CacheIndex"] = cacheIndexFile;
+    return info;
+}
+
+void BinaryCacheStore::setExtraCacheInfo(const StringMap & info)
+{
+    for (auto & i : info) {
+        if (i.first == "NarInfoBundle")
+            narInfoBundleFile = i.second;
+        else if (i.first == "CacheIndex")
+            cacheIndexFile = i.second;
+    }
+}
+
 std::shared_ptr<std::string> BinaryCacheStore::getFile(const std::string & path)
 {
     std::promise<std::shared_ptr<std::string>> promise;
@@ -67,12 +91,62 @@ std::shared_ptr<std::string> BinaryCacheStore::getFile(const std::string & path)
     return promise.get_future().get();
 }
 
+void BinaryCacheStore::getFile(const std::string & path, Sink & sink)
+{
+    auto data = getFile(path);
+    if (!data)
+        throw NoSuchBinaryCacheFile("file '%s' does not exist in binary cache '%s'", path, getUri());
+    sink(*data);
+}
+
+void BinaryCacheStore::getFile(const std::string & path, uint64_t offset, Sink & sink)
+{
+    LambdaSink skipSink([&](const unsigned char * data, size_t len) {
+        auto n = std::min((uint64_t) len, offset);
+        offset -= n;
+        if (len > n) sink(data + n, len - n);
+    });
+    getFile(path, skipSink);
+}
+
+static std::string compressionExtension(const std::string & method)
+{
+    return
+        method == "xz" ? ".xz" :
+        method == "bzip2" ? ".bz2" :
+        method == "br" ? ".br" :
+        method == "zstd" ? ".zst" :
+        "";
+}
+
+std::string BinaryCacheStore::chunkFileFor(const Hash & hash, const std::string & method)
+{
+    return "chunks/" + hash.to_string(Base32, false) + compressionExtension(method);
+}
+
 Path BinaryCacheStore::narInfoFileFor(const Path & storePath)
 {
     assertStorePath(storePath);
     return storePathToHash(storePath) + ".narinfo";
 }
 
+/* Return the offset of the first entry not less than 'hashPart' in
+   a sorted concatenation of hash parts. */
+static size_t findHashPart(const std::string & hashParts, const std::string & hashPart)
+{
+    size_t lo = 0, hi = hashParts.size() / 32;
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (hashParts.compare(mid * 32, 32, hashPart) < 0) lo = mid + 1; else hi = mid;
+    }
+    return lo * 32;
+}
+
+static bool hasHashPart(const std::string & hashParts, size_t pos, const std::string & hashPart)
+{
+    return pos < hashParts.size() && hashParts.compare(pos, 32, hashPart) == 0;
+}
+
 void BinaryCacheStore::writeNarInfo(ref<NarInfo> narInfo)
 {
     auto narInfoFile = narInfoFileFor(narInfo->path);
@@ -88,13 +162,49 @@ void BinaryCacheStore::writeNarInfo(ref<NarInfo> narInfo)
 
     if (diskCache)
         diskCache->upsertNarInfo(getUri(), hashPart, std::shared_ptr<NarInfo>(narInfo));
+
+    if (cacheIndexFile != "") {
+        addToCacheIndex(hashPart);
+
+        auto index(cacheIndex.lock());
+        if (index->valid) {
+            auto pos = findHashPart(index->hashParts, hashPart);
+            if (!hasHashPart(index->hashParts, pos, hashPart))
+                index->hashParts.insert(pos, hashPart);
+        }
+    }
 }
 
-void BinaryCacheStore::addToStore(const ValidPathInfo & info, const ref<std::string> & nar,
-    RepairFlag repair, CheckSigsFlag checkSigs, std::shared_ptr<FSAccessor> accessor)
+BinaryCacheStore::ConditionalFile BinaryCacheStore::getFileIfChanged(const std::string & path, const std::string & etag)
 {
-    if (!repair && isValidPath(info.path)) return;
+    ConditionalFile res;
+    res.data = getFile(path);
+    return res;
+}
+
+void BinaryCacheStore::addToCacheIndex(const std::string & hashPart)
+{
+    static std::atomic<bool> warned{false};
+    if (!warned.exchange(true))
+        printError("warning: binary cache '%s' cannot update its index incrementally; "
+            "run 'nix make-cache-index' after copying paths to it", getUri());
+}
 
+void BinaryCacheStore::upsertFile(const std::string & path,
+    std::shared_ptr<std::basic_iostream<char>> istream,
+    const std::string & mimeType)
+{
+    std::string data;
+    std::vector<char> buf(65536);
+    while (istream->read(buf.data(), buf.size()), istream->gcount())
+        data.append(buf.data(), istream->gcount());
+    if (istream->bad())
+        throw Error("reading data for '%s'", path);
+    upsertFile(path, data, mimeType);
+}
+
+void BinaryCacheStore::checkReferences(const ValidPathInfo & info)
+{
     /* Verify that all references are valid. This may do some .narinfo
        reads, but typically they'll already be cached. */
     for (auto & ref : info.references)
@@ -105,18 +215,117 @@ void BinaryCacheStore::addToStore(const ValidPathInfo & info, const ref<std::str
             throw Error(format("cannot add '%s' to the binary cache because the reference '%s' is not valid")
                 % info.path % ref);
         }
+}
+
+void BinaryCacheStore::addToStore(const ValidPathInfo & info, Source & narSource,
+    RepairFlag repair, CheckSigsFlag checkSigs, std::shared_ptr<FSAccessor> accessor)
+{
+    if (!repair && isValidPath(info.path)) return;
 
-    assert(nar->compare(0, narMagic.size(), narMagic) == 0);
+    checkReferences(info);
 
     auto narInfo = make_ref<NarInfo>(info);
 
-    narInfo->narSize = nar->size();
-    narInfo->narHash = hashString(htSHA256, *nar);
+    /* Compress the NAR into a temporary file (or into chunks) while
+       it streams past, hashing both the NAR and the compressed result
+       and indexing its contents along the way. This way, we never
+       hold the NAR in memory. */
+    Path tmpDir = createTempDir();
+    AutoDelete delTmpDir(tmpDir, true);
+    Path tmpFile = tmpDir + "/nar";
+
+    HashSink narHashSink(htSHA256);
+    HashSink fileHashSink(htSHA256);
+
+    auto now1 = std::chrono::steady_clock::now();
+
+    std::shared_ptr<FSAccessor> narAccessor;
+
+    auto processNar = [&](Sink & sink) {
+        LambdaSource teeSource([&](unsigned char * data, size_t len) {
+            size_t n = narSource.read(data, len);
+            narHashSink(data, n);
+            sink(data, n);
+            return n;
+        });
+
+        /* Parsing the NAR also verifies that it's well-formed and
+           makes sure we stop reading at its end. */
+        narAccessor = makeNarAccessor(teeSource);
+    };
+
+    /* In chunked mode, the NAR file is replaced by a list of chunks
+       (see narFromChunks()). */
+    std::string chunkList;
+    uint64_t chunksSize = 0;
+
+    if (chunkNARs) {
+        chunkList = "Compression: " + compression.get() + "\n";
+
+        ChunkingSink chunker(chunkSize / 4, chunkSize, chunkSize * 4, [&](std::string chunk) {
+            auto hash = hashString(htSHA256, chunk);
+            auto compressed = compress(compression, chunk, parallelCompression, compressionLevel,
+                settings.compressionThreads);
+            auto chunkFile = chunkFileFor(hash, compression);
+            if (repair || !fileExists(chunkFile)) {
+                stats.chunkWrite++;
+                upsertFile(chunkFile, *compressed, "application/x-nix-nar-chunk");
+            } else
+                stats.chunkWriteAverted++;
+            chunkList += fmt("%s %d %d\n", hash.to_string(Base32, false), chunk.size(), compressed->size());
+            chunksSize += compressed->size();
+        });
+
+        processNar(chunker);
+        chunker.finish();
+    }
+
+    else {
+        AutoCloseFD fd = open(tmpFile.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if (!fd) throw SysError(format("creating file '%1%'") % tmpFile);
+
+        FdSink fileSink(fd.get());
+
+        LambdaSink teeSink([&](const unsigned char * data, size_t len) {
+            fileSink(data, len);
+            fileHashSink(data, len);
+        });
+
+        auto compressionSink = makeCompressionSink(compression, teeSink, parallelCompression, compressionLevel,
+            settings.compressionThreads);
+
+        /* Verify and hash the NAR in a separate thread, so that it
+           overlaps with compression. */
+        if (settings.copyCompressionBufferSize)
+            sinkToSourceAsync(processNar, settings.copyCompressionBufferSize)->drainInto(*compressionSink);
+        else
+            processNar(*compressionSink);
+
+        compressionSink->finish();
+        fileSink.flush();
+    }
+
+    auto now2 = std::chrono::steady_clock::now();
+
+    auto narHash = narHashSink.finish();
+    narInfo->narHash = narHash.first;
+    narInfo->narSize = narHash.second;
 
     if (info.narHash && info.narHash != narInfo->narHash)
         throw Error(format("refusing to copy corrupted path '%1%' to binary cache") % info.path);
 
-    auto accessor_ = std::dynamic_pointer_cast<RemoteFSAccessor>(accessor);
+    if (chunkNARs) {
+        /* The file size is what a client without any cached chunks
+           has to download. */
+        narInfo->compression = "chunked";
+        narInfo->fileHash = hashString(htSHA256, chunkList);
+        narInfo->fileSize = chunkList.size() + chunksSize;
+    } else {
+        auto fileHash = fileHashSink.finish();
+        narInfo->compression = compression;
+        narInfo->fileHash = fileHash.first;
+        narInfo->fileSize = fileHash.second;
+    }
 
     /* Optionally write a JSON file containing a listing of the
        contents of the NAR. */
@@ -127,53 +336,43 @@ void BinaryCacheStore::addToStore(const ValidPathInfo & info, const ref<std::str
             JSONObject jsonRoot(jsonOut);
             jsonRoot.attr("version", 1);
 
-            auto narAccessor = makeNarAccessor(nar);
-
-            if (accessor_)
-                accessor_->addToCache(info.path, *nar, narAccessor);
-
             {
                 auto res = jsonRoot.placeholder("root");
-                listNar(res, narAccessor, "", true);
+                listNar(res, ref<FSAccessor>(narAccessor), "", true);
             }
         }
 
         upsertFile(storePathToHash(info.path) + ".ls", jsonOut.str(), "application/json");
     }
 
-    else {
-        if (accessor_)
-            accessor_->addToCache(info.path, *nar, makeNarAccessor(nar));
-    }
-
-    /* Compress the NAR. */
-    narInfo->compression = compression;
-    auto now1 = std::chrono::steady_clock::now();
-    auto narCompressed = compress(compression, *nar, parallelCompression);
-    auto now2 = std::chrono::steady_clock::now();
-    narInfo->fileHash = hashString(htSHA256, *narCompressed);
-    narInfo->fileSize = narCompressed->size();
-
     auto duration = std::chrono::duration_cast<std::chrono::milliseconds>(now2 - now1).count();
     printMsg(lvlTalkative, format("copying path '%1%' (%2% bytes, compressed %3$.1f%% in %4% ms) to binary cache")
         % narInfo->path % narInfo->narSize
-        % ((1.0 - (double) narCompressed->size() / nar->size()) * 100.0)
+        % ((1.0 - (double) narInfo->fileSize / narInfo->narSize) * 100.0)
         % duration);
 
-    /* Atomically write the NAR file. */
-    narInfo->url = "nar/" + narInfo->fileHash.to_string(Base32, false) + ".nar"
-        + (compression == "xz" ? ".xz" :
-           compression == "bzip2" ? ".bz2" :
-           compression == "br" ? ".br" :
-           "");
-    if (repair || !fileExists(narInfo->url)) {
-        stats.narWrite++;
-        upsertFile(narInfo->url, *narCompressed, "application/x-nix-nar");
-    } else
-        stats.narWriteAverted++;
-
-    stats.narWriteBytes += nar->size();
-    stats.narWriteCompressedBytes += narCompressed->size();
+    /* Atomically write the NAR file (or chunk list). */
+    if (chunkNARs) {
+        narInfo->url = "nar/" + narInfo->fileHash.to_string(Base32, false) + ".chunks";
+        if (repair || !fileExists(narInfo->url)) {
+            stats.narWrite++;
+            upsertFile(narInfo->url, chunkList, "text/x-nix-nar-chunks");
+        } else
+            stats.narWriteAverted++;
+    } else {
+        narInfo->url = "nar/" + narInfo->fileHash.to_string(Base32, false) + ".nar"
+            + compressionExtension(compression);
+        if (repair || !fileExists(narInfo->url)) {
+            stats.narWrite++;
+            upsertFile(narInfo->url,
+                std::make_shared<std::fstream>(tmpFile, std::ios_base::in | std::ios_base::binary),
+                "application/x-nix-nar");
+        } else
+            stats.narWriteAverted++;
+    }
+
+    stats.narWriteBytes += narInfo->narSize;
+    stats.narWriteCompressedBytes += narInfo->fileSize;
     stats.narWriteCompressionTimeMs += duration;
 
     /* Atomically write the NAR info file.*/
@@ -184,39 +383,697 @@ void BinaryCacheStore::addToStore(const ValidPathInfo & info, const ref<std::str
     stats.narInfoWrite++;
 }
 
+void BinaryCacheStore::addToStore(const ValidPathInfo & info, const ref<std::string> & nar,
+    RepairFlag repair, CheckSigsFlag checkSigs, std::shared_ptr<FSAccessor> accessor)
+{
+    if (!repair && isValidPath(info.path)) return;
+
+    /* Since we have the whole NAR in memory anyway, we can make it
+       available to the caller's accessor. */
+    auto accessor_ = std::dynamic_pointer_cast<RemoteFSAccessor>(accessor);
+    if (accessor_)
+        accessor_->addToCache(info.path, *nar, makeNarAccessor(nar));
+
+    StringSource source(*nar);
+    addToStore(info, source, repair, checkSigs, accessor);
+}
+
+static const std::string narInfoBundleName = "narinfo-bundle";
+
+void BinaryCacheStore::writeNarInfoBundle()
+{
+    auto paths = queryAllValidPaths();
+
+    /* Entries are .narinfo files separated by empty lines. */
+    Sync<std::string> bundle_;
+
+    ThreadPool pool;
+
+    for (auto & path : paths)
+        pool.enqueue([&, path]() {
+            auto data = getFile(narInfoFileFor(path));
+            if (!data) return;
+            if (!hasSuffix(*data, "\n")) *data += "\n";
+            auto bundle(bundle_.lock());
+            *bundle += *data;
+            *bundle += "\n";
+        });
+
+    pool.process();
+
+    auto file = narInfoBundleName + compressionExtension(compression);
+
+    upsertFile(file, *nix::compress(compression, *bundle_.lock(), parallelCompression, compressionLevel,
+        settings.compressionThreads),
+        "application/x-nix-narinfo-bundle");
+
+    setCacheInfo("NarInfoBundle", file);
+
+    narInfoBundleFile = file;
+    *narInfoBundle.lock() = NarInfoBundle();
+
+    printInfo("wrote .narinfo bundle '%s' containing %d paths", file, paths.size());
+}
+
+void BinaryCacheStore::setCacheInfo(const std::string & name, const std::string & value)
+{
+    std::string cacheInfoFile = "nix-cache-info";
+    std::string cacheInfo;
+    auto oldCacheInfo = getFile(cacheInfoFile);
+    for (auto & line : tokenizeString<Strings>(oldCacheInfo ? *oldCacheInfo : "StoreDir: " + storeDir, "\n"))
+        if (!hasPrefix(line, name + ":"))
+            cacheInfo += line + "\n";
+    cacheInfo += name + ": " + value + "\n";
+    upsertFile(cacheInfoFile, cacheInfo, "text/x-nix-cache-info");
+}
+
+static const std::string cacheIndexName = "nix-cache-index";
+
+/* The index is a text file containing one hash part per line. Lines
+   that aren't hash parts (e.g. comments) are ignored, and the lines
+   need not be sorted, so that writers can simply append to it. */
+static std::string parseCacheIndex(const std::string & data)
+{
+    std::vector<std::string> hashParts;
+    for (auto & line : tokenizeString<std::vector<std::string>>(data, "\n"))
+        if (line.size() == 32 && line.find_first_not_of(base32Chars) == std::string::npos)
+            hashParts.push_back(line);
+
+    std::sort(hashParts.begin(), hashParts.end());
+
+    std::string res;
+    res.reserve(hashParts.size() * 32);
+    for (auto & hashPart : hashParts)
+        if (res.empty() || res.compare(res.size() - 32, 32, hashPart) != 0)
+            res += hashPart;
+    return res;
+}
+
+void BinaryCacheStore::writeCacheIndex()
+{
+    std::string index = "# " + cacheIndexName + "\n";
+    for (auto & path : queryAllValidPaths())
+        index += storePathToHash(path) + "\n";
+
+    upsertFile(cacheIndexName, index, "text/plain");
+
+    setCacheInfo("CacheIndex", cacheIndexName);
+
+    cacheIndexFile = cacheIndexName;
+    *cacheIndex.lock() = CacheIndex();
+
+    printInfo("wrote index of binary cache '%s'", getUri());
+}
+
+void BinaryCacheStore::refreshCacheIndex(CacheIndex & index)
+{
+    /* Keep a copy of the index and its ETag, so that we don't have to
+       fetch it again if it hasn't changed. */
+    Path cacheDir = getCacheDir() + "/nix/binary-cache-index";
+    Path cacheFile = cacheDir + "/" + hashString(htSHA256, getUri()).to_string(Base32, false);
+
+    auto etag = index.etag;
+    if (!index.valid && pathExists(cacheFile) && pathExists(cacheFile + ".etag"))
+        etag = readFile(cacheFile + ".etag");
+
+    auto res = getFileIfChanged(cacheIndexFile, etag);
+
+    if (res.unchanged) {
+        if (!index.valid) {
+            index.hashParts = parseCacheIndex(readFile(cacheFile));
+            index.etag = etag;
+            index.valid = true;
+        }
+        return;
+    }
+
+    if (!res.data)
+        throw Error("file '%s' does not exist", cacheIndexFile);
+
+    index.hashParts = parseCacheIndex(*res.data);
+    index.etag = res.etag;
+    index.valid = true;
+
+    if (res.etag != "") {
+        createDirs(cacheDir);
+        writeFile(cacheFile, *res.data);
+        writeFile(cacheFile + ".etag", res.etag);
+    }
+
+    debug("loaded index of binary cache '%s' with %d entries", getUri(), index.hashParts.size() / 32);
+}
+
+bool BinaryCacheStore::knownMissing(const std::string & hashPart)
+{
+    if (!useCacheIndex || cacheIndexFile == "") return false;
+
+    auto index(cacheIndex.lock());
+
+    auto now = time(0);
+    if (index->lastRefresh + (time_t) settings.ttlNegativeNarInfoCache <= now) {
+        index->lastRefresh = now;
+        try {
+            refreshCacheIndex(*index);
+        } catch (Error & e) {
+            printError("warning: unable to fetch index of binary cache '%s': %s", getUri(), e.what());
+            index->valid = false;
+        }
+    }
+
+    if (!index->valid) return false;
+
+    return !hasHashPart(index->hashParts, findHashPart(index->hashParts, hashPart), hashPart);
+}
+
+std::shared_ptr<std::string> BinaryCacheStore::lookupNarInfoBundle(const std::string & hashPart)
+{
+    if (!useNarInfoBundle || narInfoBundleFile == "") return nullptr;
+
+    /* Note: we hold the lock while fetching the bundle, so other
+       threads wait for it rather than doing individual lookups. */
+    auto bundle(narInfoBundle.lock());
+
+    if (!bundle->loaded) {
+        bundle->loaded = true;
+
+        try {
+            auto data = getFile(narInfoBundleFile);
+            if (!data)
+                throw Error("file '%s' does not exist", narInfoBundleFile);
+
+            std::string method = "none";
+            if (hasSuffix(narInfoBundleFile, ".xz")) method = "xz";
+            else if (hasSuffix(narInfoBundleFile, ".bz2")) method = "bzip2";
+            else if (hasSuffix(narInfoBundleFile, ".br")) method = "br";
+            else if (hasSuffix(narInfoBundleFile, ".zst")) method = "zstd";
+            data = nix::decompress(method, *data);
+
+            size_t pos = 0;
+            while (pos < data->size()) {
+                auto end = data->find("\n\n", pos);
+                if (end == std::string::npos) end = data->size();
+                auto entry = data->substr(pos, end - pos + 1);
+                pos = end + 2;
+
+                auto start = entry.find("StorePath: ");
+                if (start == std::string::npos) continue;
+                start += 11;
+                auto eol = entry.find('\n', start);
+                auto path = entry.substr(start, eol - start);
+                if (!isStorePath(path)) continue;
+
+                bundle->narInfos.emplace(storePathToHash(path), std::move(entry));
+            }
+
+            stats.narInfoRead++;
+
+            debug("loaded .narinfo bundle of '%s' with %d entries", getUri(), bundle->narInfos.size());
+        } catch (Error & e) {
+            printError("warning: unable to fetch .narinfo bundle of '%s': %s", getUri(), e.what());
+            return nullptr;
+        }
+    }
+
+    auto i = bundle->narInfos.find(hashPart);
+    if (i == bundle->narInfos.end()) return nullptr;
+    return std::make_shared<std::string>(i->second);
+}
+
 bool BinaryCacheStore::isValidPathUncached(const Path & storePath)
 {
+    if (knownMissing(storePathToHash(storePath))) return false;
+
     // FIXME: this only checks whether a .narinfo with a matching hash
     // part exists. So ‘f4kb...-foo’ matches ‘f4kb...-bar’, even
     // though they shouldn't. Not easily fixed.
     return fileExists(narInfoFileFor(storePath));
 }
 
-void BinaryCacheStore::narFromPath(const Path & storePath, Sink & sink)
+/* A partially downloaded compressed NAR. The checkpoint file records
+   the size and hash of a prefix of the partial file that is known to
+   be complete; this prefix is verified before a download is resumed,
+   and anything after it is discarded. */
+struct PartialNar
 {
-    auto info = queryPathInfo(storePath).cast<const NarInfo>();
+    /* How often to update the checkpoint while downloading. */
+    const uint64_t checkpointInterval = 16 * 1024 * 1024;
 
-    auto nar = getFile(info->url);
+    /* Partial downloads that haven't been touched for this long are
+       assumed to be abandoned. */
+    static const time_t maxAge = 7 * 24 * 3600;
 
-    if (!nar) throw Error(format("file '%s' missing from binary cache") % info->url);
+    Path file, checkpointFile;
+    AutoCloseFD lockFd, fd;
 
-    stats.narRead++;
-    stats.narReadCompressedBytes += nar->size();
+    /* Number of bytes in 'file', all of which have been fed into
+       'hashSink'. */
+    uint64_t size = 0, checkpointSize = 0;
 
-    uint64_t narSize = 0;
+    std::unique_ptr<HashSink> hashSink;
 
-    StringSource source(*nar);
+    PartialNar(const Hash & fileHash)
+    {
+        Path dir = getCacheDir() + "/nix/partial-nars";
+        createDirs(dir);
+
+        static std::once_flag pruned;
+        std::call_once(pruned, [&]() {
+            try {
+                pruneAbandoned(dir);
+            } catch (Error &) {
+                ignoreException();
+            }
+        });
+
+        Path base = dir + "/" + fileHash.to_string(Base32, false);
+        file = base + ".part";
+        checkpointFile = base + ".checkpoint";
+
+        /* If another process is downloading the same file, don't
+           touch it. */
+        if (!lock(base)) return;
+
+        fd = open(file.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (!fd) throw SysError("opening '%s'", file);
+
+        hashSink = std::make_unique<HashSink>(htSHA256);
+
+        if (pathExists(checkpointFile)) {
+            auto fields = tokenizeString<std::vector<std::string>>(readFile(checkpointFile));
+            uint64_t n;
+            if (fields.size() == 2 && string2Int(fields[0], n)) {
+                try {
+                    std::vector<unsigned char> buf(65536);
+                    uint64_t left = n;
+                    while (left) {
+                        auto len = std::min((uint64_t) buf.size(), left);
+                        readFull(fd.get(), buf.data(), len);
+                        (*hashSink)(buf.data(), len);
+                        left -= len;
+                    }
+                    if (hashSink->currentHash().first == Hash(fields[1]))
+                        size = checkpointSize = n;
+                } catch (EndOfFile &) {
+                } catch (BadHash &) {
+                }
+            }
+            if (!size) {
+                printError("warning: discarding corrupt partial download '%s'", file);
+                hashSink = std::make_unique<HashSink>(htSHA256);
+            }
+        }
+
+        if (ftruncate(fd.get(), size) == -1)
+            throw SysError("truncating '%s'", file);
+        if (lseek(fd.get(), size, SEEK_SET) == -1)
+            throw SysError("seeking in '%s'", file);
+    }
+
+    /* Acquire the lock of the partial download 'base' without
+       waiting. Fails if the lock file was deleted by
+       pruneAbandoned() after we opened it. */
+    bool lock(const Path & base)
+    {
+        lockFd = openLockFile(base + ".lock", true);
+        struct stat st;
+        if (!lockFile(lockFd.get(), ltWrite, false)
+            || fstat(lockFd.get(), &st) == -1
+            || st.st_nlink == 0)
+        {
+            lockFd = -1;
+            return false;
+        }
+        return true;
+    }
+
+    bool locked() { return (bool) lockFd; }
+
+    /* Delete partial downloads that haven't been resumed for
+       'maxAge' seconds, e.g. because the path is no longer
+       needed. */
+    static void pruneAbandoned(const Path & dir)
+    {
+        auto now = time(0);
+
+        for (auto & i : readDirectory(dir)) {
+            if (!hasSuffix(i.name, ".lock")) continue;
+            Path base = dir + "/" + std::string(i.name, 0, i.name.size() - 5);
+
+            struct stat st;
+            if (lstat((base + ".part").c_str(), &st) == 0 && st.st_mtime + maxAge > now)
+                continue;
+
+            AutoCloseFD fd = openLockFile(base + ".lock", false);
+            if (!fd || !lockFile(fd.get(), ltWrite, false)) continue;
+
+            debug("removing abandoned partial download '%s'", base);
+            unlink((base + ".part").c_str());
+            unlink((base + ".checkpoint").c_str());
+            unlink((base + ".lock").c_str());
+        }
+    }
+
+    /* Send the part of the file we already have to 'sink'. */
+    void replay(Sink & sink)
+    {
+        AutoCloseFD fd2 = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+        if (!fd2) throw SysError("opening '%s'", file);
+        std::vector<unsigned char> buf(65536);
+        uint64_t left = size;
+        while (left) {
+            auto len = std::min((uint64_t) buf.size(), left);
+            readFull(fd2.get(), buf.data(), len);
+            sink(buf.data(), len);
+            left -= len;
+        }
+    }
+
+    void append(const unsigned char * data, size_t len)
+    {
+        writeFull(fd.get(), data, len);
+        (*hashSink)(data, len);
+        size += len;
+        if (size - checkpointSize >= checkpointInterval)
+            checkpoint();
+    }
+
+    void checkpoint()
+    {
+        if (size == checkpointSize) return;
+        if (fdatasync(fd.get()) == -1)
+            throw SysError("syncing '%s'", file);
+        Path tmp = checkpointFile + ".tmp";
+        writeFile(tmp, fmt("%d %s\n", size, hashSink->currentHash().first.to_string()));
+        if (rename(tmp.c_str(), checkpointFile.c_str()) == -1)
+            throw SysError("renaming '%s'", tmp);
+        checkpointSize = size;
+    }
+
+    Hash finish()
+    {
+        return hashSink->finish().first;
+    }
+
+    void remove()
+    {
+        unlink(file.c_str());
+        unlink(checkpointFile.c_str());
+    }
+};
+
+void BinaryCacheStore::narFromPath(const Path & storePath, Sink & sink)
+{
+    auto info = queryPathInfo(storePath).cast<const NarInfo>();
+
+    uint64_t narSize = 0;
 
     LambdaSink wrapperSink([&](const unsigned char * data, size_t len) {
         sink(data, len);
         narSize += len;
     });
 
-    decompress(info->compression, source, wrapperSink);
+    if (info->compression == "chunked")
+        narFromChunks(*info, wrapperSink);
+
+    else {
+        /* Decompress the NAR while it is being fetched, so that
+           neither the compressed nor the uncompressed NAR needs to be
+           held in memory. */
+        uint64_t compressedSize = 0;
+
+        std::unique_ptr<PartialNar> partial;
+        if (keepPartialNars() && info->fileHash) {
+            partial = std::make_unique<PartialNar>(info->fileHash);
+            if (!partial->locked())
+                partial.reset();
+            else if (partial->size)
+                printInfo("resuming download of '%s' at byte %d", info->url, partial->size);
+        }
+
+        bool downloaded = false;
+
+        auto source = sinkToSource([&](Sink & nextSink) {
+            LambdaSink countingSink([&](const unsigned char * data, size_t len) {
+                compressedSize += len;
+                nextSink(data, len);
+            });
+
+            if (!partial) {
+                getFile(info->url, countingSink);
+                return;
+            }
+
+            auto offset = partial->size;
+            if (offset) partial->replay(countingSink);
+
+            LambdaSink partialSink([&](const unsigned char * data, size_t len) {
+                partial->append(data, len);
+                countingSink(data, len);
+            });
+            getFile(info->url, offset, partialSink);
+
+            downloaded = true;
+        });
+
+        try {
+            decompress(info->compression, *source, wrapperSink);
+        } catch (...) {
+            /* Keep what we have if the download was interrupted, but
+               not if the data is bad. */
+            if (partial) {
+                try {
+                    try {
+                        throw;
+                    } catch (Interrupted &) {
+                        partial->checkpoint();
+                    } catch (DownloadError & e) {
+                        if (e.error == Downloader::Transient || e.error == Downloader::Interrupted)
+                            partial->checkpoint();
+                        else
+                            partial->remove();
+                    } catch (...) {
+                        partial->remove();
+                    }
+                } catch (...) {
+                    ignoreException();
+                }
+            }
+            throw;
+        }
+
+        if (partial) {
+            partial->remove();
+            if (downloaded && partial->finish() != info->fileHash)
+                throw Error("file '%s' in binary cache '%s' does not match its hash", info->url, getUri());
+        }
+
+        stats.narRead++;
+        stats.narReadCompressedBytes += compressedSize;
+    }
 
     stats.narReadBytes += narSize;
 }
 
+void BinaryCacheStore::narFromChunks(const NarInfo & info, Sink & sink)
+{
+    auto chunkList = getFile(info.url);
+
+    if (!chunkList) throw Error(format("file '%s' missing from binary cache") % info.url);
+
+    if (hashString(htSHA256, *chunkList) != info.fileHash)
+        throw Error(format("chunk list '%s' in binary cache is corrupt") % info.url);
+
+    struct Chunk
+    {
+        Hash hash;
+        uint64_t size, fileSize;
+    };
+
+    std::string method;
+    std::vector<Chunk> chunks;
+
+    for (auto & line : tokenizeString<Strings>(*chunkList, "\n")) {
+        if (hasPrefix(line, "Compression: ")) {
+            method = std::string(line, 13);
+            continue;
+        }
+        auto fields = tokenizeString<std::vector<std::string>>(line, " ");
+        Chunk chunk;
+        if (fields.size() != 3
+            || !string2Int(fields[1], chunk.size)
+            || !string2Int(fields[2], chunk.fileSize))
+            throw Error(format("chunk list '%s' in binary cache is corrupt") % info.url);
+        chunk.hash = Hash(fields[0], htSHA256);
+        chunks.push_back(chunk);
+    }
+
+    if (method == "")
+        throw Error(format("chunk list '%s' does not specify a compression method") % info.url);
+
+    if (chunkCache != "") createDirs(chunkCache);
+
+    auto cacheFileFor = [&](const Chunk & chunk) {
+        return chunkCache.get() + "/" + chunk.hash.to_string(Base32, false);
+    };
+
+    /* Fetch chunks that are not in the local chunk cache, keeping a
+       bounded number of downloads in flight so that we don't pay a
+       round trip per chunk. */
+    struct Pending
+    {
+        bool cached;
+        std::future<std::shared_ptr<std::string>> data;
+    };
+
+    std::deque<Pending> pending;
+    size_t next = 0;
+    size_t maxPending = std::max((size_t) 1, settings.binaryCachesParallelConnections.get());
+
+    auto enqueue = [&]() {
+        auto & chunk = chunks[next++];
+        auto promise = std::make_shared<std::promise<std::shared_ptr<std::string>>>();
+        Path cacheFile = cacheFileFor(chunk);
+        std::shared_ptr<std::string> cached;
+        if (chunkCache != "") {
+            try {
+                cached = std::make_shared<std::string>(readFile(cacheFile));
+                /* Mark the chunk as recently used. */
+                utimes(cacheFile.c_str(), nullptr);
+            } catch (SysError & e) {
+                /* The chunk may have been evicted concurrently. */
+                if (e.errNo != ENOENT) throw;
+            }
+        }
+        if (cached) {
+            promise->set_value(cached);
+            pending.push_back({true, promise->get_future()});
+        } else {
+            getFile(chunkFileFor(chunk.hash, method),
+                [promise](std::shared_ptr<std::string> result) {
+                    promise->set_value(result);
+                },
+                [promise](std::exception_ptr exc) {
+                    promise->set_exception(exc);
+                });
+            pending.push_back({false, promise->get_future()});
+        }
+    };
+
+    stats.narRead++;
+
+    for (auto & chunk : chunks) {
+        checkInterrupt();
+
+        while (next < chunks.size() && pending.size() < maxPending)
+            enqueue();
+
+        auto p = std::move(pending.front());
+        pending.pop_front();
+
+        auto data = p.data.get();
+
+        if (!data)
+            throw Error(format("chunk '%s' of '%s' missing from binary cache")
+                % chunk.hash.to_string(Base32, false) % info.path);
+
+        if (!p.cached) {
+            stats.narReadCompressedBytes += data->size();
+            data = decompress(method, *data);
+        }
+
+        if (data->size() != chunk.size || hashString(htSHA256, *data) != chunk.hash) {
+            if (p.cached) deletePath(cacheFileFor(chunk));
+            throw Error(format("chunk '%s' of '%s' is corrupt")
+                % chunk.hash.to_string(Base32, false) % info.path);
+        }
+
+        if (!p.cached && chunkCache != "") {
+            try {
+                addToChunkCache(cacheFileFor(chunk), *data);
+            } catch (Error & e) {
+                /* Caching is an optimisation, so don't fail the
+                   substitution. */
+                ignoreException();
+            }
+        }
+
+        sink(*data);
+    }
+}
+
+void BinaryCacheStore::addToChunkCache(const Path & cacheFile, const std::string & data)
+{
+    /* Other threads and processes may be caching the same chunk, so
+       give every writer its own temporary file. */
+    Path tmp = fmt("%s.tmp-%d-%d", cacheFile, getpid(), random());
+    writeFile(tmp, data);
+    if (rename(tmp.c_str(), cacheFile.c_str())) {
+        auto savedErrno = errno;
+        unlink(tmp.c_str());
+        errno = savedErrno;
+        throw SysError("renaming '%s' to '%s'", tmp, cacheFile);
+    }
+
+    if (chunkCacheSize.get() == 0) return;
+
+    auto state(chunkCacheState.lock());
+    state->size += data.size();
+    if (!state->measured || state->size > chunkCacheSize)
+        pruneChunkCache(*state);
+}
+
+void BinaryCacheStore::pruneChunkCache(ChunkCache & state)
+{
+    struct Entry
+    {
+        time_t mtime;
+        uint64_t size;
+        Path path;
+    };
+
+    std::vector<Entry> entries;
+    uint64_t total = 0;
+    auto now = time(0);
+
+    for (auto & i : readDirectory(chunkCache)) {
+        Path path = chunkCache.get() + "/" + i.name;
+        struct stat st;
+        if (lstat(path.c_str(), &st)) {
+            if (errno == ENOENT) continue;
+            throw SysError("getting status of '%s'", path);
+        }
+        if (!S_ISREG(st.st_mode)) continue;
+        total += st.st_size;
+        /* Don't delete temporary files that may still be in use. */
+        if (i.name.find(".tmp-") != std::string::npos && st.st_mtime > now - 3600) continue;
+        entries.push_back({st.st_mtime, (uint64_t) st.st_size, path});
+    }
+
+    state.measured = true;
+    state.size = total;
+
+    if (total <= chunkCacheSize) return;
+
+    /* Delete down to 90% of the limit, so that we don't have to do
+       this again for every chunk. */
+    uint64_t target = chunkCacheSize / 10 * 9;
+
+    std::sort(entries.begin(), entries.end(), [](const Entry & a, const Entry & b) {
+        return a.mtime < b.mtime;
+    });
+
+    uint64_t deleted = 0;
+    for (auto & entry : entries) {
+        if (state.size <= target) break;
+        if (unlink(entry.path.c_str()) == -1 && errno != ENOENT)
+            throw SysError("deleting '%s'", entry.path);
+        state.size -= entry.size;
+        deleted++;
+    }
+
+    debug("deleted %d chunks from chunk cache '%s'", deleted, chunkCache);
+}
+
 void BinaryCacheStore::queryPathInfoUncached(const Path & storePath,
         std::function<void(std::shared_ptr<ValidPathInfo>)> success,
         std::function<void(std::exception_ptr exc)> failure)
@@ -228,6 +1085,17 @@ void BinaryCacheStore::queryPathInfoUncached(const Path & storePath,
 
     auto narInfoFile = narInfoFileFor(storePath);
 
+    /* The bundle may be stale, so on a miss we fall back to fetching
+       the .narinfo. */
+    if (auto data = lookupNarInfoBundle(storePathToHash(storePath))) {
+        stats.narInfoReadAverted++;
+        return callSuccess(success, failure, (std::shared_ptr<ValidPathInfo>)
+            std::make_shared<NarInfo>(*this, *data, narInfoFile));
+    }
+
+    if (knownMissing(storePathToHash(storePath)))
+        return success(0);
+
     getFile(narInfoFile,
         [=](std::shared_ptr<std::string> data) {
             if (!data) return success(0);
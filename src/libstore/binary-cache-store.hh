@@ -4,28 +4,82 @@
 #include "store-api.hh"
 
 #include "pool.hh"
+#include "sync.hh"
 
 #include <atomic>
+#include <iostream>
 
 namespace nix {
 
 struct NarInfo;
 
+MakeError(NoSuchBinaryCacheFile, Error);
+
 class BinaryCacheStore : public Store
 {
 public:
 
-    const Setting<std::string> compression{this, "xz", "compression", "NAR compression method ('xz', 'bzip2', or 'none')"};
+    const Setting<std::string> compression{this, "xz", "compression", "NAR compression method ('xz', 'bzip2', 'br', 'zstd', or 'none')"};
     const Setting<bool> writeNARListing{this, false, "write-nar-listing", "whether to write a JSON file listing the files in each NAR"};
     const Setting<Path> secretKeyFile{this, "", "secret-key", "path to secret key used to sign the binary cache"};
     const Setting<Path> localNarCache{this, "", "local-nar-cache", "path to a local cache of NARs"};
     const Setting<bool> parallelCompression{this, false, "parallel-compression",
-        "enable multi-threading compression, available for xz only currently"};
+        "enable multi-threading compression, available for xz and zstd only currently"};
+    const Setting<int> compressionLevel{this, -1, "compression-level",
+        "NAR compression level (-1 for the method's default), used by xz and zstd"};
+    const Setting<bool> chunkNARs{this, false, "chunk-nars",
+        "whether to split NARs into content-defined, deduplicated chunks"};
+    const Setting<uint64_t> chunkSize{this, 256 * 1024, "chunk-size",
+        "average size (in bytes) of NAR chunks"};
+    const Setting<Path> chunkCache{this, getCacheDir() + "/nix/chunks", "chunk-cache",
+        "directory in which to cache downloaded NAR chunks (empty to disable)"};
+    const Setting<uint64_t> chunkCacheSize{this, 4ULL * 1024 * 1024 * 1024, "chunk-cache-size",
+        "maximum size (in bytes) of the chunk cache, beyond which the least recently used chunks are deleted (0 for no limit)"};
+    const Setting<bool> useNarInfoBundle{this, false, "narinfo-bundle",
+        "whether to fetch the cache's .narinfo bundle (if any) to answer path info queries locally"};
+    const Setting<bool> useCacheIndex{this, false, "cache-index",
+        "whether to use the cache's membership index (if any) to answer queries for missing paths locally; "
+        "only enable this if the index is kept up to date"};
 
 private:
 
     std::unique_ptr<SecretKey> secretKey;
 
+    /* The file containing all .narinfo files of this cache, as
+       announced by 'NarInfoBundle' in nix-cache-info. */
+    std::string narInfoBundleFile;
+
+    struct NarInfoBundle
+    {
+        bool loaded = false;
+        /* Map from hash parts to .narinfo contents. */
+        std::map<std::string, std::string> narInfos;
+    };
+
+    Sync<NarInfoBundle> narInfoBundle;
+
+    struct CacheIndex
+    {
+        bool valid = false;
+        time_t lastRefresh = 0;
+        std::string etag;
+        /* The sorted hash parts of all paths in the cache,
+           concatenated. */
+        std::string hashParts;
+    };
+
+    Sync<CacheIndex> cacheIndex;
+
+    struct ChunkCache
+    {
+        bool measured = false;
+        /* The size of the chunk cache when it was last measured,
+           plus the size of the chunks we've added since. */
+        uint64_t size = 0;
+    };
+
+    Sync<ChunkCache> chunkCacheState;
+
 protected:
 
     BinaryCacheStore(const Params & params);
@@ -38,6 +92,46 @@ public:
         const std::string & data,
         const std::string & mimeType) = 0;
 
+    /* Like upsertFile() above, but read the contents from a stream,
+       so that large files need not be held in memory.  The default
+       implementation reads the whole stream into a string. */
+    virtual void upsertFile(const std::string & path,
+        std::shared_ptr<std::basic_iostream<char>> istream,
+        const std::string & mimeType);
+
+    /* Dump the contents of the specified file to a sink, throwing
+       NoSuchBinaryCacheFile if it doesn't exist. The default
+       implementation reads the whole file into memory first. */
+    virtual void getFile(const std::string & path, Sink & sink);
+
+    /* Like getFile(path, sink), but skip the first 'offset' bytes of
+       the file. The default implementation fetches the entire file
+       and discards the skipped part. */
+    virtual void getFile(const std::string & path, uint64_t offset, Sink & sink);
+
+    /* Whether to keep partially downloaded NARs in
+       ~/.cache/nix/partial-nars so that interrupted downloads can be
+       resumed (with getFile(path, offset, sink)). */
+    virtual bool keepPartialNars() { return false; }
+
+    struct ConditionalFile
+    {
+        bool unchanged = false;
+        std::shared_ptr<std::string> data;
+        std::string etag;
+    };
+
+    /* Return the contents of the specified file, unless its ETag is
+       'etag', in which case 'unchanged' is set. The default
+       implementation doesn't support ETags and always fetches the
+       file. */
+    virtual ConditionalFile getFileIfChanged(const std::string & path, const std::string & etag);
+
+    /* Record in the cache's membership index that the given hash part
+       is present. The default implementation cannot do this, so it
+       only warns that the index is now stale. */
+    virtual void addToCacheIndex(const std::string & hashPart);
+
     /* Return the contents of the specified file, or null if it
        doesn't exist. */
     virtual void getFile(const std::string & path,
@@ -51,20 +145,68 @@ protected:
     bool wantMassQuery_ = false;
     int priority = 50;
 
+    /* The membership index of this cache, as announced by
+       'CacheIndex' in nix-cache-info. */
+    std::string cacheIndexFile;
+
+    /* The nix-cache-info fields other than 'WantMassQuery' and
+       'Priority' that init() remembers, for storing in the NAR info
+       disk cache. */
+    StringMap getExtraCacheInfo();
+
+    void setExtraCacheInfo(const StringMap & info);
+
 public:
 
     virtual void init();
 
 private:
 
-    std::string narMagic;
-
     std::string narInfoFileFor(const Path & storePath);
 
     void writeNarInfo(ref<NarInfo> narInfo);
 
+    void checkReferences(const ValidPathInfo & info);
+
+    std::string chunkFileFor(const Hash & hash, const std::string & method);
+
+    /* Reassemble a NAR stored as a list of content-addressed chunks,
+       fetching only those chunks that aren't in the local chunk
+       cache. */
+    void narFromChunks(const NarInfo & info, Sink & sink);
+
+    void addToChunkCache(const Path & cacheFile, const std::string & data);
+
+    /* Measure the size of the chunk cache, and if it exceeds
+       'chunk-cache-size', delete the least recently used chunks. */
+    void pruneChunkCache(ChunkCache & state);
+
+    /* Return the .narinfo for the given hash part from the
+       .narinfo bundle, fetching the bundle on first use. */
+    std::shared_ptr<std::string> lookupNarInfoBundle(const std::string & hashPart);
+
+    /* Return true if the cache's membership index shows that it
+       doesn't contain the given hash part. The index is refreshed
+       after 'narinfo-cache-negative-ttl' seconds. */
+    bool knownMissing(const std::string & hashPart);
+
+    void refreshCacheIndex(CacheIndex & index);
+
+    /* Set a field in nix-cache-info, replacing its previous value. */
+    void setCacheInfo(const std::string & name, const std::string & value);
+
 public:
 
+    /* Write a bundle of all .narinfo files in this cache and announce
+       it in nix-cache-info, so that clients can fetch it in a single
+       request. */
+    void writeNarInfoBundle();
+
+    /* Write the membership index of this cache and announce it in
+       nix-cache-info. Clients use it to avoid looking up paths that
+       aren't in the cache. */
+    void writeCacheIndex();
+
     bool isValidPathUncached(const Path & path) override;
 
     PathSet queryAllValidPaths() override
@@ -89,6 +231,10 @@ public:
 
     bool wantMassQuery() override { return wantMassQuery_; }
 
+    void addToStore(const ValidPathInfo & info, Source & narSource,
+        RepairFlag repair, CheckSigsFlag checkSigs,
+        std::shared_ptr<FSAccessor> accessor) override;
+
     void addToStore(const ValidPathInfo & info, const ref<std::string> & nar,
         RepairFlag repair, CheckSigsFlag checkSigs,
         std::shared_ptr<FSAccessor> accessor) override;
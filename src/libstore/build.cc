@@ -223,6 +223,11 @@ private:
     /* Goals waiting for a build slot. */
     WeakGoals wantingToBuild;
 
+    /* Substitution goals waiting for a build slot. These are started
+       smallest download first, so that small paths (which are often
+       needed to unblock builds) don't queue behind large ones. */
+    WeakGoals wantingToSubstitute;
+
     /* Child processes currently running. */
     std::list<Child> children;
 
@@ -317,6 +322,14 @@ public:
        might be right away). */
     void waitForBuildSlot(GoalPtr goal);
 
+    /* Put a substitution goal to sleep until a build slot becomes
+       available and no smaller substitution is waiting for it. */
+    void waitForSubstitutionSlot(GoalPtr goal);
+
+    /* Wake up as many of the waiting substitution goals as there are
+       free build slots. */
+    void wakeUpSubstitutions();
+
     /* Wait for any goal to finish.  Pretty indiscriminate way to
        wait for some resource that some other goal is holding. */
     void waitForAnyGoal(GoalPtr goal);
@@ -3338,8 +3351,14 @@ Path DerivationGoal::openLogFile()
     Path dir = fmt("%s/%s/%s/", worker.store.logDir, worker.store.drvsLogDir, string(baseName, 0, 2));
     createDirs(dir);
 
+    if (settings.compressLog
+        && settings.buildLogCompression != "bzip2"
+        && settings.buildLogCompression != "zstd")
+        throw Error("unsupported build log compression method '%s'", settings.buildLogCompression);
+
     Path logFileName = fmt("%s/%s%s", dir, string(baseName, 2),
-        settings.compressLog ? ".bz2" : "");
+        !settings.compressLog ? "" :
+        settings.buildLogCompression == "zstd" ? ".zst" : ".bz2");
 
     fdLogFile = open(logFileName.c_str(), O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, 0666);
     if (!fdLogFile) throw SysError(format("creating log file '%1%'") % logFileName);
@@ -3347,7 +3366,7 @@ Path DerivationGoal::openLogFile()
     logFileSink = std::make_shared<FdSink>(fdLogFile.get());
 
     if (settings.compressLog)
-        logSink = std::shared_ptr<CompressionSink>(makeCompressionSink("bzip2", *logFileSink));
+        logSink = std::shared_ptr<CompressionSink>(makeCompressionSink(settings.buildLogCompression, *logFileSink));
     else
         logSink = logFileSink;
 
@@ -3578,6 +3597,13 @@ public:
 
     Path getStorePath() { return storePath; }
 
+    /* The number of bytes we expect to download for this path. */
+    uint64_t getExpectedDownloadSize()
+    {
+        auto narInfo = std::dynamic_pointer_cast<const NarInfo>(info);
+        return narInfo && narInfo->fileSize ? narInfo->fileSize : info ? info->narSize : 0;
+    }
+
     void amDone(ExitCode result) override
     {
         Goal::amDone(result);
@@ -3745,7 +3771,7 @@ void SubstitutionGoal::tryToRun()
        a substituter to run.  This is because substitutions cannot be
        distributed to another machine via the build hook. */
     if (worker.getNrLocalBuilds() >= std::max(1U, (unsigned int) settings.maxBuildJobs)) {
-        worker.waitForBuildSlot(shared_from_this());
+        worker.waitForSubstitutionSlot(shared_from_this());
         return;
     }
 
@@ -4002,6 +4028,10 @@ void Worker::childTerminated(Goal * goal, bool wakeSleepers)
 
     if (wakeSleepers) {
 
+        /* Wake up the substitutions that get the free build slots
+           before derivations can claim them. */
+        wakeUpSubstitutions();
+
         /* Wake up goals waiting for a build slot. */
         for (auto & j : wantingToBuild) {
             GoalPtr goal = j.lock();
@@ -4023,6 +4053,40 @@ void Worker::waitForBuildSlot(GoalPtr goal)
 }
 
 
+void Worker::waitForSubstitutionSlot(GoalPtr goal)
+{
+    debug("wait for substitution slot");
+    addToWeakGoals(wantingToSubstitute, goal);
+}
+
+
+void Worker::wakeUpSubstitutions()
+{
+    unsigned int slots = std::max(1U, (unsigned int) settings.maxBuildJobs);
+    if (nrLocalBuilds >= slots || wantingToSubstitute.empty()) return;
+
+    std::vector<std::shared_ptr<SubstitutionGoal>> goals;
+    for (auto & i : wantingToSubstitute) {
+        GoalPtr goal = i.lock();
+        if (goal) goals.push_back(std::static_pointer_cast<SubstitutionGoal>(goal));
+    }
+    wantingToSubstitute.clear();
+
+    std::stable_sort(goals.begin(), goals.end(),
+        [](const std::shared_ptr<SubstitutionGoal> & a, const std::shared_ptr<SubstitutionGoal> & b) {
+            return a->getExpectedDownloadSize() < b->getExpectedDownloadSize();
+        });
+
+    size_t n = slots - nrLocalBuilds;
+    for (auto & goal : goals)
+        if (n) {
+            wakeUp(goal);
+            n--;
+        } else
+            wantingToSubstitute.push_back(goal);
+}
+
+
 void Worker::waitForAnyGoal(GoalPtr goal)
 {
     debug("wait for any goal");
@@ -4067,6 +4131,11 @@ void Worker::run(const Goals & _topGoals)
 
         if (topGoals.empty()) break;
 
+        /* A substitution that was given a free build slot may not
+           have claimed it (e.g. because its path was locked). */
+        wakeUpSubstitutions();
+        if (!awake.empty()) continue;
+
         /* Wait for input. */
         if (!children.empty() || !waitingForAWhile.empty())
             waitForInput();
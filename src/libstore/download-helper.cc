@@ -0,0 +1,488 @@
+#include "download-helper.hh"
+#include "globals.hh"
+#include "pathlocks.hh"
+#include "serialise.hh"
+#include "sync.hh"
+
+#include <atomic>
+#include <deque>
+#include <thread>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+namespace nix {
+
+#define DOWNLOAD_HELPER_MAGIC_1 0x646c6870
+#define DOWNLOAD_HELPER_MAGIC_2 0x70686c64
+#define DOWNLOAD_HELPER_PROTOCOL_VERSION 3
+
+typedef enum {
+    msgData = 1,
+    msgDone = 2,
+    msgError = 3,
+} DownloadHelperMessage;
+
+
+Path getDownloadHelperSocket()
+{
+    return getCacheDir() + "/nix/download-helper/socket";
+}
+
+
+MakeError(DownloadHelperUnavailable, Error);
+
+
+/* A connection to the download helper, which performs one request at
+   a time. */
+struct DownloadHelperConnection
+{
+    AutoCloseFD fd;
+    FdSink to;
+    FdSource from;
+
+    DownloadHelperConnection(AutoCloseFD && _fd)
+        : fd(std::move(_fd)), to(fd.get()), from(fd.get())
+    {
+        try {
+            to << DOWNLOAD_HELPER_MAGIC_1;
+            to.flush();
+            if (readInt(from) != DOWNLOAD_HELPER_MAGIC_2)
+                throw DownloadHelperUnavailable("protocol mismatch with download helper");
+            if (readInt(from) != DOWNLOAD_HELPER_PROTOCOL_VERSION)
+                throw DownloadHelperUnavailable("unsupported download helper protocol version");
+        } catch (EndOfFile &) {
+            throw DownloadHelperUnavailable("download helper closed the connection");
+        } catch (SysError & e) {
+            throw DownloadHelperUnavailable("cannot talk to download helper: %s", e.msg());
+        }
+    }
+
+    DownloadResult run(const DownloadRequest & request)
+    {
+        Activity act(*logger, lvlTalkative, actDownload,
+            fmt(request.data ? "uploading '%s'" : "downloading '%s'", request.uri),
+            {request.uri}, request.parentAct);
+
+        /* If the helper goes away before it has started on the
+           request (e.g. because it crashed or was killed), the request
+           can still be performed in-process. */
+        try {
+            to << request.uri << request.expectedETag << request.verifyTLS
+               << request.head << request.tries << request.baseRetryTimeMs
+               << request.decompress << (request.data ? 1 : 0);
+            if (request.data) to << *request.data;
+            to << request.mimeType << (request.dataCallback ? 1 : 0)
+               << request.priority << request.maxRate << request.rateLimitKey
+               << request.rangeStart;
+            to.flush();
+        } catch (SysError & e) {
+            throw DownloadHelperUnavailable("cannot talk to download helper: %s", e.msg());
+        }
+
+        uint64_t received = 0;
+        bool replied = false;
+
+        while (true) {
+            uint64_t msg;
+            try {
+                msg = readInt(from);
+            } catch (EndOfFile &) {
+                if (replied) throw;
+                throw DownloadHelperUnavailable("download helper closed the connection");
+            }
+            replied = true;
+
+            if (msg == msgData) {
+                auto data = readString(from);
+                received += data.size();
+                act.progress(received, 0);
+                request.dataCallback((char *) data.data(), data.size());
+            }
+
+            else if (msg == msgDone) {
+                DownloadResult result;
+                result.etag = readString(from);
+                result.effectiveUrl = readString(from);
+                result.cached = readInt(from);
+                result.data = std::make_shared<std::string>(readString(from));
+                result.queueTimeMs = readLongLong(from);
+                result.throttleTimeMs = readLongLong(from);
+                received += result.data->size();
+                act.progress(received, received);
+                return result;
+            }
+
+            else if (msg == msgError) {
+                auto error = (Downloader::Error) readInt(from);
+                throw DownloadError(error, readString(from));
+            }
+
+            else
+                throw Error("protocol mismatch with download helper");
+        }
+    }
+};
+
+
+static AutoCloseFD connectToHelper()
+{
+    Path socketPath = getDownloadHelperSocket();
+
+    AutoCloseFD fd = socket(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (!fd)
+        throw SysError("cannot create Unix domain socket");
+
+    struct sockaddr_un addr;
+    addr.sun_family = AF_UNIX;
+    if (socketPath.size() + 1 >= sizeof(addr.sun_path))
+        throw DownloadHelperUnavailable("socket path '%s' is too long", socketPath);
+    strcpy(addr.sun_path, socketPath.c_str());
+
+    if (::connect(fd.get(), (struct sockaddr *) &addr, sizeof(addr)) == -1)
+        return AutoCloseFD();
+
+    return fd;
+}
+
+
+static void startHelper()
+{
+    Path program = settings.nixBinDir + "/nix";
+
+    debug("starting download helper '%s'", program);
+
+    ProcessOptions options;
+    options.dieWithParent = false;
+
+    Pid pid = startProcess([&]() {
+        /* Fork again so that the helper is not our child, and detach
+           it from our session and terminal. */
+        if (setsid() == -1)
+            throw SysError("creating a new session");
+        if (fork()) _exit(0);
+        AutoCloseFD null = open("/dev/null", O_RDWR);
+        if (!null) throw SysError("opening /dev/null");
+        if (dup2(null.get(), STDIN_FILENO) == -1 ||
+            dup2(null.get(), STDOUT_FILENO) == -1 ||
+            dup2(null.get(), STDERR_FILENO) == -1)
+            throw SysError("redirecting standard file descriptors");
+        execl(program.c_str(), "nix", "download-helper", nullptr);
+        throw SysError("executing '%s'", program);
+    }, options);
+
+    pid.wait();
+}
+
+
+struct DownloadHelperClient : public Downloader
+{
+    struct Item
+    {
+        DownloadRequest request;
+        std::function<void(const DownloadResult &)> success;
+        std::function<void(std::exception_ptr exc)> failure;
+    };
+
+    struct State
+    {
+        bool quit = false;
+        size_t idle = 0;
+        std::deque<std::shared_ptr<Item>> queue;
+        std::vector<std::thread> workers;
+    };
+
+    Sync<State> state_;
+
+    std::condition_variable wakeup;
+
+    /* Used if the helper cannot be reached. */
+    std::shared_ptr<Downloader> fallback;
+    std::once_flag fallbackCreated;
+    std::atomic<bool> unavailable{false};
+
+    std::mutex startMutex;
+
+    ~DownloadHelperClient()
+    {
+        std::vector<std::thread> workers;
+        {
+            auto state(state_.lock());
+            state->quit = true;
+            std::swap(workers, state->workers);
+        }
+        wakeup.notify_all();
+        for (auto & thread : workers)
+            thread.join();
+    }
+
+    std::unique_ptr<DownloadHelperConnection> connect()
+    {
+        auto fd = connectToHelper();
+
+        if (!fd) {
+            std::lock_guard<std::mutex> lock(startMutex);
+
+            fd = connectToHelper();
+
+            if (!fd) {
+                startHelper();
+
+                for (int n = 0; n < 100 && !fd; ++n) {
+                    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+                    fd = connectToHelper();
+                }
+
+                if (!fd)
+                    throw DownloadHelperUnavailable("cannot connect to download helper at '%s'",
+                        getDownloadHelperSocket());
+            }
+        }
+
+        return std::make_unique<DownloadHelperConnection>(std::move(fd));
+    }
+
+    void workerThread()
+    {
+        std::unique_ptr<DownloadHelperConnection> conn;
+
+        while (true) {
+            std::shared_ptr<Item> item;
+
+            {
+                auto state(state_.lock());
+                state->idle++;
+                while (state->queue.empty() && !state->quit)
+                    state.wait(wakeup);
+                state->idle--;
+                if (state->quit) return;
+                item = state->queue.front();
+                state->queue.pop_front();
+            }
+
+            try {
+                if (unavailable)
+                    throw DownloadHelperUnavailable("download helper is unavailable");
+                if (!conn) conn = connect();
+                auto result = conn->run(item->request);
+                callSuccess(item->success, item->failure, const_cast<const DownloadResult &>(result));
+            } catch (DownloadHelperUnavailable & e) {
+                conn.reset();
+                std::call_once(fallbackCreated, [&]() {
+                    printError("warning: %s; downloading without the helper", e.what());
+                    fallback = makeDownloader();
+                    unavailable = true;
+                });
+                fallback->enqueueDownload(item->request, item->success, item->failure);
+            } catch (...) {
+                /* The connection may be in an unknown state (e.g. if
+                   the data callback threw), so don't reuse it. */
+                conn.reset();
+                callFailure(item->failure);
+            }
+        }
+    }
+
+    void enqueueDownload(const DownloadRequest & request,
+        std::function<void(const DownloadResult &)> success,
+        std::function<void(std::exception_ptr exc)> failure) override
+    {
+        if (unavailable) {
+            fallback->enqueueDownload(request, success, failure);
+            return;
+        }
+
+        auto state(state_.lock());
+
+        /* Keep the queue sorted by priority, preserving FIFO order
+           within each priority. */
+        auto i = std::find_if(state->queue.begin(), state->queue.end(),
+            [&](const std::shared_ptr<Item> & item) { return item->request.priority < request.priority; });
+        state->queue.insert(i, std::make_shared<Item>(Item{request, success, failure}));
+
+        /* Start another worker (i.e. another connection to the
+           helper) if all existing ones are busy. */
+        size_t maxConnections = settings.binaryCachesParallelConnections;
+        if (state->idle < state->queue.size()
+            && (maxConnections == 0 || state->workers.size() < maxConnections))
+            state->workers.emplace_back([this]() { workerThread(); });
+
+        wakeup.notify_one();
+    }
+};
+
+ref<Downloader> makeDownloadHelperClient()
+{
+    return make_ref<DownloadHelperClient>();
+}
+
+
+static void serveConnection(AutoCloseFD fd)
+{
+    FdSource from(fd.get());
+    FdSink to(fd.get());
+
+    try {
+
+        if (readInt(from) != DOWNLOAD_HELPER_MAGIC_1) return;
+        to << DOWNLOAD_HELPER_MAGIC_2 << DOWNLOAD_HELPER_PROTOCOL_VERSION;
+        to.flush();
+
+        while (true) {
+            DownloadRequest request("");
+
+            try {
+                request.uri = readString(from);
+            } catch (EndOfFile &) {
+                return;
+            }
+
+            request.expectedETag = readString(from);
+            request.verifyTLS = readInt(from);
+            request.head = readInt(from);
+            request.tries = readInt(from);
+            request.baseRetryTimeMs = readInt(from);
+            request.decompress = readInt(from);
+            if (readInt(from))
+                request.data = std::make_shared<std::string>(readString(from));
+            request.mimeType = readString(from);
+            bool stream = readInt(from);
+            request.priority = (int) readLongLong(from);
+            request.maxRate = readLongLong(from);
+            request.rateLimitKey = readString(from);
+            request.rangeStart = readLongLong(from);
+
+            try {
+                if (stream) {
+                    LambdaSink sink([&](const unsigned char * data, size_t len) {
+                        to << msgData;
+                        writeString(data, len, to);
+                    });
+                    auto result = getDownloader()->download(std::move(request), sink);
+                    to << msgDone << result.etag << result.effectiveUrl << result.cached << ""
+                       << result.queueTimeMs << result.throttleTimeMs;
+                } else {
+                    auto result = getDownloader()->download(request);
+                    to << msgDone << result.etag << result.effectiveUrl << result.cached
+                       << (result.data ? *result.data : "")
+                       << result.queueTimeMs << result.throttleTimeMs;
+                }
+            } catch (DownloadError & e) {
+                to << msgError << e.error << e.msg();
+            } catch (Error & e) {
+                to << msgError << Downloader::Misc << e.msg();
+            }
+
+            to.flush();
+        }
+
+    } catch (std::exception & e) {
+        /* Most likely the client went away. */
+        debug("download helper connection: %s", e.what());
+    }
+}
+
+
+void runDownloadHelper(unsigned int idleTimeout)
+{
+    /* Don't forward our own downloads to ourselves. */
+    settings.useDownloadHelper = false;
+
+    Path socketPath = getDownloadHelperSocket();
+    Path socketDir = dirOf(socketPath);
+
+    createDirs(socketDir);
+    if (chmod(socketDir.c_str(), 0700) == -1)
+        throw SysError("setting permissions on '%s'", socketDir);
+
+    /* Ensure that only one helper is running. */
+    AutoCloseFD lockFd = openLockFile(socketPath + ".lock", true);
+    if (!lockFile(lockFd.get(), ltWrite, false)) {
+        debug("download helper is already running");
+        return;
+    }
+
+    AutoCloseFD fdSocket = socket(PF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (!fdSocket)
+        throw SysError("cannot create Unix domain socket");
+
+    /* sockaddr_un allows path names of only 108 characters, so chdir
+       to the socket directory and use a relative path name. */
+    if (chdir(socketDir.c_str()) == -1)
+        throw SysError("cannot change current directory");
+    Path socketPathRel = "./" + baseNameOf(socketPath);
+
+    struct sockaddr_un addr;
+    addr.sun_family = AF_UNIX;
+    if (socketPathRel.size() >= sizeof(addr.sun_path))
+        throw Error("socket path '%s' is too long", socketPathRel);
+    strcpy(addr.sun_path, socketPathRel.c_str());
+
+    unlink(socketPath.c_str());
+
+    if (bind(fdSocket.get(), (struct sockaddr *) &addr, sizeof(addr)) == -1)
+        throw SysError("cannot bind to socket '%s'", socketPath);
+
+    if (chdir("/") == -1)
+        throw SysError("cannot change current directory");
+
+    if (listen(fdSocket.get(), 64) == -1)
+        throw SysError("cannot listen on socket '%s'", socketPath);
+
+    printInfo("download helper listening on '%s'", socketPath);
+
+    /* Number of open client connections. Static because connection
+       threads are detached. */
+    static std::atomic<size_t> active{0};
+    auto lastActivity = std::chrono::steady_clock::now();
+
+    while (true) {
+        checkInterrupt();
+
+        struct pollfd pfd;
+        pfd.fd = fdSocket.get();
+        pfd.events = POLLIN;
+
+        int res = poll(&pfd, 1, 1000);
+        if (res == -1) {
+            if (errno == EINTR) continue;
+            throw SysError("polling download helper socket");
+        }
+
+        auto now = std::chrono::steady_clock::now();
+
+        if (res == 0) {
+            if (active)
+                lastActivity = now;
+            else if (now - lastActivity >= std::chrono::seconds(idleTimeout)) {
+                debug("download helper exiting after %d seconds of inactivity", idleTimeout);
+                break;
+            }
+            continue;
+        }
+
+        AutoCloseFD remote = accept4(fdSocket.get(), nullptr, nullptr, SOCK_CLOEXEC);
+        if (!remote) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            throw SysError("accepting connection");
+        }
+
+        lastActivity = now;
+        active++;
+
+        std::thread([](AutoCloseFD fd) {
+            serveConnection(std::move(fd));
+            active--;
+        }, std::move(remote)).detach();
+    }
+
+    /* Remove the socket while we still hold the lock, so that new
+       clients start a new helper. */
+    unlink(socketPath.c_str());
+}
+
+}
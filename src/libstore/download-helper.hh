@@ -0,0 +1,26 @@
+#pragma once
+
+#include "download.hh"
+
+namespace nix {
+
+/* The download helper is a per-user process that performs downloads
+   on behalf of other Nix processes. Since it outlives them, it can
+   keep connections to binary caches open (and multiplex requests over
+   them) across invocations of Nix. */
+
+/* Return the path of the socket on which the download helper of the
+   current user listens. */
+Path getDownloadHelperSocket();
+
+/* Return a Downloader that forwards requests to the download helper,
+   starting it if necessary. If the helper is unavailable, requests
+   are performed in-process. */
+ref<Downloader> makeDownloadHelperClient();
+
+/* Serve download requests on the download helper socket, until no
+   requests have been received for 'idleTimeout' seconds. Returns
+   immediately if another helper is already running. */
+void runDownloadHelper(unsigned int idleTimeout);
+
+}
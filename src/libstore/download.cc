@@ -7,6 +7,8 @@
 #include "s3.hh"
 #include "compression.hh"
 #include "pathlocks.hh"
+#include "finally.hh"
+#include "download-helper.hh"
 
 #ifdef ENABLE_S3
 #include <aws/core/client/ClientConfiguration.h>
@@ -48,7 +50,7 @@ ref<std::string> decodeContent(const std::string & encoding, ref<std::string> da
 {
     if (encoding == "")
         return data;
-    else if (encoding == "br")
+    else if (encoding == "br" || encoding == "zstd")
         return decompress(encoding, *data);
     else
         throw Error("unsupported Content-Encoding '%s'", encoding);
@@ -63,6 +65,27 @@ struct CurlDownloader : public Downloader
 
     bool enableHttp2;
 
+    size_t maxActiveDownloads;
+
+    /* A token bucket shared by all requests with the same
+       'rateLimitKey'. Only accessed from the worker thread. */
+    struct RateLimiter
+    {
+        uint64_t rate = 0;
+        double tokens = 0;
+        std::chrono::steady_clock::time_point lastRefill;
+
+        void refill(std::chrono::steady_clock::time_point now)
+        {
+            double elapsed = std::chrono::duration<double>(now - lastRefill).count();
+            /* Allow bursts of at most one second's worth of data. */
+            tokens = std::min(tokens + elapsed * rate, (double) rate);
+            lastRefill = now;
+        }
+    };
+
+    std::map<std::string, RateLimiter> rateLimiters;
+
     struct DownloadItem : public std::enable_shared_from_this<DownloadItem>
     {
         CurlDownloader & downloader;
@@ -82,10 +105,42 @@ struct CurlDownloader : public Downloader
            has been reached. */
         std::chrono::steady_clock::time_point embargo;
 
+        /* Sequence number used to start requests of equal priority in
+           FIFO order. */
+        uint64_t seq = 0;
+
+        std::chrono::steady_clock::time_point enqueued;
+
+        RateLimiter * rateLimiter = nullptr;
+
+        /* Whether the transfer has been paused because 'rateLimiter'
+           ran out of tokens. */
+        bool paused = false;
+        std::chrono::steady_clock::time_point pausedSince;
+
         struct curl_slist * requestHeaders = 0;
 
         std::string encoding;
 
+        /* Number of bytes passed to request.dataCallback. */
+        uint64_t writtenToSink = 0;
+
+        /* The offset at which the current attempt started. Servers
+           that don't support ranges send the whole file, in which
+           case we skip 'bytesToSkip' bytes of the response body. */
+        uint64_t resumeOffset = 0;
+        uint64_t bytesToSkip = 0;
+        bool bodyStarted = false;
+
+        /* The start of the range and the size of the file, as given
+           by the Content-Range header of the response (-1 if
+           absent or unknown). */
+        int64_t contentRangeStart = -1, contentRangeSize = -1;
+
+        /* Exception thrown by request.dataCallback, which cannot
+           propagate through curl. */
+        std::exception_ptr writeException;
+
         DownloadItem(CurlDownloader & downloader, const DownloadRequest & request)
             : downloader(downloader)
             , request(request)
@@ -121,10 +176,70 @@ struct CurlDownloader : public Downloader
             callFailure(failure, std::make_exception_ptr(e));
         }
 
+        static bool successfulStatus(long httpStatus)
+        {
+            return httpStatus == 200 || httpStatus == 201 || httpStatus == 204 || httpStatus == 206 || httpStatus == 304 || httpStatus == 226 /* FTP */ || httpStatus == 0 /* other protocol */;
+        }
+
         size_t writeCallback(void * contents, size_t size, size_t nmemb)
         {
             size_t realSize = size * nmemb;
-            result.data->append((char *) contents, realSize);
+
+            if (rateLimiter) {
+                auto now = std::chrono::steady_clock::now();
+                rateLimiter->refill(now);
+                if (rateLimiter->tokens <= 0) {
+                    /* curl will pass the same data again after the
+                       worker thread has resumed the transfer. */
+                    paused = true;
+                    pausedSince = now;
+                    return CURL_WRITEFUNC_PAUSE;
+                }
+                rateLimiter->tokens -= realSize;
+            }
+
+            try {
+                long httpStatus = 0;
+                if (request.dataCallback || resumeOffset)
+                    curl_easy_getinfo(req, CURLINFO_RESPONSE_CODE, &httpStatus);
+
+                char * data = (char *) contents;
+                size_t len = realSize;
+
+                if (!bodyStarted) {
+                    bodyStarted = true;
+                    bytesToSkip = 0;
+                    if (resumeOffset && httpStatus == 200)
+                        bytesToSkip = resumeOffset;
+                    else if (resumeOffset && httpStatus == 206) {
+                        if (contentRangeStart == -1 || (uint64_t) contentRangeStart > resumeOffset)
+                            throw nix::Error("server returned an unexpected range when resuming the download of '%s' at byte %d",
+                                request.uri, resumeOffset);
+                        bytesToSkip = resumeOffset - contentRangeStart;
+                    }
+                }
+
+                if (bytesToSkip) {
+                    auto n = std::min((uint64_t) len, bytesToSkip);
+                    bytesToSkip -= n;
+                    data += n;
+                    len -= n;
+                }
+
+                /* The body of error responses is still accumulated
+                   in 'result.data' for diagnostics. */
+                if (request.dataCallback && successfulStatus(httpStatus)) {
+                    if (encoding != "")
+                        throw nix::Error("cannot stream '%s' because it has Content-Encoding '%s'", request.uri, encoding);
+                    writtenToSink += len;
+                    if (len) request.dataCallback(data, len);
+                } else
+                    result.data->append(data, len);
+            } catch (...) {
+                writeException = std::current_exception();
+                return 0;
+            }
+
             return realSize;
         }
 
@@ -144,6 +259,8 @@ struct CurlDownloader : public Downloader
                 status = ss.size() >= 2 ? ss[1] : "";
                 result.data = std::make_shared<std::string>();
                 encoding = "";
+                bodyStarted = false;
+                contentRangeStart = contentRangeSize = -1;
             } else {
                 auto i = line.find(':');
                 if (i != string::npos) {
@@ -160,12 +277,27 @@ struct CurlDownloader : public Downloader
                             return 0;
                         }
                     } else if (name == "content-encoding")
-                        encoding = trim(string(line, i + 1));;
+                        encoding = trim(string(line, i + 1));
+                    else if (name == "content-range")
+                        parseContentRange(trim(string(line, i + 1)));
                 }
             }
             return realSize;
         }
 
+        /* Parse 'bytes <start>-<end>/<size>' or 'bytes * /<size>'. */
+        void parseContentRange(const std::string & value)
+        {
+            if (!hasPrefix(value, "bytes ")) return;
+            auto range = trim(std::string(value, 6));
+            auto slash = range.find('/');
+            if (slash == std::string::npos) return;
+            int64_t n;
+            if (string2Int(std::string(range, slash + 1), n)) contentRangeSize = n;
+            auto dash = range.find('-');
+            if (dash < slash && string2Int(std::string(range, 0, dash), n)) contentRangeStart = n;
+        }
+
         static size_t headerCallbackWrapper(void * contents, size_t size, size_t nmemb, void * userp)
         {
             return ((DownloadItem *) userp)->headerCallback(contents, size, nmemb);
@@ -218,6 +350,8 @@ struct CurlDownloader : public Downloader
 
             curl_easy_reset(req);
 
+            paused = false;
+
             if (verbosity >= lvlVomit) {
                 curl_easy_setopt(req, CURLOPT_VERBOSE, 1);
                 curl_easy_setopt(req, CURLOPT_DEBUGFUNCTION, DownloadItem::debugCallback);
@@ -275,6 +409,16 @@ struct CurlDownloader : public Downloader
             curl_easy_setopt(req, CURLOPT_NETRC_FILE, settings.netrcFile.get().c_str());
             curl_easy_setopt(req, CURLOPT_NETRC, CURL_NETRC_OPTIONAL);
 
+            /* Continue where the previous attempt left off. Don't use
+               CURLOPT_RESUME_FROM_LARGE, since curl then fails if the
+               server ignores the range; we handle that ourselves. */
+            resumeOffset = request.rangeStart + writtenToSink;
+            bytesToSkip = 0;
+            bodyStarted = false;
+            contentRangeStart = contentRangeSize = -1;
+            if (resumeOffset)
+                curl_easy_setopt(req, CURLOPT_RANGE, fmt("%d-", resumeOffset).c_str());
+
             result.data = std::make_shared<std::string>();
         }
 
@@ -289,24 +433,39 @@ struct CurlDownloader : public Downloader
                 result.effectiveUrl = effectiveUrlCStr;
 
             debug(format("finished download of '%s'; curl status = %d, HTTP status = %d, body = %d bytes")
-                % request.uri % code % httpStatus % (result.data ? result.data->size() : 0));
+                % request.uri % code % httpStatus % (request.dataCallback ? writtenToSink : result.data ? result.data->size() : 0));
+
+            if (writeException) {
+                done = true;
+                callFailure(failure, writeException);
+                return;
+            }
 
             if (code == CURLE_WRITE_ERROR && result.etag == request.expectedETag) {
                 code = CURLE_OK;
                 httpStatus = 304;
             }
 
-            if (code == CURLE_OK &&
-                (httpStatus == 200 || httpStatus == 201 || httpStatus == 204 || httpStatus == 304 || httpStatus == 226 /* FTP */ || httpStatus == 0 /* other protocol */))
+            /* If the range can't be satisfied because we already have
+               the whole file, we're done. */
+            if (code == CURLE_OK && httpStatus == 416 && resumeOffset
+                && contentRangeSize == (int64_t) resumeOffset)
+            {
+                httpStatus = 206;
+                result.data = std::make_shared<std::string>();
+            }
+
+            if (code == CURLE_OK && successfulStatus(httpStatus))
             {
                 result.cached = httpStatus == 304;
                 done = true;
 
                 try {
-                    if (request.decompress)
+                    if (request.decompress && !request.dataCallback)
                         result.data = decodeContent(encoding, ref<std::string>(result.data));
                     callSuccess(success, failure, const_cast<const DownloadResult &>(result));
-                    act.progress(result.data->size(), result.data->size());
+                    auto size = request.dataCallback ? writtenToSink : result.data->size();
+                    act.progress(size, size);
                 } catch (...) {
                     done = true;
                     callFailure(failure, std::current_exception());
@@ -345,6 +504,8 @@ struct CurlDownloader : public Downloader
                         case CURLE_INTERFACE_FAILED:
                         case CURLE_UNKNOWN_OPTION:
                         case CURLE_SSL_CACERT_BADFILE:
+                        case CURLE_RANGE_ERROR:
+                        case CURLE_BAD_DOWNLOAD_RESUME:
                             err = Misc;
                             break;
                         default: // Shut up warnings
@@ -362,7 +523,8 @@ struct CurlDownloader : public Downloader
                       : DownloadError(err, format("unable to download '%s': %s (%d)") % request.uri % curl_easy_strerror(code) % code);
 
                 /* If this is a transient error, then maybe retry the
-                   download after a while. */
+                   download after a while. If we've already passed
+                   data to the caller, the retry resumes after it. */
                 if (err == Transient && attempt < request.tries) {
                     int ms = request.baseRetryTimeMs * std::pow(2.0f, attempt - 1 + std::uniform_real_distribution<>(0.0, 0.5)(downloader.mt19937));
                     printError(format("warning: %s; retrying in %d ms") % exc.what() % ms);
@@ -375,6 +537,14 @@ struct CurlDownloader : public Downloader
         }
     };
 
+    struct PriorityComparator {
+        bool operator() (const std::shared_ptr<DownloadItem> & i1, const std::shared_ptr<DownloadItem> & i2) {
+            return i1->request.priority != i2->request.priority
+                ? i1->request.priority < i2->request.priority
+                : i1->seq > i2->seq;
+        }
+    };
+
     struct State
     {
         struct EmbargoComparator {
@@ -383,6 +553,7 @@ struct CurlDownloader : public Downloader
             }
         };
         bool quit = false;
+        uint64_t nextSeq = 0;
         std::priority_queue<std::shared_ptr<DownloadItem>, std::vector<std::shared_ptr<DownloadItem>>, EmbargoComparator> incoming;
     };
 
@@ -413,6 +584,8 @@ struct CurlDownloader : public Downloader
 
         enableHttp2 = settings.enableHttp2;
 
+        maxActiveDownloads = settings.maxActiveDownloads;
+
         wakeupPipe.create();
         fcntl(wakeupPipe.readSide.get(), F_SETFL, O_NONBLOCK);
 
@@ -447,6 +620,9 @@ struct CurlDownloader : public Downloader
 
         std::map<CURL *, std::shared_ptr<DownloadItem>> items;
 
+        /* Requests that are waiting for a transfer slot. */
+        std::priority_queue<std::shared_ptr<DownloadItem>, std::vector<std::shared_ptr<DownloadItem>>, PriorityComparator> pending;
+
         bool quit = false;
 
         std::chrono::steady_clock::time_point nextWakeup;
@@ -474,6 +650,27 @@ struct CurlDownloader : public Downloader
                 }
             }
 
+            /* Resume transfers that were paused by their rate limiter
+               if it has tokens again. */
+            auto now = std::chrono::steady_clock::now();
+
+            for (auto & i : items) {
+                auto & item(i.second);
+                if (!item->paused) continue;
+                item->rateLimiter->refill(now);
+                if (item->rateLimiter->tokens > 0) {
+                    item->paused = false;
+                    item->result.throttleTimeMs += std::chrono::duration_cast<std::chrono::milliseconds>(now - item->pausedSince).count();
+                    curl_easy_pause(item->req, CURLPAUSE_CONT);
+                } else {
+                    auto resume = now + std::chrono::milliseconds(
+                        (uint64_t) (-item->rateLimiter->tokens * 1000 / item->rateLimiter->rate) + 1);
+                    if (nextWakeup == std::chrono::steady_clock::time_point()
+                        || resume < nextWakeup)
+                        nextWakeup = resume;
+                }
+            }
+
             /* Wait for activity, including wakeup events. */
             int numfds = 0;
             struct curl_waitfd extraFDs[1];
@@ -481,7 +678,9 @@ struct CurlDownloader : public Downloader
             extraFDs[0].events = CURL_WAIT_POLLIN;
             extraFDs[0].revents = 0;
             auto sleepTimeMs =
-                nextWakeup != std::chrono::steady_clock::time_point()
+                !pending.empty() && (!maxActiveDownloads || items.size() < maxActiveDownloads)
+                ? 0
+                : nextWakeup != std::chrono::steady_clock::time_point()
                 ? std::max(0, (int) std::chrono::duration_cast<std::chrono::milliseconds>(nextWakeup - std::chrono::steady_clock::now()).count())
                 : 10000;
             vomit("download thread waiting for %d ms", sleepTimeMs);
@@ -502,7 +701,7 @@ struct CurlDownloader : public Downloader
             }
 
             std::vector<std::shared_ptr<DownloadItem>> incoming;
-            auto now = std::chrono::steady_clock::now();
+            now = std::chrono::steady_clock::now();
 
             {
                 auto state(state_.lock());
@@ -521,13 +720,33 @@ struct CurlDownloader : public Downloader
                 quit = state->quit;
             }
 
-            for (auto & item : incoming) {
+            for (auto & item : incoming)
+                pending.push(item);
+
+            /* Start the highest-priority requests for which there
+               are transfer slots. */
+            while (!pending.empty() && (!maxActiveDownloads || items.size() < maxActiveDownloads)) {
+                auto item = pending.top();
+                pending.pop();
                 debug(format("starting download of %s") % item->request.uri);
+                if (item->attempt == 0)
+                    item->result.queueTimeMs = std::chrono::duration_cast<std::chrono::milliseconds>(now - item->enqueued).count();
+                if (item->request.maxRate) {
+                    auto i = rateLimiters.find(item->request.rateLimitKey);
+                    if (i == rateLimiters.end()) {
+                        i = rateLimiters.emplace(item->request.rateLimitKey, RateLimiter()).first;
+                        i->second.tokens = item->request.maxRate;
+                        i->second.lastRefill = now;
+                    }
+                    i->second.rate = item->request.maxRate;
+                    item->rateLimiter = &i->second;
+                }
                 item->init();
                 curl_multi_add_handle(curlm, item->req);
                 item->active = true;
                 items[item->req] = item;
             }
+
         }
 
         debug("download thread shutting down");
@@ -555,6 +774,10 @@ struct CurlDownloader : public Downloader
             auto state(state_.lock());
             if (state->quit)
                 throw nix::Error("cannot enqueue download request because the download thread is shutting down");
+            if (item->attempt == 0) {
+                item->seq = state->nextSeq++;
+                item->enqueued = std::chrono::steady_clock::now();
+            }
             state->incoming.push(item);
         }
         writeFull(wakeupPipe.writeSide.get(), " ");
@@ -600,7 +823,12 @@ ref<Downloader> getDownloader()
 {
     static std::shared_ptr<Downloader> downloader;
     static std::once_flag downloaderCreated;
-    std::call_once(downloaderCreated, [&]() { downloader = makeDownloader(); });
+    std::call_once(downloaderCreated, [&]() {
+        if (settings.useDownloadHelper)
+            downloader = makeDownloadHelperClient();
+        else
+            downloader = makeDownloader();
+    });
     return ref<Downloader>(downloader);
 }
 
@@ -623,6 +851,100 @@ DownloadResult Downloader::download(const DownloadRequest & request)
     return enqueueDownload(request).get();
 }
 
+DownloadResult Downloader::download(DownloadRequest && request, Sink & sink)
+{
+    /* Note: we can't call 'sink' via request.dataCallback, because
+       that would cause the sink to execute on the downloader
+       thread. So instead the data is passed to this thread through a
+       bounded buffer. */
+
+    struct State {
+        bool quit = false;
+        std::exception_ptr exc;
+        std::string data;
+        DownloadResult result;
+        std::condition_variable avail, request;
+    };
+
+    auto _state = std::make_shared<Sync<State>>();
+
+    /* In case of an exception (e.g. from the sink), make the
+       downloader thread abort the transfer. */
+    Finally finally([&]() {
+        auto state(_state->lock());
+        state->quit = true;
+        state->request.notify_one();
+    });
+
+    request.dataCallback = [_state](char * buf, size_t len) {
+
+        auto state(_state->lock());
+
+        if (state->quit)
+            throw nix::Error("download was cancelled");
+
+        /* If the buffer is full, then go to sleep until the calling
+           thread wakes us up (i.e. when it has removed data from the
+           buffer). We don't wait forever to prevent stalling the
+           downloader thread, which also serves other downloads. */
+        if (state->data.size() > 1024 * 1024) {
+            debug("download buffer is full; going to sleep");
+            state.wait_for(state->request, std::chrono::seconds(10));
+        }
+
+        state->data.append(buf, len);
+        state->avail.notify_one();
+    };
+
+    enqueueDownload(request,
+        [_state](const DownloadResult & r) {
+            auto state(_state->lock());
+            state->quit = true;
+            state->result = r;
+            state->result.data = nullptr;
+            state->avail.notify_one();
+            state->request.notify_one();
+        },
+        [_state](std::exception_ptr ex) {
+            auto state(_state->lock());
+            state->quit = true;
+            state->exc = ex;
+            state->avail.notify_one();
+            state->request.notify_one();
+        });
+
+    while (true) {
+        checkInterrupt();
+
+        std::string chunk;
+
+        {
+            auto state(_state->lock());
+
+            while (state->data.empty()) {
+
+                if (state->quit) {
+                    if (state->exc) std::rethrow_exception(state->exc);
+                    return state->result;
+                }
+
+                state.wait(state->avail);
+            }
+
+            chunk = std::move(state->data);
+            state->data.clear();
+
+            state->request.notify_one();
+        }
+
+        /* Flush the data to the sink and wake up the download thread
+           if it's blocked on a full buffer. We don't hold the state
+           lock while doing this to prevent blocking the download
+           thread if sink() takes a long time. */
+        sink((unsigned char *) chunk.data(), chunk.size());
+    }
+}
+
 Path Downloader::downloadCached(ref<Store> store, const string & url_, bool unpack, string name, const Hash & expectedHash, string * effectiveUrl, int ttl)
 {
     auto url = resolveUri(url_);
@@ -22,6 +22,25 @@ struct DownloadRequest
     std::shared_ptr<std::string> data;
     std::string mimeType;
 
+    /* If set, the body of a successful response is passed to this
+       function (on the downloader thread) as it arrives, rather than
+       being accumulated in DownloadResult::data. */
+    std::function<void(char *, size_t)> dataCallback;
+
+    /* If non-zero, fetch the file starting at this offset (i.e. send
+       an HTTP Range request). */
+    uint64_t rangeStart = 0;
+
+    /* Requests with a higher priority are started first if the number
+       of concurrent transfers is limited by 'max-active-downloads'. */
+    int priority = 0;
+
+    /* If non-zero, the combined download rate of all requests with
+       the same 'rateLimitKey' is limited to this many bytes per
+       second. */
+    uint64_t maxRate = 0;
+    std::string rateLimitKey;
+
     DownloadRequest(const std::string & uri)
         : uri(uri), parentAct(getCurActivity()) { }
 };
@@ -32,6 +51,11 @@ struct DownloadResult
     std::string etag;
     std::string effectiveUrl;
     std::shared_ptr<std::string> data;
+
+    /* Time spent waiting for a transfer slot, and time the transfer
+       was paused to honour 'maxRate'. */
+    uint64_t queueTimeMs = 0;
+    uint64_t throttleTimeMs = 0;
 };
 
 class Store;
@@ -50,6 +74,12 @@ struct Downloader
     /* Synchronously download a file. */
     DownloadResult download(const DownloadRequest & request);
 
+    /* Download a file, writing its contents to a sink. The sink will
+       be invoked on the thread of the caller, and the amount of data
+       buffered between the downloader thread and the caller is
+       bounded. The data member of the result is not set. */
+    DownloadResult download(DownloadRequest && request, Sink & sink);
+
     /* Check if the specified file is already in ~/.cache/nix/tarballs
        and is more recent than ‘tarball-ttl’ seconds. Otherwise,
        use the recorded ETag to verify if the server has a more
@@ -150,7 +150,7 @@ public:
         "Amount of reserved disk space for the garbage collector."};
 
     Setting<bool> fsyncMetadata{this, true, "fsync-metadata",
-        "Whether SQLite should use fsync()."};
+        "Whether the Nix database should use fsync()."};
 
     Setting<bool> useSQLiteWAL{this, true, "use-sqlite-wal",
         "Whether SQLite should use WAL mode."};
@@ -177,6 +177,9 @@ public:
         "Whether to compress logs.",
         {"build-compress-log"}};
 
+    Setting<std::string> buildLogCompression{this, "bzip2", "build-log-compression",
+        "The compression method used for build logs ('bzip2' or 'zstd')."};
+
     Setting<unsigned long> maxLogSize{this, 0, "max-build-log-size",
         "Maximum number of bytes a builder can write to stdout/stderr "
         "before being killed (0 means no limit).",
@@ -284,9 +287,30 @@ public:
         "Number of parallel HTTP connections.",
         {"binary-caches-parallel-connections"}};
 
+    Setting<unsigned int> copyJobs{this, 0, "copy-jobs",
+        "Number of store paths to copy between stores in parallel. 0 means the number of CPU cores."};
+
+    Setting<size_t> copyBufferSize{this, 4 * 1024 * 1024, "copy-buffer-size",
+        "Maximum amount of NAR data buffered between reading a store path from the source store "
+        "and adding it to the destination store. 0 means doing both in a single thread."};
+
+    Setting<size_t> copyCompressionBufferSize{this, 4 * 1024 * 1024, "copy-compression-buffer-size",
+        "Maximum amount of NAR data buffered between hashing a store path and compressing it "
+        "when adding it to a binary cache. 0 means doing both in a single thread."};
+
+    Setting<unsigned int> compressionThreads{this, 0, "compression-threads",
+        "Number of threads used to compress a NAR for a binary cache that has 'parallel-compression' enabled. "
+        "0 means the number of CPU cores."};
+
+    Setting<size_t> maxActiveDownloads{this, 64, "max-active-downloads",
+        "Maximum number of downloads in progress at the same time. Further requests are queued by priority. 0 means no limit."};
+
     Setting<bool> enableHttp2{this, true, "http2",
         "Whether to enable HTTP/2 support."};
 
+    Setting<bool> useDownloadHelper{this, false, "download-helper",
+        "Whether to perform downloads through a per-user helper process that keeps connections open across Nix invocations."};
+
     Setting<unsigned int> tarballTtl{this, 60 * 60, "tarball-ttl",
         "How soon to expire files fetched by builtins.fetchTarball and builtins.fetchurl."};
 
@@ -313,6 +337,17 @@ public:
         "Additional URIs of substituters.",
         {"extra-binary-caches"}};
 
+    Setting<Strings> peers{this, {}, "peers",
+        "The URIs of stores on nearby machines that the peer:// substituter should query."};
+
+    Setting<std::string> peerDiscoveryAddress{this, "239.255.43.21:5043", "peer-discovery-address",
+        "The IPv4 address and port to which the peer:// substituter sends discovery queries. "
+        "Empty to disable discovery."};
+
+    Setting<unsigned int> peerDiscoveryTimeout{this, 250, "peer-discovery-timeout",
+        "How long (in milliseconds) the peer:// substituter waits for replies to discovery queries, "
+        "at most; it stops waiting shortly after the first reply."};
+
     Setting<StringSet> trustedSubstituters{this, {}, "trusted-substituters",
         "Disabled substituters that may be enabled via the substituters option by untrusted users.",
         {"trusted-binary-caches"}};
@@ -328,10 +363,21 @@ public:
         "The TTL in seconds for positive lookups in the disk cache i.e binary cache lookups that "
         "return a valid path result."};
 
+    Setting<std::string> narInfoCacheBackend{this, "sqlite", "narinfo-cache-backend",
+        "How to store the disk cache of binary cache lookups: 'sqlite' or 'mmap'."};
+
     /* ?Who we trust to use the daemon in safe ways */
     Setting<Strings> allowedUsers{this, {"*"}, "allowed-users",
         "Which users or groups are allowed to connect to the daemon."};
 
+    Setting<unsigned int> daemonThreads{this, 0, "daemon-threads",
+        "Number of threads with which the daemon serves queries from a shared store. "
+        "0 means forking a process for every connection."};
+
+    Setting<size_t> sharedPathInfoCacheSize{this, 0, "shared-path-info-cache-size",
+        "Number of entries in the path info cache shared by all processes using the Nix database. "
+        "0 disables the cache."};
+
     Setting<bool> printMissing{this, true, "print-missing",
         "Whether to print what paths need to be built or downloaded."};
 
@@ -383,6 +429,18 @@ public:
     Setting<uint64_t> maxFree{this, std::numeric_limits<uint64_t>::max(), "max-free",
         "Stop deleting garbage when free disk space is above the specified amount."};
 
+    Setting<unsigned int> verifyThreads{this, 0, "verify-threads",
+        "Number of threads with which 'nix-store --verify --check-contents' hashes paths. "
+        "0 means the number of CPU cores."};
+
+    Setting<uint64_t> verifyMaxReadRate{this, 0, "verify-max-read-rate",
+        "Maximum number of bytes per second that 'nix-store --verify --check-contents' reads. "
+        "0 means no limit."};
+
+    Setting<unsigned int> verifyContentsPercentage{this, 100, "verify-contents-percentage",
+        "Percentage of valid paths whose contents 'nix-store --verify --check-contents' checks, "
+        "starting with the paths that were verified least recently."};
+
     Setting<Strings> allowedUris{this, {}, "allowed-uris",
         "Prefixes of URIs that builtin functions such as fetchurl and fetchGit are allowed to fetch."};
 
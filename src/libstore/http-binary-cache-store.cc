@@ -15,6 +15,15 @@ private:
 
 public:
 
+    const Setting<uint64_t> maxDownloadRate{this, 0, "max-download-rate",
+        "maximum combined download rate from this cache in bytes per second (0 means no limit)"};
+
+    const Setting<bool> resumeDownloads{this, true, "resume-downloads",
+        "whether to keep partially downloaded NARs so that interrupted downloads can be resumed"};
+
+    const Setting<unsigned int> downloadTries{this, 8, "download-tries",
+        "number of times to try downloading a file from this cache"};
+
     HttpBinaryCacheStore(
         const Params & params, const Path & _cacheUri)
         : BinaryCacheStore(params)
@@ -34,13 +43,16 @@ public:
     void init() override
     {
         // FIXME: do this lazily?
-        if (!diskCache->cacheExists(cacheUri, wantMassQuery_, priority)) {
+        StringMap extraInfo;
+        if (diskCache->cacheExists(cacheUri, wantMassQuery_, priority, extraInfo))
+            setExtraCacheInfo(extraInfo);
+        else {
             try {
                 BinaryCacheStore::init();
             } catch (UploadToHTTP &) {
                 throw Error("'%s' does not appear to be a binary cache", cacheUri);
             }
-            diskCache->createCache(cacheUri, storeDir, wantMassQuery_, priority);
+            diskCache->createCache(cacheUri, storeDir, wantMassQuery_, priority, getExtraCacheInfo());
         }
     }
 
@@ -51,7 +63,7 @@ protected:
         try {
             DownloadRequest request(cacheUri + "/" + path);
             request.head = true;
-            request.tries = 5;
+            request.tries = std::min(5u, downloadTries.get());
             getDownloader()->download(request);
             return true;
         } catch (DownloadError & e) {
@@ -77,15 +89,78 @@ protected:
         }
     }
 
+    DownloadRequest makeRequest(const std::string & path)
+    {
+        DownloadRequest request(cacheUri + "/" + path);
+        request.tries = downloadTries;
+        /* Fetch metadata before NARs, since the substitution goals
+           waiting for it can't make progress otherwise. */
+        if (!hasPrefix(path, "nar/") && !hasPrefix(path, "chunks/"))
+            request.priority = 1;
+        request.maxRate = maxDownloadRate;
+        request.rateLimitKey = cacheUri;
+        return request;
+    }
+
+    void updateStats(const DownloadResult & result)
+    {
+        stats.downloadQueueTimeMs += result.queueTimeMs;
+        stats.downloadThrottleTimeMs += result.throttleTimeMs;
+    }
+
+    ConditionalFile getFileIfChanged(const std::string & path, const std::string & etag) override
+    {
+        auto request(makeRequest(path));
+        request.expectedETag = etag;
+
+        ConditionalFile res;
+
+        try {
+            auto result = getDownloader()->download(request);
+            updateStats(result);
+            res.unchanged = result.cached;
+            res.data = result.data;
+            res.etag = result.etag;
+        } catch (DownloadError & e) {
+            if (e.error != Downloader::NotFound && e.error != Downloader::Forbidden)
+                throw;
+        }
+
+        return res;
+    }
+
+    bool keepPartialNars() override
+    {
+        return resumeDownloads;
+    }
+
+    void getFile(const std::string & path, Sink & sink) override
+    {
+        getFile(path, 0, sink);
+    }
+
+    void getFile(const std::string & path, uint64_t offset, Sink & sink) override
+    {
+        auto request(makeRequest(path));
+        request.rangeStart = offset;
+        try {
+            updateStats(getDownloader()->download(std::move(request), sink));
+        } catch (DownloadError & e) {
+            if (e.error == Downloader::NotFound || e.error == Downloader::Forbidden)
+                throw NoSuchBinaryCacheFile("file '%s' does not exist in binary cache '%s'", path, getUri());
+            throw;
+        }
+    }
+
     void getFile(const std::string & path,
         std::function<void(std::shared_ptr<std::string>)> success,
         std::function<void(std::exception_ptr exc)> failure) override
     {
-        DownloadRequest request(cacheUri + "/" + path);
-        request.tries = 8;
+        auto request(makeRequest(path));
 
         getDownloader()->enqueueDownload(request,
-            [success](const DownloadResult & result) {
+            [this, success](const DownloadResult & result) {
+                updateStats(result);
                 success(result.data);
             },
             [success, failure](std::exception_ptr exc) {
@@ -2,6 +2,8 @@
 #include "globals.hh"
 #include "nar-info-disk-cache.hh"
 
+#include <fcntl.h>
+
 namespace nix {
 
 class LocalBinaryCacheStore : public BinaryCacheStore
@@ -34,6 +36,31 @@ protected:
         const std::string & data,
         const std::string & mimeType) override;
 
+    void upsertFile(const std::string & path,
+        std::shared_ptr<std::basic_iostream<char>> istream,
+        const std::string & mimeType) override;
+
+    void addToCacheIndex(const std::string & hashPart) override
+    {
+        /* Appends of a single line are atomic, so concurrent writers
+           don't need to lock the index. */
+        Path indexFile = binaryCacheDir + "/" + cacheIndexFile;
+        AutoCloseFD fd = open(indexFile.c_str(), O_WRONLY | O_APPEND | O_CLOEXEC);
+        if (!fd) throw SysError("opening binary cache index '%s'", indexFile);
+        writeFull(fd.get(), hashPart + "\n");
+    }
+
+    void getFile(const std::string & path, Sink & sink) override
+    {
+        try {
+            readFile(binaryCacheDir + "/" + path, sink);
+        } catch (SysError & e) {
+            if (e.errNo == ENOENT)
+                throw NoSuchBinaryCacheFile("file '%s' does not exist in binary cache", path);
+            throw;
+        }
+    }
+
     void getFile(const std::string & path,
         std::function<void(std::shared_ptr<std::string>)> success,
         std::function<void(std::exception_ptr exc)> failure) override
@@ -67,14 +94,16 @@ protected:
 void LocalBinaryCacheStore::init()
 {
     createDirs(binaryCacheDir + "/nar");
+    if (chunkNARs)
+        createDirs(binaryCacheDir + "/chunks");
     BinaryCacheStore::init();
 }
 
-static void atomicWrite(const Path & path, const std::string & s)
+static void atomicWrite(const Path & path, std::function<void(const Path &)> write)
 {
     Path tmp = path + ".tmp." + std::to_string(getpid());
     AutoDelete del(tmp, false);
-    writeFile(tmp, s);
+    write(tmp);
     if (rename(tmp.c_str(), path.c_str()))
         throw SysError(format("renaming '%1%' to '%2%'") % tmp % path);
     del.cancel();
@@ -89,7 +118,26 @@ void LocalBinaryCacheStore::upsertFile(const std::string & path,
     const std::string & data,
     const std::string & mimeType)
 {
-    atomicWrite(binaryCacheDir + "/" + path, data);
+    atomicWrite(binaryCacheDir + "/" + path, [&](const Path & tmp) {
+        writeFile(tmp, data);
+    });
+}
+
+void LocalBinaryCacheStore::upsertFile(const std::string & path,
+    std::shared_ptr<std::basic_iostream<char>> istream,
+    const std::string & mimeType)
+{
+    atomicWrite(binaryCacheDir + "/" + path, [&](const Path & tmp) {
+        AutoCloseFD fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+        if (!fd) throw SysError(format("opening file '%1%'") % tmp);
+        FdSink sink(fd.get());
+        std::vector<char> buf(65536);
+        while (istream->read(buf.data(), buf.size()), istream->gcount())
+            sink((const unsigned char *) buf.data(), istream->gcount());
+        if (istream->bad())
+            throw Error(format("reading data for '%1%'") % path);
+        sink.flush();
+    });
 }
 
 static RegisterStoreImplementation regStore([](
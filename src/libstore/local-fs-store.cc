@@ -113,6 +113,7 @@ std::shared_ptr<std::string> LocalFSStore::getBuildLog(const Path & path_)
             ? fmt("%s/%s/%s/%s", logDir, drvsLogDir, string(baseName, 0, 2), string(baseName, 2))
             : fmt("%s/%s/%s", logDir, drvsLogDir, baseName);
         Path logBz2Path = logPath + ".bz2";
+        Path logZstdPath = logPath + ".zst";
 
         if (pathExists(logPath))
             return std::make_shared<std::string>(readFile(logPath));
@@ -123,6 +124,12 @@ std::shared_ptr<std::string> LocalFSStore::getBuildLog(const Path & path_)
             } catch (Error &) { }
         }
 
+        else if (pathExists(logZstdPath)) {
+            try {
+                return decompress("zstd", readFile(logZstdPath));
+            } catch (Error &) { }
+        }
+
     }
 
     return nullptr;
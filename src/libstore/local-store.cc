@@ -5,10 +5,15 @@
 #include "worker-protocol.hh"
 #include "derivations.hh"
 #include "nar-info.hh"
+#include "shared-path-info-cache.hh"
+#include "finally.hh"
+#include "thread-pool.hh"
 
 #include <iostream>
 #include <algorithm>
 #include <cstring>
+#include <thread>
+#include <unordered_set>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -28,14 +33,9 @@
 #include <sys/mount.h>
 #include <sys/ioctl.h>
 #include <sys/xattr.h>
+#include <sys/syscall.h>
 #endif
 
-#ifdef __CYGWIN__
-#include <windows.h>
-#endif
-
-#include <sqlite3.h>
-
 
 namespace nix {
 
@@ -54,6 +54,8 @@ LocalStore::LocalStore(const Params & params)
     , tempRootsDir(stateDir + "/temproots")
     , fnTempRoots(fmt("%s/%d", tempRootsDir, getpid()))
 {
+    checkOptimiseMethod();
+
     auto state(_state.lock());
 
     /* Create missing state directories if they don't already exist. */
@@ -155,8 +157,8 @@ LocalStore::LocalStore(const Params & params)
             % curSchema % nixSchemaVersion);
 
     else if (curSchema == 0) { /* new store */
+        state->db = openDB(0);
         curSchema = nixSchemaVersion;
-        openDB(*state, true);
         writeFile(schemaPath, (format("%1%") % nixSchemaVersion).str());
     }
 
@@ -184,60 +186,27 @@ LocalStore::LocalStore(const Params & params)
 
         if (curSchema < 7) { upgradeStore7(); }
 
-        openDB(*state, false);
-
-        if (curSchema < 8) {
-            SQLiteTxn txn(state->db);
-            state->db.exec("alter table ValidPaths add column ultimate integer");
-            state->db.exec("alter table ValidPaths add column sigs text");
-            txn.commit();
-        }
-
-        if (curSchema < 9) {
-            SQLiteTxn txn(state->db);
-            state->db.exec("drop table FailedPaths");
-            txn.commit();
-        }
-
-        if (curSchema < 10) {
-            SQLiteTxn txn(state->db);
-            state->db.exec("alter table ValidPaths add column ca text");
-            txn.commit();
-        }
+        state->db = openDB(curSchema);
 
         writeFile(schemaPath, (format("%1%") % nixSchemaVersion).str());
 
         lockFile(globalLock.get(), ltRead, true);
     }
 
-    else openDB(*state, false);
-
-    /* Prepare SQL statements. */
-    state->stmtRegisterValidPath.create(state->db,
-        "insert into ValidPaths (path, hash, registrationTime, deriver, narSize, ultimate, sigs, ca) values (?, ?, ?, ?, ?, ?, ?, ?);");
-    state->stmtUpdatePathInfo.create(state->db,
-        "update ValidPaths set narSize = ?, hash = ?, ultimate = ?, sigs = ?, ca = ? where path = ?;");
-    state->stmtAddReference.create(state->db,
-        "insert or replace into Refs (referrer, reference) values (?, ?);");
-    state->stmtQueryPathInfo.create(state->db,
-        "select id, hash, registrationTime, deriver, narSize, ultimate, sigs, ca from ValidPaths where path = ?;");
-    state->stmtQueryReferences.create(state->db,
-        "select path from Refs join ValidPaths on reference = id where referrer = ?;");
-    state->stmtQueryReferrers.create(state->db,
-        "select path from Refs join ValidPaths on referrer = id where reference = (select id from ValidPaths where path = ?);");
-    state->stmtInvalidatePath.create(state->db,
-        "delete from ValidPaths where path = ?;");
-    state->stmtAddDerivationOutput.create(state->db,
-        "insert or replace into DerivationOutputs (drv, id, path) values (?, ?, ?);");
-    state->stmtQueryValidDerivers.create(state->db,
-        "select v.id, v.path from DerivationOutputs d join ValidPaths v on d.drv = v.id where d.path = ?;");
-    state->stmtQueryDerivationOutputs.create(state->db,
-        "select id, path from DerivationOutputs where drv = ?;");
-    // Use "path >= ?" with limit 1 rather than "path like '?%'" to
-    // ensure efficient lookup.
-    state->stmtQueryPathFromHashPart.create(state->db,
-        "select path from ValidPaths where path >= ? limit 1;");
-    state->stmtQueryValidPaths.create(state->db, "select path from ValidPaths");
+    else state->db = openDB(curSchema);
+
+    /* Open the shared path info cache. If it exists we must keep it
+       up to date even if we're not configured to create it. */
+    if (settings.sharedPathInfoCacheSize || pathExists(dbDir + "/path-info-cache")) {
+        try {
+            sharedCache = std::make_unique<SharedPathInfoCache>(dbDir, true, settings.sharedPathInfoCacheSize);
+            sharedCache->checkDatabase(state->db->sequenceNumber());
+        } catch (SysError & e) {
+            /* Users who can't write the cache can't write the
+               database either. */
+            if (e.errNo != EACCES && e.errNo != EROFS) throw;
+        }
+    }
 }
 
 
@@ -286,71 +255,21 @@ int LocalStore::getSchema()
 }
 
 
-void LocalStore::openDB(State & state, bool create)
+std::unique_ptr<PathDB> LocalStore::openDB(int schema)
 {
     if (access(dbDir.c_str(), R_OK | W_OK))
         throw SysError(format("Nix database directory '%1%' is not writable") % dbDir);
 
-    /* Open the Nix database. */
-    string dbPath = dbDir + "/db.sqlite";
-    auto & db(state.db);
-    if (sqlite3_open_v2(dbPath.c_str(), &db.db,
-            SQLITE_OPEN_READWRITE | (create ? SQLITE_OPEN_CREATE : 0), 0) != SQLITE_OK)
-        throw Error(format("cannot open Nix database '%1%'") % dbPath);
-
-#ifdef __CYGWIN__
-    /* The cygwin version of sqlite3 has a patch which calls
-       SetDllDirectory("/usr/bin") on init. It was intended to fix extension
-       loading, which we don't use, and the effect of SetDllDirectory is
-       inherited by child processes, and causes libraries to be loaded from
-       /usr/bin instead of $PATH. This breaks quite a few things (e.g.
-       checkPhase on openssh), so we set it back to default behaviour. */
-    SetDllDirectoryW(L"");
-#endif
-
-    if (sqlite3_busy_timeout(db, 60 * 60 * 1000) != SQLITE_OK)
-        throwSQLiteError(db, "setting timeout");
-
-    db.exec("pragma foreign_keys = 1");
-
-    /* !!! check whether sqlite has been built with foreign key
-       support */
-
-    /* Whether SQLite should fsync().  "Normal" synchronous mode
-       should be safe enough.  If the user asks for it, don't sync at
-       all.  This can cause database corruption if the system
-       crashes. */
-    string syncMode = settings.fsyncMetadata ? "normal" : "off";
-    db.exec("pragma synchronous = " + syncMode);
-
-    /* Set the SQLite journal mode.  WAL mode is fastest, so it's the
-       default. */
-    string mode = settings.useSQLiteWAL ? "wal" : "truncate";
-    string prevMode;
-    {
-        SQLiteStmt stmt;
-        stmt.create(db, "pragma main.journal_mode;");
-        if (sqlite3_step(stmt) != SQLITE_ROW)
-            throwSQLiteError(db, "querying journal mode");
-        prevMode = string((const char *) sqlite3_column_text(stmt, 0));
-    }
-    if (prevMode != mode &&
-        sqlite3_exec(db, ("pragma main.journal_mode = " + mode + ";").c_str(), 0, 0, 0) != SQLITE_OK)
-        throwSQLiteError(db, "setting journal mode");
-
-    /* Increase the auto-checkpoint interval to 40000 pages.  This
-       seems enough to ensure that instantiating the NixOS system
-       derivation is done in a single fsync(). */
-    if (mode == "wal" && sqlite3_exec(db, "pragma wal_autocheckpoint = 40000;", 0, 0, 0) != SQLITE_OK)
-        throwSQLiteError(db, "setting autocheckpoint interval");
-
-    /* Initialise the database schema, if necessary. */
-    if (create) {
-        const char * schema =
-#include "schema.sql.gen.hh"
-            ;
-        db.exec(schema);
-    }
+    /* Stores that have been migrated to the log-structured database
+       have no SQLite database, so that older versions of Nix refuse
+       to use them. */
+    Path logDir = dbDir + "/paths";
+    if (pathExists(logDir)) {
+        if (schema && schema != nixSchemaVersion)
+            throw Error("Nix database '%s' has an unexpected schema version", logDir);
+        return openLogPathDB(logDir, storeDir);
+    } else
+        return openSQLitePathDB(dbDir + "/db.sqlite", storeDir, schema);
 }
 
 
@@ -578,23 +497,13 @@ void LocalStore::checkDerivationOutputs(const Path & drvPath, const Derivation &
 }
 
 
-uint64_t LocalStore::addValidPath(State & state,
+void LocalStore::addValidPath(State & state,
     const ValidPathInfo & info, bool checkOutputs)
 {
     if (info.ca != "" && !info.isContentAddressed(*this))
         throw Error("cannot add path '%s' to the Nix store because it claims to be content-addressed but isn't", info.path);
 
-    state.stmtRegisterValidPath.use()
-        (info.path)
-        (info.narHash.to_string(Base16))
-        (info.registrationTime == 0 ? time(0) : info.registrationTime)
-        (info.deriver, info.deriver != "")
-        (info.narSize, info.narSize != 0)
-        (info.ultimate ? 1 : 0, info.ultimate)
-        (concatStringsSep(" ", info.sigs), !info.sigs.empty())
-        (info.ca, !info.ca.empty())
-        .exec();
-    uint64_t id = sqlite3_last_insert_rowid(state.db);
+    state.db->addPath(info);
 
     /* If this is a derivation, then store the derivation outputs in
        the database.  This is useful for the garbage collector: it can
@@ -610,21 +519,14 @@ uint64_t LocalStore::addValidPath(State & state,
            registration above is undone. */
         if (checkOutputs) checkDerivationOutputs(info.path, drv);
 
-        for (auto & i : drv.outputs) {
-            state.stmtAddDerivationOutput.use()
-                (id)
-                (i.first)
-                (i.second.path)
-                .exec();
-        }
+        for (auto & i : drv.outputs)
+            state.db->addDerivationOutput(info.path, i.first, i.second.path);
     }
 
     {
         auto state_(Store::state.lock());
         state_->pathInfoCache.upsert(storePathToHash(info.path), std::make_shared<ValidPathInfo>(info));
     }
-
-    return id;
 }
 
 
@@ -634,87 +536,86 @@ void LocalStore::queryPathInfoUncached(const Path & path,
 {
     sync2async<std::shared_ptr<ValidPathInfo>>(success, failure, [&]() {
 
-        auto info = std::make_shared<ValidPathInfo>();
-        info->path = path;
-
         assertStorePath(path);
 
-        return retrySQLite<std::shared_ptr<ValidPathInfo>>([&]() {
-            auto state(_state.lock());
-
-            /* Get the path info. */
-            auto useQueryPathInfo(state->stmtQueryPathInfo.use()(path));
+        if (sharedCache) {
+            auto info = sharedCache->lookup(storePathToHash(path));
+            if (info && info->path == path) return info;
+        }
 
-            if (!useQueryPathInfo.next())
-                return std::shared_ptr<ValidPathInfo>();
+        auto generation = sharedCache ? sharedCache->generation() : 0;
 
-            info->id = useQueryPathInfo.getInt(0);
+        auto info = retrySQLite<std::shared_ptr<ValidPathInfo>>([&]() {
+            auto state(_state.lock());
+            return queryPathInfo_(*state, path);
+        });
 
-            try {
-                info->narHash = Hash(useQueryPathInfo.getStr(1));
-            } catch (BadHash & e) {
-                throw Error("in valid-path entry for '%s': %s", path, e.what());
-            }
+        if (info && sharedCache) sharedCache->insert(generation, *info);
 
-            info->registrationTime = useQueryPathInfo.getInt(2);
+        return info;
+    });
+}
 
-            auto s = (const char *) sqlite3_column_text(state->stmtQueryPathInfo, 3);
-            if (s) info->deriver = s;
 
-            /* Note that narSize = NULL yields 0. */
-            info->narSize = useQueryPathInfo.getInt(4);
+std::map<Path, std::shared_ptr<ValidPathInfo>> LocalStore::queryPathInfosUncached(const PathSet & paths)
+{
+    std::map<Path, std::shared_ptr<ValidPathInfo>> infos;
+    PathSet missing;
 
-            info->ultimate = useQueryPathInfo.getInt(5) == 1;
+    for (auto & path : paths) {
+        assertStorePath(path);
+        auto info = sharedCache ? sharedCache->lookup(storePathToHash(path)) : nullptr;
+        if (info && info->path == path)
+            infos[path] = info;
+        else
+            missing.insert(path);
+    }
 
-            s = (const char *) sqlite3_column_text(state->stmtQueryPathInfo, 6);
-            if (s) info->sigs = tokenizeString<StringSet>(s, " ");
+    if (missing.empty()) return infos;
 
-            s = (const char *) sqlite3_column_text(state->stmtQueryPathInfo, 7);
-            if (s) info->ca = s;
+    auto generation = sharedCache ? sharedCache->generation() : 0;
 
-            /* Get the references. */
-            auto useQueryReferences(state->stmtQueryReferences.use()(info->id));
+    retrySQLite<void>([&]() {
+        auto state(_state.lock());
+        for (auto & path : missing)
+            infos[path] = queryPathInfo_(*state, path);
+    });
 
-            while (useQueryReferences.next())
-                info->references.insert(useQueryReferences.getStr(0));
+    if (sharedCache)
+        for (auto & path : missing)
+            if (auto & info = infos[path])
+                sharedCache->insert(generation, *info);
 
-            return info;
-        });
-    });
+    return infos;
 }
 
 
-/* Update path info in the database. */
-void LocalStore::updatePathInfo(State & state, const ValidPathInfo & info)
+std::shared_ptr<ValidPathInfo> LocalStore::queryPathInfo_(State & state, const Path & path)
 {
-    state.stmtUpdatePathInfo.use()
-        (info.narSize, info.narSize != 0)
-        (info.narHash.to_string(Base16))
-        (info.ultimate ? 1 : 0, info.ultimate)
-        (concatStringsSep(" ", info.sigs), !info.sigs.empty())
-        (info.ca, !info.ca.empty())
-        (info.path)
-        .exec();
+    return state.db->queryPathInfo(path);
 }
 
 
-uint64_t LocalStore::queryValidPathId(State & state, const Path & path)
+/* Update path info in the database. */
+void LocalStore::updatePathInfo(State & state, const ValidPathInfo & info)
 {
-    auto use(state.stmtQueryPathInfo.use()(path));
-    if (!use.next())
-        throw Error(format("path '%1%' is not valid") % path);
-    return use.getInt(0);
+    state.db->updatePathInfo(info);
+
+    if (sharedCache) sharedCache->invalidate();
 }
 
 
 bool LocalStore::isValidPath_(State & state, const Path & path)
 {
-    return state.stmtQueryPathInfo.use()(path).next();
+    return state.db->isValidPath(path);
 }
 
 
 bool LocalStore::isValidPathUncached(const Path & path)
 {
+    /* Don't use the shared cache here: callers like addToStore() and
+       the garbage collector rely on the answer, and the cache doesn't
+       see paths deleted by Nix versions that don't know about it. */
     return retrySQLite<bool>([&]() {
         auto state(_state.lock());
         return isValidPath_(*state, path);
@@ -735,20 +636,66 @@ PathSet LocalStore::queryAllValidPaths()
 {
     return retrySQLite<PathSet>([&]() {
         auto state(_state.lock());
-        auto use(state->stmtQueryValidPaths.use());
-        PathSet res;
-        while (use.next()) res.insert(use.getStr(0));
-        return res;
+        return state->db->queryAllValidPaths();
     });
 }
 
 
-void LocalStore::queryReferrers(State & state, const Path & path, PathSet & referrers)
+void LocalStore::scanValidPaths(const ValidPathFilter & filter, bool withInfo,
+    std::function<void(const Path & path, std::shared_ptr<const ValidPathInfo> info)> callback)
 {
-    auto useQueryReferrers(state.stmtQueryReferrers.use()(path));
+    /* Use a database connection of our own, so that the scan doesn't
+       hold the state lock while 'callback' runs, and 'callback' may
+       modify the database. */
+    auto db = openDB(nixSchemaVersion);
+    db->scanValidPaths(filter, withInfo, callback);
+}
+
+
+/* Building the referrers index takes as long as thousands of
+   referrer queries, so only do it after this many. */
+static const uint64_t referrersIndexThreshold = 10000;
+
+
+ReferrersIndex * LocalStore::getReferrersIndex(State & state, bool force)
+{
+    auto version = state.db->dataVersion();
+
+    if (state.referrersIndex) {
+        if (state.referrersIndexVersion == version)
+            return state.referrersIndex.get();
+        /* Another process has changed the database. */
+        state.referrersIndex.reset();
+        state.referrerQueries = 0;
+    }
+
+    if (!force && ++state.referrerQueries < referrersIndexThreshold)
+        return nullptr;
 
-    while (useQueryReferrers.next())
-        referrers.insert(useQueryReferrers.getStr(0));
+    auto index = std::make_unique<ReferrersIndex>();
+    for (auto & path : state.db->queryAllValidPaths())
+        index->addPath(path, {});
+    state.db->queryAllReferences([&](const Path & referrer, const Path & reference) {
+        index->addReference(referrer, reference);
+    });
+
+    debug("built referrers index of %d paths", index->size());
+
+    state.referrersIndex = std::move(index);
+    state.referrersIndexVersion = version;
+    state.referrerQueries = 0;
+    return state.referrersIndex.get();
+}
+
+
+void LocalStore::queryReferrers(State & state, const Path & path, PathSet & referrers)
+{
+    /* Note that the index doesn't reflect uncommitted changes, but
+       nothing queries referrers of paths it has just changed. */
+    if (auto index = getReferrersIndex(state, false))
+        index->queryReferrers(path, referrers);
+    else
+        state.db->queryReferrers(path, referrers);
 }
 
 
@@ -762,21 +709,57 @@ void LocalStore::queryReferrers(const Path & path, PathSet & referrers)
 }
 
 
+std::map<Path, PathSet> LocalStore::queryMultipleReferrers(const PathSet & paths)
+{
+    for (auto & path : paths)
+        assertStorePath(path);
+
+    return retrySQLite<std::map<Path, PathSet>>([&]() {
+        auto state(_state.lock());
+        std::map<Path, PathSet> res;
+        for (auto & path : paths)
+            queryReferrers(*state, path, res[path]);
+        return res;
+    });
+}
+
+
+void LocalStore::computeFSClosure(const PathSet & paths,
+    PathSet & out, bool flipDirection,
+    bool includeOutputs, bool includeDerivers)
+{
+    if (!flipDirection || includeOutputs || includeDerivers) {
+        Store::computeFSClosure(paths, out, flipDirection, includeOutputs, includeDerivers);
+        return;
+    }
+
+    for (auto & path : paths)
+        assertStorePath(path);
+
+    retrySQLite<void>([&]() {
+        auto state(_state.lock());
+        getReferrersIndex(*state, true)->queryReferrersClosure(paths, out);
+    });
+}
+
+
 PathSet LocalStore::queryValidDerivers(const Path & path)
 {
     assertStorePath(path);
 
     return retrySQLite<PathSet>([&]() {
         auto state(_state.lock());
+        return state->db->queryValidDerivers(path);
+    });
+}
 
-        auto useQueryValidDerivers(state->stmtQueryValidDerivers.use()(path));
-
-        PathSet derivers;
-        while (useQueryValidDerivers.next())
-            derivers.insert(useQueryValidDerivers.getStr(1));
 
-        return derivers;
-    });
+PathSet LocalStore::queryDerivationOutputs(State & state, const Path & path)
+{
+    PathSet outputs;
+    for (auto & i : state.db->queryDerivationOutputs(path))
+        outputs.insert(i.second);
+    return outputs;
 }
 
 
@@ -784,15 +767,19 @@ PathSet LocalStore::queryDerivationOutputs(const Path & path)
 {
     return retrySQLite<PathSet>([&]() {
         auto state(_state.lock());
+        return queryDerivationOutputs(*state, path);
+    });
+}
 
-        auto useQueryDerivationOutputs(state->stmtQueryDerivationOutputs.use()
-            (queryValidPathId(*state, path)));
-
-        PathSet outputs;
-        while (useQueryDerivationOutputs.next())
-            outputs.insert(useQueryDerivationOutputs.getStr(1));
 
-        return outputs;
+std::map<Path, PathSet> LocalStore::queryMultipleDerivationOutputs(const PathSet & paths)
+{
+    return retrySQLite<std::map<Path, PathSet>>([&]() {
+        auto state(_state.lock());
+        std::map<Path, PathSet> res;
+        for (auto & path : paths)
+            res[path] = queryDerivationOutputs(*state, path);
+        return res;
     });
 }
 
@@ -802,33 +789,41 @@ StringSet LocalStore::queryDerivationOutputNames(const Path & path)
     return retrySQLite<StringSet>([&]() {
         auto state(_state.lock());
 
-        auto useQueryDerivationOutputs(state->stmtQueryDerivationOutputs.use()
-            (queryValidPathId(*state, path)));
-
         StringSet outputNames;
-        while (useQueryDerivationOutputs.next())
-            outputNames.insert(useQueryDerivationOutputs.getStr(0));
-
+        for (auto & i : state->db->queryDerivationOutputs(path))
+            outputNames.insert(i.first);
         return outputNames;
     });
 }
 
 
-Path LocalStore::queryPathFromHashPart(const string & hashPart)
+Path LocalStore::queryPathFromHashPart(State & state, const string & hashPart)
 {
     if (hashPart.size() != storePathHashLen) throw Error("invalid hash part");
 
-    Path prefix = storeDir + "/" + hashPart;
+    return state.db->queryPathFromHashPart(hashPart);
+}
+
 
-    return retrySQLite<Path>([&]() -> std::string {
+Path LocalStore::queryPathFromHashPart(const string & hashPart)
+{
+    return retrySQLite<Path>([&]() {
         auto state(_state.lock());
+        return queryPathFromHashPart(*state, hashPart);
+    });
+}
 
-        auto useQueryPathFromHashPart(state->stmtQueryPathFromHashPart.use()(prefix));
-
-        if (!useQueryPathFromHashPart.next()) return "";
 
-        const char * s = (const char *) sqlite3_column_text(state->stmtQueryPathFromHashPart, 0);
-        return s && prefix.compare(0, prefix.size(), s, prefix.size()) == 0 ? s : "";
+std::map<string, Path> LocalStore::queryPathsFromHashParts(const StringSet & hashParts)
+{
+    return retrySQLite<std::map<string, Path>>([&]() {
+        auto state(_state.lock());
+        std::map<string, Path> res;
+        for (auto & hashPart : hashParts) {
+            auto path = queryPathFromHashPart(*state, hashPart);
+            if (path != "") res[hashPart] = path;
+        }
+        return res;
     });
 }
 
@@ -865,24 +860,74 @@ void LocalStore::querySubstitutablePathInfos(const PathSet & paths,
     SubstitutablePathInfos & infos)
 {
     if (!settings.useSubstitutes) return;
+
     for (auto & sub : getDefaultSubstituters()) {
         if (sub->storeDir != storeDir) continue;
-        for (auto & path : paths) {
-            if (infos.count(path)) continue;
+
+        /* Issue the queries for all remaining paths at once, so that
+           substituters that support asynchronous queries (i.e. binary
+           caches) can process them concurrently. */
+        struct State
+        {
+            size_t left = 0;
+            SubstitutablePathInfos & infos;
+            std::exception_ptr exc;
+            State(SubstitutablePathInfos & infos) : infos(infos) { }
+        };
+
+        Sync<State> state_{State(infos)};
+        std::condition_variable wakeup;
+
+        PathSet remaining;
+        for (auto & path : paths)
+            if (!infos.count(path)) remaining.insert(path);
+        if (remaining.empty()) break;
+
+        state_.lock()->left = remaining.size();
+
+        auto failure = [&state_, &wakeup](std::exception_ptr exc) {
+            auto state(state_.lock());
+            try {
+                std::rethrow_exception(exc);
+            } catch (InvalidPath &) {
+            } catch (...) {
+                state->exc = exc;
+            }
+            assert(state->left);
+            if (!--state->left) wakeup.notify_one();
+        };
+
+        for (auto & path : remaining) {
             debug(format("checking substituter '%s' for path '%s'")
                 % sub->getUri() % path);
+
+            /* The callbacks refer to this stack frame, so a query
+               that fails before it is issued mustn't make us return
+               before the queries already issued have finished. */
             try {
-                auto info = sub->queryPathInfo(path);
-                auto narInfo = std::dynamic_pointer_cast<const NarInfo>(
-                    std::shared_ptr<const ValidPathInfo>(info));
-                infos[path] = SubstitutablePathInfo{
-                    info->deriver,
-                    info->references,
-                    narInfo ? narInfo->fileSize : 0,
-                    info->narSize};
-            } catch (InvalidPath) {
+                sub->queryPathInfo(path,
+                    [path, &state_, &wakeup](ref<ValidPathInfo> info) {
+                        auto narInfo = std::dynamic_pointer_cast<const NarInfo>(
+                            std::shared_ptr<ValidPathInfo>(info));
+                        auto state(state_.lock());
+                        state->infos[path] = SubstitutablePathInfo{
+                            info->deriver,
+                            info->references,
+                            narInfo ? narInfo->fileSize : 0,
+                            info->narSize};
+                        assert(state->left);
+                        if (!--state->left) wakeup.notify_one();
+                    },
+                    failure);
+            } catch (...) {
+                failure(std::current_exception());
             }
         }
+
+        auto state(state_.lock());
+        while (state->left)
+            state.wait(wakeup);
+        if (state->exc) std::rethrow_exception(state->exc);
     }
 }
 
@@ -895,6 +940,16 @@ void LocalStore::registerValidPath(const ValidPathInfo & info)
 }
 
 
+struct LocalStore::PendingRegistration
+{
+    const ValidPathInfos & infos;
+    bool done = false;
+    std::exception_ptr exc;
+
+    PendingRegistration(const ValidPathInfos & infos) : infos(infos) { }
+};
+
+
 void LocalStore::registerValidPaths(const ValidPathInfos & infos)
 {
     /* SQLite will fsync by default, but the new valid paths may not
@@ -903,26 +958,96 @@ void LocalStore::registerValidPaths(const ValidPathInfos & infos)
        registering operation. */
     if (settings.syncBeforeRegistering) sync();
 
+    /* Group commit: if another thread is committing, wait for it to
+       finish, and then commit everything that has queued up in the
+       meantime (ours or someone else's) in a single transaction. So
+       concurrent substitutions pay for one commit per group rather
+       than one per path. */
+    auto reg = std::make_shared<PendingRegistration>(infos);
+
+    groupCommit_.lock()->pending.push_back(reg);
+
+    while (true) {
+        std::vector<std::shared_ptr<PendingRegistration>> group;
+
+        {
+            auto groupCommit(groupCommit_.lock());
+            while (!reg->done && groupCommit->committing)
+                groupCommit.wait(groupCommitDone);
+            if (reg->done) break;
+            group = std::move(groupCommit->pending);
+            groupCommit->pending.clear();
+            groupCommit->committing = true;
+        }
+
+        try {
+            if (group.size() == 1)
+                registerValidPaths_(group[0]->infos);
+            else {
+                ValidPathInfos all;
+                for (auto & r : group)
+                    all.insert(all.end(), r->infos.begin(), r->infos.end());
+                debug("registering %d paths from %d callers", all.size(), group.size());
+                registerValidPaths_(all);
+            }
+        } catch (...) {
+            if (group.size() == 1)
+                group[0]->exc = std::current_exception();
+            else
+                /* Commit the registrations one by one to find out
+                   whose failed. */
+                for (auto & r : group)
+                    try {
+                        registerValidPaths_(r->infos);
+                    } catch (...) {
+                        r->exc = std::current_exception();
+                    }
+        }
+
+        {
+            auto groupCommit(groupCommit_.lock());
+            for (auto & r : group)
+                r->done = true;
+            groupCommit->committing = false;
+        }
+
+        groupCommitDone.notify_all();
+    }
+
+    if (reg->exc) std::rethrow_exception(reg->exc);
+}
+
+
+void LocalStore::registerValidPaths_(const ValidPathInfos & infos)
+{
     return retrySQLite<void>([&]() {
         auto state(_state.lock());
 
-        SQLiteTxn txn(state->db);
+        /* Path info read during the transaction (e.g. by
+           topoSortPaths()) may end up in the shared cache, so it must
+           not survive a rollback. */
+        bool invalidate = true;
+        Finally invalidateCache([&]() {
+            if (invalidate && sharedCache) sharedCache->invalidate();
+        });
+
+        auto txn(state->db->beginTxn());
         PathSet paths;
+        bool updated = false;
 
         for (auto & i : infos) {
             assert(i.narHash.type == htSHA256);
-            if (isValidPath_(*state, i.path))
+            if (isValidPath_(*state, i.path)) {
                 updatePathInfo(*state, i);
-            else
+                updated = true;
+            } else
                 addValidPath(*state, i, false);
             paths.insert(i.path);
         }
 
-        for (auto & i : infos) {
-            auto referrer = queryValidPathId(*state, i.path);
+        for (auto & i : infos)
             for (auto & j : i.references)
-                state->stmtAddReference.use()(referrer)(queryValidPathId(*state, j)).exec();
-        }
+                state->db->addReference(i.path, j);
 
         /* Check that the derivation outputs are correct.  We can't do
            this in addValidPath() above, because the references might
@@ -941,7 +1066,15 @@ void LocalStore::registerValidPaths(const ValidPathInfos & infos)
            has multiple outputs. */
         topoSortPaths(paths);
 
-        txn.commit();
+        txn->commit();
+
+        if (state->referrersIndex)
+            for (auto & i : infos)
+                state->referrersIndex->addPath(i.path, i.references);
+
+        /* Another process may have cached the old info of updated
+           paths after updatePathInfo() but before the commit. */
+        invalidate = updated;
     });
 }
 
@@ -952,10 +1085,12 @@ void LocalStore::invalidatePath(State & state, const Path & path)
 {
     debug(format("invalidating path '%1%'") % path);
 
-    state.stmtInvalidatePath.use()(path).exec();
+    state.db->invalidatePath(path);
 
-    /* Note that the foreign key constraints on the Refs table take
-       care of deleting the references entries for `path'. */
+    if (state.referrersIndex)
+        state.referrersIndex->removePath(path);
+
+    if (sharedCache) sharedCache->invalidate();
 
     {
         auto state_(Store::state.lock());
@@ -1182,7 +1317,7 @@ void LocalStore::invalidatePathChecked(const Path & path)
     retrySQLite<void>([&]() {
         auto state(_state.lock());
 
-        SQLiteTxn txn(state->db);
+        auto txn(state->db->beginTxn());
 
         if (isValidPath_(*state, path)) {
             PathSet referrers; queryReferrers(*state, path, referrers);
@@ -1191,19 +1326,116 @@ void LocalStore::invalidatePathChecked(const Path & path)
                 throw PathInUse(format("cannot delete path '%1%' because it is in use by %2%")
                     % path % showPaths(referrers));
             invalidatePath(*state, path);
+
+            try {
+                txn->commit();
+            } catch (...) {
+                /* invalidatePath() has removed the path from the
+                   referrers index. */
+                state->referrersIndex.reset();
+                throw;
+            }
         }
 
-        txn.commit();
+        /* Other processes may have cached the path between
+           invalidatePath() and the commit. */
+        if (sharedCache) sharedCache->invalidate();
     });
 }
 
 
+/* verifyStore() appends a line '<hash part> <time>' to this file
+   whenever it has verified the contents of a path. Return the most
+   recent time for each valid path. */
+static std::unordered_map<std::string, time_t> readLastVerified(
+    const Path & path, const PathSet & validPaths)
+{
+    std::unordered_map<std::string, time_t> res;
+    if (!pathExists(path)) return res;
+
+    std::unordered_set<std::string> valid;
+    for (auto & i : validPaths)
+        valid.insert(storePathToHash(i));
+
+    size_t lines = 0;
+    for (auto & line : tokenizeString<Strings>(readFile(path), "\n")) {
+        lines++;
+        auto fields = tokenizeString<std::vector<string>>(line);
+        time_t t;
+        if (fields.size() == 2 && string2Int(fields[1], t) && valid.count(fields[0]))
+            res[fields[0]] = t;
+    }
+
+    /* Drop superseded lines and those of paths that are no longer
+       valid. */
+    if (lines > 2 * res.size() + 1000) {
+        std::string s;
+        for (auto & i : res)
+            s += fmt("%s %d\n", i.first, i.second);
+        Path tmp = path + ".tmp";
+        writeFile(tmp, s);
+        if (rename(tmp.c_str(), path.c_str()) == -1)
+            throw SysError("renaming '%s' to '%s'", tmp, path);
+    }
+
+    return res;
+}
+
+
+/* Limit the combined rate at which threads read data. */
+struct ReadThrottle
+{
+    const uint64_t bytesPerSecond;
+
+    Sync<std::chrono::steady_clock::time_point> next;
+
+    ReadThrottle(uint64_t bytesPerSecond) : bytesPerSecond(bytesPerSecond) { }
+
+    void operator () (size_t len)
+    {
+        if (!bytesPerSecond) return;
+        auto now = std::chrono::steady_clock::now();
+        std::chrono::steady_clock::time_point start;
+        {
+            auto next_(next.lock());
+            start = std::max(*next_, now);
+            *next_ = start + std::chrono::nanoseconds(len * 1000000000ULL / bytesPerSecond);
+        }
+        std::this_thread::sleep_until(start);
+    }
+};
+
+
+/* Put the calling thread in the idle I/O scheduling class while in
+   scope, so that hashing the store only uses the disk when nothing
+   else does. */
+struct IdleIOPriority
+{
+#if __linux__
+    int prev;
+
+    IdleIOPriority()
+    {
+        prev = syscall(SYS_ioprio_get, 1 /* IOPRIO_WHO_PROCESS */, 0);
+        syscall(SYS_ioprio_set, 1, 0, 3 << 13 /* IOPRIO_CLASS_IDLE */);
+    }
+
+    ~IdleIOPriority()
+    {
+        if (prev != -1) syscall(SYS_ioprio_set, 1, 0, prev);
+    }
+#endif
+};
+
+
 bool LocalStore::verifyStore(bool checkContents, RepairFlag repair)
 {
     printError(format("reading the Nix store..."));
 
     bool errors = false;
 
+    Activity act(*logger, actVerifyPaths);
+
     /* Acquire the global GC lock to prevent a garbage collection. */
     AutoCloseFD fdGCLock = openGCLock(ltWrite);
 
@@ -1213,10 +1445,11 @@ bool LocalStore::verifyStore(bool checkContents, RepairFlag repair)
     /* Check whether all valid paths actually exist. */
     printInfo("checking path existence...");
 
-    PathSet validPaths2 = queryAllValidPaths(), validPaths, done;
+    PathSet validPaths, done;
 
-    for (auto & i : validPaths2)
-        verifyPath(i, store, done, validPaths, repair, errors);
+    scanValidPaths({}, false, [&](const Path & path, std::shared_ptr<const ValidPathInfo> info) {
+        verifyPath(path, store, done, validPaths, repair, errors, act);
+    });
 
     /* Release the GC lock so that checking content hashes (which can
        take ages) doesn't block the GC or builds. */
@@ -1226,21 +1459,74 @@ bool LocalStore::verifyStore(bool checkContents, RepairFlag repair)
     if (checkContents) {
         printInfo("checking hashes...");
 
-        Hash nullHash(htSHA256);
+        /* Check the paths that were verified least recently first, so
+           that interrupted or partial runs eventually cover the whole
+           store. */
+        Path lastVerifiedPath = dbDir + "/verified";
+        auto lastVerified = readLastVerified(lastVerifiedPath, validPaths);
 
+        std::vector<std::pair<time_t, Path>> todo;
         for (auto & i : validPaths) {
+            auto j = lastVerified.find(storePathToHash(i));
+            todo.emplace_back(j == lastVerified.end() ? 0 : j->second, i);
+        }
+        std::sort(todo.begin(), todo.end());
+
+        size_t percentage = std::min(settings.verifyContentsPercentage.get(), 100U);
+        size_t count = (todo.size() * percentage + 99) / 100;
+        if (count < todo.size()) {
+            printInfo("checking the %d least recently verified of %d paths", count, todo.size());
+            todo.resize(count);
+        }
+
+        AutoCloseFD fdLastVerified = open(lastVerifiedPath.c_str(),
+            O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+        if (!fdLastVerified)
+            throw SysError("opening '%s'", lastVerifiedPath);
+
+        Hash nullHash(htSHA256);
+
+        ReadThrottle throttle(settings.verifyMaxReadRate);
+
+        std::atomic<size_t> checked{0}, active{0}, failed{0};
+        std::atomic<bool> hashErrors{false};
+
+        auto report = [&]() {
+            act.progress(checked, todo.size(), active, failed);
+        };
+
+        /* Repairs are done afterwards, one at a time. */
+        Sync<PathSet> toRepair_;
+
+        auto doPath = [&](const Path & i) {
+            checkInterrupt();
+
+            MaintainCount<std::atomic<size_t>> mcActive(active);
+            report();
+
+            IdleIOPriority ioPriority;
+
             try {
                 auto info = std::const_pointer_cast<ValidPathInfo>(std::shared_ptr<const ValidPathInfo>(queryPathInfo(i)));
 
                 /* Check the content hash (optionally - slow). */
                 printMsg(lvlTalkative, format("checking contents of '%1%'") % i);
-                HashResult current = hashPath(info->narHash.type, toRealPath(i));
+
+                HashSink hashSink(info->narHash.type);
+                LambdaSink sink([&](const unsigned char * data, size_t len) {
+                    throttle(len);
+                    hashSink(data, len);
+                });
+                dumpPath(toRealPath(i), sink);
+                HashResult current = hashSink.finish();
 
                 if (info->narHash != nullHash && info->narHash != current.first) {
                     printError(format("path '%1%' was modified! "
                             "expected hash '%2%', got '%3%'")
                         % i % info->narHash.to_string() % current.first.to_string());
-                    if (repair) repairPath(i); else errors = true;
+                    act.result(resCorruptedPath, i);
+                    failed++;
+                    if (repair) toRepair_.lock()->insert(i); else hashErrors = true;
                 } else {
 
                     bool update = false;
@@ -1264,6 +1550,7 @@ bool LocalStore::verifyStore(bool checkContents, RepairFlag repair)
                         updatePathInfo(*state, *info);
                     }
 
+                    writeFull(fdLastVerified.get(), fmt("%s %d\n", storePathToHash(i), time(0)));
                 }
 
             } catch (Error & e) {
@@ -1273,9 +1560,25 @@ bool LocalStore::verifyStore(bool checkContents, RepairFlag repair)
                     printError(format("error: %1%") % e.msg());
                 else
                     printError(format("warning: %1%") % e.msg());
-                errors = true;
+                failed++;
+                hashErrors = true;
             }
-        }
+
+            checked++;
+            report();
+        };
+
+        ThreadPool pool(settings.verifyThreads);
+
+        for (auto & i : todo)
+            pool.enqueue(std::bind(doPath, i.second));
+
+        pool.process();
+
+        if (hashErrors) errors = true;
+
+        for (auto & i : *toRepair_.lock())
+            repairPath(i);
     }
 
     return errors;
@@ -1283,7 +1586,8 @@ bool LocalStore::verifyStore(bool checkContents, RepairFlag repair)
 
 
 void LocalStore::verifyPath(const Path & path, const PathSet & store,
-    PathSet & done, PathSet & validPaths, RepairFlag repair, bool & errors)
+    PathSet & done, PathSet & validPaths, RepairFlag repair, bool & errors,
+    const Activity & act)
 {
     checkInterrupt();
 
@@ -1298,13 +1602,15 @@ void LocalStore::verifyPath(const Path & path, const PathSet & store,
     }
 
     if (store.find(baseNameOf(path)) == store.end()) {
+        act.result(resMissingPath, path);
+
         /* Check any referrers first.  If we can invalidate them
            first, then we can invalidate this path as well. */
         bool canInvalidate = true;
         PathSet referrers; queryReferrers(path, referrers);
         for (auto & i : referrers)
             if (i != path) {
-                verifyPath(i, store, done, validPaths, repair, errors);
+                verifyPath(i, store, done, validPaths, repair, errors, act);
                 if (validPaths.find(i) != validPaths.end())
                     canInvalidate = false;
             }
@@ -1387,7 +1693,111 @@ void LocalStore::upgradeStore7()
 void LocalStore::vacuumDB()
 {
     auto state(_state.lock());
-    state->db.exec("vacuum");
+    state->db->vacuum();
+}
+
+
+void LocalStore::migrateDB(const std::string & backend)
+{
+    if (backend != "sqlite" && backend != "log")
+        throw Error("unknown Nix database backend '%s'", backend);
+
+    Path logDir = dbDir + "/paths";
+    Path sqlitePath = dbDir + "/db.sqlite";
+    bool toLog = backend == "log";
+
+    if (pathExists(logDir) == toLog) {
+        printInfo("the Nix database already uses the '%s' backend", backend);
+        return;
+    }
+
+    if (!lockFile(globalLock.get(), ltWrite, false)) {
+        printError("waiting for exclusive access to the Nix store...");
+        lockFile(globalLock.get(), ltWrite, true);
+    }
+
+    Finally releaseLock([&]() {
+        lockFile(globalLock.get(), ltRead, true);
+    });
+
+    auto state(_state.lock());
+
+    /* Copy everything to a new database, and only replace the old
+       one when that has succeeded. */
+    Path tmpPath = (toLog ? logDir : sqlitePath) + ".tmp";
+    deletePath(tmpPath);
+    for (auto suffix : {"-wal", "-shm", "-journal"})
+        deletePath(tmpPath + suffix);
+
+    {
+        auto db = toLog
+            ? openLogPathDB(tmpPath, storeDir)
+            : openSQLitePathDB(tmpPath, storeDir, 0);
+
+        auto paths = state->db->queryAllValidPaths();
+
+        printInfo("copying %d paths to the new database...", paths.size());
+
+        auto txn(db->beginTxn());
+
+        std::vector<std::shared_ptr<ValidPathInfo>> infos;
+        for (auto & path : paths) {
+            auto info = state->db->queryPathInfo(path);
+            if (!info) throw Error("path '%s' disappeared from the Nix database", path);
+            db->addPath(*info);
+            infos.push_back(info);
+        }
+
+        for (auto & info : infos)
+            for (auto & ref : info->references)
+                db->addReference(info->path, ref);
+
+        for (auto & path : paths)
+            if (isDerivation(path))
+                for (auto & i : state->db->queryDerivationOutputs(path))
+                    db->addDerivationOutput(path, i.first, i.second);
+
+        txn->commit();
+    }
+
+    state->db.reset();
+    state->referrersIndex.reset();
+
+    /* The presence of the log directory determines which database is
+       used, so renaming it (or deleting it) switches atomically. */
+    if (toLog) {
+        if (rename(tmpPath.c_str(), logDir.c_str()) == -1)
+            throw SysError("renaming '%s' to '%s'", tmpPath, logDir);
+        for (auto suffix : {"", "-wal", "-shm", "-journal"})
+            deletePath(sqlitePath + suffix);
+    } else {
+        if (rename(tmpPath.c_str(), sqlitePath.c_str()) == -1)
+            throw SysError("renaming '%s' to '%s'", tmpPath, sqlitePath);
+        deletePath(logDir);
+    }
+
+    state->db = openDB(nixSchemaVersion);
+
+    if (sharedCache) {
+        sharedCache->invalidate();
+        sharedCache->checkDatabase(state->db->sequenceNumber());
+    }
+
+    printInfo("the Nix database now uses the '%s' backend", backend);
+}
+
+
+void LocalStore::clearPathInfoCacheIfStale()
+{
+    bool stale = retrySQLite<bool>([&]() {
+        auto state(_state.lock());
+        int64_t dataVersion = state->db->dataVersion();
+        bool stale = dataVersion != state->dataVersion;
+        state->dataVersion = dataVersion;
+        return stale;
+    });
+
+    if (stale) clearPathInfoCache();
 }
 
 
@@ -1396,15 +1806,20 @@ void LocalStore::addSignatures(const Path & storePath, const StringSet & sigs)
     retrySQLite<void>([&]() {
         auto state(_state.lock());
 
-        SQLiteTxn txn(state->db);
+        auto txn(state->db->beginTxn());
 
-        auto info = std::const_pointer_cast<ValidPathInfo>(std::shared_ptr<const ValidPathInfo>(queryPathInfo(storePath)));
+        /* Read the info in the transaction rather than from a cache,
+           so that we don't drop signatures added by someone else. */
+        auto info = queryPathInfo_(*state, storePath);
+        if (!info) throw InvalidPath(format("path '%s' is not valid") % storePath);
 
         info->sigs.insert(sigs.begin(), sigs.end());
 
         updatePathInfo(*state, *info);
 
-        txn.commit();
+        txn->commit();
+
+        if (sharedCache) sharedCache->invalidate();
     });
 }
 
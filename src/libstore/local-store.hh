@@ -2,12 +2,15 @@
 
 #include "sqlite.hh"
 
+#include "path-db.hh"
 #include "pathlocks.hh"
+#include "referrers-index.hh"
 #include "store-api.hh"
 #include "sync.hh"
 #include "util.hh"
 
 #include <chrono>
+#include <condition_variable>
 #include <future>
 #include <string>
 #include <unordered_set>
@@ -24,6 +27,7 @@ const int nixSchemaVersion = 10;
 
 
 struct Derivation;
+class SharedPathInfoCache;
 
 
 struct OptimiseStats
@@ -43,22 +47,22 @@ private:
 
     struct State
     {
-        /* The SQLite database object. */
-        SQLite db;
-
-        /* Some precompiled SQLite statements. */
-        SQLiteStmt stmtRegisterValidPath;
-        SQLiteStmt stmtUpdatePathInfo;
-        SQLiteStmt stmtAddReference;
-        SQLiteStmt stmtQueryPathInfo;
-        SQLiteStmt stmtQueryReferences;
-        SQLiteStmt stmtQueryReferrers;
-        SQLiteStmt stmtInvalidatePath;
-        SQLiteStmt stmtAddDerivationOutput;
-        SQLiteStmt stmtQueryValidDerivers;
-        SQLiteStmt stmtQueryDerivationOutputs;
-        SQLiteStmt stmtQueryPathFromHashPart;
-        SQLiteStmt stmtQueryValidPaths;
+        /* The Nix database. */
+        std::unique_ptr<PathDB> db;
+
+        /* The database version (as returned by
+           PathDB::dataVersion()) at the last call to
+           clearPathInfoCacheIfStale(). */
+        int64_t dataVersion = -1;
+
+        /* A copy of the references in the database, if it has been
+           built, and the database version it corresponds to. */
+        std::unique_ptr<ReferrersIndex> referrersIndex;
+        uint64_t referrersIndexVersion = 0;
+
+        /* The number of referrer queries since the referrers index
+           was discarded. */
+        uint64_t referrerQueries = 0;
 
         /* The file to which we write our temporary roots. */
         AutoCloseFD fdTempRoots;
@@ -83,6 +87,26 @@ private:
 
     Sync<State, std::recursive_mutex> _state;
 
+    /* Registrations by concurrent registerValidPaths() calls that
+       are waiting to be committed together. */
+    struct PendingRegistration;
+
+    struct GroupCommit
+    {
+        std::vector<std::shared_ptr<PendingRegistration>> pending;
+
+        /* Whether some thread is committing a group. */
+        bool committing = false;
+    };
+
+    Sync<GroupCommit> groupCommit_;
+
+    std::condition_variable groupCommitDone;
+
+    /* The path info cache shared with other processes, if enabled
+       (or created by another process). */
+    std::unique_ptr<SharedPathInfoCache> sharedCache;
+
 public:
 
     PathSetting realStoreDir_;
@@ -102,6 +126,9 @@ private:
         settings.requireSigs,
         "require-sigs", "whether store paths should have a trusted signature on import"};
 
+    Setting<std::string> optimiseMethod{(Store*) this, "hardlink",
+        "optimise-method", "how to deduplicate identical files ('hardlink' or 'reflink')"};
+
     const PublicKeys & getPublicKeys();
 
 public:
@@ -126,20 +153,37 @@ public:
 
     PathSet queryAllValidPaths() override;
 
+    void scanValidPaths(const ValidPathFilter & filter, bool withInfo,
+        std::function<void(const Path & path, std::shared_ptr<const ValidPathInfo> info)> callback) override;
+
     void queryPathInfoUncached(const Path & path,
         std::function<void(std::shared_ptr<ValidPathInfo>)> success,
         std::function<void(std::exception_ptr exc)> failure) override;
 
+    std::map<Path, std::shared_ptr<ValidPathInfo>> queryPathInfosUncached(const PathSet & paths) override;
+
     void queryReferrers(const Path & path, PathSet & referrers) override;
 
+    std::map<Path, PathSet> queryMultipleReferrers(const PathSet & paths) override;
+
+    using Store::computeFSClosure;
+
+    void computeFSClosure(const PathSet & paths,
+        PathSet & out, bool flipDirection = false,
+        bool includeOutputs = false, bool includeDerivers = false) override;
+
     PathSet queryValidDerivers(const Path & path) override;
 
     PathSet queryDerivationOutputs(const Path & path) override;
 
+    std::map<Path, PathSet> queryMultipleDerivationOutputs(const PathSet & paths) override;
+
     StringSet queryDerivationOutputNames(const Path & path) override;
 
     Path queryPathFromHashPart(const string & hashPart) override;
 
+    std::map<string, Path> queryPathsFromHashParts(const StringSet & hashParts) override;
+
     PathSet querySubstitutablePaths(const PathSet & paths) override;
 
     void querySubstitutablePathInfos(const PathSet & paths,
@@ -208,10 +252,21 @@ public:
        hash must be a SHA-256 hash. */
     void registerValidPath(const ValidPathInfo & info);
 
+    /* Register 'infos'. Registrations from concurrent threads are
+       committed in a single transaction. */
     void registerValidPaths(const ValidPathInfos & infos);
 
     void vacuumDB();
 
+    /* Convert the Nix database to the given backend ("sqlite" or
+       "log"). This requires exclusive access to the store. */
+    void migrateDB(const std::string & backend);
+
+    /* Clear the path info cache if another process has modified the
+       database since the previous call. This allows a long-running
+       process to serve many clients from one LocalStore. */
+    void clearPathInfoCacheIfStale();
+
     /* Repair the contents of the given path by redownloading it using
        a substituter (if available). */
     void repairPath(const Path & path);
@@ -226,21 +281,25 @@ private:
 
     int getSchema();
 
-    void openDB(State & state, bool create);
+    /* Open the Nix database, which must have the given schema
+       version (0 to create it). */
+    std::unique_ptr<PathDB> openDB(int schema);
 
     void makeStoreWritable();
 
-    uint64_t queryValidPathId(State & state, const Path & path);
-
-    uint64_t addValidPath(State & state, const ValidPathInfo & info, bool checkOutputs = true);
+    void addValidPath(State & state, const ValidPathInfo & info, bool checkOutputs = true);
 
     void invalidatePath(State & state, const Path & path);
 
+    /* Register 'infos' in a transaction of their own. */
+    void registerValidPaths_(const ValidPathInfos & infos);
+
     /* Delete a path from the Nix store. */
     void invalidatePathChecked(const Path & path);
 
     void verifyPath(const Path & path, const PathSet & store,
-        PathSet & done, PathSet & validPaths, RepairFlag repair, bool & errors);
+        PathSet & done, PathSet & validPaths, RepairFlag repair, bool & errors,
+        const Activity & act);
 
     void updatePathInfo(State & state, const ValidPathInfo & info);
 
@@ -282,10 +341,27 @@ private:
     Strings readDirectoryIgnoringInodes(const Path & path, const InodeHash & inodeHash);
     void optimisePath_(Activity * act, OptimiseStats & stats, const Path & path, InodeHash & inodeHash);
 
+    /* Throw if 'optimise-method' is unknown or not supported on
+       this platform. */
+    void checkOptimiseMethod();
+
+    /* Share the extents of `path' with those of `linkPath' without
+       replacing its inode.  Returns the number of bytes that weren't
+       shared before, or -1 if the contents turned out to differ. */
+    int64_t dedupeFile(const Path & path, const Path & linkPath, size_t size);
+
     // Internal versions that are not wrapped in retry_sqlite.
     bool isValidPath_(State & state, const Path & path);
+    std::shared_ptr<ValidPathInfo> queryPathInfo_(State & state, const Path & path);
     void queryReferrers(State & state, const Path & path, PathSet & referrers);
 
+    /* Return the referrers index, (re)building it if it is missing
+       or out of date, if 'force' is set or it's likely to pay off.
+       Otherwise return null. */
+    ReferrersIndex * getReferrersIndex(State & state, bool force);
+    PathSet queryDerivationOutputs(State & state, const Path & path);
+    Path queryPathFromHashPart(State & state, const string & hashPart);
+
     /* Add signatures to a ValidPathInfo using the secret keys
        specified by the ‘secret-key-files’ option. */
     void signPathInfo(ValidPathInfo & info);
@@ -42,7 +42,7 @@ libstore_CXXFLAGS = \
  -DSANDBOX_SHELL="\"$(sandbox_shell)\"" \
  -DLSOF=\"$(lsof)\"
 
-$(d)/local-store.cc: $(d)/schema.sql.gen.hh
+$(d)/sqlite-path-db.cc: $(d)/schema.sql.gen.hh
 
 $(d)/build.cc:
 
@@ -0,0 +1,1292 @@
+#include "path-db.hh"
+#include "sqlite.hh"
+#include "globals.hh"
+#include "serialise.hh"
+
+#include <atomic>
+#include <cstring>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#if __APPLE__ || __FreeBSD__
+#include <sys/sysctl.h>
+#endif
+
+namespace nix {
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2,
+    "the Nix database index requires lock-free atomics");
+
+
+/* Thrown by a commit that conflicts with one made by another process
+   since the transaction read the database. Derived from SQLiteBusy, so
+   that retrySQLite() retries the transaction. */
+MakeError(PathDBConflict, SQLiteBusy);
+
+/* A PathDB that doesn't use SQLite. Like the mmap NAR info disk
+   cache, it appends records to a log file and locates them through an
+   open-addressing hash table in a memory-mapped index file shared by
+   all processes.
+
+   There are records for the info of a valid path (including its
+   references and, for derivations, its outputs), for invalidated
+   paths, and for referrer and deriver edges. The latter form linked
+   lists in the log, whose heads are in the index, so that referrers
+   can be found without scanning anything. Edges are never removed;
+   readers skip edges whose referrer or deriver is no longer valid,
+   and a path that becomes valid again reuses its old edges.
+
+   Readers never take locks: a slot is only updated (atomically) after
+   the record it points to has been written. Transactions are buffered
+   in memory and written as a single checksummed batch when they are
+   committed, so that writers only serialise (through a lock file) for
+   the duration of the append. Paths in a batch are published after
+   their references, so a reader never sees a valid path with invalid
+   references.
+
+   The log, not the index, is authoritative. Batches that were
+   written but not (completely) published, e.g. because the writer
+   crashed, are published by the next writer. Since the index isn't
+   synced to disk, it is rebuilt from the log after a reboot, or if
+   it's corrupt. A writer
+   also rebuilds the index, dropping obsolete records from the log,
+   when it becomes half full, or when superseded records (those of
+   updated and invalidated paths) take up more than half of the
+   log. The rebuilt log and index form a new
+   "generation" that other processes switch to when they notice that
+   the old one has been flagged as obsolete. */
+class LogPathDB : public PathDB
+{
+public:
+
+    static constexpr uint64_t indexMagic = 0x786469626468746eULL;
+    static constexpr uint64_t indexVersion = 2;
+
+    /* Written at the start of every log, so that no record is at
+       offset 0, which denotes the end of an edge list. */
+    static constexpr char logMagic[8] = {'n', 'i', 'x', '-', 'p', 'd', 'b', '1'};
+
+    /* Maximum size of the batches written while rebuilding. */
+    static constexpr size_t maxBatchSize = 1024 * 1024;
+
+    /* Don't bother rebuilding to reclaim less than this. */
+    static constexpr uint64_t minDeadSize = 64 * 1024;
+
+    struct Header
+    {
+        uint64_t magic;
+        uint64_t version;
+        uint64_t generation;
+        uint64_t capacity;
+        std::atomic<uint64_t> used;
+        std::atomic<uint64_t> obsolete;
+        /* The boot during which the index was built. */
+        std::atomic<uint64_t> bootId;
+        /* Incremented by every commit. */
+        std::atomic<uint64_t> dataVersion;
+        /* The size of the log that has been published in the
+           index. */
+        std::atomic<uint64_t> logEnd;
+        /* Roughly how much of the log a rebuild would drop. */
+        std::atomic<uint64_t> deadSize;
+    };
+
+    struct Slot
+    {
+        /* Hash of the record key, or 0 if the slot is empty. */
+        std::atomic<uint64_t> key;
+        /* Offset of the record in the log. */
+        std::atomic<uint64_t> offset;
+    };
+
+    enum RecordType : uint64_t { rtPath = 1, rtInvalid = 2, rtReferrer = 3, rtDeriver = 4 };
+
+    struct Generation
+    {
+        uint64_t number = 0;
+        AutoCloseFD indexFd, logFd;
+        void * map = MAP_FAILED;
+        size_t mapSize = 0;
+        Header * header = nullptr;
+        Slot * slots = nullptr;
+
+        ~Generation()
+        {
+            if (map != MAP_FAILED) munmap(map, mapSize);
+        }
+    };
+
+    /* A valid path, or an invalid one if 'info' is null. */
+    struct Entry
+    {
+        std::shared_ptr<ValidPathInfo> info;
+        std::map<string, Path> outputs;
+        /* For an entry of a pending transaction that modifies a
+           committed one, the record that it was read from. */
+        std::string base;
+    };
+
+    Path dir;
+    Path storeDir;
+
+    AutoCloseFD lockFd;
+
+    std::shared_ptr<Generation> current;
+
+    /* The changes made by the current transaction, if any. */
+    std::unique_ptr<std::map<Path, Entry>> pending;
+
+    /* The version of the database after our last commit or check
+       for changes, and the number of times it had been changed by
+       others since. */
+    uint64_t lastSeenVersion = 0;
+    uint64_t externalChanges = 0;
+
+    LogPathDB(const Path & dir, const Path & storeDir)
+        : dir(dir), storeDir(storeDir)
+    {
+        createDirs(dir);
+
+        Path lockPath = dir + "/lock";
+        lockFd = open(lockPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (!lockFd)
+            throw SysError("opening lock file '%s'", lockPath);
+
+        lastSeenVersion = version(*getGeneration());
+    }
+
+    struct WriteLock
+    {
+        int fd;
+
+        WriteLock(int fd) : fd(fd)
+        {
+            while (flock(fd, LOCK_EX) == -1)
+                if (errno != EINTR)
+                    throw SysError("acquiring Nix database lock");
+        }
+
+        ~WriteLock()
+        {
+            flock(fd, LOCK_UN);
+        }
+    };
+
+    static uint64_t fnv1a(const std::string & s)
+    {
+        uint64_t h = 14695981039346656037ULL;
+        for (unsigned char c : s) {
+            h ^= c;
+            h *= 1099511628211ULL;
+        }
+        return h;
+    }
+
+    static uint64_t hashKey(const std::string & key)
+    {
+        auto h = fnv1a(key);
+        return h ? h : 1;
+    }
+
+    /* Return an identifier of the current boot, or 0 if we can't
+       tell boots apart. */
+    static uint64_t getBootId()
+    {
+        static uint64_t bootId = []() -> uint64_t {
+#if __linux__
+            try {
+                return hashKey(readFile("/proc/sys/kernel/random/boot_id"));
+            } catch (SysError &) {
+            }
+#elif __APPLE__
+            char uuid[64];
+            size_t len = sizeof(uuid);
+            if (sysctlbyname("kern.bootsessionuuid", uuid, &len, nullptr, 0) == 0)
+                return hashKey(std::string(uuid, strnlen(uuid, len)));
+#elif __FreeBSD__
+            struct timeval boottime;
+            size_t len = sizeof(boottime);
+            int mib[2] = {CTL_KERN, KERN_BOOTTIME};
+            if (sysctl(mib, 2, &boottime, &len, nullptr, 0) == 0)
+                return hashKey(fmt("%d.%d", boottime.tv_sec, boottime.tv_usec));
+#endif
+            return 0;
+        }();
+        return bootId;
+    }
+
+    static std::string pathKey(const Path & path)
+    {
+        return "p" + storePathToHash(path);
+    }
+
+    static std::string referrersKey(const Path & path)
+    {
+        return "r" + storePathToHash(path);
+    }
+
+    static std::string deriversKey(const Path & path)
+    {
+        return "d" + storePathToHash(path);
+    }
+
+    Path logPathFor(uint64_t generation)
+    {
+        return dir + "/log-" + std::to_string(generation);
+    }
+
+    static void preadFull(int fd, unsigned char * buf, size_t count, uint64_t offset)
+    {
+        while (count) {
+            ssize_t res = pread(fd, buf, count, offset);
+            if (res == -1) {
+                if (errno == EINTR) continue;
+                throw SysError("reading from Nix database log");
+            }
+            if (res == 0) throw EndOfFile("unexpected end of Nix database log");
+            count -= res;
+            buf += res;
+            offset += res;
+        }
+    }
+
+    static uint64_t readUint64(int fd, uint64_t offset)
+    {
+        unsigned char buf[8];
+        preadFull(fd, buf, sizeof(buf), offset);
+        uint64_t n = 0;
+        for (size_t i = 0; i < 8; ++i)
+            n |= (uint64_t) buf[i] << (i * 8);
+        return n;
+    }
+
+    static std::string readRecord(Generation & gen, uint64_t offset)
+    {
+        auto len = readUint64(gen.logFd.get(), offset);
+        if (len > 64 * 1024 * 1024)
+            throw Error("corrupt record in Nix database log");
+        std::string record(len, 0);
+        preadFull(gen.logFd.get(), (unsigned char *) &record[0], len, offset + 8);
+        return record;
+    }
+
+    static void parseRecordHeader(Source & source, uint64_t & type, std::string & key)
+    {
+        type = readNum<uint64_t>(source);
+        key = readString(source);
+    }
+
+    /* Return the slot for 'key', or null. */
+    Slot * findSlot(Generation & gen, const std::string & key)
+    {
+        auto h = hashKey(key);
+        auto mask = gen.header->capacity - 1;
+
+        for (auto i = h & mask; ; i = (i + 1) & mask) {
+            auto k = gen.slots[i].key.load(std::memory_order_acquire);
+            if (k == 0) return nullptr;
+            if (k != h) continue;
+            auto record = readRecord(gen, gen.slots[i].offset.load(std::memory_order_acquire));
+            StringSource source(record);
+            uint64_t type; std::string key2;
+            parseRecordHeader(source, type, key2);
+            if (key2 == key) return &gen.slots[i];
+        }
+    }
+
+    /* Return the record with the given key, or an empty string. */
+    std::string lookup(Generation & gen, const std::string & key)
+    {
+        auto slot = findSlot(gen, key);
+        return slot ? readRecord(gen, slot->offset.load(std::memory_order_acquire)) : "";
+    }
+
+    /* Point the slot for 'key' at the record at 'offset'. Must be
+       called with the write lock held. */
+    void insert(Generation & gen, const std::string & key, uint64_t offset)
+    {
+        if (auto slot = findSlot(gen, key)) {
+            slot->offset.store(offset, std::memory_order_release);
+            return;
+        }
+
+        auto h = hashKey(key);
+        auto mask = gen.header->capacity - 1;
+
+        for (auto i = h & mask; ; i = (i + 1) & mask) {
+            if (gen.slots[i].key.load(std::memory_order_acquire) == 0) {
+                /* Set the offset first, so that readers that see the
+                   key also see a valid offset. */
+                gen.slots[i].offset.store(offset, std::memory_order_release);
+                gen.slots[i].key.store(h, std::memory_order_release);
+                gen.header->used++;
+                return;
+            }
+        }
+    }
+
+    /* A batch of records being prepared for appending to the log at
+       'start'. */
+    struct Batch
+    {
+        uint64_t start;
+        std::string data;
+        std::vector<std::pair<std::string, uint64_t>> records;
+
+        Batch(uint64_t start) : start(start) { }
+
+        /* Add a record and return its offset in the log. */
+        uint64_t add(const std::string & key, const std::string & record)
+        {
+            uint64_t offset = start + 8 + data.size();
+            StringSink sink;
+            sink << record.size();
+            data += *sink.s;
+            data += record;
+            records.emplace_back(key, offset);
+            return offset;
+        }
+
+        /* Return the batch as written to the log: its length, the
+           records, and a checksum. */
+        std::string finish()
+        {
+            StringSink sink;
+            sink << data.size();
+            *sink.s += data;
+            sink << fnv1a(data);
+            return *sink.s;
+        }
+    };
+
+    static void pwriteFull(int fd, const std::string & s, uint64_t offset)
+    {
+        const char * p = s.data();
+        size_t count = s.size();
+        while (count) {
+            ssize_t res = pwrite(fd, p, count, offset);
+            if (res == -1) {
+                if (errno == EINTR) continue;
+                throw SysError("writing to Nix database log");
+            }
+            count -= res;
+            p += res;
+            offset += res;
+        }
+    }
+
+    /* Call 'record' for every record in the complete batches in the
+       log after 'offset'. Returns the end of the last complete
+       batch. */
+    uint64_t scanLog(int fd, uint64_t offset,
+        std::function<void(const std::string & key, uint64_t offset, Source & source, uint64_t type)> record)
+    {
+        struct stat st;
+        if (fstat(fd, &st) == -1)
+            throw SysError("statting Nix database log");
+        uint64_t size = st.st_size;
+
+        while (offset + 16 <= size) {
+            auto len = readUint64(fd, offset);
+            if (len > size - offset - 16) break;
+            std::string data(len, 0);
+            preadFull(fd, (unsigned char *) &data[0], len, offset + 8);
+            if (readUint64(fd, offset + 8 + len) != fnv1a(data)) break;
+
+            StringSource batch(data);
+            while (batch.pos < data.size()) {
+                auto recordOffset = offset + 8 + batch.pos;
+                auto r = readString(batch);
+                StringSource source(r);
+                uint64_t type; std::string key;
+                parseRecordHeader(source, type, key);
+                record(key, recordOffset, source, type);
+            }
+
+            offset += 16 + len;
+        }
+
+        return offset;
+    }
+
+    /* Open the current index and its log. Returns null if there is
+       no usable index, i.e. if it's missing, has been replaced in the
+       meantime or is corrupt. */
+    std::shared_ptr<Generation> openGeneration()
+    {
+        auto gen = std::make_shared<Generation>();
+
+        Path indexPath = dir + "/index";
+        gen->indexFd = open(indexPath.c_str(), O_RDWR | O_CLOEXEC);
+        if (!gen->indexFd) {
+            if (errno == ENOENT) return nullptr;
+            throw SysError("opening Nix database index '%s'", indexPath);
+        }
+
+        struct stat st;
+        if (fstat(gen->indexFd.get(), &st) == -1)
+            throw SysError("statting '%s'", indexPath);
+        if ((size_t) st.st_size < sizeof(Header)) return nullptr;
+
+        gen->mapSize = st.st_size;
+        gen->map = mmap(nullptr, gen->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, gen->indexFd.get(), 0);
+        if (gen->map == MAP_FAILED)
+            throw SysError("mapping Nix database index '%s'", indexPath);
+
+        gen->header = (Header *) gen->map;
+        gen->slots = (Slot *) (gen->header + 1);
+
+        /* The index is fully initialised before it's renamed into
+           place, so this means it's corrupt. */
+        auto capacity = gen->header->capacity;
+        if (gen->header->magic != indexMagic
+            || gen->header->version != indexVersion
+            || capacity == 0
+            || (capacity & (capacity - 1))
+            || gen->mapSize != sizeof(Header) + capacity * sizeof(Slot))
+            return nullptr;
+
+        gen->number = gen->header->generation;
+
+        Path logPath = logPathFor(gen->number);
+        gen->logFd = open(logPath.c_str(), O_RDWR | O_CLOEXEC);
+        if (!gen->logFd) {
+            /* The index may have been replaced since we opened it. */
+            if (errno == ENOENT) return nullptr;
+            throw SysError("opening Nix database log '%s'", logPath);
+        }
+
+        return gen;
+    }
+
+    /* Call 'fun' for the generation number of every log in the
+       database directory. */
+    void forEachLog(std::function<void(uint64_t generation)> fun)
+    {
+        for (auto & entry : readDirectory(dir)) {
+            if (!hasPrefix(entry.name, "log-")) continue;
+            uint64_t n;
+            if (string2Int(std::string(entry.name, 4), n)) fun(n);
+        }
+    }
+
+    /* Open the newest log, if any, to rebuild the index from. Must be
+       called with the write lock held. */
+    std::shared_ptr<Generation> openNewestLog()
+    {
+        uint64_t newest = 0;
+        forEachLog([&](uint64_t n) { newest = std::max(newest, n); });
+        if (!newest) return nullptr;
+
+        auto gen = std::make_shared<Generation>();
+        gen->number = newest;
+        Path logPath = logPathFor(newest);
+        gen->logFd = open(logPath.c_str(), O_RDWR | O_CLOEXEC);
+        if (!gen->logFd)
+            throw SysError("opening Nix database log '%s'", logPath);
+        return gen;
+    }
+
+    /* Create a new generation from the records in the log of 'old',
+       leaving room for 'extra' more keys. 'old' may consist of just
+       a log. Must be called with the write lock held. */
+    std::shared_ptr<Generation> rebuild(std::shared_ptr<Generation> old, size_t extra = 0)
+    {
+        /* Find the latest record of every path. We read the log
+           rather than the index, which may be stale. */
+        std::unordered_map<std::string, uint64_t> latest;
+        if (old)
+            scanLog(old->logFd.get(), sizeof(logMagic),
+                [&](const std::string & key, uint64_t offset, Source & source, uint64_t type) {
+                    if (type == rtPath || type == rtInvalid)
+                        latest[key] = offset;
+                });
+
+        std::vector<uint64_t> live;
+        for (auto & i : latest) {
+            auto record = readRecord(*old, i.second);
+            StringSource source(record);
+            uint64_t type; std::string key;
+            parseRecordHeader(source, type, key);
+            if (type == rtPath) live.push_back(i.second);
+        }
+        latest.clear();
+        std::sort(live.begin(), live.end());
+
+        /* Every path can have an entry, a referrers list and a
+           derivers list. */
+        uint64_t capacity = 1024;
+        while (capacity < (live.size() * 3 + extra) * 2) capacity *= 2;
+
+        uint64_t generation = old ? old->number + 1 : 1;
+
+        auto gen = std::make_shared<Generation>();
+        gen->number = generation;
+
+        /* The new log is renamed into place after the index, so that
+           the newest log is always the current one. */
+        Path logPath = logPathFor(generation);
+        Path tmpLogPath = dir + "/log.tmp";
+        gen->logFd = open(tmpLogPath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (!gen->logFd)
+            throw SysError("creating Nix database log '%s'", tmpLogPath);
+        pwriteFull(gen->logFd.get(), std::string(logMagic, sizeof(logMagic)), 0);
+
+        Path indexPath = dir + "/index";
+        Path tmpPath = indexPath + ".tmp";
+        gen->indexFd = open(tmpPath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (!gen->indexFd)
+            throw SysError("creating Nix database index '%s'", tmpPath);
+
+        gen->mapSize = sizeof(Header) + capacity * sizeof(Slot);
+        if (ftruncate(gen->indexFd.get(), gen->mapSize) == -1)
+            throw SysError("resizing '%s'", tmpPath);
+
+        gen->map = mmap(nullptr, gen->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, gen->indexFd.get(), 0);
+        if (gen->map == MAP_FAILED)
+            throw SysError("mapping Nix database index '%s'", tmpPath);
+
+        gen->header = (Header *) gen->map;
+        gen->slots = (Slot *) (gen->header + 1);
+        gen->header->magic = indexMagic;
+        gen->header->version = indexVersion;
+        gen->header->generation = generation;
+        gen->header->capacity = capacity;
+        gen->header->bootId = getBootId();
+        gen->header->dataVersion = old && old->header ? old->header->dataVersion + 1 : 0;
+
+        uint64_t logEnd = sizeof(logMagic);
+
+        /* Copy the live entries, regenerating their edges. */
+        std::unordered_map<std::string, uint64_t> heads;
+        Batch batch(logEnd);
+
+        auto flush = [&]() {
+            auto data = batch.finish();
+            pwriteFull(gen->logFd.get(), data, logEnd);
+            for (auto & r : batch.records)
+                insert(*gen, r.first, r.second);
+            logEnd += data.size();
+            batch = Batch(logEnd);
+        };
+
+        for (auto offset : live) {
+            auto record = readRecord(*old, offset);
+            StringSource source(record);
+            uint64_t type; std::string key;
+            parseRecordHeader(source, type, key);
+            auto entry = parseEntry(source);
+
+            batch.add(key, record);
+
+            for (auto & ref : entry.info->references)
+                addEdge(batch, heads, rtReferrer, referrersKey(ref), entry.info->path);
+
+            for (auto & output : entry.outputs)
+                addEdge(batch, heads, rtDeriver, deriversKey(output.second), entry.info->path);
+
+            if (batch.data.size() >= maxBatchSize) flush();
+        }
+
+        if (!batch.records.empty()) flush();
+
+        if (settings.fsyncMetadata && fsync(gen->logFd.get()) == -1)
+            throw SysError("syncing Nix database log");
+
+        gen->header->logEnd = logEnd;
+
+        /* The old logs are deleted below, so the new index and log
+           must be on disk before then. */
+        if (settings.fsyncMetadata && fsync(gen->indexFd.get()) == -1)
+            throw SysError("syncing Nix database index");
+
+        if (rename(tmpPath.c_str(), indexPath.c_str()) == -1)
+            throw SysError("renaming '%s' to '%s'", tmpPath, indexPath);
+
+        if (rename(tmpLogPath.c_str(), logPath.c_str()) == -1)
+            throw SysError("renaming '%s' to '%s'", tmpLogPath, logPath);
+
+        if (settings.fsyncMetadata) {
+            AutoCloseFD dirFd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (!dirFd || fsync(dirFd.get()) == -1)
+                throw SysError("syncing Nix database directory '%s'", dir);
+        }
+
+        if (old && old->header)
+            old->header->obsolete.store(1, std::memory_order_release);
+
+        /* Processes still using an old generation keep its log open,
+           so it can be deleted. */
+        forEachLog([&](uint64_t n) {
+            if (n != generation) unlink(logPathFor(n).c_str());
+        });
+
+        debug("rebuilt Nix database index with %d valid paths", live.size());
+
+        return gen;
+    }
+
+    /* Add an edge to the list 'key', whose head is in 'heads' or, if
+       not there yet, in the current generation. */
+    void addEdge(Batch & batch, std::unordered_map<std::string, uint64_t> & heads,
+        RecordType type, const std::string & key, const Path & path,
+        Generation * gen = nullptr)
+    {
+        auto i = heads.find(key);
+        uint64_t prev = 0;
+        if (i != heads.end())
+            prev = i->second;
+        else if (gen) {
+            auto slot = findSlot(*gen, key);
+            if (slot) prev = slot->offset.load(std::memory_order_acquire);
+        }
+        StringSink sink;
+        sink << type << key << path << prev;
+        heads[key] = batch.add(key, *sink.s);
+    }
+
+    /* Whether the edge list 'key' of 'gen' contains 'path'. */
+    bool hasEdge(Generation & gen, const std::string & key, const Path & path)
+    {
+        auto slot = findSlot(gen, key);
+        for (auto offset = slot ? slot->offset.load(std::memory_order_acquire) : 0; offset; ) {
+            auto record = readRecord(gen, offset);
+            StringSource source(record);
+            uint64_t type; std::string key2;
+            parseRecordHeader(source, type, key2);
+            if (readString(source) == path) return true;
+            offset = readNum<uint64_t>(source);
+        }
+        return false;
+    }
+
+    /* The space taken up in the log by an edge. */
+    static uint64_t edgeSize(const std::string & key, const Path & path)
+    {
+        StringSink sink;
+        sink << rtReferrer << key << path << (uint64_t) 0;
+        return 8 + sink.s->size();
+    }
+
+    /* Publish the batches written to the log of 'gen' but not yet
+       to its index, e.g. because the writer crashed, and drop
+       incomplete batches. Must be called with the write lock
+       held. */
+    void recover(Generation & gen)
+    {
+        auto logEnd = gen.header->logEnd.load();
+
+        struct stat st;
+        if (fstat(gen.logFd.get(), &st) == -1)
+            throw SysError("statting Nix database log");
+        if ((uint64_t) st.st_size == logEnd) return;
+
+        auto end = scanLog(gen.logFd.get(), logEnd,
+            [&](const std::string & key, uint64_t offset, Source & source, uint64_t type) {
+                insert(gen, key, offset);
+            });
+
+        if ((uint64_t) st.st_size != end) {
+            printError("warning: discarding %d bytes of incomplete data at the end of the Nix database log",
+                st.st_size - end);
+            if (ftruncate(gen.logFd.get(), end) == -1)
+                throw SysError("truncating Nix database log");
+        }
+
+        gen.header->logEnd = end;
+        gen.header->dataVersion++;
+    }
+
+    std::shared_ptr<Generation> getGenerationLocked()
+    {
+        auto gen = current;
+        if (!gen || gen->header->obsolete.load(std::memory_order_acquire))
+            gen = openGeneration();
+
+        if (!gen) {
+            /* The index is missing or corrupt, or a rebuild was
+               interrupted after replacing the index but before
+               replacing the log. Either way, the newest log is
+               authoritative. */
+            auto log = openNewestLog();
+            if (log)
+                printError("warning: rebuilding the index of Nix database '%s'", dir);
+            else if (pathExists(dir + "/index"))
+                throw Error("the log of Nix database '%s' is missing", dir);
+            gen = rebuild(log);
+        }
+
+        else if (gen->header->bootId.load() != getBootId())
+            gen = rebuild(gen);
+
+        else
+            recover(*gen);
+
+        current = gen;
+        return gen;
+    }
+
+    std::shared_ptr<Generation> getGeneration()
+    {
+        if (current && !current->header->obsolete.load(std::memory_order_acquire))
+            return current;
+
+        /* The index may be in the middle of being replaced, so try a
+           few times before taking the lock. */
+        for (int tries = 0; tries < 3; ++tries) {
+            auto gen = openGeneration();
+            if (gen
+                && !gen->header->obsolete.load(std::memory_order_acquire)
+                && gen->header->bootId.load() == getBootId())
+            {
+                current = gen;
+                return gen;
+            }
+        }
+
+        WriteLock lock(lockFd.get());
+        return getGenerationLocked();
+    }
+
+    static std::string serialiseEntry(const std::string & key, const Entry & entry)
+    {
+        auto & info(*entry.info);
+        Strings outputs;
+        for (auto & i : entry.outputs) {
+            outputs.push_back(i.first);
+            outputs.push_back(i.second);
+        }
+        StringSink sink;
+        sink << rtPath << key << info.path << info.narHash.to_string()
+             << info.registrationTime << info.deriver << info.narSize
+             << info.ultimate << info.sigs << info.ca << info.references
+             << outputs;
+        return *sink.s;
+    }
+
+    static Entry parseEntry(Source & source)
+    {
+        Entry entry;
+        auto info = std::make_shared<ValidPathInfo>();
+        info->path = readString(source);
+        info->narHash = Hash(readString(source));
+        info->registrationTime = readNum<uint64_t>(source);
+        info->deriver = readString(source);
+        info->narSize = readNum<uint64_t>(source);
+        info->ultimate = readNum<uint64_t>(source);
+        info->sigs = readStrings<StringSet>(source);
+        info->ca = readString(source);
+        info->references = readStrings<PathSet>(source);
+        auto outputs = readStrings<Strings>(source);
+        for (auto i = outputs.begin(); i != outputs.end(); ++i) {
+            auto & id(*i++);
+            if (i == outputs.end()) throw Error("corrupt derivation outputs in Nix database log");
+            entry.outputs[id] = *i;
+        }
+        entry.info = info;
+        return entry;
+    }
+
+    Entry committedEntry(const Path & path)
+    {
+        auto record = lookup(*getGeneration(), pathKey(path));
+        auto entry = parsePathRecord(record, path);
+        if (entry.info) entry.base = std::move(record);
+        return entry;
+    }
+
+    /* Return the entry in 'record', which is empty if 'record' isn't
+       the record of 'path' as a valid path. */
+    static Entry parsePathRecord(const std::string & record, const Path & path)
+    {
+        if (record.empty()) return Entry();
+        StringSource source(record);
+        uint64_t type; std::string key;
+        parseRecordHeader(source, type, key);
+        if (type != rtPath) return Entry();
+        auto entry = parseEntry(source);
+        if (entry.info->path != path) return Entry();
+        return entry;
+    }
+
+    /* Return the entry of 'path' as seen by the current
+       transaction. */
+    Entry getEntry(const Path & path)
+    {
+        if (pending) {
+            auto i = pending->find(path);
+            if (i != pending->end()) return i->second;
+        }
+        return committedEntry(path);
+    }
+
+    /* Return the entry of 'path' in the current transaction, for
+       modification. */
+    Entry & pendingEntry(const Path & path)
+    {
+        auto i = pending->find(path);
+        if (i != pending->end()) {
+            if (!i->second.info) throw Error(format("path '%1%' is not valid") % path);
+            return i->second;
+        }
+        auto entry = committedEntry(path);
+        if (!entry.info) throw Error(format("path '%1%' is not valid") % path);
+        entry.info = std::make_shared<ValidPathInfo>(*entry.info);
+        return (*pending)[path] = entry;
+    }
+
+    /* Return the paths in the edge list 'key'. */
+    PathSet queryEdges(const std::string & key)
+    {
+        PathSet res;
+        auto gen = getGeneration();
+        auto slot = findSlot(*gen, key);
+        for (auto offset = slot ? slot->offset.load(std::memory_order_acquire) : 0; offset; ) {
+            auto record = readRecord(*gen, offset);
+            StringSource source(record);
+            uint64_t type; std::string key2;
+            parseRecordHeader(source, type, key2);
+            res.insert(readString(source));
+            offset = readNum<uint64_t>(source);
+        }
+        return res;
+    }
+
+    struct LogTxn : Txn
+    {
+        LogPathDB & db;
+        bool active = true;
+
+        LogTxn(LogPathDB & db) : db(db)
+        {
+            if (db.pending) throw Error("nested Nix database transactions are not supported");
+            db.pending = std::make_unique<std::map<Path, Entry>>();
+        }
+
+        void commit() override
+        {
+            db.commit();
+            active = false;
+        }
+
+        ~LogTxn()
+        {
+            db.pending.reset();
+        }
+    };
+
+    std::unique_ptr<Txn> beginTxn() override
+    {
+        return std::make_unique<LogTxn>(*this);
+    }
+
+    /* Run 'fun' in the current transaction, or in a new one if there
+       is none. */
+    void modify(std::function<void()> fun)
+    {
+        if (pending) { fun(); return; }
+        LogTxn txn(*this);
+        fun();
+        txn.commit();
+    }
+
+    void commit()
+    {
+        if (pending->empty()) return;
+
+        WriteLock lock(lockFd.get());
+
+        auto gen = getGenerationLocked();
+        noteExternalChanges(*gen);
+
+        /* Another process may have changed the database since we
+           looked at it, so check that the references of new paths are
+           still valid, and that deleted paths haven't gained
+           referrers. */
+        auto isValid = [&](const Path & path) {
+            auto i = pending->find(path);
+            if (i != pending->end()) return (bool) i->second.info;
+            return (bool) committedEntry(path).info;
+        };
+
+        for (auto & i : *pending) {
+            /* Entries that modify a committed entry must not overwrite
+               changes made since it was read, or make a path that has
+               been invalidated since valid again. */
+            if (!i.second.base.empty() && lookup(*gen, pathKey(i.first)) != i.second.base)
+                throw PathDBConflict("path '%s' was changed by another process", i.first);
+
+            if (i.second.info) {
+                for (auto & ref : i.second.info->references)
+                    if (!isValid(ref))
+                        throw Error(format("path '%1%' is not valid") % ref);
+            } else {
+                for (auto & referrer : queryReferrers(i.first))
+                    if (referrer != i.first)
+                        throw Error("cannot invalidate path '%s' because it is in use by '%s'", i.first, referrer);
+            }
+        }
+
+        /* Order the paths so that references are published before
+           their referrers. */
+        Paths sorted;
+        PathSet visited;
+        std::function<void(const Path &)> visit = [&](const Path & path) {
+            if (!visited.insert(path).second) return;
+            auto & entry((*pending)[path]);
+            if (entry.info)
+                for (auto & ref : entry.info->references)
+                    if (pending->count(ref)) visit(ref);
+            sorted.push_back(path);
+        };
+        for (auto & i : *pending) visit(i.first);
+
+        /* The new records are appended to the log after the batches
+           that have been published. */
+        Batch batch(gen->header->logEnd);
+        std::unordered_map<std::string, uint64_t> heads;
+
+        /* How much this commit adds to the dead size of the log. */
+        uint64_t dead = 0;
+
+        for (auto & path : sorted) {
+            auto & entry((*pending)[path]);
+            auto key = pathKey(path);
+
+            /* The record this one supersedes, if any. */
+            auto oldRecord = lookup(*gen, key);
+            if (!oldRecord.empty()) dead += 8 + oldRecord.size();
+            auto old = parsePathRecord(oldRecord, path);
+
+            if (!entry.info) {
+                StringSink sink;
+                sink << rtInvalid << key;
+                batch.add(key, *sink.s);
+                /* Neither this record nor the edges of the path
+                   survive a rebuild. (If the path becomes valid again
+                   before then, its edges are reused, so this is only
+                   an estimate.) */
+                dead += 8 + sink.s->size();
+                if (old.info) {
+                    for (auto & ref : old.info->references)
+                        dead += edgeSize(referrersKey(ref), path);
+                    for (auto & output : old.outputs)
+                        dead += edgeSize(deriversKey(output.second), path);
+                }
+                continue;
+            }
+
+            batch.add(key, serialiseEntry(key, entry));
+
+            /* If the path was registered before, it may still have
+               edges from then, e.g. if it was invalidated and is now
+               being registered again. */
+            auto needEdge = [&](const std::string & edgesKey) {
+                return oldRecord.empty() || !hasEdge(*gen, edgesKey, path);
+            };
+
+            for (auto & ref : entry.info->references)
+                if ((!old.info || !old.info->references.count(ref)) && needEdge(referrersKey(ref)))
+                    addEdge(batch, heads, rtReferrer, referrersKey(ref), path, gen.get());
+
+            for (auto & output : entry.outputs) {
+                auto i = old.outputs.find(output.first);
+                if ((!old.info || i == old.outputs.end() || i->second != output.second)
+                    && needEdge(deriversKey(output.second)))
+                    addEdge(batch, heads, rtDeriver, deriversKey(output.second), path, gen.get());
+            }
+        }
+
+        /* Updates and invalidations don't take up new slots, so also
+           rebuild if most of the log is dead. (Not counting this
+           commit, which would still be dead after the rebuild.) */
+        auto deadSize = gen->header->deadSize.load();
+
+        if ((gen->header->used + batch.records.size()) * 2 >= gen->header->capacity
+            || (deadSize >= minDeadSize && deadSize * 2 > batch.start))
+        {
+            current = rebuild(gen, batch.records.size());
+            lastSeenVersion = version(*current);
+            /* The offsets in the batch refer to the old log, so start
+               over. */
+            return commit();
+        }
+
+        auto data = batch.finish();
+        pwriteFull(gen->logFd.get(), data, batch.start);
+
+        if (settings.fsyncMetadata && fsync(gen->logFd.get()) == -1)
+            throw SysError("syncing Nix database log");
+
+        for (auto & r : batch.records)
+            insert(*gen, r.first, r.second);
+
+        gen->header->logEnd = batch.start + data.size();
+        gen->header->deadSize = deadSize + dead;
+        gen->header->dataVersion++;
+        lastSeenVersion = version(*gen);
+
+        pending->clear();
+    }
+
+    void addPath(const ValidPathInfo & info) override
+    {
+        modify([&]() {
+            Entry entry;
+            entry.info = std::make_shared<ValidPathInfo>(info);
+            entry.info->references.clear();
+            entry.info->id = 0;
+            if (entry.info->registrationTime == 0)
+                entry.info->registrationTime = time(0);
+            (*pending)[info.path] = entry;
+        });
+    }
+
+    void addReference(const Path & referrer, const Path & reference) override
+    {
+        modify([&]() {
+            if (!getEntry(reference).info)
+                throw Error(format("path '%1%' is not valid") % reference);
+            pendingEntry(referrer).info->references.insert(reference);
+        });
+    }
+
+    void addDerivationOutput(const Path & drvPath,
+        const string & id, const Path & outPath) override
+    {
+        modify([&]() {
+            pendingEntry(drvPath).outputs[id] = outPath;
+        });
+    }
+
+    void updatePathInfo(const ValidPathInfo & info) override
+    {
+        modify([&]() {
+            auto & entry(pendingEntry(info.path));
+            entry.info->narSize = info.narSize;
+            entry.info->narHash = info.narHash;
+            entry.info->ultimate = info.ultimate;
+            entry.info->sigs = info.sigs;
+            entry.info->ca = info.ca;
+        });
+    }
+
+    void invalidatePath(const Path & path) override
+    {
+        modify([&]() {
+            (*pending)[path] = Entry();
+        });
+    }
+
+    std::shared_ptr<ValidPathInfo> queryPathInfo(const Path & path) override
+    {
+        auto info = getEntry(path).info;
+        return info ? std::make_shared<ValidPathInfo>(*info) : nullptr;
+    }
+
+    bool isValidPath(const Path & path) override
+    {
+        return (bool) getEntry(path).info;
+    }
+
+    void queryReferrers(const Path & path, PathSet & referrers) override
+    {
+        for (auto & referrer : queryReferrers(path))
+            referrers.insert(referrer);
+    }
+
+    PathSet queryReferrers(const Path & path)
+    {
+        PathSet res;
+
+        auto check = [&](const Path & referrer) {
+            auto entry = getEntry(referrer);
+            if (entry.info && entry.info->references.count(path))
+                res.insert(referrer);
+        };
+
+        for (auto & referrer : queryEdges(referrersKey(path)))
+            check(referrer);
+
+        if (pending)
+            for (auto & i : *pending)
+                check(i.first);
+
+        return res;
+    }
+
+    PathSet queryValidDerivers(const Path & path) override
+    {
+        PathSet res;
+
+        auto check = [&](const Path & drvPath) {
+            auto entry = getEntry(drvPath);
+            if (!entry.info) return;
+            for (auto & output : entry.outputs)
+                if (output.second == path) res.insert(drvPath);
+        };
+
+        for (auto & drvPath : queryEdges(deriversKey(path)))
+            check(drvPath);
+
+        if (pending)
+            for (auto & i : *pending)
+                check(i.first);
+
+        return res;
+    }
+
+    std::map<string, Path> queryDerivationOutputs(const Path & drvPath) override
+    {
+        auto entry = getEntry(drvPath);
+        if (!entry.info)
+            throw Error(format("path '%1%' is not valid") % drvPath);
+        return entry.outputs;
+    }
+
+    Path queryPathFromHashPart(const string & hashPart) override
+    {
+        Path prefix = storeDir + "/" + hashPart + "-";
+
+        if (pending)
+            for (auto & i : *pending)
+                if (hasPrefix(i.first, prefix))
+                    return i.second.info ? i.first : "";
+
+        auto record = lookup(*getGeneration(), "p" + hashPart);
+        if (record.empty()) return "";
+        StringSource source(record);
+        uint64_t type; std::string key;
+        parseRecordHeader(source, type, key);
+        return type == rtPath ? readString(source) : "";
+    }
+
+    PathSet queryAllValidPaths() override
+    {
+        PathSet res;
+
+        auto gen = getGeneration();
+        for (uint64_t i = 0; i < gen->header->capacity; ++i) {
+            if (!gen->slots[i].key.load(std::memory_order_acquire)) continue;
+            auto record = readRecord(*gen, gen->slots[i].offset.load(std::memory_order_acquire));
+            StringSource source(record);
+            uint64_t type; std::string key;
+            parseRecordHeader(source, type, key);
+            if (type == rtPath) res.insert(readString(source));
+        }
+
+        if (pending)
+            for (auto & i : *pending) {
+                if (i.second.info)
+                    res.insert(i.first);
+                else
+                    res.erase(i.first);
+            }
+
+        return res;
+    }
+
+    void scanValidPaths(const ValidPathFilter & filter, bool withInfo,
+        std::function<void(const Path & path, std::shared_ptr<ValidPathInfo> info)> callback) override
+    {
+        /* Keep using this generation if another process replaces it;
+           its records remain readable. */
+        auto gen = getGeneration();
+        for (uint64_t i = 0; i < gen->header->capacity; ++i) {
+            if (!gen->slots[i].key.load(std::memory_order_acquire)) continue;
+            auto record = readRecord(*gen, gen->slots[i].offset.load(std::memory_order_acquire));
+            StringSource source(record);
+            uint64_t type; std::string key;
+            parseRecordHeader(source, type, key);
+            if (type != rtPath) continue;
+
+            /* Check the filter before parsing the rest of the
+               record. */
+            auto pos = source.pos;
+            auto path = readString(source);
+            if (!filter.matches(path)) continue;
+
+            std::shared_ptr<ValidPathInfo> info;
+            if (withInfo) {
+                source.pos = pos;
+                info = parseEntry(source).info;
+            }
+            callback(path, info);
+        }
+    }
+
+    static uint64_t version(Generation & gen)
+    {
+        return (gen.header->generation << 32) + gen.header->dataVersion.load();
+    }
+
+    void noteExternalChanges(Generation & gen)
+    {
+        auto v = version(gen);
+        if (v != lastSeenVersion) {
+            externalChanges++;
+            lastSeenVersion = v;
+        }
+    }
+
+    void queryAllReferences(
+        std::function<void(const Path & referrer, const Path & reference)> callback) override
+    {
+        auto gen = getGeneration();
+        for (uint64_t i = 0; i < gen->header->capacity; ++i) {
+            if (!gen->slots[i].key.load(std::memory_order_acquire)) continue;
+            auto record = readRecord(*gen, gen->slots[i].offset.load(std::memory_order_acquire));
+            StringSource source(record);
+            uint64_t type; std::string key;
+            parseRecordHeader(source, type, key);
+            if (type != rtPath) continue;
+            auto entry = parseEntry(source);
+            if (pending && pending->count(entry.info->path)) continue;
+            for (auto & ref : entry.info->references)
+                callback(entry.info->path, ref);
+        }
+
+        if (pending)
+            for (auto & i : *pending)
+                if (i.second.info)
+                    for (auto & ref : i.second.info->references)
+                        callback(i.first, ref);
+    }
+
+    uint64_t dataVersion() override
+    {
+        noteExternalChanges(*getGeneration());
+        return externalChanges;
+    }
+
+    uint64_t sequenceNumber() override
+    {
+        return version(*getGeneration());
+    }
+
+    void vacuum() override
+    {
+        WriteLock lock(lockFd.get());
+        auto gen = getGenerationLocked();
+        noteExternalChanges(*gen);
+        current = rebuild(gen);
+        lastSeenVersion = version(*current);
+    }
+};
+
+
+constexpr char LogPathDB::logMagic[8];
+
+
+std::unique_ptr<PathDB> openLogPathDB(const Path & dir, const Path & storeDir)
+{
+    return std::make_unique<LogPathDB>(dir, storeDir);
+}
+
+
+}
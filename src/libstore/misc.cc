@@ -4,94 +4,94 @@
 #include "store-api.hh"
 #include "thread-pool.hh"
 
+#include <algorithm>
+
 
 namespace nix {
 
 
 void Store::computeFSClosure(const PathSet & startPaths,
-    PathSet & paths_, bool flipDirection, bool includeOutputs, bool includeDerivers)
+    PathSet & paths, bool flipDirection, bool includeOutputs, bool includeDerivers)
 {
-    struct State
-    {
-        size_t pending;
-        PathSet & paths;
-        std::exception_ptr exc;
-    };
-
-    Sync<State> state_(State{0, paths_, 0});
-
-    std::function<void(const Path &)> enqueue;
-
-    std::condition_variable done;
-
-    enqueue = [&](const Path & path) -> void {
-        {
-            auto state(state_.lock());
-            if (state->exc) return;
-            if (state->paths.count(path)) return;
-            state->paths.insert(path);
-            state->pending++;
-        }
-
-        queryPathInfo(path,
-            [&, path](ref<ValidPathInfo> info) {
-                // FIXME: calls to isValidPath() should be async
-
-                if (flipDirection) {
-
-                    PathSet referrers;
-                    queryReferrers(path, referrers);
-                    for (auto & ref : referrers)
-                        if (ref != path)
-                            enqueue(ref);
-
-                    if (includeOutputs)
-                        for (auto & i : queryValidDerivers(path))
-                            enqueue(i);
-
-                    if (includeDerivers && isDerivation(path))
-                        for (auto & i : queryDerivationOutputs(path))
-                            if (isValidPath(i) && queryPathInfo(i)->deriver == path)
-                                enqueue(i);
-
-                } else {
-
-                    for (auto & ref : info->references)
-                        if (ref != path)
-                            enqueue(ref);
-
-                    if (includeOutputs && isDerivation(path))
-                        for (auto & i : queryDerivationOutputs(path))
-                            if (isValidPath(i)) enqueue(i);
+    /* Explore the closure one level at a time, so that every level
+       takes a few batched queries rather than several per path. */
+    PathSet todo;
 
-                    if (includeDerivers && isValidPath(info->deriver))
-                        enqueue(info->deriver);
+    auto enqueue = [&](const Path & path) {
+        if (paths.insert(path).second)
+            todo.insert(path);
+    };
 
-                }
+    for (auto & startPath : startPaths)
+        enqueue(startPath);
 
-                {
-                    auto state(state_.lock());
-                    assert(state->pending);
-                    if (!--state->pending) done.notify_one();
-                }
+    while (!todo.empty()) {
+        checkInterrupt();
+
+        PathSet level;
+        std::swap(level, todo);
+
+        auto infos = queryPathInfos(level);
+        for (auto & path : level)
+            if (!infos.count(path))
+                throw InvalidPath("path '%s' is not valid", path);
+
+        PathSet drvs;
+        if (includeOutputs || includeDerivers)
+            for (auto & path : level)
+                if (isDerivation(path)) drvs.insert(path);
+
+        if (flipDirection) {
+
+            for (auto & i : queryMultipleReferrers(level))
+                for (auto & ref : i.second)
+                    if (ref != i.first)
+                        enqueue(ref);
+
+            if (includeOutputs)
+                for (auto & path : level)
+                    for (auto & i : queryValidDerivers(path))
+                        enqueue(i);
+
+            if (includeDerivers && !drvs.empty()) {
+                auto outputs = queryMultipleDerivationOutputs(drvs);
+                PathSet allOutputs;
+                for (auto & i : outputs)
+                    allOutputs.insert(i.second.begin(), i.second.end());
+                auto outputInfos = queryPathInfos(allOutputs);
+                for (auto & i : outputs)
+                    for (auto & output : i.second) {
+                        auto info = outputInfos.find(output);
+                        if (info != outputInfos.end() && info->second->deriver == i.first)
+                            enqueue(output);
+                    }
+            }
 
-            },
+        } else {
 
-            [&, path](std::exception_ptr exc) {
-                auto state(state_.lock());
-                if (!state->exc) state->exc = exc;
-                assert(state->pending);
-                if (!--state->pending) done.notify_one();
-            });
-    };
+            for (auto & i : infos)
+                for (auto & ref : i.second->references)
+                    if (ref != i.first)
+                        enqueue(ref);
+
+            if (includeOutputs && !drvs.empty()) {
+                PathSet outputs;
+                for (auto & i : queryMultipleDerivationOutputs(drvs))
+                    outputs.insert(i.second.begin(), i.second.end());
+                for (auto & i : queryValidPaths(outputs))
+                    enqueue(i);
+            }
 
-    for (auto & startPath : startPaths)
-        enqueue(startPath);
+            if (includeDerivers) {
+                PathSet derivers;
+                for (auto & i : infos)
+                    if (i.second->deriver != "")
+                        derivers.insert(i.second->deriver);
+                for (auto & i : queryValidPaths(derivers))
+                    enqueue(i);
+            }
 
-    {
-        auto state(state_.lock());
-        while (state->pending) state.wait(done);
-        if (state->exc) std::rethrow_exception(state->exc);
+        }
     }
 }
 
@@ -111,7 +111,11 @@ void Store::queryMissing(const PathSet & targets,
 
     downloadSize_ = narSize_ = 0;
 
-    ThreadPool pool;
+    /* Most of the work below consists of waiting for substituters to
+       answer path info queries, so allow as many of those in flight
+       as we have HTTP connections, rather than one per core. */
+    ThreadPool pool(std::max((size_t) std::thread::hardware_concurrency(),
+            settings.binaryCachesParallelConnections.get()));
 
     struct State
     {
@@ -189,11 +193,15 @@ void Store::queryMissing(const PathSet & targets,
 
             Derivation drv = derivationFromPath(i2.first);
 
-            PathSet invalid;
+            PathSet wanted;
             for (auto & j : drv.outputs)
-                if (wantOutput(j.first, i2.second)
-                    && !isValidPath(j.second.path))
-                    invalid.insert(j.second.path);
+                if (wantOutput(j.first, i2.second))
+                    wanted.insert(j.second.path);
+
+            PathSet invalid;
+            auto valid = queryValidPaths(wanted);
+            std::set_difference(wanted.begin(), wanted.end(), valid.begin(), valid.end(),
+                std::inserter(invalid, invalid.begin()));
             if (invalid.empty()) return;
 
             if (settings.useSubstitutes && drv.substitutesAllowed()) {
@@ -243,6 +251,8 @@ Paths Store::topoSortPaths(const PathSet & paths)
     Paths sorted;
     PathSet visited, parents;
 
+    auto infos = queryPathInfos(paths);
+
     std::function<void(const Path & path, const Path * parent)> dfsVisit;
 
     dfsVisit = [&](const Path & path, const Path * parent) {
@@ -254,10 +264,9 @@ Paths Store::topoSortPaths(const PathSet & paths)
         parents.insert(path);
 
         PathSet references;
-        try {
-            references = queryPathInfo(path)->references;
-        } catch (InvalidPath &) {
-        }
+        auto info = infos.find(path);
+        if (info != infos.end())
+            references = info->second->references;
 
         for (auto & i : references)
             /* Don't traverse into paths that don't exist.  That can
@@ -0,0 +1,353 @@
+#include "multiplexer.hh"
+
+#include <map>
+
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+namespace nix {
+
+/* Don't read more from channels while this much data is waiting to
+   be sent to the other side. */
+static const size_t maxBuffered = 1024 * 1024;
+
+/* How much data may be in flight on one channel, i.e. sent by one
+   side but not yet passed on to the channel's local end by the
+   other. This bounds what we buffer for a channel that isn't being
+   read, without holding up the other channels. */
+static const size_t window = 1024 * 1024;
+
+/* The largest frame we send is one read() from a channel, so anything
+   much bigger is a protocol error. */
+static const size_t maxFrameSize = 1024 * 1024;
+
+static const size_t headerSize = 16;
+
+/* Set in the channel ID of frames that return credit. */
+static const uint64_t creditFlag = 1ULL << 63;
+
+
+/* Append a frame carrying 'len' bytes of 'data', or, if 'data' is
+   null, a frame with only a header whose length field is 'len'. */
+static void appendFrame(std::string & buf, uint64_t id, const char * data, size_t len)
+{
+    unsigned char header[headerSize];
+    for (size_t n = 0; n < 8; ++n) {
+        header[n] = (id >> (n * 8)) & 0xff;
+        header[8 + n] = ((uint64_t) len >> (n * 8)) & 0xff;
+    }
+    buf.append((char *) header, headerSize);
+    if (data) buf.append(data, len);
+}
+
+
+static uint64_t getUint64(const std::string & buf, size_t pos)
+{
+    uint64_t n = 0;
+    for (size_t i = 0; i < 8; ++i)
+        n |= (uint64_t) (unsigned char) buf[pos + i] << (i * 8);
+    return n;
+}
+
+
+/* Write as much of 'buf' to 'fd' as can be written without
+   blocking. 'fd' may be a blocking socket or pipe shared with other
+   processes, so we can't just make it non-blocking. Returns false if
+   the connection is broken. */
+static bool writeAvailable(int fd, std::string & buf)
+{
+    size_t done = 0;
+    bool ok = true;
+
+    while (done < buf.size()) {
+        auto n = send(fd, buf.data() + done, buf.size() - done, MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (n == -1 && errno == ENOTSOCK) {
+            /* A pipe: after POLLOUT, writing up to PIPE_BUF bytes
+               won't block. */
+            struct pollfd pfd;
+            pfd.fd = fd;
+            pfd.events = POLLOUT;
+            pfd.revents = 0;
+            if (poll(&pfd, 1, 0) != 1 || !(pfd.revents & POLLOUT)) break;
+            n = write(fd, buf.data() + done, std::min(buf.size() - done, (size_t) PIPE_BUF));
+        }
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+            ok = false;
+            break;
+        }
+        done += n;
+    }
+
+    buf.erase(0, done);
+    return ok;
+}
+
+
+Multiplexer::Multiplexer(int fdIn, int fdOut, ChannelHandler onNewChannel)
+    : fdIn(fdIn), fdOut(fdOut), onNewChannel(onNewChannel)
+{
+    wakeupPipe.create();
+    thread = std::thread([this]() { run(); });
+}
+
+
+Multiplexer::~Multiplexer()
+{
+    quit = true;
+    writeFull(wakeupPipe.writeSide.get(), "x", false);
+    if (thread.joinable()) thread.join();
+}
+
+
+AutoCloseFD Multiplexer::openChannel()
+{
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) == -1)
+        throw SysError("creating socket pair");
+    AutoCloseFD ours = fds[0], theirs = fds[1];
+    closeOnExec(ours.get());
+    closeOnExec(theirs.get());
+
+    {
+        auto newChannels(newChannels_.lock());
+        if (!open) throw EndOfFile("multiplexed connection has been closed");
+        newChannels->emplace_back(nextId++, std::move(ours));
+    }
+
+    writeFull(wakeupPipe.writeSide.get(), "x", false);
+
+    return theirs;
+}
+
+
+void Multiplexer::wait()
+{
+    if (thread.joinable()) thread.join();
+}
+
+
+void Multiplexer::run()
+{
+    struct Channel
+    {
+        AutoCloseFD fd;
+
+        /* Data received for this channel that hasn't been written to
+           it yet. */
+        std::string out;
+
+        /* Whether the local end won't send more data. */
+        bool localEOF = false;
+
+        /* Whether the other side won't send more data. */
+        bool remoteEOF = false;
+        bool shutDown = false;
+
+        /* Whether the local end has gone away, so that data for it
+           should be discarded. */
+        bool broken = false;
+
+        /* How much more data we may send on this channel. */
+        size_t credit = window;
+
+        /* How much of the data received for this channel has been
+           passed on (or discarded) without returning the credit to
+           the other side yet. */
+        size_t consumed = 0;
+    };
+
+    std::map<uint64_t, Channel> channels;
+
+    /* Data received from / to be sent to the other side. */
+    std::string in, out;
+
+    try {
+
+        while (!quit) {
+
+            {
+                auto newChannels(newChannels_.lock());
+                for (auto & i : *newChannels) {
+                    auto & chan = channels[i.first];
+                    chan.fd = std::move(i.second);
+                    int flags = fcntl(chan.fd.get(), F_GETFL);
+                    if (flags == -1 || fcntl(chan.fd.get(), F_SETFL, flags | O_NONBLOCK) == -1)
+                        throw SysError("making channel non-blocking");
+                }
+                newChannels->clear();
+            }
+
+            std::vector<struct pollfd> fds;
+            std::vector<uint64_t> ids;
+
+            auto addFd = [&](int fd, short events) {
+                struct pollfd pfd;
+                pfd.fd = events ? fd : -1;
+                pfd.events = events;
+                pfd.revents = 0;
+                fds.push_back(pfd);
+            };
+
+            addFd(wakeupPipe.readSide.get(), POLLIN);
+            addFd(fdIn, POLLIN);
+            addFd(fdOut, out.empty() ? 0 : POLLOUT);
+
+            for (auto & i : channels) {
+                short events = 0;
+                if (!i.second.localEOF && i.second.credit && out.size() < maxBuffered) events |= POLLIN;
+                if (!i.second.out.empty()) events |= POLLOUT;
+                addFd(i.second.fd.get(), events);
+                ids.push_back(i.first);
+            }
+
+            if (poll(fds.data(), fds.size(), -1) == -1) {
+                if (errno == EINTR) continue;
+                throw SysError("polling multiplexed connection");
+            }
+
+            if (fds[0].revents & POLLIN) {
+                char buf[64];
+                if (read(wakeupPipe.readSide.get(), buf, sizeof(buf)) == -1 && errno != EINTR)
+                    throw SysError("reading from wakeup pipe");
+            }
+
+            /* Read frames from the other side and queue their data
+               for the corresponding channels. */
+            if (fds[1].revents) {
+                char buf[65536];
+                auto n = read(fdIn, buf, sizeof(buf));
+                if (n == -1) {
+                    if (errno == ECONNRESET) break;
+                    if (errno != EINTR && errno != EAGAIN)
+                        throw SysError("reading from multiplexed connection");
+                }
+                else if (n == 0) break;
+                else {
+                    in.append(buf, n);
+
+                    size_t pos = 0;
+                    while (in.size() - pos >= headerSize) {
+                        uint64_t id = getUint64(in, pos);
+                        uint64_t len = getUint64(in, pos + 8);
+
+                        if (id & creditFlag) {
+                            pos += headerSize;
+                            auto i = channels.find(id & ~creditFlag);
+                            if (i == channels.end()) continue;
+                            if (len > window - i->second.credit)
+                                throw Error("multiplexed connection returned more credit than it was given");
+                            i->second.credit += len;
+                            continue;
+                        }
+
+                        if (len > maxFrameSize)
+                            throw Error("multiplexed connection sent an oversized frame");
+                        if (in.size() - pos - headerSize < len) break;
+                        const char * data = in.data() + pos + headerSize;
+                        pos += headerSize + len;
+
+                        auto i = channels.find(id);
+                        if (i == channels.end()) {
+                            if (!onNewChannel || len == 0) continue;
+                            int sp[2];
+                            if (socketpair(AF_UNIX, SOCK_STREAM, 0, sp) == -1)
+                                throw SysError("creating socket pair");
+                            AutoCloseFD ours = sp[0], theirs = sp[1];
+                            closeOnExec(ours.get());
+                            closeOnExec(theirs.get());
+                            int flags = fcntl(ours.get(), F_GETFL);
+                            if (flags == -1 || fcntl(ours.get(), F_SETFL, flags | O_NONBLOCK) == -1)
+                                throw SysError("making channel non-blocking");
+                            i = channels.emplace(id, Channel()).first;
+                            i->second.fd = std::move(ours);
+                            onNewChannel(std::move(theirs));
+                        }
+
+                        auto & chan(i->second);
+                        if (len == 0)
+                            chan.remoteEOF = true;
+                        else if (chan.out.size() + len > window)
+                            throw Error("multiplexed connection sent more data than the channel's window");
+                        else if (!chan.broken && !chan.remoteEOF)
+                            chan.out.append(data, len);
+                        else
+                            chan.consumed += len;
+                    }
+
+                    in.erase(0, pos);
+                }
+            }
+
+            if (fds[2].revents && !writeAvailable(fdOut, out))
+                break;
+
+            for (size_t n = 0; n < ids.size(); ++n) {
+                auto & pfd(fds[3 + n]);
+                auto i = channels.find(ids[n]);
+                auto & chan(i->second);
+
+                if (pfd.revents && !chan.out.empty()) {
+                    auto k = send(chan.fd.get(), chan.out.data(), chan.out.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+                    if (k >= 0) {
+                        chan.out.erase(0, k);
+                        chan.consumed += k;
+                    } else if (errno != EINTR && errno != EAGAIN && errno != EWOULDBLOCK) {
+                        chan.consumed += chan.out.size();
+                        chan.out.clear();
+                        chan.broken = true;
+                    }
+                }
+
+                /* Return credit in batches rather than for every
+                   send(). */
+                if (chan.consumed && (chan.consumed >= window / 4 || chan.out.empty())) {
+                    appendFrame(out, ids[n] | creditFlag, nullptr, chan.consumed);
+                    chan.consumed = 0;
+                }
+
+                if (pfd.revents && !chan.localEOF && (pfd.events & POLLIN)) {
+                    char buf[65536];
+                    auto k = read(chan.fd.get(), buf, std::min(sizeof(buf), chan.credit));
+                    if (k == -1 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK))
+                        ;
+                    else if (k <= 0) {
+                        chan.localEOF = true;
+                        appendFrame(out, ids[n], nullptr, 0);
+                    } else {
+                        appendFrame(out, ids[n], buf, k);
+                        chan.credit -= k;
+                    }
+                }
+
+                if (chan.remoteEOF && chan.out.empty() && !chan.shutDown) {
+                    shutdown(chan.fd.get(), SHUT_WR);
+                    chan.shutDown = true;
+                }
+
+                if (chan.localEOF && chan.shutDown)
+                    channels.erase(i);
+            }
+
+            /* Try to send what we queued right away rather than
+               waiting for the next poll(). */
+            if (!out.empty() && !writeAvailable(fdOut, out))
+                break;
+        }
+
+    } catch (std::exception & e) {
+        printError("error in multiplexed connection: %s", e.what());
+    }
+
+    /* Closing the channels tells their users that the connection is
+       gone. */
+    auto newChannels(newChannels_.lock());
+    open = false;
+    newChannels->clear();
+    channels.clear();
+}
+
+}
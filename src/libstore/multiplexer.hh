@@ -0,0 +1,81 @@
+#pragma once
+
+#include "util.hh"
+#include "sync.hh"
+
+#include <atomic>
+#include <functional>
+#include <thread>
+
+namespace nix {
+
+/* A Multiplexer carries any number of independent byte streams
+   ("channels") over a single connection, so that several worker
+   protocol operations can be in progress at the same time and
+   complete in any order. Locally, each channel is one end of a Unix
+   domain socket pair, so it can be used with FdSource/FdSink exactly
+   like an ordinary connection.
+
+   On the wire, data is sent in frames consisting of a 64-bit channel
+   ID, a 64-bit length and that many bytes of data. A frame of length
+   0 means that the sender will not send any more data on that
+   channel. A channel is opened by sending data on it.
+
+   Each side may have at most a fixed amount of data in flight per
+   channel; once the receiver has passed data on to the channel's
+   local end, it returns the credit in a frame that has the top bit of
+   the channel ID set, the number of bytes as its length and no
+   data. Thus a channel whose local end isn't reading only stops
+   itself, not the other channels. */
+class Multiplexer
+{
+public:
+
+    typedef std::function<void(AutoCloseFD && fd)> ChannelHandler;
+
+    /* Start multiplexing over the connection consisting of 'fdIn' and
+       'fdOut' (which may be the same file descriptor, and are not
+       owned by the Multiplexer). If 'onNewChannel' is set, channels
+       opened by the other side are accepted and their local end is
+       passed to 'onNewChannel'; otherwise, their data is
+       discarded. */
+    Multiplexer(int fdIn, int fdOut, ChannelHandler onNewChannel = nullptr);
+
+    ~Multiplexer();
+
+    /* Open a new channel and return its local end. */
+    AutoCloseFD openChannel();
+
+    /* Whether the underlying connection is still open. */
+    bool isOpen()
+    {
+        return open;
+    }
+
+    /* Wait until the underlying connection has been closed. All
+       channels are closed at that point. */
+    void wait();
+
+private:
+
+    int fdIn, fdOut;
+
+    ChannelHandler onNewChannel;
+
+    std::atomic_bool open{true};
+    std::atomic_bool quit{false};
+
+    uint64_t nextId = 1;
+
+    /* Channels opened by openChannel() that the multiplexer thread
+       hasn't picked up yet. */
+    Sync<std::list<std::pair<uint64_t, AutoCloseFD>>> newChannels_;
+
+    Pipe wakeupPipe;
+
+    std::thread thread;
+
+    void run();
+};
+
+}
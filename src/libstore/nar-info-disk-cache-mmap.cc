@@ -0,0 +1,575 @@
+#include "nar-info-disk-cache.hh"
+#include "sync.hh"
+#include "globals.hh"
+#include "serialise.hh"
+
+#include <atomic>
+#include <mutex>
+
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace nix {
+
+static_assert(ATOMIC_LLONG_LOCK_FREE == 2, "the NAR info index requires lock-free 64-bit atomics");
+
+/* A NarInfoDiskCache that doesn't use SQLite. Entries are appended
+   to a log file and located through an open-addressing hash table in
+   a memory-mapped index file shared by all processes. Lookups don't
+   take any locks: a record is only published in the index (by
+   atomically setting its slot) after it has been completely written
+   to the log. Writers serialise through a lock file.
+
+   When the index becomes half full, and once a day to drop expired
+   entries, a writer copies the live entries to a new log and index
+   (a new "generation"), renames the new index into place and marks
+   the old one as obsolete, causing other processes to switch over. */
+class NarInfoDiskCacheMmap : public NarInfoDiskCache
+{
+public:
+
+    /* How often to purge expired entries from the cache. */
+    const int purgeInterval = 24 * 3600;
+
+    static constexpr uint64_t indexMagic = 0x786469666e69726eULL;
+    static constexpr uint64_t indexVersion = 1;
+
+    struct Header
+    {
+        uint64_t magic;
+        uint64_t version;
+        uint64_t generation;
+        uint64_t capacity;
+        std::atomic<uint64_t> used;
+        std::atomic<uint64_t> obsolete;
+        std::atomic<uint64_t> lastPurge;
+    };
+
+    struct Slot
+    {
+        /* Hash of the record key, or 0 if the slot is empty. */
+        std::atomic<uint64_t> key;
+        /* Offset of the record in the log. */
+        std::atomic<uint64_t> offset;
+    };
+
+    enum RecordType : uint64_t { rtCache = 1, rtValid = 2, rtInvalid = 3 };
+
+    struct Generation
+    {
+        AutoCloseFD indexFd, logFd;
+        void * map = MAP_FAILED;
+        size_t mapSize = 0;
+        Header * header = nullptr;
+        Slot * slots = nullptr;
+
+        ~Generation()
+        {
+            if (map != MAP_FAILED) munmap(map, mapSize);
+        }
+    };
+
+    struct Cache
+    {
+        Path storeDir;
+        bool wantMassQuery;
+        int priority;
+        StringMap extraInfo;
+    };
+
+    struct State
+    {
+        std::shared_ptr<Generation> current;
+        std::map<std::string, Cache> caches;
+    };
+
+    Path dir;
+
+    AutoCloseFD lockFd;
+
+    /* Serialises writers within this process; the lock file does so
+       between processes. */
+    std::mutex writeMutex;
+
+    Sync<State> _state;
+
+    NarInfoDiskCacheMmap()
+    {
+        dir = getCacheDir() + "/nix/narinfo-cache-v1";
+        createDirs(dir);
+
+        Path lockPath = dir + "/lock";
+        lockFd = open(lockPath.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (!lockFd)
+            throw SysError("opening lock file '%s'", lockPath);
+    }
+
+    struct WriteLock
+    {
+        std::unique_lock<std::mutex> lock;
+        int fd;
+
+        WriteLock(std::mutex & mutex, int fd) : lock(mutex), fd(fd)
+        {
+            while (flock(fd, LOCK_EX) == -1)
+                if (errno != EINTR)
+                    throw SysError("acquiring NAR info cache lock");
+        }
+
+        ~WriteLock()
+        {
+            flock(fd, LOCK_UN);
+        }
+    };
+
+    static uint64_t hashKey(const std::string & key)
+    {
+        /* FNV-1a. */
+        uint64_t h = 14695981039346656037ULL;
+        for (unsigned char c : key) {
+            h ^= c;
+            h *= 1099511628211ULL;
+        }
+        return h ? h : 1;
+    }
+
+    static std::string cacheKey(const std::string & uri)
+    {
+        return "c" + uri;
+    }
+
+    static std::string narKey(const std::string & uri, const std::string & hashPart)
+    {
+        return "n" + uri + std::string(1, 0) + hashPart;
+    }
+
+    Path logPathFor(uint64_t generation)
+    {
+        return dir + "/log-" + std::to_string(generation);
+    }
+
+    static void preadFull(int fd, unsigned char * buf, size_t count, uint64_t offset)
+    {
+        while (count) {
+            ssize_t res = pread(fd, buf, count, offset);
+            if (res == -1) {
+                if (errno == EINTR) continue;
+                throw SysError("reading from NAR info cache log");
+            }
+            if (res == 0) throw EndOfFile("unexpected end of NAR info cache log");
+            count -= res;
+            buf += res;
+            offset += res;
+        }
+    }
+
+    static std::string readRecord(Generation & gen, uint64_t offset)
+    {
+        unsigned char buf[8];
+        preadFull(gen.logFd.get(), buf, sizeof(buf), offset);
+        std::string lenBuf((char *) buf, sizeof(buf));
+        StringSource lenSource(lenBuf);
+        auto len = readNum<uint64_t>(lenSource);
+        if (len > 64 * 1024 * 1024)
+            throw Error("corrupt record in NAR info cache log");
+        std::string record(len, 0);
+        preadFull(gen.logFd.get(), (unsigned char *) &record[0], len, offset + sizeof(buf));
+        return record;
+    }
+
+    /* Read the type, key and timestamp of a record. */
+    static void parseRecordHeader(Source & source, uint64_t & type, std::string & key, time_t & timestamp)
+    {
+        type = readNum<uint64_t>(source);
+        key = readString(source);
+        timestamp = readNum<uint64_t>(source);
+    }
+
+    /* Return the record with the given key, or an empty string. */
+    std::string lookup(Generation & gen, const std::string & key)
+    {
+        auto h = hashKey(key);
+        auto mask = gen.header->capacity - 1;
+
+        for (auto i = h & mask; ; i = (i + 1) & mask) {
+            auto k = gen.slots[i].key.load(std::memory_order_acquire);
+            if (k == 0) return "";
+            if (k != h) continue;
+            auto record = readRecord(gen, gen.slots[i].offset.load(std::memory_order_acquire));
+            StringSource source(record);
+            uint64_t type; std::string key2; time_t timestamp;
+            parseRecordHeader(source, type, key2, timestamp);
+            if (key2 == key) return record;
+        }
+    }
+
+    /* Point the slot for 'key' at the record at 'offset'. Must be
+       called with the write lock held. */
+    void insert(Generation & gen, const std::string & key, uint64_t offset)
+    {
+        auto h = hashKey(key);
+        auto mask = gen.header->capacity - 1;
+
+        for (auto i = h & mask; ; i = (i + 1) & mask) {
+            auto k = gen.slots[i].key.load(std::memory_order_acquire);
+            if (k == 0) {
+                /* Set the offset first, so that readers that see the
+                   key also see a valid offset. */
+                gen.slots[i].offset.store(offset, std::memory_order_release);
+                gen.slots[i].key.store(h, std::memory_order_release);
+                gen.header->used++;
+                return;
+            }
+            if (k != h) continue;
+            auto record = readRecord(gen, gen.slots[i].offset.load(std::memory_order_acquire));
+            StringSource source(record);
+            uint64_t type; std::string key2; time_t timestamp;
+            parseRecordHeader(source, type, key2, timestamp);
+            if (key2 == key) {
+                gen.slots[i].offset.store(offset, std::memory_order_release);
+                return;
+            }
+        }
+    }
+
+    static uint64_t appendRecord(int fd, const std::string & record)
+    {
+        auto offset = lseek(fd, 0, SEEK_END);
+        if (offset == -1)
+            throw SysError("seeking in NAR info cache log");
+        StringSink sink;
+        sink << record.size();
+        *sink.s += record;
+        writeFull(fd, *sink.s);
+        return offset;
+    }
+
+    /* Open the current index and its log. Returns null if there is
+       no usable index. */
+    std::shared_ptr<Generation> openGeneration()
+    {
+        auto gen = std::make_shared<Generation>();
+
+        Path indexPath = dir + "/index";
+        gen->indexFd = open(indexPath.c_str(), O_RDWR | O_CLOEXEC);
+        if (!gen->indexFd) {
+            if (errno == ENOENT) return nullptr;
+            throw SysError("opening NAR info cache index '%s'", indexPath);
+        }
+
+        struct stat st;
+        if (fstat(gen->indexFd.get(), &st) == -1)
+            throw SysError("statting '%s'", indexPath);
+        if ((size_t) st.st_size < sizeof(Header)) return nullptr;
+
+        gen->mapSize = st.st_size;
+        gen->map = mmap(nullptr, gen->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, gen->indexFd.get(), 0);
+        if (gen->map == MAP_FAILED)
+            throw SysError("mapping NAR info cache index '%s'", indexPath);
+
+        gen->header = (Header *) gen->map;
+        gen->slots = (Slot *) (gen->header + 1);
+
+        auto capacity = gen->header->capacity;
+        if (gen->header->magic != indexMagic
+            || gen->header->version != indexVersion
+            || capacity == 0
+            || (capacity & (capacity - 1))
+            || gen->mapSize != sizeof(Header) + capacity * sizeof(Slot))
+            return nullptr;
+
+        Path logPath = logPathFor(gen->header->generation);
+        gen->logFd = open(logPath.c_str(), O_RDWR | O_CLOEXEC);
+        if (!gen->logFd) {
+            /* The index may have been replaced since we opened it. */
+            if (errno == ENOENT) return nullptr;
+            throw SysError("opening NAR info cache log '%s'", logPath);
+        }
+
+        return gen;
+    }
+
+    bool isLive(const std::string & record, time_t now)
+    {
+        StringSource source(record);
+        uint64_t type; std::string key; time_t timestamp;
+        parseRecordHeader(source, type, key, timestamp);
+        return
+            type == rtCache
+            || (type == rtValid && timestamp > now - (time_t) settings.ttlPositiveNarInfoCache)
+            || (type == rtInvalid && timestamp > now - (time_t) settings.ttlNegativeNarInfoCache);
+    }
+
+    /* Create a new generation containing the live entries of 'old'.
+       Must be called with the write lock held. */
+    std::shared_ptr<Generation> rebuild(std::shared_ptr<Generation> old)
+    {
+        auto now = time(0);
+
+        std::vector<std::string> live;
+        if (old) {
+            for (uint64_t i = 0; i < old->header->capacity; ++i) {
+                if (!old->slots[i].key.load(std::memory_order_acquire)) continue;
+                try {
+                    auto record = readRecord(*old, old->slots[i].offset.load(std::memory_order_acquire));
+                    if (isLive(record, now)) live.push_back(std::move(record));
+                } catch (Error & e) {
+                    /* Drop corrupt entries; this is only a cache. */
+                }
+            }
+        }
+
+        uint64_t capacity = 1024;
+        while (capacity < live.size() * 4) capacity *= 2;
+
+        uint64_t generation = old ? old->header->generation + 1 : now;
+
+        auto gen = std::make_shared<Generation>();
+
+        Path logPath = logPathFor(generation);
+        gen->logFd = open(logPath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (!gen->logFd)
+            throw SysError("creating NAR info cache log '%s'", logPath);
+
+        Path indexPath = dir + "/index";
+        Path tmpPath = indexPath + ".tmp";
+        gen->indexFd = open(tmpPath.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (!gen->indexFd)
+            throw SysError("creating NAR info cache index '%s'", tmpPath);
+
+        gen->mapSize = sizeof(Header) + capacity * sizeof(Slot);
+        if (ftruncate(gen->indexFd.get(), gen->mapSize) == -1)
+            throw SysError("resizing '%s'", tmpPath);
+
+        gen->map = mmap(nullptr, gen->mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, gen->indexFd.get(), 0);
+        if (gen->map == MAP_FAILED)
+            throw SysError("mapping NAR info cache index '%s'", tmpPath);
+
+        gen->header = (Header *) gen->map;
+        gen->slots = (Slot *) (gen->header + 1);
+        gen->header->magic = indexMagic;
+        gen->header->version = indexVersion;
+        gen->header->generation = generation;
+        gen->header->capacity = capacity;
+        gen->header->lastPurge = now;
+
+        for (auto & record : live) {
+            StringSource source(record);
+            uint64_t type; std::string key; time_t timestamp;
+            parseRecordHeader(source, type, key, timestamp);
+            insert(*gen, key, appendRecord(gen->logFd.get(), record));
+        }
+
+        if (rename(tmpPath.c_str(), indexPath.c_str()) == -1)
+            throw SysError("renaming '%s' to '%s'", tmpPath, indexPath);
+
+        if (old)
+            old->header->obsolete.store(1, std::memory_order_release);
+
+        /* Processes still using an old generation keep their log open,
+           so it can be deleted. */
+        for (auto & entry : readDirectory(dir))
+            if (hasPrefix(entry.name, "log-") && dir + "/" + entry.name != logPath)
+                unlink((dir + "/" + entry.name).c_str());
+
+        debug("rebuilt NAR info cache index with %d live entries", live.size());
+
+        return gen;
+    }
+
+    std::shared_ptr<Generation> getGenerationLocked()
+    {
+        auto gen = _state.lock()->current;
+        if (!gen || gen->header->obsolete.load(std::memory_order_acquire)) {
+            gen = openGeneration();
+            if (!gen) gen = rebuild(nullptr);
+            _state.lock()->current = gen;
+        }
+        return gen;
+    }
+
+    std::shared_ptr<Generation> getGeneration()
+    {
+        {
+            auto state(_state.lock());
+            if (state->current && !state->current->header->obsolete.load(std::memory_order_acquire))
+                return state->current;
+        }
+
+        /* The index may be in the middle of being replaced, so try a
+           few times before taking the lock. */
+        for (int tries = 0; tries < 3; ++tries) {
+            auto gen = openGeneration();
+            if (gen && !gen->header->obsolete.load(std::memory_order_acquire)) {
+                _state.lock()->current = gen;
+                return gen;
+            }
+        }
+
+        WriteLock lock(writeMutex, lockFd.get());
+        return getGenerationLocked();
+    }
+
+    void append(const std::string & key, const std::string & record)
+    {
+        WriteLock lock(writeMutex, lockFd.get());
+
+        auto gen = getGenerationLocked();
+
+        if (gen->header->used * 2 >= gen->header->capacity
+            || (time_t) gen->header->lastPurge + purgeInterval < time(0))
+        {
+            gen = rebuild(gen);
+            _state.lock()->current = gen;
+        }
+
+        insert(*gen, key, appendRecord(gen->logFd.get(), record));
+    }
+
+    void createCache(const std::string & uri, const Path & storeDir, bool wantMassQuery, int priority,
+        const StringMap & extraInfo) override
+    {
+        StringSink sink;
+        sink << rtCache << cacheKey(uri) << time(0) << storeDir << wantMassQuery << priority;
+        sink << extraInfo.size();
+        for (auto & i : extraInfo)
+            sink << i.first << i.second;
+        append(cacheKey(uri), *sink.s);
+
+        _state.lock()->caches[uri] = Cache{storeDir, wantMassQuery, priority, extraInfo};
+    }
+
+    bool cacheExists(const std::string & uri,
+        bool & wantMassQuery, int & priority, StringMap & extraInfo) override
+    {
+        {
+            auto state(_state.lock());
+            auto i = state->caches.find(uri);
+            if (i != state->caches.end()) {
+                wantMassQuery = i->second.wantMassQuery;
+                priority = i->second.priority;
+                extraInfo = i->second.extraInfo;
+                return true;
+            }
+        }
+
+        auto record = lookup(*getGeneration(), cacheKey(uri));
+        if (record.empty()) return false;
+
+        StringSource source(record);
+        uint64_t type; std::string key; time_t timestamp;
+        parseRecordHeader(source, type, key, timestamp);
+
+        Cache cache;
+        cache.storeDir = readString(source);
+        cache.wantMassQuery = readNum<uint64_t>(source);
+        cache.priority = readNum<uint64_t>(source);
+
+        /* Records written before extra info was stored end here. */
+        if (source.pos < record.size()) {
+            auto n = readNum<size_t>(source);
+            while (n--) {
+                auto name = readString(source);
+                cache.extraInfo[name] = readString(source);
+            }
+        }
+
+        _state.lock()->caches[uri] = cache;
+
+        wantMassQuery = cache.wantMassQuery;
+        priority = cache.priority;
+        extraInfo = cache.extraInfo;
+
+        return true;
+    }
+
+    std::pair<Outcome, std::shared_ptr<NarInfo>> lookupNarInfo(
+        const std::string & uri, const std::string & hashPart) override
+    {
+        Path storeDir;
+        {
+            auto state(_state.lock());
+            auto i = state->caches.find(uri);
+            if (i == state->caches.end()) abort();
+            storeDir = i->second.storeDir;
+        }
+
+        auto record = lookup(*getGeneration(), narKey(uri, hashPart));
+        if (record.empty())
+            return {oUnknown, 0};
+
+        StringSource source(record);
+        uint64_t type; std::string key; time_t timestamp;
+        parseRecordHeader(source, type, key, timestamp);
+
+        if (!isLive(record, time(0)))
+            return {oUnknown, 0};
+
+        if (type == rtInvalid)
+            return {oInvalid, 0};
+
+        auto narInfo = make_ref<NarInfo>();
+
+        auto namePart = readString(source);
+        narInfo->path = storeDir + "/" +
+            hashPart + (namePart.empty() ? "" : "-" + namePart);
+        narInfo->url = readString(source);
+        narInfo->compression = readString(source);
+        auto fileHash = readString(source);
+        if (!fileHash.empty())
+            narInfo->fileHash = Hash(fileHash);
+        narInfo->fileSize = readNum<uint64_t>(source);
+        narInfo->narHash = Hash(readString(source));
+        narInfo->narSize = readNum<uint64_t>(source);
+        for (auto & r : readStrings<Strings>(source))
+            narInfo->references.insert(storeDir + "/" + r);
+        auto deriver = readString(source);
+        if (!deriver.empty())
+            narInfo->deriver = storeDir + "/" + deriver;
+        narInfo->sigs = readStrings<StringSet>(source);
+
+        return {oValid, narInfo};
+    }
+
+    void upsertNarInfo(
+        const std::string & uri, const std::string & hashPart,
+        std::shared_ptr<ValidPathInfo> info) override
+    {
+        auto key = narKey(uri, hashPart);
+
+        StringSink sink;
+
+        if (info) {
+
+            auto narInfo = std::dynamic_pointer_cast<NarInfo>(info);
+
+            assert(hashPart == storePathToHash(info->path));
+
+            sink << rtValid << key << time(0)
+                 << storePathToName(info->path)
+                 << (narInfo ? narInfo->url : "")
+                 << (narInfo ? narInfo->compression : "")
+                 << (narInfo && narInfo->fileHash ? narInfo->fileHash.to_string() : "")
+                 << (narInfo ? narInfo->fileSize : 0)
+                 << info->narHash.to_string()
+                 << info->narSize
+                 << info->shortRefs()
+                 << (info->deriver != "" ? baseNameOf(info->deriver) : "")
+                 << info->sigs;
+
+        } else
+            sink << rtInvalid << key << time(0);
+
+        append(key, *sink.s);
+    }
+};
+
+ref<NarInfoDiskCache> makeMmapNarInfoDiskCache()
+{
+    return make_ref<NarInfoDiskCacheMmap>();
+}
+
+}
@@ -15,7 +15,8 @@ create table if not exists BinaryCaches (
     timestamp integer not null,
     storeDir  text not null,
     wantMassQuery integer not null,
-    priority  integer not null
+    priority  integer not null,
+    extraInfo text
 );
 
 create table if not exists NARs (
@@ -57,6 +58,7 @@ public:
         Path storeDir;
         bool wantMassQuery;
         int priority;
+        StringMap extraInfo;
     };
 
     struct State
@@ -72,7 +74,7 @@ public:
     {
         auto state(_state.lock());
 
-        Path dbPath = getCacheDir() + "/nix/binary-cache-v5.sqlite";
+        Path dbPath = getCacheDir() + "/nix/binary-cache-v6.sqlite";
         createDirs(dirOf(dbPath));
 
         state->db = SQLite(dbPath);
@@ -87,10 +89,10 @@ public:
         state->db.exec(schema);
 
         state->insertCache.create(state->db,
-            "insert or replace into BinaryCaches(url, timestamp, storeDir, wantMassQuery, priority) values (?, ?, ?, ?, ?)");
+            "insert or replace into BinaryCaches(url, timestamp, storeDir, wantMassQuery, priority, extraInfo) values (?, ?, ?, ?, ?, ?)");
 
         state->queryCache.create(state->db,
-            "select id, storeDir, wantMassQuery, priority from BinaryCaches where url = ?");
+            "select id, storeDir, wantMassQuery, priority, extraInfo from BinaryCaches where url = ?");
 
         state->insertNAR.create(state->db,
             "insert or replace into NARs(cache, hashPart, namePart, url, compression, fileHash, fileSize, narHash, "
@@ -133,21 +135,43 @@ public:
         return i->second;
     }
 
-    void createCache(const std::string & uri, const Path & storeDir, bool wantMassQuery, int priority) override
+    /* Extra cache info is stored as 'Name: value' lines, like in
+       nix-cache-info. */
+    static std::string showExtraInfo(const StringMap & extraInfo)
+    {
+        std::string s;
+        for (auto & i : extraInfo)
+            s += i.first + ": " + i.second + "\n";
+        return s;
+    }
+
+    static StringMap parseExtraInfo(const std::string & s)
+    {
+        StringMap extraInfo;
+        for (auto & line : tokenizeString<Strings>(s, "\n")) {
+            auto colon = line.find(": ");
+            if (colon == std::string::npos) continue;
+            extraInfo[line.substr(0, colon)] = line.substr(colon + 2);
+        }
+        return extraInfo;
+    }
+
+    void createCache(const std::string & uri, const Path & storeDir, bool wantMassQuery, int priority,
+        const StringMap & extraInfo) override
     {
         retrySQLite<void>([&]() {
             auto state(_state.lock());
 
             // FIXME: race
 
-            state->insertCache.use()(uri)(time(0))(storeDir)(wantMassQuery)(priority).exec();
+            state->insertCache.use()(uri)(time(0))(storeDir)(wantMassQuery)(priority)(showExtraInfo(extraInfo)).exec();
             assert(sqlite3_changes(state->db) == 1);
-            state->caches[uri] = Cache{(int) sqlite3_last_insert_rowid(state->db), storeDir, wantMassQuery, priority};
+            state->caches[uri] = Cache{(int) sqlite3_last_insert_rowid(state->db), storeDir, wantMassQuery, priority, extraInfo};
         });
     }
 
     bool cacheExists(const std::string & uri,
-        bool & wantMassQuery, int & priority) override
+        bool & wantMassQuery, int & priority, StringMap & extraInfo) override
     {
         return retrySQLite<bool>([&]() {
             auto state(_state.lock());
@@ -157,13 +181,15 @@ public:
                 auto queryCache(state->queryCache.use()(uri));
                 if (!queryCache.next()) return false;
                 state->caches.emplace(uri,
-                    Cache{(int) queryCache.getInt(0), queryCache.getStr(1), queryCache.getInt(2) != 0, (int) queryCache.getInt(3)});
+                    Cache{(int) queryCache.getInt(0), queryCache.getStr(1), queryCache.getInt(2) != 0, (int) queryCache.getInt(3),
+                        parseExtraInfo(queryCache.isNull(4) ? "" : queryCache.getStr(4))});
             }
 
             auto & cache(getCache(*state, uri));
 
             wantMassQuery = cache.wantMassQuery;
             priority = cache.priority;
+            extraInfo = cache.extraInfo;
 
             return true;
         });
@@ -255,9 +281,20 @@ public:
     }
 };
 
+static ref<NarInfoDiskCache> makeNarInfoDiskCache()
+{
+    auto backend = settings.narInfoCacheBackend.get();
+    if (backend == "sqlite")
+        return make_ref<NarInfoDiskCacheImpl>();
+    else if (backend == "mmap")
+        return makeMmapNarInfoDiskCache();
+    else
+        throw Error("unknown NAR info disk cache backend '%s'", backend);
+}
+
 ref<NarInfoDiskCache> getNarInfoDiskCache()
 {
-    static ref<NarInfoDiskCache> cache = make_ref<NarInfoDiskCacheImpl>();
+    static ref<NarInfoDiskCache> cache = makeNarInfoDiskCache();
     return cache;
 }
 
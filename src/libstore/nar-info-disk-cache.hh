@@ -10,11 +10,14 @@ class NarInfoDiskCache
 public:
     typedef enum { oValid, oInvalid, oUnknown } Outcome;
 
+    /* 'extraInfo' holds the other nix-cache-info fields that the
+       store needs on every use (such as 'NarInfoBundle'), so that
+       they're still known when nix-cache-info isn't fetched again. */
     virtual void createCache(const std::string & uri, const Path & storeDir,
-        bool wantMassQuery, int priority) = 0;
+        bool wantMassQuery, int priority, const StringMap & extraInfo) = 0;
 
     virtual bool cacheExists(const std::string & uri,
-        bool & wantMassQuery, int & priority) = 0;
+        bool & wantMassQuery, int & priority, StringMap & extraInfo) = 0;
 
     virtual std::pair<Outcome, std::shared_ptr<NarInfo>> lookupNarInfo(
         const std::string & uri, const std::string & hashPart) = 0;
@@ -28,4 +31,8 @@ public:
    multiple threads. */
 ref<NarInfoDiskCache> getNarInfoDiskCache();
 
+/* Return a cache that keeps its entries in an append-only log and a
+   memory-mapped index rather than in SQLite. */
+ref<NarInfoDiskCache> makeMmapNarInfoDiskCache();
+
 }
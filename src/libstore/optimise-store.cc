@@ -10,6 +10,14 @@
 #include <errno.h>
 #include <stdio.h>
 #include <regex>
+#include <atomic>
+
+#if __linux__
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#endif
 
 
 namespace nix {
@@ -41,6 +49,108 @@ struct MakeReadOnly
 };
 
 
+#if __linux__ && defined(FIDEDUPERANGE)
+struct Extent
+{
+    uint64_t logical, physical, length;
+    uint32_t flags;
+};
+
+
+/* Return the extents of a file, or an empty list if the file system
+   doesn't tell. */
+static std::vector<Extent> getExtents(int fd, uint64_t size)
+{
+    std::vector<Extent> extents;
+
+    const size_t maxExtents = 256;
+    std::vector<unsigned char> buf(sizeof(fiemap) + maxExtents * sizeof(fiemap_extent));
+    auto map = (fiemap *) buf.data();
+
+    uint64_t start = 0;
+    while (start < size) {
+        std::fill(buf.begin(), buf.end(), 0);
+        map->fm_start = start;
+        map->fm_length = size - start;
+        map->fm_flags = FIEMAP_FLAG_SYNC;
+        map->fm_extent_count = maxExtents;
+
+        if (ioctl(fd, FS_IOC_FIEMAP, map) == -1) return {};
+        if (map->fm_mapped_extents == 0) break;
+
+        for (unsigned int i = 0; i < map->fm_mapped_extents; ++i) {
+            auto & e = map->fm_extents[i];
+            extents.push_back({e.fe_logical, e.fe_physical, e.fe_length, e.fe_flags});
+            start = e.fe_logical + e.fe_length;
+            if (e.fe_flags & FIEMAP_EXTENT_LAST) return extents;
+        }
+    }
+
+    return extents;
+}
+
+
+/* Return the number of bytes in the file with extents 'a' that are
+   stored in the same place as the same bytes of the file with
+   extents 'b', i.e. that have already been deduplicated. */
+static uint64_t sharedBytes(const std::vector<Extent> & a, const std::vector<Extent> & b, uint64_t size)
+{
+    const uint32_t unknown = FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC
+        | FIEMAP_EXTENT_DATA_INLINE | FIEMAP_EXTENT_NOT_ALIGNED;
+
+    uint64_t shared = 0;
+    size_t j = 0;
+
+    for (auto & x : a) {
+        while (j < b.size() && b[j].logical + b[j].length <= x.logical) j++;
+        for (size_t k = j; k < b.size() && b[k].logical < x.logical + x.length; k++) {
+            auto & y = b[k];
+            if ((x.flags | y.flags) & unknown) continue;
+            if (x.physical - x.logical != y.physical - y.logical) continue;
+            /* The physical offsets of compressed extents don't
+               correspond to logical offsets. */
+            if (((x.flags | y.flags) & FIEMAP_EXTENT_ENCODED)
+                && (x.logical != y.logical || x.length != y.length)) continue;
+            shared += std::min(x.logical + x.length, y.logical + y.length)
+                - std::max(x.logical, y.logical);
+        }
+    }
+
+    return std::min(shared, size);
+}
+
+
+/* Whether all extents of a file are shared with some other file. */
+static bool allExtentsShared(const Path & path, uint64_t size)
+{
+    AutoCloseFD fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fd) throw SysError("opening '%s'", path);
+
+    auto extents = getExtents(fd.get(), size);
+    if (extents.empty()) return false;
+
+    for (auto & e : extents)
+        if (!(e.flags & FIEMAP_EXTENT_SHARED)) return false;
+
+    return true;
+}
+#endif
+
+
+void LocalStore::checkOptimiseMethod()
+{
+    if (optimiseMethod == "hardlink") return;
+    if (optimiseMethod == "reflink") {
+#if __linux__ && defined(FIDEDUPERANGE)
+        return;
+#else
+        throw Error("'optimise-method = reflink' is not supported on this platform");
+#endif
+    }
+    throw Error("unknown optimise method '%s'", optimiseMethod);
+}
+
+
 LocalStore::InodeHash LocalStore::loadInodeHash()
 {
     debug("loading hash inodes in memory");
@@ -119,18 +229,26 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
         return;
     }
 
-    /* We can hard link regular files and maybe symlinks. */
+    bool reflink = optimiseMethod == "reflink";
+
+    /* We can hard link regular files and maybe symlinks.  Extents
+       can only be shared between non-empty regular files. */
     if (!S_ISREG(st.st_mode)
 #if CAN_LINK_SYMLINK
-        && !S_ISLNK(st.st_mode)
+        && (reflink || !S_ISLNK(st.st_mode))
 #endif
         ) return;
 
+    if (reflink && st.st_size == 0) return;
+
     /* Sometimes SNAFUs can cause files in the Nix store to be
        modified, in particular when running programs as root under
        NixOS (example: $fontconfig/var/cache being modified).  Skip
-       those files.  FIXME: check the modification time. */
-    if (S_ISREG(st.st_mode) && (st.st_mode & S_IWUSR)) {
+       those files.  FIXME: check the modification time.  This is
+       not a concern for reflinks, since the kernel compares the
+       contents before sharing any extents and the files keep
+       their own inodes. */
+    if (!reflink && S_ISREG(st.st_mode) && (st.st_mode & S_IWUSR)) {
         printError(format("skipping suspicious writable file '%1%'") % path);
         return;
     }
@@ -141,6 +259,18 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
         return;
     }
 
+#if __linux__ && defined(FIDEDUPERANGE)
+    /* Deduplicated files keep their own inode, so they're not in
+       'inodeHash' on the next run.  Don't hash them again.  This also
+       skips files that only share their extents with a snapshot, but
+       those don't take up additional space either. */
+    if (reflink && allExtentsShared(path, st.st_size)) {
+        debug(format("'%1%' is already deduplicated") % path);
+        inodeHash.insert(st.st_ino);
+        return;
+    }
+#endif
+
     /* Hash the file.  Note that hashPath() returns the hash over the
        NAR serialisation, which includes the execute bit on the file.
        Thus, executable and non-executable files with the same
@@ -200,6 +330,38 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
         goto retry;
     }
 
+    /* In reflink mode, the first file with a given hash is hard
+       linked into the links directory as usual, but subsequent
+       duplicates keep their own inode and merely share extents with
+       it.  So link counts never exceed 2 and we don't need to make
+       the containing directory writable. */
+    if (reflink) {
+        auto deduped = dedupeFile(path, linkPath, st.st_size);
+
+        if (deduped == -1) {
+            printError(format("removing corrupted link '%1%'") % linkPath);
+            unlink(linkPath.c_str());
+            goto retry;
+        }
+
+        inodeHash.insert(st.st_ino);
+
+        if (deduped == 0) return;
+
+        printMsg(lvlTalkative, format("deduplicated '%1%' against '%2%'") % path % linkPath);
+
+        uint64_t blocks = (deduped + 511) / 512;
+
+        stats.filesLinked++;
+        stats.bytesFreed += deduped;
+        stats.blocksFreed += blocks;
+
+        if (act)
+            act->result(resFileLinked, deduped, blocks);
+
+        return;
+    }
+
     printMsg(lvlTalkative, format("linking '%1%' to '%2%'") % path % linkPath);
 
     /* Make the containing directory writable, but only if it's not
@@ -251,6 +413,70 @@ void LocalStore::optimisePath_(Activity * act, OptimiseStats & stats,
 }
 
 
+int64_t LocalStore::dedupeFile(const Path & path, const Path & linkPath, size_t size)
+{
+#if __linux__ && defined(FIDEDUPERANGE)
+    AutoCloseFD fdSrc = open(linkPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fdSrc) throw SysError("opening '%s'", linkPath);
+
+    AutoCloseFD fdDst = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (!fdDst) throw SysError("opening '%s'", path);
+
+    /* FIDEDUPERANGE also reports extents that were already shared
+       as deduplicated, so don't count those. */
+    auto alreadyShared = sharedBytes(
+        getExtents(fdDst.get(), size), getExtents(fdSrc.get(), size), size);
+    if (alreadyShared == size) return 0;
+
+    std::vector<unsigned char> buf(sizeof(file_dedupe_range) + sizeof(file_dedupe_range_info));
+    auto range = (file_dedupe_range *) buf.data();
+    auto & info = range->info[0];
+
+    /* Filesystems may cap the amount of data deduplicated per call,
+       so keep going until we've covered the whole file. */
+    uint64_t offset = 0;
+    while (offset < size) {
+        checkInterrupt();
+
+        std::fill(buf.begin(), buf.end(), 0);
+        range->src_offset = offset;
+        range->src_length = size - offset;
+        range->dest_count = 1;
+        info.dest_fd = fdDst.get();
+        info.dest_offset = offset;
+
+        if (ioctl(fdSrc.get(), FIDEDUPERANGE, range) == -1)
+            info.status = -errno;
+
+        if (info.status == FILE_DEDUPE_RANGE_DIFFERS) return -1;
+
+        if (info.status < 0) {
+            auto err = -info.status;
+            if (err == EOPNOTSUPP || err == ENOTTY || err == EINVAL || err == EXDEV) {
+                /* The filesystem doesn't support sharing extents
+                   (or not between these files).  Just disable
+                   deduplication of this file, but only complain
+                   once. */
+                static std::atomic<bool> warned{false};
+                if (!warned.exchange(true))
+                    printError("cannot deduplicate '%s' against '%s': %s", path, linkPath, strerror(err));
+                return offset > alreadyShared ? offset - alreadyShared : 0;
+            }
+            errno = err;
+            throw SysError("deduplicating '%s' against '%s'", path, linkPath);
+        }
+
+        if (info.bytes_deduped == 0) break;
+        offset += info.bytes_deduped;
+    }
+
+    return offset > alreadyShared ? offset - alreadyShared : 0;
+#else
+    throw Error("reflink-based store optimisation is not supported on this platform");
+#endif
+}
+
+
 void LocalStore::optimiseStore(OptimiseStats & stats)
 {
     Activity act(*logger, actOptimiseStore);
@@ -286,8 +512,9 @@ void LocalStore::optimiseStore()
     optimiseStore(stats);
 
     printInfo(
-        format("%1% freed by hard-linking %2% files")
+        format("%1% freed by %2% %3% files")
         % showBytes(stats.bytesFreed)
+        % (optimiseMethod == "reflink" ? "deduplicating" : "hard-linking")
         % stats.filesLinked);
 }
 
@@ -0,0 +1,105 @@
+#pragma once
+
+#include "store-api.hh"
+
+namespace nix {
+
+
+/* The database underlying LocalStore, recording which store paths
+   are valid, their info and references, and the outputs of valid
+   derivations. Implementations are not thread-safe; LocalStore
+   serialises access to them. Changes made outside of a transaction
+   take effect immediately. */
+class PathDB
+{
+public:
+
+    virtual ~PathDB() { }
+
+    struct Txn
+    {
+        /* Roll back the transaction unless it has been committed. */
+        virtual ~Txn() { }
+
+        virtual void commit() = 0;
+    };
+
+    virtual std::unique_ptr<Txn> beginTxn() = 0;
+
+    /* Register 'info', except for its references, which are added
+       by addReference(). */
+    virtual void addPath(const ValidPathInfo & info) = 0;
+
+    virtual void addReference(const Path & referrer, const Path & reference) = 0;
+
+    virtual void addDerivationOutput(const Path & drvPath,
+        const string & id, const Path & outPath) = 0;
+
+    /* Update the NAR hash and size, signatures, and content-address
+       info of a valid path. */
+    virtual void updatePathInfo(const ValidPathInfo & info) = 0;
+
+    /* Make a path invalid, along with its references and outputs.
+       The caller is responsible for checking that it has no
+       referrers. */
+    virtual void invalidatePath(const Path & path) = 0;
+
+    /* Return the info of a path, including its references, or null
+       if it's not valid. */
+    virtual std::shared_ptr<ValidPathInfo> queryPathInfo(const Path & path) = 0;
+
+    virtual bool isValidPath(const Path & path) = 0;
+
+    virtual void queryReferrers(const Path & path, PathSet & referrers) = 0;
+
+    /* Return the valid derivations that have 'path' as an output. */
+    virtual PathSet queryValidDerivers(const Path & path) = 0;
+
+    /* Return the outputs of a valid derivation, indexed by output
+       name. */
+    virtual std::map<string, Path> queryDerivationOutputs(const Path & drvPath) = 0;
+
+    /* Return the valid path with the given hash part, or "". */
+    virtual Path queryPathFromHashPart(const string & hashPart) = 0;
+
+    virtual PathSet queryAllValidPaths() = 0;
+
+    /* Call 'callback' for every valid path that matches 'filter',
+       with its info if 'withInfo' is set. This must not be called
+       inside a transaction, since backends may use transactions of
+       their own to read the paths in batches. 'callback' must not use
+       this object. */
+    virtual void scanValidPaths(const ValidPathFilter & filter, bool withInfo,
+        std::function<void(const Path & path, std::shared_ptr<ValidPathInfo> info)> callback) = 0;
+
+    /* Call 'callback' for every reference between valid paths. */
+    virtual void queryAllReferences(
+        std::function<void(const Path & referrer, const Path & reference)> callback) = 0;
+
+    /* Return a number that changes whenever another process has
+       modified the database, but not when this object has (like
+       SQLite's 'pragma data_version'). */
+    virtual uint64_t dataVersion() = 0;
+
+    /* Return a number that grows as paths are registered and that
+       never decreases, unless the database is re-created or restored
+       from a backup. */
+    virtual uint64_t sequenceNumber() = 0;
+
+    /* Reclaim space used by deleted entries. */
+    virtual void vacuum() = 0;
+};
+
+
+/* Open the SQLite database 'dbPath', creating it if 'schema' is 0 and
+   upgrading it if 'schema' is lower than the current schema
+   version. */
+std::unique_ptr<PathDB> openSQLitePathDB(const Path & dbPath,
+    const Path & storeDir, int schema);
+
+/* Open (or create) a database that consists of an append-only log and
+   a memory-mapped index in the directory 'dir'. */
+std::unique_ptr<PathDB> openLogPathDB(const Path & dir, const Path & storeDir);
+
+
+}
@@ -0,0 +1,395 @@
+#include "peer-store.hh"
+#include "store-api.hh"
+#include "globals.hh"
+#include "sync.hh"
+
+#include <chrono>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+namespace nix {
+
+static std::string uriScheme = "peer://";
+
+static const std::string queryMagic = "nix-peer-query 1";
+static const std::string replyMagic = "nix-peer 1";
+
+
+static struct sockaddr_in parseAddress(const std::string & address)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+
+    auto colon = address.rfind(':');
+    unsigned int port;
+    if (colon == std::string::npos
+        || !string2Int(address.substr(colon + 1), port)
+        || port == 0 || port > 65535
+        || inet_pton(AF_INET, address.substr(0, colon).c_str(), &addr.sin_addr) != 1)
+        throw Error("invalid peer discovery address '%s'; expected an IPv4 address and a port", address);
+    addr.sin_port = htons(port);
+
+    return addr;
+}
+
+
+static bool isMulticast(const struct sockaddr_in & addr)
+{
+    return IN_MULTICAST(ntohl(addr.sin_addr.s_addr));
+}
+
+
+static std::string showAddress(const struct sockaddr_in & addr)
+{
+    char buf[INET_ADDRSTRLEN];
+    if (!inet_ntop(AF_INET, &addr.sin_addr, buf, sizeof(buf)))
+        return "?";
+    return fmt("%s:%d", buf, ntohs(addr.sin_port));
+}
+
+
+/* Wait until 'fd' is readable or 'timeout' milliseconds have
+   passed. */
+static bool waitReadable(int fd, int timeout)
+{
+    struct pollfd pfd;
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    if (poll(&pfd, 1, timeout) == -1) {
+        if (errno == EINTR) return false;
+        throw SysError("polling peer discovery socket");
+    }
+    return pfd.revents & POLLIN;
+}
+
+
+Strings discoverPeers(const std::string & address, unsigned int timeout)
+{
+    auto addr = parseAddress(address);
+
+    AutoCloseFD fd = socket(PF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (!fd) throw SysError("creating peer discovery socket");
+
+    if (isMulticast(addr)) {
+        /* Don't leave the local network. */
+        unsigned char ttl = 1;
+        if (setsockopt(fd.get(), IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) == -1)
+            throw SysError("setting multicast TTL");
+    }
+
+    if (sendto(fd.get(), queryMagic.data(), queryMagic.size(), 0,
+            (struct sockaddr *) &addr, sizeof(addr)) == -1)
+        throw SysError("sending peer discovery query to '%s'", address);
+
+    Strings uris;
+    StringSet seen;
+
+    /* Peers on the local network answer quickly, so once the first
+       reply has arrived, only wait a little longer for the others. */
+    const auto grace = std::chrono::milliseconds(50);
+
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+
+    while (true) {
+        checkInterrupt();
+
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+            deadline - std::chrono::steady_clock::now()).count();
+        if (left <= 0) break;
+
+        if (!waitReadable(fd.get(), left)) continue;
+
+        char buf[65536];
+        struct sockaddr_in from;
+        socklen_t fromLen = sizeof(from);
+        auto n = recvfrom(fd.get(), buf, sizeof(buf), 0, (struct sockaddr *) &from, &fromLen);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            throw SysError("receiving peer discovery reply");
+        }
+
+        auto lines = tokenizeString<Strings>(std::string(buf, n), "\n");
+        if (lines.empty() || lines.front() != replyMagic) continue;
+        lines.pop_front();
+
+        for (auto & uri : lines)
+            if (seen.insert(uri).second) {
+                debug("peer '%s' announced store '%s'", showAddress(from), uri);
+                uris.push_back(uri);
+            }
+
+        deadline = std::min(deadline, std::chrono::steady_clock::now() + grace);
+    }
+
+    return uris;
+}
+
+
+void runPeerAnnouncer(const std::string & address, const Strings & uris)
+{
+    auto addr = parseAddress(address);
+
+    AutoCloseFD fd = socket(PF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if (!fd) throw SysError("creating peer discovery socket");
+
+    int one = 1;
+    if (setsockopt(fd.get(), SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) == -1)
+        throw SysError("setting SO_REUSEADDR");
+
+    auto bindAddr = addr;
+    if (isMulticast(addr))
+        bindAddr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+    if (bind(fd.get(), (struct sockaddr *) &bindAddr, sizeof(bindAddr)) == -1)
+        throw SysError("binding to '%s'", address);
+
+    if (isMulticast(addr)) {
+        struct ip_mreq mreq;
+        mreq.imr_multiaddr = addr.sin_addr;
+        mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+        if (setsockopt(fd.get(), IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) == -1)
+            throw SysError("joining multicast group '%s'", address);
+    }
+
+    std::string reply = replyMagic + "\n";
+    for (auto & uri : uris)
+        reply += uri + "\n";
+
+    printInfo("announcing %d stores on '%s'", uris.size(), address);
+
+    while (true) {
+        checkInterrupt();
+
+        if (!waitReadable(fd.get(), 1000)) continue;
+
+        char buf[1024];
+        struct sockaddr_in from;
+        socklen_t fromLen = sizeof(from);
+        auto n = recvfrom(fd.get(), buf, sizeof(buf), 0, (struct sockaddr *) &from, &fromLen);
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            throw SysError("receiving peer discovery query");
+        }
+
+        if (std::string(buf, n) != queryMagic) continue;
+
+        debug("answering peer discovery query from '%s'", showAddress(from));
+
+        if (sendto(fd.get(), reply.data(), reply.size(), 0,
+                (struct sockaddr *) &from, fromLen) == -1)
+            printError("warning: cannot reply to '%s': %s", showAddress(from), strerror(errno));
+    }
+}
+
+
+/* Whether 'uri' is an announced store URI that we're willing to
+   open. Anybody on the network can answer discovery queries, so only
+   accept HTTP binary caches, and no query string, since that would
+   let the announcer set arbitrary store parameters (such as where to
+   write files). */
+static bool isSafePeerUri(const std::string & uri)
+{
+    if (!hasPrefix(uri, "http://") && !hasPrefix(uri, "https://"))
+        return false;
+    for (auto c : uri)
+        if (c == '?' || c == '#' || (unsigned char) c <= ' ' || c == 0x7f)
+            return false;
+    return true;
+}
+
+
+/* A substituter that forwards queries to the stores of nearby
+   machines, as configured in the 'peers' option or discovered on the
+   local network. Paths obtained from peers are subject to the usual
+   signature checks, so peers need not be trusted. */
+struct PeerStore : public Store
+{
+    const Setting<int> priority{this, 10, "priority", "priority of this substituter (lower value means higher priority)"};
+
+    struct State
+    {
+        bool initialised = false;
+        std::list<ref<Store>> peers;
+    };
+
+    Sync<State> _state;
+
+    PeerStore(const Params & params)
+        : Store(params)
+    {
+    }
+
+    std::string getUri() override
+    {
+        return uriScheme;
+    }
+
+    int getPriority() override
+    {
+        return priority;
+    }
+
+    std::list<ref<Store>> getPeers()
+    {
+        auto state(_state.lock());
+
+        if (!state->initialised) {
+            state->initialised = true;
+
+            StringSet done;
+
+            auto addPeer = [&](const std::string & uri) {
+                if (hasPrefix(uri, uriScheme) || !done.insert(uri).second) return;
+                /* Peers come and go, so don't spend long retrying
+                   one that has become unreachable. */
+                Params params;
+                if (hasPrefix(uri, "http://") || hasPrefix(uri, "https://"))
+                    params["download-tries"] = "1";
+                try {
+                    state->peers.push_back(openStore(uri, params));
+                    debug("using peer store '%s'", uri);
+                } catch (Error & e) {
+                    printError("warning: cannot open peer store '%s': %s", uri, e.what());
+                }
+            };
+
+            for (auto & uri : settings.peers.get())
+                addPeer(uri);
+
+            if (settings.peerDiscoveryAddress.get() != "") {
+                try {
+                    for (auto & uri : discoverPeers(settings.peerDiscoveryAddress, settings.peerDiscoveryTimeout)) {
+                        if (isSafePeerUri(uri))
+                            addPeer(uri);
+                        else
+                            printError("warning: ignoring announced peer store '%s'", uri);
+                    }
+                } catch (Error & e) {
+                    printError("warning: peer discovery failed: %s", e.what());
+                }
+            }
+        }
+
+        return state->peers;
+    }
+
+    /* Stop using a peer that failed, so that we don't keep waiting
+       for a machine that has gone away. */
+    void dropPeer(const ref<Store> & peer, const Error & e)
+    {
+        printError("warning: disabling peer store '%s': %s", peer->getUri(), e.what());
+        auto state(_state.lock());
+        state->peers.remove_if([&](const ref<Store> & p) { return &*p == &*peer; });
+    }
+
+    void queryPathInfoUncached(const Path & path,
+        std::function<void(std::shared_ptr<ValidPathInfo>)> success,
+        std::function<void(std::exception_ptr exc)> failure) override
+    {
+        sync2async<std::shared_ptr<ValidPathInfo>>(success, failure, [&]() -> std::shared_ptr<ValidPathInfo> {
+            for (auto & peer : getPeers()) {
+                try {
+                    auto info = peer->queryPathInfo(path);
+                    debug("peer store '%s' has '%s'", peer->getUri(), path);
+                    return std::make_shared<ValidPathInfo>(*info);
+                } catch (InvalidPath &) {
+                } catch (Error & e) {
+                    dropPeer(peer, e);
+                }
+            }
+            return nullptr;
+        });
+    }
+
+    void narFromPath(const Path & path, Sink & sink) override
+    {
+        for (auto & peer : getPeers()) {
+            try {
+                if (!peer->isValidPath(path)) continue;
+            } catch (Error & e) {
+                dropPeer(peer, e);
+                continue;
+            }
+            /* Once data has been written to the sink, we can't switch
+               to another peer; the substitution goal will fall back
+               to the next substituter instead. */
+            peer->narFromPath(path, sink);
+            return;
+        }
+        throw InvalidPath("path '%s' is not available from any peer", path);
+    }
+
+    PathSet queryAllValidPaths() override { unsupported(); }
+
+    void queryReferrers(const Path & path, PathSet & referrers) override
+    { unsupported(); }
+
+    PathSet queryDerivationOutputs(const Path & path) override
+    { unsupported(); }
+
+    StringSet queryDerivationOutputNames(const Path & path) override
+    { unsupported(); }
+
+    Path queryPathFromHashPart(const string & hashPart) override
+    { unsupported(); }
+
+    void addToStore(const ValidPathInfo & info, Source & narSource,
+        RepairFlag repair, CheckSigsFlag checkSigs,
+        std::shared_ptr<FSAccessor> accessor) override
+    { unsupported(); }
+
+    Path addToStore(const string & name, const Path & srcPath,
+        bool recursive, HashType hashAlgo,
+        PathFilter & filter, RepairFlag repair) override
+    { unsupported(); }
+
+    Path addTextToStore(const string & name, const string & s,
+        const PathSet & references, RepairFlag repair) override
+    { unsupported(); }
+
+    BuildResult buildDerivation(const Path & drvPath, const BasicDerivation & drv,
+        BuildMode buildMode) override
+    { unsupported(); }
+
+    void ensurePath(const Path & path) override
+    { unsupported(); }
+
+    void addTempRoot(const Path & path) override
+    { unsupported(); }
+
+    void addIndirectRoot(const Path & path) override
+    { unsupported(); }
+
+    Roots findRoots() override
+    { unsupported(); }
+
+    void collectGarbage(const GCOptions & options, GCResults & results) override
+    { unsupported(); }
+
+    ref<FSAccessor> getFSAccessor() override
+    { unsupported(); }
+
+    void addSignatures(const Path & storePath, const StringSet & sigs) override
+    { unsupported(); }
+
+    void connect() override
+    {
+        getPeers();
+    }
+};
+
+static RegisterStoreImplementation regStore([](
+    const std::string & uri, const Store::Params & params)
+    -> std::shared_ptr<Store>
+{
+    if (uri != uriScheme) return 0;
+    return std::make_shared<PeerStore>(params);
+});
+
+}
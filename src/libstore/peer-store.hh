@@ -0,0 +1,24 @@
+#pragma once
+
+#include "types.hh"
+
+namespace nix {
+
+/* Peer discovery lets machines on the same network find each other's
+   stores, so that they can substitute from each other rather than
+   from an upstream binary cache. A machine that wants to share its
+   store runs an announcer, which answers UDP queries sent to a
+   (typically multicast) address with the URIs of the stores it
+   serves (e.g. an HTTP binary cache). The peer:// substituter sends
+   such a query and uses whatever stores reply. */
+
+/* Send a discovery query to 'address' (of the form 'ip:port') and
+   return the store URIs announced in the replies received within
+   'timeout' milliseconds. */
+Strings discoverPeers(const std::string & address, unsigned int timeout);
+
+/* Answer discovery queries sent to 'address' with 'uris'. Does not
+   return unless interrupted. */
+void runPeerAnnouncer(const std::string & address, const Strings & uris);
+
+}
@@ -0,0 +1,128 @@
+#include "referrers-index.hh"
+#include "store-api.hh"
+
+#include <algorithm>
+
+namespace nix {
+
+
+void ReferrersIndex::insertSorted(std::vector<uint32_t> & v, uint32_t id)
+{
+    auto i = std::lower_bound(v.begin(), v.end(), id);
+    if (i == v.end() || *i != id) v.insert(i, id);
+}
+
+
+void ReferrersIndex::eraseSorted(std::vector<uint32_t> & v, uint32_t id)
+{
+    auto i = std::lower_bound(v.begin(), v.end(), id);
+    if (i != v.end() && *i == id) v.erase(i);
+}
+
+
+uint32_t ReferrersIndex::intern(const Path & path)
+{
+    auto hashPart = storePathToHash(path);
+
+    auto i = ids.find(hashPart);
+    if (i != ids.end()) return i->second;
+
+    uint32_t id;
+    if (!freeIds.empty()) {
+        id = freeIds.back();
+        freeIds.pop_back();
+    } else {
+        id = nodes.size();
+        nodes.emplace_back();
+    }
+
+    nodes[id].path = path;
+    ids.emplace(hashPart, id);
+    return id;
+}
+
+
+void ReferrersIndex::addPath(const Path & path, const PathSet & references)
+{
+    intern(path);
+    for (auto & ref : references)
+        addReference(path, ref);
+}
+
+
+void ReferrersIndex::addReference(const Path & referrer, const Path & reference)
+{
+    auto id = intern(referrer);
+    auto refId = intern(reference);
+    insertSorted(nodes[id].references, refId);
+    insertSorted(nodes[refId].referrers, id);
+}
+
+
+void ReferrersIndex::removePath(const Path & path)
+{
+    auto i = ids.find(storePathToHash(path));
+    if (i == ids.end()) return;
+    auto id = i->second;
+    ids.erase(i);
+
+    auto & node(nodes[id]);
+
+    for (auto ref : node.references)
+        if (ref != id) eraseSorted(nodes[ref].referrers, id);
+
+    /* A path can only become invalid when it has no referrers other
+       than itself, but don't leave dangling ids if it does. */
+    for (auto referrer : node.referrers)
+        if (referrer != id) eraseSorted(nodes[referrer].references, id);
+
+    node = Node();
+    freeIds.push_back(id);
+}
+
+
+bool ReferrersIndex::isValidPath(const Path & path)
+{
+    auto i = ids.find(storePathToHash(path));
+    return i != ids.end() && nodes[i->second].path == path;
+}
+
+
+void ReferrersIndex::queryReferrers(const Path & path, PathSet & referrers)
+{
+    if (!isValidPath(path)) return;
+    for (auto referrer : nodes[ids[storePathToHash(path)]].referrers)
+        referrers.insert(nodes[referrer].path);
+}
+
+
+void ReferrersIndex::queryReferrersClosure(const PathSet & paths, PathSet & out)
+{
+    std::vector<bool> visited(nodes.size(), false);
+    std::vector<uint32_t> todo;
+
+    /* Like Store::computeFSClosure(), don't explore paths that are
+       already in 'out'. */
+    auto enqueue = [&](uint32_t id) {
+        if (visited[id]) return;
+        visited[id] = true;
+        if (out.insert(nodes[id].path).second)
+            todo.push_back(id);
+    };
+
+    for (auto & path : paths) {
+        if (!isValidPath(path))
+            throw InvalidPath("path '%s' is not valid", path);
+        enqueue(ids[storePathToHash(path)]);
+    }
+
+    while (!todo.empty()) {
+        auto id = todo.back();
+        todo.pop_back();
+        for (auto referrer : nodes[id].referrers)
+            enqueue(referrer);
+    }
+}
+
+
+}
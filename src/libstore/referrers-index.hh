@@ -0,0 +1,63 @@
+#pragma once
+
+#include "types.hh"
+
+#include <unordered_map>
+
+namespace nix {
+
+/* An in-memory copy of the references between valid paths, for
+   answering referrer and referrer closure queries without going to
+   the database. Paths are interned as 32-bit ids, and every path has
+   sorted vectors of the ids of its references and referrers. Not
+   thread-safe. */
+class ReferrersIndex
+{
+public:
+
+    /* Record that 'path' is valid and has 'references', which must
+       be valid. References of a path that is already in the index
+       are added to the existing ones. */
+    void addPath(const Path & path, const PathSet & references);
+
+    /* Record that 'referrer' (which need not have been added yet)
+       refers to 'reference'. */
+    void addReference(const Path & referrer, const Path & reference);
+
+    /* Remove a path and its references. */
+    void removePath(const Path & path);
+
+    bool isValidPath(const Path & path);
+
+    void queryReferrers(const Path & path, PathSet & referrers);
+
+    /* Add the closure of 'paths' under the referrers relation to
+       'out'. Throws InvalidPath if a path in 'paths' is not
+       valid. */
+    void queryReferrersClosure(const PathSet & paths, PathSet & out);
+
+    size_t size() { return ids.size(); }
+
+private:
+
+    struct Node
+    {
+        Path path;
+        std::vector<uint32_t> references, referrers;
+    };
+
+    std::vector<Node> nodes;
+
+    /* Ids indexed by the hash part of the path. */
+    std::unordered_map<std::string, uint32_t> ids;
+
+    std::vector<uint32_t> freeIds;
+
+    uint32_t intern(const Path & path);
+
+    static void insertSorted(std::vector<uint32_t> & v, uint32_t id);
+
+    static void eraseSorted(std::vector<uint32_t> & v, uint32_t id);
+};
+
+}
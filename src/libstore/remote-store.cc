@@ -7,6 +7,8 @@
 #include "globals.hh"
 #include "derivations.hh"
 #include "pool.hh"
+#include "multiplexer.hh"
+#include "shared-path-info-cache.hh"
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -62,7 +64,7 @@ ref<RemoteStore::Connection> RemoteStore::openConnectionWrapper()
     if (failed)
         throw Error("opening a connection to remote store '%s' previously failed", getUri());
     try {
-        return openConnection();
+        return multiplex ? openChannel() : openConnection();
     } catch (...) {
         failed = true;
         throw;
@@ -70,11 +72,67 @@ ref<RemoteStore::Connection> RemoteStore::openConnectionWrapper()
 }
 
 
+struct RemoteStore::Multiplexed
+{
+    ref<Connection> conn;
+    Multiplexer mux;
+
+    Multiplexed(ref<Connection> conn)
+        : conn(conn), mux(conn->from.fd, conn->to.fd)
+    { }
+};
+
+
+struct RemoteStore::Channel : RemoteStore::Connection
+{
+    AutoCloseFD fd;
+};
+
+
+ref<RemoteStore::Connection> RemoteStore::openChannel()
+{
+    auto multiplexed(multiplexed_.lock());
+
+    if (!*multiplexed || !(*multiplexed)->mux.isOpen()) {
+        auto conn = openConnection();
+
+        /* Older daemons can't multiplex, so use the connection
+           directly. */
+        if (GET_PROTOCOL_MINOR(conn->daemonVersion) < 21)
+            return conn;
+
+        conn->to << wopMultiplex;
+        conn->processStderr();
+
+        *multiplexed = std::make_shared<Multiplexed>(conn);
+    }
+
+    auto conn = make_ref<Channel>();
+    conn->fd = (*multiplexed)->mux.openChannel();
+    conn->from.fd = conn->fd.get();
+    conn->to.fd = conn->fd.get();
+    conn->daemonVersion = (*multiplexed)->conn->daemonVersion;
+    conn->startTime = std::chrono::steady_clock::now();
+
+    return conn;
+}
+
+
 UDSRemoteStore::UDSRemoteStore(const Params & params)
     : Store(params)
     , LocalFSStore(params)
     , RemoteStore(params)
 {
+    /* Path info of a daemon on this machine can be read from its
+       shared cache without asking it. */
+    Path dbDir = stateDir + "/db";
+    if (pathExists(dbDir + "/path-info-cache")) {
+        try {
+            sharedCache = std::make_shared<SharedPathInfoCache>(dbDir, false);
+        } catch (Error & e) {
+            debug("not using path info cache: %s", e.what());
+        }
+    }
 }
 
 
@@ -199,6 +257,10 @@ void RemoteStore::setOptions(Connection & conn)
 
 bool RemoteStore::isValidPathUncached(const Path & path)
 {
+    if (sharedCache) {
+        auto info = sharedCache->lookup(storePathToHash(path));
+        if (info && info->path == path) return true;
+    }
     auto conn(connections->get());
     conn->to << wopIsValidPath << path;
     conn->processStderr();
@@ -292,11 +354,70 @@ void RemoteStore::querySubstitutablePathInfos(const PathSet & paths,
 }
 
 
+/* Read the fields of a ValidPathInfo after its path, as sent in reply
+   to wopQueryPathInfo and wopQueryPathInfos. */
+static void readPathInfo(Store & store, Source & from, unsigned int daemonVersion,
+    ValidPathInfo & info)
+{
+    info.deriver = readString(from);
+    if (info.deriver != "") store.assertStorePath(info.deriver);
+    info.narHash = Hash(readString(from), htSHA256);
+    info.references = readStorePaths<PathSet>(store, from);
+    from >> info.registrationTime >> info.narSize;
+    if (GET_PROTOCOL_MINOR(daemonVersion) >= 16) {
+        from >> info.ultimate;
+        info.sigs = readStrings<StringSet>(from);
+        from >> info.ca;
+    }
+}
+
+
+void RemoteStore::scanValidPaths(const ValidPathFilter & filter, bool withInfo,
+    std::function<void(const Path & path, std::shared_ptr<const ValidPathInfo> info)> callback)
+{
+    /* Use a connection outside of the pool, so that 'callback' can
+       use this store while the reply is being streamed. It isn't a
+       multiplexed channel either, since unread data on a channel
+       stalls the others. */
+    auto conn = openConnection();
+
+    if (GET_PROTOCOL_MINOR(conn->daemonVersion) < 23) {
+        Store::scanValidPaths(filter, withInfo, callback);
+        return;
+    }
+
+    conn->to << wopScanValidPaths << filter.hashPrefix << filter.namePrefix << withInfo;
+    conn->processStderr();
+
+    /* The reply is a sequence of paths, each preceded by 1 and
+       terminated by 0, or by 2 and an error message if the daemon
+       failed half-way. */
+    while (true) {
+        auto tag = readNum<unsigned int>(conn->from);
+        if (tag == 0) break;
+        if (tag == 2) throw Error(readString(conn->from));
+        if (tag != 1) throw Error("unexpected reply to wopScanValidPaths");
+        auto path = readStorePath(*this, conn->from);
+        std::shared_ptr<ValidPathInfo> info;
+        if (withInfo) {
+            info = std::make_shared<ValidPathInfo>();
+            info->path = path;
+            readPathInfo(*this, conn->from, conn->daemonVersion, *info);
+        }
+        callback(path, info);
+    }
+}
+
+
 void RemoteStore::queryPathInfoUncached(const Path & path,
     std::function<void(std::shared_ptr<ValidPathInfo>)> success,
     std::function<void(std::exception_ptr exc)> failure)
 {
     sync2async<std::shared_ptr<ValidPathInfo>>(success, failure, [&]() {
+        if (sharedCache) {
+            auto info = sharedCache->lookup(storePathToHash(path));
+            if (info && info->path == path) return info;
+        }
         auto conn(connections->get());
         conn->to << wopQueryPathInfo << path;
         try {
@@ -313,21 +434,52 @@ void RemoteStore::queryPathInfoUncached(const Path & path,
         }
         auto info = std::make_shared<ValidPathInfo>();
         info->path = path;
-        info->deriver = readString(conn->from);
-        if (info->deriver != "") assertStorePath(info->deriver);
-        info->narHash = Hash(readString(conn->from), htSHA256);
-        info->references = readStorePaths<PathSet>(*this, conn->from);
-        conn->from >> info->registrationTime >> info->narSize;
-        if (GET_PROTOCOL_MINOR(conn->daemonVersion) >= 16) {
-            conn->from >> info->ultimate;
-            info->sigs = readStrings<StringSet>(conn->from);
-            conn->from >> info->ca;
-        }
+        readPathInfo(*this, conn->from, conn->daemonVersion, *info);
         return info;
     });
 }
 
 
+std::map<Path, std::shared_ptr<ValidPathInfo>> RemoteStore::queryPathInfosUncached(const PathSet & paths_)
+{
+    std::map<Path, std::shared_ptr<ValidPathInfo>> infos;
+    PathSet paths;
+
+    for (auto & path : paths_) {
+        auto info = sharedCache ? sharedCache->lookup(storePathToHash(path)) : nullptr;
+        if (info && info->path == path)
+            infos[path] = info;
+        else
+            paths.insert(path);
+    }
+
+    if (paths.empty()) return infos;
+
+    {
+        auto conn(connections->get());
+        if (GET_PROTOCOL_MINOR(conn->daemonVersion) >= 22) {
+            conn->to << wopQueryPathInfos << paths;
+            conn->processStderr();
+            for (auto & path : paths)
+                infos[path] = nullptr;
+            size_t count = readNum<size_t>(conn->from);
+            while (count--) {
+                auto info = std::make_shared<ValidPathInfo>();
+                info->path = readStorePath(*this, conn->from);
+                readPathInfo(*this, conn->from, conn->daemonVersion, *info);
+                infos[info->path] = info;
+            }
+            return infos;
+        }
+    }
+
+    /* Older daemons only have the single-path operations. */
+    for (auto & i : Store::queryPathInfosUncached(paths))
+        infos[i.first] = i.second;
+    return infos;
+}
+
+
 void RemoteStore::queryReferrers(const Path & path,
     PathSet & referrers)
 {
@@ -339,6 +491,35 @@ void RemoteStore::queryReferrers(const Path & path,
 }
 
 
+/* Read the reply to wopQueryMultipleReferrers and
+   wopQueryMultipleDerivationOutputs. */
+static std::map<Path, PathSet> readPathSetMap(Store & store, Source & from)
+{
+    std::map<Path, PathSet> res;
+    size_t count = readNum<size_t>(from);
+    while (count--) {
+        auto path = readStorePath(store, from);
+        res[path] = readStorePaths<PathSet>(store, from);
+    }
+    return res;
+}
+
+
+std::map<Path, PathSet> RemoteStore::queryMultipleReferrers(const PathSet & paths)
+{
+    {
+        auto conn(connections->get());
+        if (GET_PROTOCOL_MINOR(conn->daemonVersion) >= 22) {
+            conn->to << wopQueryMultipleReferrers << paths;
+            conn->processStderr();
+            return readPathSetMap(*this, conn->from);
+        }
+    }
+
+    return Store::queryMultipleReferrers(paths);
+}
+
+
 PathSet RemoteStore::queryValidDerivers(const Path & path)
 {
     auto conn(connections->get());
@@ -357,6 +538,21 @@ PathSet RemoteStore::queryDerivationOutputs(const Path & path)
 }
 
 
+std::map<Path, PathSet> RemoteStore::queryMultipleDerivationOutputs(const PathSet & paths)
+{
+    {
+        auto conn(connections->get());
+        if (GET_PROTOCOL_MINOR(conn->daemonVersion) >= 22) {
+            conn->to << wopQueryMultipleDerivationOutputs << paths;
+            conn->processStderr();
+            return readPathSetMap(*this, conn->from);
+        }
+    }
+
+    return Store::queryMultipleDerivationOutputs(paths);
+}
+
+
 PathSet RemoteStore::queryDerivationOutputNames(const Path & path)
 {
     auto conn(connections->get());
@@ -377,6 +573,27 @@ Path RemoteStore::queryPathFromHashPart(const string & hashPart)
 }
 
 
+std::map<string, Path> RemoteStore::queryPathsFromHashParts(const StringSet & hashParts)
+{
+    {
+        auto conn(connections->get());
+        if (GET_PROTOCOL_MINOR(conn->daemonVersion) >= 22) {
+            conn->to << wopQueryPathsFromHashParts << hashParts;
+            conn->processStderr();
+            std::map<string, Path> res;
+            size_t count = readNum<size_t>(conn->from);
+            while (count--) {
+                auto hashPart = readString(conn->from);
+                res[hashPart] = readStorePath(*this, conn->from);
+            }
+            return res;
+        }
+    }
+
+    return Store::queryPathsFromHashParts(hashParts);
+}
+
+
 void RemoteStore::addToStore(const ValidPathInfo & info, Source & source,
     RepairFlag repair, CheckSigsFlag checkSigs, std::shared_ptr<FSAccessor> accessor)
 {
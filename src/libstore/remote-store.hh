@@ -13,6 +13,7 @@ class Pipe;
 class Pid;
 struct FdSink;
 struct FdSource;
+class SharedPathInfoCache;
 template<typename T> class Pool;
 
 
@@ -28,6 +29,9 @@ public:
     const Setting<unsigned int> maxConnectionAge{(Store*) this, std::numeric_limits<unsigned int>::max(),
             "max-connection-age", "number of seconds to reuse a connection"};
 
+    const Setting<bool> multiplex{(Store*) this, false,
+            "multiplex", "whether to run concurrent operations over a single connection to the Nix daemon"};
+
     RemoteStore(const Params & params);
 
     /* Implementations of abstract store API methods. */
@@ -39,20 +43,31 @@ public:
 
     PathSet queryAllValidPaths() override;
 
+    void scanValidPaths(const ValidPathFilter & filter, bool withInfo,
+        std::function<void(const Path & path, std::shared_ptr<const ValidPathInfo> info)> callback) override;
+
     void queryPathInfoUncached(const Path & path,
         std::function<void(std::shared_ptr<ValidPathInfo>)> success,
         std::function<void(std::exception_ptr exc)> failure) override;
 
+    std::map<Path, std::shared_ptr<ValidPathInfo>> queryPathInfosUncached(const PathSet & paths) override;
+
     void queryReferrers(const Path & path, PathSet & referrers) override;
 
+    std::map<Path, PathSet> queryMultipleReferrers(const PathSet & paths) override;
+
     PathSet queryValidDerivers(const Path & path) override;
 
     PathSet queryDerivationOutputs(const Path & path) override;
 
+    std::map<Path, PathSet> queryMultipleDerivationOutputs(const PathSet & paths) override;
+
     StringSet queryDerivationOutputNames(const Path & path) override;
 
     Path queryPathFromHashPart(const string & hashPart) override;
 
+    std::map<string, Path> queryPathsFromHashParts(const StringSet & hashParts) override;
+
     PathSet querySubstitutablePaths(const PathSet & paths) override;
 
     void querySubstitutablePathInfos(const PathSet & paths,
@@ -116,6 +131,18 @@ protected:
 
     ref<Connection> openConnectionWrapper();
 
+    /* If 'multiplex' is enabled, the connections in the pool are
+       channels of a single multiplexed connection. */
+    struct Multiplexed;
+    struct Channel;
+
+    Sync<std::shared_ptr<Multiplexed>> multiplexed_;
+
+    ref<Connection> openChannel();
+
+    /* The daemon's shared path info cache, if we can read it. */
+    std::shared_ptr<SharedPathInfoCache> sharedCache;
+
     virtual ref<Connection> openConnection() = 0;
 
     void initConnection(Connection & conn);
@@ -15,6 +15,8 @@
 #include <aws/core/auth/AWSCredentialsProviderChain.h>
 #include <aws/core/client/ClientConfiguration.h>
 #include <aws/core/client/DefaultRetryStrategy.h>
+#include <aws/core/http/HttpResponse.h>
+#include <aws/core/http/Scheme.h>
 #include <aws/core/utils/logging/FormattedLogSystem.h>
 #include <aws/core/utils/logging/LogMacros.h>
 #include <aws/core/utils/threading/Executor.h>
@@ -27,6 +29,8 @@
 #include <aws/s3/model/PutObjectRequest.h>
 #include <aws/transfer/TransferManager.h>
 
+#include <deque>
+
 using namespace Aws::Transfer;
 
 namespace nix {
@@ -34,8 +38,9 @@ namespace nix {
 struct S3Error : public Error
 {
     Aws::S3::S3Errors err;
-    S3Error(Aws::S3::S3Errors err, const FormatOrString & fs)
-        : Error(fs), err(err) { };
+    Aws::Http::HttpResponseCode responseCode;
+    S3Error(Aws::S3::S3Errors err, Aws::Http::HttpResponseCode responseCode, const FormatOrString & fs)
+        : Error(fs), err(err), responseCode(responseCode) { };
 };
 
 /* Helper: given an Outcome<R, E>, return R in case of success, or
@@ -46,6 +51,7 @@ R && checkAws(const FormatOrString & fs, Aws::Utils::Outcome<R, E> && outcome)
     if (!outcome.IsSuccess())
         throw S3Error(
             outcome.GetError().GetErrorType(),
+            outcome.GetError().GetResponseCode(),
             fs.s + ": " + outcome.GetError().GetMessage());
     return outcome.GetResultWithOwnership();
 }
@@ -84,8 +90,9 @@ static void initAWS()
     });
 }
 
-S3Helper::S3Helper(const std::string & profile, const std::string & region)
-    : config(makeConfig(region))
+S3Helper::S3Helper(const std::string & profile, const std::string & region,
+    const std::string & scheme, const std::string & endpoint)
+    : config(makeConfig(region, scheme, endpoint))
     , client(make_ref<Aws::S3::S3Client>(
             profile == ""
             ? std::dynamic_pointer_cast<Aws::Auth::AWSCredentialsProvider>(
@@ -116,11 +123,16 @@ class RetryStrategy : public Aws::Client::DefaultRetryStrategy
     }
 };
 
-ref<Aws::Client::ClientConfiguration> S3Helper::makeConfig(const string & region)
+ref<Aws::Client::ClientConfiguration> S3Helper::makeConfig(const string & region,
+    const string & scheme, const string & endpoint)
 {
     initAWS();
     auto res = make_ref<Aws::Client::ClientConfiguration>();
     res->region = region;
+    if (!scheme.empty())
+        res->scheme = Aws::Http::SchemeMapper::FromString(scheme.c_str());
+    if (!endpoint.empty())
+        res->endpointOverride = endpoint;
     res->requestTimeoutMs = 600 * 1000;
     res->retryStrategy = std::make_shared<RetryStrategy>();
     res->caFile = settings.caFile;
@@ -173,8 +185,17 @@ struct S3BinaryCacheStoreImpl : public S3BinaryCacheStore
     const Setting<std::string> narinfoCompression{this, "", "narinfo-compression", "compression method for .narinfo files"};
     const Setting<std::string> lsCompression{this, "", "ls-compression", "compression method for .ls files"};
     const Setting<std::string> logCompression{this, "", "log-compression", "compression method for log/* files"};
+    const Setting<std::string> scheme{this, "", "scheme", "The scheme to use for S3 requests, https by default."};
+    const Setting<std::string> endpoint{this, "", "endpoint", "An optional override of the endpoint to use when talking to S3."};
     const Setting<uint64_t> bufferSize{
         this, 5 * 1024 * 1024, "buffer-size", "size (in bytes) of each part in multi-part uploads"};
+    const Setting<unsigned int> uploadConcurrency{
+        this, 8, "multipart-upload-concurrency", "number of parts of a multi-part upload to send in parallel"};
+    const Setting<uint64_t> downloadPartSize{
+        this, 8 * 1024 * 1024, "download-part-size",
+        "size (in bytes) of the ranges in which large objects are downloaded in parallel (0 to disable)"};
+    const Setting<unsigned int> downloadConcurrency{
+        this, 8, "download-concurrency", "number of ranges of an object to download in parallel"};
 
     std::string bucketName;
 
@@ -182,11 +203,15 @@ struct S3BinaryCacheStoreImpl : public S3BinaryCacheStore
 
     S3Helper s3Helper;
 
+    std::shared_ptr<Aws::Utils::Threading::PooledThreadExecutor> executor;
+
     S3BinaryCacheStoreImpl(
         const Params & params, const std::string & bucketName)
         : S3BinaryCacheStore(params)
         , bucketName(bucketName)
-        , s3Helper(profile, region)
+        , s3Helper(profile, region, scheme, endpoint)
+        , executor(std::make_shared<Aws::Utils::Threading::PooledThreadExecutor>(
+                std::max(1u, uploadConcurrency.get())))
     {
         diskCache = getNarInfoDiskCache();
     }
@@ -198,7 +223,10 @@ struct S3BinaryCacheStoreImpl : public S3BinaryCacheStore
 
     void init() override
     {
-        if (!diskCache->cacheExists(getUri(), wantMassQuery_, priority)) {
+        StringMap extraInfo;
+        if (diskCache->cacheExists(getUri(), wantMassQuery_, priority, extraInfo))
+            setExtraCacheInfo(extraInfo);
+        else {
 
             /* Create the bucket if it doesn't already exists. */
             // FIXME: HeadBucket would be more appropriate, but doesn't return
@@ -228,7 +256,7 @@ struct S3BinaryCacheStoreImpl : public S3BinaryCacheStore
 
             BinaryCacheStore::init();
 
-            diskCache->createCache(getUri(), storeDir, wantMassQuery_, priority);
+            diskCache->createCache(getUri(), storeDir, wantMassQuery_, priority, getExtraCacheInfo());
         }
     }
 
@@ -273,25 +301,30 @@ struct S3BinaryCacheStoreImpl : public S3BinaryCacheStore
         return true;
     }
 
-    void uploadFile(const std::string & path, const std::string & data,
+    void uploadFile(const std::string & path,
+        std::shared_ptr<std::basic_iostream<char>> stream,
         const std::string & mimeType,
         const std::string & contentEncoding)
     {
-        auto stream = std::make_shared<istringstream_nocopy>(data);
-
-        auto maxThreads = std::thread::hardware_concurrency();
-
-        static std::shared_ptr<Aws::Utils::Threading::PooledThreadExecutor>
-            executor = std::make_shared<Aws::Utils::Threading::PooledThreadExecutor>(maxThreads);
-
         TransferManagerConfiguration transferConfig(executor.get());
 
         transferConfig.s3Client = s3Helper.client;
         transferConfig.bufferSize = bufferSize;
 
-        if (contentEncoding != "")
+        /* The transfer manager only has as many parts in flight as fit
+           in its buffer heap, so size the heap for the desired
+           concurrency. */
+        transferConfig.transferBufferMaxHeapSize =
+            bufferSize * std::max(1u, uploadConcurrency.get());
+
+        /* Small files are sent with a single PutObject rather than a
+           multi-part upload, so set the encoding on both templates. */
+        if (contentEncoding != "") {
             transferConfig.createMultipartUploadTemplate.SetContentEncoding(
                 contentEncoding);
+            transferConfig.putObjectTemplate.SetContentEncoding(
+                contentEncoding);
+        }
 
         transferConfig.uploadProgressCallback =
             [&](const TransferManager *transferManager,
@@ -313,7 +346,7 @@ struct S3BinaryCacheStoreImpl : public S3BinaryCacheStore
                   case TransferStatus::COMPLETED:
                       printTalkative("upload of '%s' completed", path);
                       stats.put++;
-                      stats.putBytes += data.size();
+                      stats.putBytes += transferHandle->GetBytesTotalSize();
                       break;
                   case TransferStatus::IN_PROGRESS:
                       break;
@@ -346,11 +379,18 @@ struct S3BinaryCacheStoreImpl : public S3BinaryCacheStore
                 .count();
 
         printInfo(format("uploaded 's3://%1%/%2%' (%3% bytes) in %4% ms") %
-                  bucketName % path % data.size() % duration);
+                  bucketName % path % transferHandle->GetBytesTotalSize() % duration);
 
         stats.putTimeMs += duration;
     }
 
+    void uploadFile(const std::string & path, const std::string & data,
+        const std::string & mimeType,
+        const std::string & contentEncoding)
+    {
+        uploadFile(path, std::make_shared<istringstream_nocopy>(data), mimeType, contentEncoding);
+    }
+
     void upsertFile(const std::string & path, const std::string & data,
         const std::string & mimeType) override
     {
@@ -364,6 +404,228 @@ struct S3BinaryCacheStoreImpl : public S3BinaryCacheStore
             uploadFile(path, data, mimeType, "");
     }
 
+    void upsertFile(const std::string & path,
+        std::shared_ptr<std::basic_iostream<char>> istream,
+        const std::string & mimeType) override
+    {
+        /* Large files (i.e. NARs) are passed to the transfer manager
+           as-is, which does a multi-part upload straight from the
+           stream. */
+        uploadFile(path, istream, mimeType, "");
+    }
+
+    Aws::S3::Model::GetObjectRequest makeRangeRequest(
+        const std::string & path, uint64_t start, uint64_t size)
+    {
+        auto request =
+            Aws::S3::Model::GetObjectRequest()
+            .WithBucket(bucketName)
+            .WithKey(path)
+            .WithRange(fmt("bytes=%d-%d", start, start + size - 1));
+
+        request.SetResponseStreamFactory([]() {
+            return Aws::New<std::stringstream>("STRINGSTREAM");
+        });
+
+        return request;
+    }
+
+    void getFile(const std::string & path, Sink & sink) override
+    {
+        if (downloadPartSize.get() == 0) {
+            getFileStreaming(path, sink);
+            return;
+        }
+
+        stats.get++;
+
+        debug("fetching 's3://%s/%s' in ranges of %d bytes...", bucketName, path, downloadPartSize.get());
+
+        auto now1 = std::chrono::steady_clock::now();
+
+        /* Fetch the first range. Its Content-Range tells us the size
+           of the object, so small objects need only one request. */
+        uint64_t partSize = downloadPartSize;
+        uint64_t totalSize, written = 0;
+        std::string etag;
+
+        {
+            auto request = makeRangeRequest(path, 0, partSize);
+
+            Aws::S3::Model::GetObjectResult result;
+            bool empty = false;
+            try {
+                result = checkAws(fmt("AWS error fetching '%s'", path),
+                    s3Helper.client->GetObject(request));
+            } catch (S3Error & e) {
+                if (e.err == Aws::S3::S3Errors::NO_SUCH_KEY)
+                    throw NoSuchBinaryCacheFile("file 's3://%s/%s' does not exist in binary cache", bucketName, path);
+                /* S3 rejects any range of an empty object with 416
+                   (InvalidRange). */
+                if (e.responseCode != Aws::Http::HttpResponseCode::REQUESTED_RANGE_NOT_SATISFIABLE)
+                    throw;
+                empty = true;
+            }
+
+            if (empty)
+                totalSize = 0;
+
+            else {
+                if (result.GetContentEncoding() != "")
+                    throw Error("cannot fetch 's3://%s/%s' in ranges because it has Content-Encoding '%s'",
+                        bucketName, path, result.GetContentEncoding());
+
+                auto data = dynamic_cast<std::stringstream &>(result.GetBody()).str();
+
+                /* Content-Range has the form 'bytes <start>-<end>/<size>'. If
+                   it's missing, the server sent the whole object. */
+                std::string contentRange = result.GetContentRange();
+                auto slash = contentRange.rfind('/');
+                if (slash == std::string::npos || !string2Int(contentRange.substr(slash + 1), totalSize))
+                    totalSize = data.size();
+
+                etag = result.GetETag();
+
+                sink(data);
+                written += data.size();
+            }
+        }
+
+        /* Fetch the remaining ranges, keeping a bounded number of
+           requests in flight. The ETag ensures that all ranges come
+           from the same version of the object. */
+        std::deque<std::pair<uint64_t, Aws::S3::Model::GetObjectOutcomeCallable>> pending;
+        uint64_t next = written;
+        size_t maxPending = std::max(1u, downloadConcurrency.get());
+
+        while (written < totalSize) {
+            checkInterrupt();
+
+            while (next < totalSize && pending.size() < maxPending) {
+                auto size = std::min(partSize, totalSize - next);
+                auto request = makeRangeRequest(path, next, size);
+                if (!etag.empty()) request.SetIfMatch(etag);
+                pending.emplace_back(size, s3Helper.client->GetObjectCallable(request));
+                next += size;
+            }
+
+            auto part = std::move(pending.front());
+            pending.pop_front();
+
+            auto result = checkAws(fmt("AWS error fetching '%s'", path), part.second.get());
+
+            auto data = dynamic_cast<std::stringstream &>(result.GetBody()).str();
+
+            if (data.size() != part.first)
+                throw Error("range of 's3://%s/%s' has size %d, expected %d",
+                    bucketName, path, data.size(), part.first);
+
+            sink(data);
+            written += data.size();
+        }
+
+        auto now2 = std::chrono::steady_clock::now();
+
+        auto durationMs = std::chrono::duration_cast<std::chrono::milliseconds>(now2 - now1).count();
+
+        stats.getBytes += written;
+        stats.getTimeMs += durationMs;
+
+        printTalkative("downloaded 's3://%s/%s' (%d bytes) in %d ms",
+            bucketName, path, written, durationMs);
+    }
+
+    /* Download an object in a single request, passing it to the sink
+       as it arrives. */
+    void getFileStreaming(const std::string & path, Sink & sink)
+    {
+        stats.get++;
+
+        debug("fetching 's3://%s/%s'...", bucketName, path);
+
+        /* A stream buffer that forwards the object to 'sink' as the
+           SDK receives it. Exceptions thrown by the sink can't
+           propagate through the SDK, so they're stashed and rethrown
+           afterwards. */
+        struct SinkBuf : std::streambuf
+        {
+            Sink & sink;
+            uint64_t written = 0;
+            std::exception_ptr exc;
+
+            SinkBuf(Sink & sink) : sink(sink) { }
+
+            std::streamsize xsputn(const char * s, std::streamsize n) override
+            {
+                if (exc) return 0;
+                try {
+                    sink((const unsigned char *) s, n);
+                    written += n;
+                    return n;
+                } catch (...) {
+                    exc = std::current_exception();
+                    return 0;
+                }
+            }
+
+            int_type overflow(int_type c) override
+            {
+                if (traits_type::eq_int_type(c, traits_type::eof()))
+                    return traits_type::not_eof(c);
+                char ch = traits_type::to_char_type(c);
+                return xsputn(&ch, 1) == 1 ? c : traits_type::eof();
+            }
+        };
+
+        SinkBuf buf(sink);
+
+        auto request =
+            Aws::S3::Model::GetObjectRequest()
+            .WithBucket(bucketName)
+            .WithKey(path);
+
+        request.SetResponseStreamFactory([&]() {
+            /* The SDK calls the factory again when it retries a
+               request, but data already passed to the sink can't be
+               taken back. */
+            if (buf.written && !buf.exc)
+                buf.exc = std::make_exception_ptr(
+                    Error("download of 's3://%s/%s' was interrupted", bucketName, path));
+            return Aws::New<Aws::IOStream>("SINKSTREAM", &buf);
+        });
+
+        auto now1 = std::chrono::steady_clock::now();
+
+        try {
+            auto result = checkAws(fmt("AWS error fetching '%s'", path),
+                s3Helper.client->GetObject(request));
+
+            if (buf.exc) std::rethrow_exception(buf.exc);
+
+            /* NARs are uploaded without a Content-Encoding, so there
+               is nothing to decode here. */
+            if (result.GetContentEncoding() != "")
+                throw Error("cannot stream 's3://%s/%s' because it has Content-Encoding '%s'",
+                    bucketName, path, result.GetContentEncoding());
+
+        } catch (S3Error & e) {
+            if (buf.exc) std::rethrow_exception(buf.exc);
+            if (e.err == Aws::S3::S3Errors::NO_SUCH_KEY)
+                throw NoSuchBinaryCacheFile("file 's3://%s/%s' does not exist in binary cache", bucketName, path);
+            throw;
+        }
+
+        auto now2 = std::chrono::steady_clock::now();
+
+        auto durationMs = std::chrono::duration_cast<std::chrono::milliseconds>(now2 - now1).count();
+
+        stats.getBytes += buf.written;
+        stats.getTimeMs += durationMs;
+
+        printTalkative("downloaded 's3://%s/%s' (%d bytes) in %d ms",
+            bucketName, path, buf.written, durationMs);
+    }
+
     void getFile(const std::string & path,
         std::function<void(std::shared_ptr<std::string>)> success,
         std::function<void(std::exception_ptr exc)> failure) override
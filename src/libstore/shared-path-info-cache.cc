@@ -0,0 +1,279 @@
+#include "shared-path-info-cache.hh"
+#include "pathlocks.hh"
+
+#include <atomic>
+#include <cstring>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace nix {
+
+static const uint64_t cacheMagic = 0x6e69782d70696331; // "nix-pic1"
+static const uint32_t cacheVersion = 2;
+static const size_t slotSize = 4096;
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2,
+    "the shared path info cache requires lock-free atomics");
+
+
+/* The first slot of the file holds the header. */
+struct SharedPathInfoCache::Header
+{
+    uint64_t magic;
+    uint32_t version;
+    uint32_t slots;
+    std::atomic<uint64_t> generation;
+    /* Identity of the database that the entries were read from, and
+       the highest sequence number seen in it. */
+    std::atomic<uint64_t> database;
+    std::atomic<uint64_t> sequence;
+};
+
+
+struct SharedPathInfoCache::Slot
+{
+    /* Sequence number, which is odd while the slot is being
+       written. */
+    std::atomic<uint32_t> seq;
+    uint32_t size;
+    uint64_t generation;
+    char hashPart[storePathHashLen];
+    unsigned char data[slotSize - 16 - storePathHashLen];
+};
+
+/* Return a number that identifies the database in 'dbDir', i.e. that
+   changes if it's deleted and re-created, restored from a backup or
+   converted to another backend. */
+static uint64_t databaseIdentity(const Path & dbDir)
+{
+    struct stat st;
+    if (stat((dbDir + "/paths").c_str(), &st) == -1
+        && stat((dbDir + "/db.sqlite").c_str(), &st) == -1)
+        return 0;
+    return ((uint64_t) st.st_dev << 32) ^ (uint64_t) st.st_ino;
+}
+
+
+SharedPathInfoCache::SharedPathInfoCache(const Path & dbDir, bool writable, size_t slots)
+    : dbDir(dbDir), writable(writable)
+{
+    Path path = dbDir + "/path-info-cache";
+
+    auto tryOpen = [&]() {
+        fd = open(path.c_str(), (writable ? O_RDWR : O_RDONLY) | O_CLOEXEC);
+        if (!fd) {
+            if (errno == ENOENT) return false;
+            throw SysError("opening path info cache '%s'", path);
+        }
+
+        struct stat st;
+        if (fstat(fd.get(), &st) == -1)
+            throw SysError("getting status of '%s'", path);
+        if ((size_t) st.st_size < slotSize) return false;
+
+        mapSize = st.st_size;
+        map = mmap(nullptr, mapSize, PROT_READ | (writable ? PROT_WRITE : 0), MAP_SHARED, fd.get(), 0);
+        if (map == MAP_FAILED) {
+            map = nullptr;
+            throw SysError("mapping path info cache '%s'", path);
+        }
+
+        auto h = header();
+        if (h->magic == cacheMagic && h->version == cacheVersion
+            && mapSize == ((size_t) h->slots + 1) * slotSize)
+            return true;
+
+        munmap(map, mapSize);
+        map = nullptr;
+        return false;
+    };
+
+    if (tryOpen()) {
+        checkIdentity();
+        return;
+    }
+
+    if (!writable || !slots)
+        throw Error("path info cache '%s' does not exist", path);
+
+    /* Create the cache under a lock, and in a temporary file that is
+       renamed into place, so that nobody sees a partially initialised
+       cache or keeps using one that is about to be replaced. If the
+       cache exists with a different size, we use that. */
+    AutoCloseFD lock = openLockFile(path + ".lock", true);
+    lockFile(lock.get(), ltWrite, true);
+
+    if (tryOpen()) {
+        checkIdentity();
+        return;
+    }
+
+    Path tmp = fmt("%s.tmp-%d", path, getpid());
+    {
+        AutoCloseFD tmpFd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (!tmpFd) throw SysError("creating '%s'", tmp);
+        if (ftruncate(tmpFd.get(), (slots + 1) * slotSize) == -1)
+            throw SysError("resizing '%s'", tmp);
+        struct { uint64_t magic; uint32_t version; uint32_t slots; uint64_t generation; uint64_t database; uint64_t sequence; }
+            h = { cacheMagic, cacheVersion, (uint32_t) slots, 0, databaseIdentity(dbDir), 0 };
+        writeFull(tmpFd.get(), (unsigned char *) &h, sizeof(h));
+    }
+
+    if (rename(tmp.c_str(), path.c_str()) == -1)
+        throw SysError("renaming '%s' to '%s'", tmp, path);
+
+    if (!tryOpen())
+        throw Error("cannot open path info cache '%s'", path);
+    checkIdentity();
+}
+
+
+SharedPathInfoCache::~SharedPathInfoCache()
+{
+    if (map) munmap(map, mapSize);
+}
+
+
+SharedPathInfoCache::Header * SharedPathInfoCache::header()
+{
+    return (Header *) map;
+}
+
+
+SharedPathInfoCache::Slot * SharedPathInfoCache::slot(const std::string & hashPart)
+{
+    static_assert(sizeof(Slot) == slotSize, "unexpected slot size");
+
+    /* FNV-1a, which unlike std::hash is the same in every process. */
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (auto c : hashPart) {
+        h ^= (unsigned char) c;
+        h *= 0x100000001b3ULL;
+    }
+    return (Slot *) ((char *) map + (1 + h % header()->slots) * slotSize);
+}
+
+
+uint64_t SharedPathInfoCache::generation()
+{
+    return header()->generation.load();
+}
+
+
+std::shared_ptr<ValidPathInfo> SharedPathInfoCache::lookup(const std::string & hashPart)
+{
+    if (hashPart.size() != storePathHashLen) return nullptr;
+
+    auto s = slot(hashPart);
+
+    auto seq = s->seq.load(std::memory_order_acquire);
+    if (seq & 1) return nullptr;
+
+    auto generation = s->generation;
+    auto size = std::min((size_t) s->size, sizeof(s->data));
+    bool match = memcmp(s->hashPart, hashPart.data(), storePathHashLen) == 0;
+    std::string data((char *) s->data, size);
+
+    /* If the slot changed while we were reading it, what we read may
+       be garbage. */
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (s->seq.load(std::memory_order_relaxed) != seq) return nullptr;
+
+    if (!match || generation != header()->generation.load()) return nullptr;
+
+    try {
+        StringSource source(data);
+        auto info = std::make_shared<ValidPathInfo>();
+        source >> info->path >> info->deriver;
+        info->narHash = Hash(readString(source));
+        info->references = readStrings<PathSet>(source);
+        source >> info->registrationTime >> info->narSize >> info->ultimate;
+        info->sigs = readStrings<StringSet>(source);
+        source >> info->ca;
+        return info;
+    } catch (Error & e) {
+        return nullptr;
+    }
+}
+
+
+void SharedPathInfoCache::insert(uint64_t generation, const ValidPathInfo & info)
+{
+    if (!writable) return;
+
+    StringSink sink;
+    sink << info.path << info.deriver << info.narHash.to_string()
+         << info.references << info.registrationTime << info.narSize
+         << info.ultimate << info.sigs << info.ca;
+
+    auto hashPart = storePathToHash(info.path);
+    auto s = slot(hashPart);
+
+    if (sink.s->size() > sizeof(s->data)) return;
+
+    /* Don't wait for a concurrent writer; just skip caching. */
+    auto seq = s->seq.load();
+    if ((seq & 1) || !s->seq.compare_exchange_strong(seq, seq + 1, std::memory_order_acquire))
+        return;
+
+    /* Make sure that readers see the odd sequence number before any
+       of the writes below. */
+    std::atomic_thread_fence(std::memory_order_release);
+
+    s->generation = generation;
+    s->size = sink.s->size();
+    memcpy(s->hashPart, hashPart.data(), storePathHashLen);
+    memcpy(s->data, sink.s->data(), sink.s->size());
+
+    s->seq.store(seq + 2, std::memory_order_release);
+}
+
+
+void SharedPathInfoCache::invalidate()
+{
+    if (writable) header()->generation++;
+}
+
+
+void SharedPathInfoCache::reset(uint64_t database, uint64_t sequence)
+{
+    header()->generation++;
+    header()->database.store(database);
+    header()->sequence.store(sequence);
+}
+
+
+void SharedPathInfoCache::checkIdentity()
+{
+    auto database = databaseIdentity(dbDir);
+    if (header()->database.load() == database) return;
+
+    /* The entries may have been read from a database that has been
+       replaced since, so they must not be used. */
+    if (!writable)
+        throw Error("path info cache in '%s' belongs to a different database", dbDir);
+
+    reset(database, 0);
+}
+
+
+void SharedPathInfoCache::checkDatabase(uint64_t sequence)
+{
+    if (!writable) return;
+
+    checkIdentity();
+
+    auto seen = header()->sequence.load();
+    while (seen < sequence)
+        if (header()->sequence.compare_exchange_weak(seen, sequence)) return;
+
+    /* The database has gone back in time, e.g. because it was
+       restored from a backup in place. */
+    if (seen > sequence)
+        reset(databaseIdentity(dbDir), sequence);
+}
+
+}
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "store-api.hh"
+
+namespace nix {
+
+/* A cache of path info in a memory-mapped file that is shared by all
+   processes using the same Nix database, so that they don't each
+   have to query the database (or the daemon) for the same paths.
+   Processes that open the database (i.e. LocalStore) fill the cache;
+   clients of the daemon only read it.
+
+   The cache is a fixed-size hash table indexed by the hash part of
+   store paths. Each slot is protected by a sequence lock, so readers
+   never block. Rather than tracking which entries are affected when
+   path info changes or paths become invalid, every such change bumps
+   a generation counter, which invalidates all entries.
+
+   Nix versions that predate the cache don't bump the generation, so
+   LocalStore doesn't rely on the cache where a stale entry would be
+   harmful (e.g. to check whether a path is valid before adding or
+   deleting it). */
+class SharedPathInfoCache
+{
+public:
+
+    /* Open the cache of the database in 'dbDir'. If 'writable' and
+       'slots' is non-zero, the cache is created with 'slots' entries
+       if it doesn't exist yet. Throws if the cache can't be opened,
+       or if it's read-only and belongs to a previous incarnation of
+       the database. */
+    SharedPathInfoCache(const Path & dbDir, bool writable, size_t slots = 0);
+
+    ~SharedPathInfoCache();
+
+    /* Return the current generation. Path info read from the
+       database after this call can be inserted with this
+       generation. */
+    uint64_t generation();
+
+    /* Return the cached info for 'hashPart', or null. */
+    std::shared_ptr<ValidPathInfo> lookup(const std::string & hashPart);
+
+    /* Cache 'info', which was read in 'generation'. Info that
+       doesn't fit in a slot is silently dropped, as is everything if
+       the cache isn't writable. */
+    void insert(uint64_t generation, const ValidPathInfo & info);
+
+    /* Invalidate all entries. This must be called after path info
+       in the database has been changed or removed. */
+    void invalidate();
+
+    /* Invalidate all entries if the database has been replaced since
+       they were read. 'sequence' is a number that grows as paths are
+       registered in the database (see PathDB::sequenceNumber()), so
+       if it's lower than the one seen previously, the database has
+       been re-created or restored from a backup. */
+    void checkDatabase(uint64_t sequence);
+
+private:
+
+    struct Header;
+    struct Slot;
+
+    Path dbDir;
+    AutoCloseFD fd;
+    bool writable;
+    void * map = nullptr;
+    size_t mapSize = 0;
+
+    Header * header();
+    Slot * slot(const std::string & hashPart);
+
+    void reset(uint64_t database, uint64_t sequence);
+
+    /* Check that the cache belongs to the database file in 'dbDir'. */
+    void checkIdentity();
+};
+
+}
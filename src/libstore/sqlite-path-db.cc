@@ -0,0 +1,435 @@
+#include "path-db.hh"
+#include "sqlite.hh"
+#include "globals.hh"
+
+#include <time.h>
+
+#ifdef __CYGWIN__
+#include <windows.h>
+#endif
+
+#include <sqlite3.h>
+
+namespace nix {
+
+
+/* The number of paths read per transaction by scanValidPaths(). */
+static const size_t scanBatchSize = 1000;
+
+
+class SQLitePathDB : public PathDB
+{
+    Path storeDir;
+
+    /* The SQLite database object. */
+    SQLite db;
+
+    /* Some precompiled SQLite statements. */
+    SQLiteStmt stmtRegisterValidPath;
+    SQLiteStmt stmtUpdatePathInfo;
+    SQLiteStmt stmtAddReference;
+    SQLiteStmt stmtQueryPathInfo;
+    SQLiteStmt stmtQueryReferences;
+    SQLiteStmt stmtQueryReferrers;
+    SQLiteStmt stmtInvalidatePath;
+    SQLiteStmt stmtAddDerivationOutput;
+    SQLiteStmt stmtQueryValidDerivers;
+    SQLiteStmt stmtQueryDerivationOutputs;
+    SQLiteStmt stmtQueryPathFromHashPart;
+    SQLiteStmt stmtQueryValidPaths;
+    SQLiteStmt stmtScanValidPaths;
+    SQLiteStmt stmtQueryAllReferences;
+    SQLiteStmt stmtQueryDataVersion;
+    SQLiteStmt stmtQuerySequenceNumber;
+
+public:
+
+    SQLitePathDB(const Path & dbPath, const Path & storeDir, int schema)
+        : storeDir(storeDir)
+    {
+        bool create = schema == 0;
+
+        if (sqlite3_open_v2(dbPath.c_str(), &db.db,
+                SQLITE_OPEN_READWRITE | (create ? SQLITE_OPEN_CREATE : 0), 0) != SQLITE_OK)
+            throw Error(format("cannot open Nix database '%1%'") % dbPath);
+
+#ifdef __CYGWIN__
+        /* The cygwin version of sqlite3 has a patch which calls
+           SetDllDirectory("/usr/bin") on init. It was intended to fix extension
+           loading, which we don't use, and the effect of SetDllDirectory is
+           inherited by child processes, and causes libraries to be loaded from
+           /usr/bin instead of $PATH. This breaks quite a few things (e.g.
+           checkPhase on openssh), so we set it back to default behaviour. */
+        SetDllDirectoryW(L"");
+#endif
+
+        if (sqlite3_busy_timeout(db, 60 * 60 * 1000) != SQLITE_OK)
+            throwSQLiteError(db, "setting timeout");
+
+        db.exec("pragma foreign_keys = 1");
+
+        /* !!! check whether sqlite has been built with foreign key
+           support */
+
+        /* Whether SQLite should fsync().  "Normal" synchronous mode
+           should be safe enough.  If the user asks for it, don't sync at
+           all.  This can cause database corruption if the system
+           crashes. */
+        string syncMode = settings.fsyncMetadata ? "normal" : "off";
+        db.exec("pragma synchronous = " + syncMode);
+
+        /* Set the SQLite journal mode.  WAL mode is fastest, so it's the
+           default. */
+        string mode = settings.useSQLiteWAL ? "wal" : "truncate";
+        string prevMode;
+        {
+            SQLiteStmt stmt;
+            stmt.create(db, "pragma main.journal_mode;");
+            if (sqlite3_step(stmt) != SQLITE_ROW)
+                throwSQLiteError(db, "querying journal mode");
+            prevMode = string((const char *) sqlite3_column_text(stmt, 0));
+        }
+        if (prevMode != mode &&
+            sqlite3_exec(db, ("pragma main.journal_mode = " + mode + ";").c_str(), 0, 0, 0) != SQLITE_OK)
+            throwSQLiteError(db, "setting journal mode");
+
+        /* Increase the auto-checkpoint interval to 40000 pages.  This
+           seems enough to ensure that instantiating the NixOS system
+           derivation is done in a single fsync(). */
+        if (mode == "wal" && sqlite3_exec(db, "pragma wal_autocheckpoint = 40000;", 0, 0, 0) != SQLITE_OK)
+            throwSQLiteError(db, "setting autocheckpoint interval");
+
+        /* Initialise the database schema, if necessary. */
+        if (create) {
+            const char * schema =
+#include "schema.sql.gen.hh"
+                ;
+            db.exec(schema);
+        }
+
+        else {
+            if (schema < 8) {
+                SQLiteTxn txn(db);
+                db.exec("alter table ValidPaths add column ultimate integer");
+                db.exec("alter table ValidPaths add column sigs text");
+                txn.commit();
+            }
+
+            if (schema < 9) {
+                SQLiteTxn txn(db);
+                db.exec("drop table FailedPaths");
+                txn.commit();
+            }
+
+            if (schema < 10) {
+                SQLiteTxn txn(db);
+                db.exec("alter table ValidPaths add column ca text");
+                txn.commit();
+            }
+        }
+
+        /* Prepare SQL statements. */
+        stmtRegisterValidPath.create(db,
+            "insert into ValidPaths (path, hash, registrationTime, deriver, narSize, ultimate, sigs, ca) values (?, ?, ?, ?, ?, ?, ?, ?);");
+        stmtUpdatePathInfo.create(db,
+            "update ValidPaths set narSize = ?, hash = ?, ultimate = ?, sigs = ?, ca = ? where path = ?;");
+        stmtAddReference.create(db,
+            "insert or replace into Refs (referrer, reference) values (?, ?);");
+        stmtQueryPathInfo.create(db,
+            "select id, hash, registrationTime, deriver, narSize, ultimate, sigs, ca from ValidPaths where path = ?;");
+        stmtQueryReferences.create(db,
+            "select path from Refs join ValidPaths on reference = id where referrer = ?;");
+        stmtQueryReferrers.create(db,
+            "select path from Refs join ValidPaths on referrer = id where reference = (select id from ValidPaths where path = ?);");
+        stmtInvalidatePath.create(db,
+            "delete from ValidPaths where path = ?;");
+        stmtAddDerivationOutput.create(db,
+            "insert or replace into DerivationOutputs (drv, id, path) values (?, ?, ?);");
+        stmtQueryValidDerivers.create(db,
+            "select v.id, v.path from DerivationOutputs d join ValidPaths v on d.drv = v.id where d.path = ?;");
+        stmtQueryDerivationOutputs.create(db,
+            "select id, path from DerivationOutputs where drv = ?;");
+        // Use "path >= ?" with limit 1 rather than "path like '?%'" to
+        // ensure efficient lookup.
+        stmtQueryPathFromHashPart.create(db,
+            "select path from ValidPaths where path >= ? limit 1;");
+        stmtQueryValidPaths.create(db, "select path from ValidPaths");
+        // The hash prefix is matched as a range of paths so that it
+        // can use the index.
+        stmtScanValidPaths.create(db,
+            "select path, id, hash, registrationTime, deriver, narSize, ultimate, sigs, ca from ValidPaths "
+            "where path > ? and path < ? and substr(path, ?, ?) = ? order by path limit ?;");
+        stmtQueryAllReferences.create(db,
+            "select r.path, v.path from Refs join ValidPaths r on referrer = r.id join ValidPaths v on reference = v.id;");
+        stmtQueryDataVersion.create(db, "pragma data_version");
+        stmtQuerySequenceNumber.create(db,
+            "select seq from sqlite_sequence where name = 'ValidPaths';");
+    }
+
+    struct SQLitePathDBTxn : Txn
+    {
+        SQLiteTxn txn;
+        SQLitePathDBTxn(sqlite3 * db) : txn(db) { }
+        void commit() override { txn.commit(); }
+    };
+
+    std::unique_ptr<Txn> beginTxn() override
+    {
+        return std::make_unique<SQLitePathDBTxn>(db);
+    }
+
+    uint64_t queryValidPathId(const Path & path)
+    {
+        auto use(stmtQueryPathInfo.use()(path));
+        if (!use.next())
+            throw Error(format("path '%1%' is not valid") % path);
+        return use.getInt(0);
+    }
+
+    void addPath(const ValidPathInfo & info) override
+    {
+        stmtRegisterValidPath.use()
+            (info.path)
+            (info.narHash.to_string(Base16))
+            (info.registrationTime == 0 ? time(0) : info.registrationTime)
+            (info.deriver, info.deriver != "")
+            (info.narSize, info.narSize != 0)
+            (info.ultimate ? 1 : 0, info.ultimate)
+            (concatStringsSep(" ", info.sigs), !info.sigs.empty())
+            (info.ca, !info.ca.empty())
+            .exec();
+    }
+
+    void addReference(const Path & referrer, const Path & reference) override
+    {
+        stmtAddReference.use()
+            (queryValidPathId(referrer))
+            (queryValidPathId(reference))
+            .exec();
+    }
+
+    void addDerivationOutput(const Path & drvPath,
+        const string & id, const Path & outPath) override
+    {
+        stmtAddDerivationOutput.use()
+            (queryValidPathId(drvPath))
+            (id)
+            (outPath)
+            .exec();
+    }
+
+    void updatePathInfo(const ValidPathInfo & info) override
+    {
+        stmtUpdatePathInfo.use()
+            (info.narSize, info.narSize != 0)
+            (info.narHash.to_string(Base16))
+            (info.ultimate ? 1 : 0, info.ultimate)
+            (concatStringsSep(" ", info.sigs), !info.sigs.empty())
+            (info.ca, !info.ca.empty())
+            (info.path)
+            .exec();
+    }
+
+    void invalidatePath(const Path & path) override
+    {
+        stmtInvalidatePath.use()(path).exec();
+
+        /* Note that the foreign key constraints on the Refs table take
+           care of deleting the references entries for `path'. */
+    }
+
+    /* Fill in 'info' from the columns of 'stmt' starting at 'col',
+       which are those of stmtQueryPathInfo. */
+    void readPathInfo(SQLiteStmt & stmt, SQLiteStmt::Use & use, int col, ValidPathInfo & info)
+    {
+        info.id = use.getInt(col);
+
+        try {
+            info.narHash = Hash(use.getStr(col + 1));
+        } catch (BadHash & e) {
+            throw Error("in valid-path entry for '%s': %s", info.path, e.what());
+        }
+
+        info.registrationTime = use.getInt(col + 2);
+
+        auto s = (const char *) sqlite3_column_text(stmt, col + 3);
+        if (s) info.deriver = s;
+
+        /* Note that narSize = NULL yields 0. */
+        info.narSize = use.getInt(col + 4);
+
+        info.ultimate = use.getInt(col + 5) == 1;
+
+        s = (const char *) sqlite3_column_text(stmt, col + 6);
+        if (s) info.sigs = tokenizeString<StringSet>(s, " ");
+
+        s = (const char *) sqlite3_column_text(stmt, col + 7);
+        if (s) info.ca = s;
+
+        /* Get the references. */
+        auto useQueryReferences(stmtQueryReferences.use()(info.id));
+
+        while (useQueryReferences.next())
+            info.references.insert(useQueryReferences.getStr(0));
+    }
+
+    std::shared_ptr<ValidPathInfo> queryPathInfo(const Path & path) override
+    {
+        auto info = std::make_shared<ValidPathInfo>();
+        info->path = path;
+
+        /* Get the path info. */
+        auto useQueryPathInfo(stmtQueryPathInfo.use()(path));
+
+        if (!useQueryPathInfo.next())
+            return std::shared_ptr<ValidPathInfo>();
+
+        readPathInfo(stmtQueryPathInfo, useQueryPathInfo, 0, *info);
+
+        return info;
+    }
+
+    bool isValidPath(const Path & path) override
+    {
+        return stmtQueryPathInfo.use()(path).next();
+    }
+
+    void queryReferrers(const Path & path, PathSet & referrers) override
+    {
+        auto useQueryReferrers(stmtQueryReferrers.use()(path));
+
+        while (useQueryReferrers.next())
+            referrers.insert(useQueryReferrers.getStr(0));
+    }
+
+    PathSet queryValidDerivers(const Path & path) override
+    {
+        auto useQueryValidDerivers(stmtQueryValidDerivers.use()(path));
+
+        PathSet derivers;
+        while (useQueryValidDerivers.next())
+            derivers.insert(useQueryValidDerivers.getStr(1));
+
+        return derivers;
+    }
+
+    std::map<string, Path> queryDerivationOutputs(const Path & drvPath) override
+    {
+        auto useQueryDerivationOutputs(stmtQueryDerivationOutputs.use()
+            (queryValidPathId(drvPath)));
+
+        std::map<string, Path> outputs;
+        while (useQueryDerivationOutputs.next())
+            outputs[useQueryDerivationOutputs.getStr(0)] = useQueryDerivationOutputs.getStr(1);
+
+        return outputs;
+    }
+
+    Path queryPathFromHashPart(const string & hashPart) override
+    {
+        Path prefix = storeDir + "/" + hashPart;
+
+        auto useQueryPathFromHashPart(stmtQueryPathFromHashPart.use()(prefix));
+
+        if (!useQueryPathFromHashPart.next()) return "";
+
+        const char * s = (const char *) sqlite3_column_text(stmtQueryPathFromHashPart, 0);
+        return s && prefix.compare(0, prefix.size(), s, prefix.size()) == 0 ? s : "";
+    }
+
+    PathSet queryAllValidPaths() override
+    {
+        auto use(stmtQueryValidPaths.use());
+        PathSet res;
+        while (use.next()) res.insert(use.getStr(0));
+        return res;
+    }
+
+    void scanValidPaths(const ValidPathFilter & filter, bool withInfo,
+        std::function<void(const Path & path, std::shared_ptr<ValidPathInfo> info)> callback) override
+    {
+        /* Paths with the hash prefix sort between 'from' and 'to',
+           which is 'from' with its last character incremented. */
+        Path from = storeDir + "/" + filter.hashPrefix;
+        Path to = from;
+        to.back()++;
+
+        /* Read the paths in batches, each in a transaction that ends
+           before 'callback' is called for its paths, so that a slow
+           callback (such as the daemon writing to a client) doesn't
+           keep writers waiting. The next batch starts after the last
+           path seen. */
+        while (true) {
+            std::vector<std::pair<Path, std::shared_ptr<ValidPathInfo>>> batch;
+
+            {
+                SQLiteTxn txn(db);
+
+                auto use(stmtScanValidPaths.use()
+                    (from)
+                    (to)
+                    ((int64_t) (storeDir.size() + storePathHashLen + 3))
+                    ((int64_t) filter.namePrefix.size())
+                    (filter.namePrefix)
+                    ((int64_t) scanBatchSize));
+
+                while (use.next()) {
+                    auto path = use.getStr(0);
+                    std::shared_ptr<ValidPathInfo> info;
+                    if (withInfo) {
+                        info = std::make_shared<ValidPathInfo>();
+                        info->path = path;
+                        readPathInfo(stmtScanValidPaths, use, 1, *info);
+                    }
+                    batch.emplace_back(path, info);
+                }
+
+                txn.commit();
+            }
+
+            for (auto & i : batch)
+                callback(i.first, i.second);
+
+            if (batch.size() < scanBatchSize) break;
+            from = batch.back().first;
+        }
+    }
+
+    void queryAllReferences(
+        std::function<void(const Path & referrer, const Path & reference)> callback) override
+    {
+        auto use(stmtQueryAllReferences.use());
+        while (use.next())
+            callback(use.getStr(0), use.getStr(1));
+    }
+
+    uint64_t dataVersion() override
+    {
+        auto use(stmtQueryDataVersion.use());
+        if (!use.next()) throw Error("cannot query database version");
+        return use.getInt(0);
+    }
+
+    uint64_t sequenceNumber() override
+    {
+        /* The last ID handed out by 'autoincrement', which unlike
+           max(id) doesn't go down when paths are deleted. */
+        auto use(stmtQuerySequenceNumber.use());
+        return use.next() ? use.getInt(0) : 0;
+    }
+
+    void vacuum() override
+    {
+        db.exec("vacuum");
+    }
+};
+
+
+std::unique_ptr<PathDB> openSQLitePathDB(const Path & dbPath,
+    const Path & storeDir, int schema)
+{
+    return std::make_unique<SQLitePathDB>(dbPath, storeDir, schema);
+}
+
+
+}
@@ -376,6 +376,166 @@ void Store::queryPathInfo(const Path & storePath,
 }
 
 
+std::map<Path, ref<const ValidPathInfo>> Store::queryPathInfos(const PathSet & paths)
+{
+    std::map<Path, ref<const ValidPathInfo>> res;
+    PathSet missing;
+
+    auto isValid = [&](const Path & path, const std::shared_ptr<ValidPathInfo> & info) {
+        return info && (info->path == path || storePathToName(path) == "");
+    };
+
+    {
+        auto state_(state.lock());
+        for (auto & path : paths) {
+            auto info = state_->pathInfoCache.get(storePathToHash(path));
+            if (info) {
+                stats.narInfoReadAverted++;
+                if (isValid(path, *info))
+                    res.emplace(path, ref<const ValidPathInfo>(*info));
+            } else
+                missing.insert(path);
+        }
+    }
+
+    if (missing.empty()) return res;
+
+    auto infos = queryPathInfosUncached(missing);
+
+    auto state_(state.lock());
+    for (auto & i : infos) {
+        /* Don't let a path with the right hash but the wrong name
+           hide the info of the real path. */
+        auto hashPart = storePathToHash(i.first);
+        if (i.second || !state_->pathInfoCache.get(hashPart))
+            state_->pathInfoCache.upsert(hashPart, i.second);
+        if (isValid(i.first, i.second))
+            res.emplace(i.first, ref<const ValidPathInfo>(i.second));
+        else
+            stats.narInfoMissing++;
+    }
+
+    return res;
+}
+
+
+std::map<Path, std::shared_ptr<ValidPathInfo>> Store::queryPathInfosUncached(const PathSet & paths)
+{
+    struct State
+    {
+        size_t left;
+        std::map<Path, std::shared_ptr<ValidPathInfo>> infos;
+        std::exception_ptr exc;
+    };
+
+    Sync<State> state_(State{paths.size()});
+
+    std::condition_variable wakeup;
+    ThreadPool pool;
+
+    auto doQuery = [&](const Path & path) {
+        checkInterrupt();
+        queryPathInfo(path,
+            [path, &state_, &wakeup](ref<ValidPathInfo> info) {
+                auto state(state_.lock());
+                state->infos[path] = info;
+                assert(state->left);
+                if (!--state->left)
+                    wakeup.notify_one();
+            },
+            [path, &state_, &wakeup](std::exception_ptr exc) {
+                auto state(state_.lock());
+                try {
+                    std::rethrow_exception(exc);
+                } catch (InvalidPath &) {
+                    state->infos[path] = nullptr;
+                } catch (...) {
+                    state->exc = exc;
+                }
+                assert(state->left);
+                if (!--state->left)
+                    wakeup.notify_one();
+            });
+    };
+
+    for (auto & path : paths)
+        pool.enqueue(std::bind(doQuery, path));
+
+    pool.process();
+
+    while (true) {
+        auto state(state_.lock());
+        if (!state->left) {
+            if (state->exc) std::rethrow_exception(state->exc);
+            return state->infos;
+        }
+        state.wait(wakeup);
+    }
+}
+
+
+std::map<Path, PathSet> Store::queryMultipleReferrers(const PathSet & paths)
+{
+    std::map<Path, PathSet> res;
+    for (auto & path : paths)
+        queryReferrers(path, res[path]);
+    return res;
+}
+
+
+std::map<Path, PathSet> Store::queryMultipleDerivationOutputs(const PathSet & paths)
+{
+    std::map<Path, PathSet> res;
+    for (auto & path : paths)
+        res[path] = queryDerivationOutputs(path);
+    return res;
+}
+
+
+std::map<string, Path> Store::queryPathsFromHashParts(const StringSet & hashParts)
+{
+    std::map<string, Path> res;
+    for (auto & hashPart : hashParts) {
+        auto path = queryPathFromHashPart(hashPart);
+        if (path != "") res[hashPart] = path;
+    }
+    return res;
+}
+
+
+bool ValidPathFilter::matches(const Path & path) const
+{
+    auto base = baseNameOf(path);
+    if (!hasPrefix(base, hashPrefix)) return false;
+    if (namePrefix.empty()) return true;
+    return base.size() > storePathHashLen
+        && base.compare(storePathHashLen + 1, namePrefix.size(), namePrefix) == 0;
+}
+
+
+void Store::scanValidPaths(const ValidPathFilter & filter, bool withInfo,
+    std::function<void(const Path & path, std::shared_ptr<const ValidPathInfo> info)> callback)
+{
+    for (auto & path : queryAllValidPaths()) {
+        if (!ValidPathFilter{filter.hashPrefix}.matches(path)) continue;
+
+        /* Some stores omit the name part, so it may have to come
+           from the path info. */
+        std::shared_ptr<const ValidPathInfo> info;
+        if (withInfo || !filter.namePrefix.empty()) {
+            try {
+                info = queryPathInfo(path);
+            } catch (InvalidPath &) {
+                continue;
+            }
+            if (!filter.matches(info->path)) continue;
+        }
+
+        callback(info ? info->path : path, withInfo ? info : nullptr);
+    }
+}
+
+
 PathSet Store::queryValidPaths(const PathSet & paths, SubstituteFlag maybeSubstitute)
 {
     struct State
@@ -606,14 +766,20 @@ void copyStorePath(ref<Store> srcStore, ref<Store> dstStore,
         info = info2;
     }
 
-    auto source = sinkToSource([&](Sink & sink) {
+    auto dumpNar = [&](Sink & sink) {
         LambdaSink wrapperSink([&](const unsigned char * data, size_t len) {
             sink(data, len);
             total += len;
             act.progress(total, info->narSize);
         });
         srcStore->narFromPath({storePath}, wrapperSink);
-    });
+    };
+
+    /* Read from the source store in a separate thread, so that it
+       overlaps with importing into the destination. */
+    auto source = settings.copyBufferSize
+        ? sinkToSourceAsync(dumpNar, settings.copyBufferSize)
+        : sinkToSource(dumpNar);
 
     dstStore->addToStore(*info, *source, repair, checkSigs);
 }
@@ -640,7 +806,7 @@ void copyPaths(ref<Store> srcStore, ref<Store> dstStore, const PathSet & storePa
         act.progress(nrDone, missing.size(), nrRunning);
     };
 
-    ThreadPool pool;
+    ThreadPool pool(settings.copyJobs);
 
     processGraph<Path>(pool,
         PathSet(missing.begin(), missing.end()),
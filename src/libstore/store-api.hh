@@ -192,6 +192,21 @@ struct ValidPathInfo
 typedef list<ValidPathInfo> ValidPathInfos;
 
 
+/* Selects the paths visited by Store::scanValidPaths(). The empty
+   filter matches every path. */
+struct ValidPathFilter
+{
+    /* Only paths whose hash part starts with this string. */
+    string hashPrefix;
+
+    /* Only paths whose name (the part after the hash) starts with
+       this string. */
+    string namePrefix;
+
+    bool matches(const Path & path) const;
+};
+
+
 enum BuildMode { bmNormal, bmRepair, bmCheck };
 
 
@@ -349,6 +364,17 @@ public:
        full store path. */
     virtual PathSet queryAllValidPaths() = 0;
 
+    /* Call 'callback' for every valid path that matches 'filter',
+       passing its info if 'withInfo' is set and null otherwise.
+       Unlike queryAllValidPaths(), this doesn't hold the set of paths
+       in memory on stores that support it. As with
+       queryAllValidPaths(), the name part of paths may be omitted,
+       unless 'withInfo' is set. Paths that become valid or invalid
+       during the scan may or may not be visited. The default
+       implementation uses queryAllValidPaths(). */
+    virtual void scanValidPaths(const ValidPathFilter & filter, bool withInfo,
+        std::function<void(const Path & path, std::shared_ptr<const ValidPathInfo> info)> callback);
+
     /* Query information about a valid path. It is permitted to omit
        the name part of the store path. */
     ref<const ValidPathInfo> queryPathInfo(const Path & path);
@@ -358,12 +384,21 @@ public:
         std::function<void(ref<ValidPathInfo>)> success,
         std::function<void(std::exception_ptr exc)> failure);
 
+    /* Query information about several valid paths at once. Invalid
+       paths are omitted from the result. */
+    std::map<Path, ref<const ValidPathInfo>> queryPathInfos(const PathSet & paths);
+
 protected:
 
     virtual void queryPathInfoUncached(const Path & path,
         std::function<void(std::shared_ptr<ValidPathInfo>)> success,
         std::function<void(std::exception_ptr exc)> failure) = 0;
 
+    /* Batched version of queryPathInfoUncached(). The result has an
+       entry for every path, which is null if the path is invalid. The
+       default implementation calls queryPathInfo() for each path. */
+    virtual std::map<Path, std::shared_ptr<ValidPathInfo>> queryPathInfosUncached(const PathSet & paths);
+
 public:
 
     /* Queries the set of incoming FS references for a store path.
@@ -387,6 +422,16 @@ public:
        path, or "" if the path doesn't exist. */
     virtual Path queryPathFromHashPart(const string & hashPart) = 0;
 
+    /* Batched versions of queryReferrers(), queryDerivationOutputs()
+       and queryPathFromHashPart(), for stores where a query per path
+       is expensive. Hash parts that don't correspond to a valid path
+       are omitted from the result of queryPathsFromHashParts(). */
+    virtual std::map<Path, PathSet> queryMultipleReferrers(const PathSet & paths);
+
+    virtual std::map<Path, PathSet> queryMultipleDerivationOutputs(const PathSet & paths);
+
+    virtual std::map<string, Path> queryPathsFromHashParts(const StringSet & hashParts);
+
     /* Query which of the given paths have substitutes. */
     virtual PathSet querySubstitutablePaths(const PathSet & paths) { return {}; };
 
@@ -579,6 +624,10 @@ public:
         std::atomic<uint64_t> narWriteBytes{0};
         std::atomic<uint64_t> narWriteCompressedBytes{0};
         std::atomic<uint64_t> narWriteCompressionTimeMs{0};
+        std::atomic<uint64_t> chunkWrite{0};
+        std::atomic<uint64_t> chunkWriteAverted{0};
+        std::atomic<uint64_t> downloadQueueTimeMs{0};
+        std::atomic<uint64_t> downloadThrottleTimeMs{0};
     };
 
     const Stats & getStats();
@@ -6,7 +6,7 @@ namespace nix {
 #define WORKER_MAGIC_1 0x6e697863
 #define WORKER_MAGIC_2 0x6478696f
 
-#define PROTOCOL_VERSION 0x114
+#define PROTOCOL_VERSION 0x117
 #define GET_PROTOCOL_MAJOR(x) ((x) & 0xff00)
 #define GET_PROTOCOL_MINOR(x) ((x) & 0x00ff)
 
@@ -49,6 +49,12 @@ typedef enum {
     wopNarFromPath = 38,
     wopAddToStoreNar = 39,
     wopQueryMissing = 40,
+    wopMultiplex = 41,
+    wopQueryPathInfos = 42,
+    wopQueryMultipleReferrers = 43,
+    wopQueryMultipleDerivationOutputs = 44,
+    wopQueryPathsFromHashParts = 45,
+    wopScanValidPaths = 46,
 } WorkerOp;
 
 
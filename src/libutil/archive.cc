@@ -40,14 +40,21 @@ static void dumpContents(const Path & path, size_t size,
     AutoCloseFD fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
     if (!fd) throw SysError(format("opening file '%1%'") % path);
 
-    std::vector<unsigned char> buf(65536);
-    size_t left = size;
-
-    while (left > 0) {
-        auto n = std::min(left, buf.size());
-        readFull(fd.get(), buf.data(), n);
-        left -= n;
-        sink(buf.data(), n);
+    /* When writing directly to a file descriptor (e.g. a connection
+       to the daemon), let the kernel copy the contents. */
+    if (auto fdSink = dynamic_cast<FdSink *>(&sink))
+        fdSink->writeFromFd(fd.get(), size);
+
+    else {
+        std::vector<unsigned char> buf(65536);
+        size_t left = size;
+
+        while (left > 0) {
+            auto n = std::min(left, buf.size());
+            readFull(fd.get(), buf.data(), n);
+            left -= n;
+            sink(buf.data(), n);
+        }
     }
 
     writePadding(size, sink);
@@ -0,0 +1,95 @@
+#include "chunker.hh"
+
+#include <array>
+
+namespace nix {
+
+/* The gear table maps each byte to a random 64-bit value.  It must be
+   the same everywhere, since it determines the chunk boundaries, so
+   we generate it from a fixed seed using SplitMix64. */
+static const std::array<uint64_t, 256> & gearTable()
+{
+    static std::array<uint64_t, 256> table = []() {
+        std::array<uint64_t, 256> table;
+        uint64_t state = 0x6e69782d63686e6bULL;
+        for (auto & entry : table) {
+            uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            entry = z ^ (z >> 31);
+        }
+        return table;
+    }();
+    return table;
+}
+
+
+ChunkingSink::ChunkingSink(size_t minSize, size_t avgSize, size_t maxSize,
+    ChunkCallback callback)
+    : minSize(minSize), maxSize(maxSize), callback(callback)
+{
+    if (minSize == 0 || minSize > avgSize || avgSize > maxSize)
+        throw Error("invalid chunk sizes %d/%d/%d", minSize, avgSize, maxSize);
+
+    /* A boundary occurs where the top 'bits' bits of the hash are
+       zero, i.e. with probability 2^-bits at each position past
+       'minSize'. */
+    unsigned int bits = 0;
+    while (bits < 63 && ((size_t) 1 << (bits + 1)) <= avgSize - minSize + 1) bits++;
+    mask = bits == 0 ? 0 : ~(uint64_t) 0 << (64 - bits);
+
+    chunk.reserve(maxSize);
+}
+
+
+void ChunkingSink::operator () (const unsigned char * data, size_t len)
+{
+    auto & gear = gearTable();
+
+    while (len) {
+        /* Bytes below the minimum chunk size cannot end a chunk, so
+           copy them in one go. */
+        if (chunk.size() < minSize) {
+            auto n = std::min(len, minSize - chunk.size());
+            for (size_t i = 0; i < n; i++)
+                hash = (hash << 1) + gear[data[i]];
+            chunk.append((const char *) data, n);
+            data += n;
+            len -= n;
+            continue;
+        }
+
+        size_t i = 0;
+        bool boundary = false;
+        auto limit = std::min(len, maxSize - chunk.size());
+        while (i < limit) {
+            hash = (hash << 1) + gear[data[i++]];
+            if (!(hash & mask)) { boundary = true; break; }
+        }
+
+        chunk.append((const char *) data, i);
+        data += i;
+        len -= i;
+
+        if (boundary || chunk.size() >= maxSize) emit();
+    }
+}
+
+
+void ChunkingSink::finish()
+{
+    if (!chunk.empty()) emit();
+}
+
+
+void ChunkingSink::emit()
+{
+    std::string s;
+    s.reserve(maxSize);
+    std::swap(s, chunk);
+    hash = 0;
+    callback(std::move(s));
+}
+
+
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include "serialise.hh"
+
+#include <functional>
+
+namespace nix {
+
+/* A sink that splits the data written to it into content-defined
+   chunks, using a gear-based rolling hash (as in FastCDC).  Chunk
+   boundaries depend only on the preceding 64 bytes, so an insertion
+   or deletion in the data only changes the chunks around it.  Chunks
+   are between 'minSize' and 'maxSize' bytes long (except the last
+   one, which may be shorter), and 'avgSize' bytes on average. */
+struct ChunkingSink : Sink
+{
+    typedef std::function<void(std::string chunk)> ChunkCallback;
+
+    ChunkingSink(size_t minSize, size_t avgSize, size_t maxSize,
+        ChunkCallback callback);
+
+    void operator () (const unsigned char * data, size_t len) override;
+
+    /* Emit the final chunk, if any. */
+    void finish();
+
+private:
+
+    size_t minSize, maxSize;
+    uint64_t mask;
+    ChunkCallback callback;
+
+    std::string chunk;
+    uint64_t hash = 0;
+
+    void emit();
+};
+
+}
@@ -13,7 +13,12 @@
 #include <brotli/encode.h>
 #endif // HAVE_BROTLI
 
+#if HAVE_ZSTD
+#include <zstd.h>
+#endif // HAVE_ZSTD
+
 #include <iostream>
+#include <thread>
 
 namespace nix {
 
@@ -37,8 +42,26 @@ static void decompressXZ(Source & source, Sink & sink)
 {
     lzma_stream strm(LZMA_STREAM_INIT);
 
+#ifdef HAVE_LZMA_MT_DECODER
+    /* Streams consisting of multiple blocks that record their sizes
+       in the block headers (such as those produced by
+       ParallelXzSink) are decoded in parallel. Single-block streams
+       are decoded in one thread as before. */
+    lzma_mt mt_options = {};
+    mt_options.flags = LZMA_CONCATENATED;
+    mt_options.timeout = 300;
+    mt_options.threads = lzma_cputhreads();
+    if (mt_options.threads == 0)
+        mt_options.threads = 1;
+    // Fall back to single-threaded decoding rather than using more
+    // than a quarter of RAM for buffering blocks.
+    mt_options.memlimit_threading = lzma_physmem() / 4;
+    mt_options.memlimit_stop = UINT64_MAX;
+    lzma_ret ret = lzma_stream_decoder_mt(&strm, &mt_options);
+#else
     lzma_ret ret = lzma_stream_decoder(
         &strm, UINT64_MAX, LZMA_CONCATENATED);
+#endif
     if (ret != LZMA_OK)
         throw CompressionError("unable to initialise lzma decoder");
 
@@ -196,6 +219,63 @@ static void decompressBrotli(Source & source, Sink & sink)
 #endif // HAVE_BROTLI
 }
 
+static void decompressZstd(Source & source, Sink & sink)
+{
+#if !HAVE_ZSTD
+    throw CompressionError("this Nix was built without zstd support");
+#else
+    auto strm = ZSTD_createDStream();
+    if (!strm)
+        throw CompressionError("unable to initialise zstd decoder");
+
+    Finally free([&]() { ZSTD_freeDStream(strm); });
+
+    std::vector<uint8_t> inbuf(ZSTD_DStreamInSize()), outbuf(ZSTD_DStreamOutSize());
+    ZSTD_inBuffer in = {inbuf.data(), 0, 0};
+    bool eof = false;
+    bool outputFull = false;
+
+    /* Whether the last call to ZSTD_decompressStream() completed a
+       frame and flushed all of its output. */
+    bool frameDone = false;
+
+    while (true) {
+        checkInterrupt();
+
+        if (in.pos == in.size && !eof) {
+            try {
+                in.size = source.read(inbuf.data(), inbuf.size());
+                in.pos = 0;
+            } catch (EndOfFile &) {
+                eof = true;
+            }
+        }
+
+        /* Stop once the input is exhausted at the end of a frame. If
+           it runs out in the middle of one (or there was no input at
+           all), the data is truncated, unless the decoder still has
+           output buffered. */
+        if (in.pos == in.size && eof) {
+            if (frameDone) return;
+            if (!outputFull)
+                throw CompressionError("zstd data ends prematurely");
+        }
+
+        ZSTD_outBuffer out = {outbuf.data(), outbuf.size(), 0};
+
+        auto ret = ZSTD_decompressStream(strm, &out, &in);
+        if (ZSTD_isError(ret))
+            throw CompressionError("error while decompressing zstd file: %s", ZSTD_getErrorName(ret));
+
+        if (out.pos)
+            sink(outbuf.data(), out.pos);
+
+        frameDone = ret == 0;
+        outputFull = out.pos == out.size;
+    }
+#endif // HAVE_ZSTD
+}
+
 ref<std::string> decompress(const std::string & method, const std::string & in)
 {
     StringSource source(in);
@@ -214,6 +294,8 @@ void decompress(const std::string & method, Source & source, Sink & sink)
         return decompressBzip2(source, sink);
     else if (method == "br")
         return decompressBrotli(source, sink);
+    else if (method == "zstd")
+        return decompressZstd(source, sink);
     else
         throw UnknownCompressionMethod("unknown compression method '%s'", method);
 }
@@ -243,8 +325,8 @@ struct XzSink : CompressionSink
         strm.next_out = outbuf;
         strm.avail_out = sizeof(outbuf);
     }
-    XzSink(Sink & nextSink) : XzSink(nextSink, [this]() {
-        return lzma_easy_encoder(&strm, 6, LZMA_CHECK_CRC64);
+    XzSink(Sink & nextSink, int level) : XzSink(nextSink, [this, level]() {
+        return lzma_easy_encoder(&strm, level == -1 ? 6 : level, LZMA_CHECK_CRC64);
     }) {}
 
     ~XzSink()
@@ -302,17 +384,23 @@ struct XzSink : CompressionSink
 #ifdef HAVE_LZMA_MT
 struct ParallelXzSink : public XzSink
 {
-  ParallelXzSink(Sink &nextSink) : XzSink(nextSink, [this]() {
+  ParallelXzSink(Sink &nextSink, int level, unsigned int threads) : XzSink(nextSink, [this, level, threads]() {
         lzma_mt mt_options = {};
         mt_options.flags = 0;
         mt_options.timeout = 300; // Using the same setting as the xz cmd line
-        mt_options.preset = LZMA_PRESET_DEFAULT;
+        mt_options.preset = level == -1 ? LZMA_PRESET_DEFAULT : level;
         mt_options.filters = NULL;
         mt_options.check = LZMA_CHECK_CRC64;
-        mt_options.threads = lzma_cputhreads();
+        mt_options.threads = threads ? threads : lzma_cputhreads();
         mt_options.block_size = 0;
         if (mt_options.threads == 0)
             mt_options.threads = 1;
+        /* Use blocks of the dictionary size rather than liblzma's
+           default of three times that, so that decompressXZ() can
+           decode NARs of more than a few MiB in parallel. */
+        lzma_options_lzma lzma_options;
+        if (!lzma_lzma_preset(&lzma_options, mt_options.preset))
+            mt_options.block_size = lzma_options.dict_size;
         // FIXME: maybe use lzma_stream_encoder_mt_memusage() to control the
         // number of threads.
         return lzma_stream_encoder_mt(&strm, &mt_options);
@@ -527,12 +615,104 @@ struct BrotliSink : CompressionSink
 };
 #endif // HAVE_BROTLI
 
-ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink, const bool parallel)
+#if HAVE_ZSTD
+struct ZstdSink : CompressionSink
+{
+    Sink & nextSink;
+    std::vector<uint8_t> outbuf;
+    ZSTD_CCtx * strm;
+    bool finished = false;
+
+    ZstdSink(Sink & nextSink, int level, bool parallel, unsigned int threads)
+        : nextSink(nextSink), outbuf(ZSTD_CStreamOutSize())
+    {
+        strm = ZSTD_createCCtx();
+        if (!strm)
+            throw CompressionError("unable to initialise zstd encoder");
+
+        auto ret = ZSTD_CCtx_setParameter(strm, ZSTD_c_compressionLevel,
+            level == -1 ? ZSTD_CLEVEL_DEFAULT : level);
+        if (ZSTD_isError(ret))
+            throw CompressionError("invalid zstd compression level %d", level);
+
+        if (parallel) {
+            /* This fails if libzstd was built without multi-threading
+               support, in which case we compress in the calling
+               thread. */
+            if (!threads) threads = std::thread::hardware_concurrency();
+            ret = ZSTD_CCtx_setParameter(strm, ZSTD_c_nbWorkers, threads ? threads : 1);
+            if (ZSTD_isError(ret))
+                printMsg(lvlError, "Warning: libzstd does not support multi-threaded compression, falling back to single-threaded compression");
+        }
+    }
+
+    ~ZstdSink()
+    {
+        ZSTD_freeCCtx(strm);
+    }
+
+    void finish() override
+    {
+        flush();
+
+        assert(!finished);
+        finished = true;
+
+        ZSTD_inBuffer in = {nullptr, 0, 0};
+
+        while (true) {
+            checkInterrupt();
+
+            ZSTD_outBuffer out = {outbuf.data(), outbuf.size(), 0};
+
+            auto remaining = ZSTD_compressStream2(strm, &out, &in, ZSTD_e_end);
+            if (ZSTD_isError(remaining))
+                throw CompressionError("error while flushing zstd file: %s", ZSTD_getErrorName(remaining));
+
+            if (out.pos)
+                nextSink(outbuf.data(), out.pos);
+
+            if (remaining == 0) break;
+        }
+    }
+
+    void write(const unsigned char * data, size_t len) override
+    {
+        assert(!finished);
+
+        ZSTD_inBuffer in = {data, len, 0};
+
+        while (in.pos < in.size) {
+            checkInterrupt();
+
+            ZSTD_outBuffer out = {outbuf.data(), outbuf.size(), 0};
+
+            auto ret = ZSTD_compressStream2(strm, &out, &in, ZSTD_e_continue);
+            if (ZSTD_isError(ret))
+                throw CompressionError("error while compressing zstd file: %s", ZSTD_getErrorName(ret));
+
+            if (out.pos)
+                nextSink(outbuf.data(), out.pos);
+        }
+    }
+};
+#endif // HAVE_ZSTD
+
+ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink, const bool parallel, int level,
+    unsigned int threads)
 {
+    if (method == "zstd") {
+#if HAVE_ZSTD
+        return make_ref<ZstdSink>(nextSink, level, parallel, threads);
+#else
+        throw CompressionError("this Nix was built without zstd support");
+#endif
+    }
+
     if (parallel) {
 #ifdef HAVE_LZMA_MT
         if (method == "xz")
-            return make_ref<ParallelXzSink>(nextSink);
+            return make_ref<ParallelXzSink>(nextSink, level, threads);
 #endif
         printMsg(lvlError, format("Warning: parallel compression requested but not supported for method '%1%', falling back to single-threaded compression") % method);
     }
@@ -540,7 +720,7 @@ ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & next
     if (method == "none")
         return make_ref<NoneSink>(nextSink);
     else if (method == "xz")
-        return make_ref<XzSink>(nextSink);
+        return make_ref<XzSink>(nextSink, level);
     else if (method == "bzip2")
         return make_ref<BzipSink>(nextSink);
     else if (method == "br")
@@ -553,10 +733,11 @@ ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & next
         throw UnknownCompressionMethod(format("unknown compression method '%s'") % method);
 }
 
-ref<std::string> compress(const std::string & method, const std::string & in, const bool parallel)
+ref<std::string> compress(const std::string & method, const std::string & in, const bool parallel, int level,
+    unsigned int threads)
 {
     StringSink ssink;
-    auto sink = makeCompressionSink(method, ssink, parallel);
+    auto sink = makeCompressionSink(method, ssink, parallel, level, threads);
     (*sink)(in);
     sink->finish();
     return ssink.s;
@@ -12,14 +12,20 @@ ref<std::string> decompress(const std::string & method, const std::string & in);
 
 void decompress(const std::string & method, Source & source, Sink & sink);
 
-ref<std::string> compress(const std::string & method, const std::string & in, const bool parallel = false);
+/* Compress 'in' using the given method. A 'level' of -1 selects the
+   method's default; it is currently used by 'xz' and 'zstd'. With
+   'parallel', 'threads' threads are used (0 for the number of CPU
+   cores). */
+ref<std::string> compress(const std::string & method, const std::string & in, const bool parallel = false, int level = -1,
+    unsigned int threads = 0);
 
 struct CompressionSink : BufferedSink
 {
     virtual void finish() = 0;
 };
 
-ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink, const bool parallel = false);
+ref<CompressionSink> makeCompressionSink(const std::string & method, Sink & nextSink, const bool parallel = false, int level = -1,
+    unsigned int threads = 0);
 
 MakeError(UnknownCompressionMethod, Error);
 
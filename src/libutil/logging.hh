@@ -35,6 +35,7 @@ typedef enum {
     resSetPhase = 104,
     resProgress = 105,
     resSetExpected = 106,
+    resMissingPath = 107,
 } ResultType;
 
 typedef uint64_t ActivityId;
@@ -1,12 +1,18 @@
 #include "serialise.hh"
 #include "util.hh"
+#include "sync.hh"
 
 #include <cstring>
 #include <cerrno>
 #include <memory>
+#include <thread>
 
 #include <boost/coroutine2/coroutine.hpp>
 
+#if __linux__
+#include <sys/sendfile.h>
+#endif
+
 
 namespace nix {
 
@@ -75,6 +81,39 @@ void FdSink::write(const unsigned char * data, size_t len)
 }
 
 
+void FdSink::writeFromFd(int srcFd, size_t size)
+{
+    flush();
+
+#if __linux__
+    while (size > 0) {
+        checkInterrupt();
+        auto n = sendfile(fd, srcFd, nullptr, std::min(size, (size_t) 1 << 30));
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            /* sendfile() doesn't support every kind of file
+               descriptor, so fall back to copying. */
+            if (errno == EINVAL || errno == ENOSYS) break;
+            _good = false;
+            throw SysError("writing to file");
+        }
+        if (n == 0) throw EndOfFile("unexpected end-of-file");
+        size -= n;
+        written += n;
+    }
+#endif
+
+    std::vector<unsigned char> buf(65536);
+
+    while (size > 0) {
+        auto n = std::min(size, buf.size());
+        readFull(srcFd, buf.data(), n);
+        size -= n;
+        (*this)(buf.data(), n);
+    }
+}
+
+
 bool FdSink::good()
 {
     return _good;
@@ -107,6 +146,21 @@ std::string Source::drain()
 }
 
 
+void Source::drainInto(Sink & sink)
+{
+    std::vector<unsigned char> buf(65536);
+    while (true) {
+        size_t n;
+        try {
+            n = read(buf.data(), buf.size());
+        } catch (EndOfFile &) {
+            break;
+        }
+        sink(buf.data(), n);
+    }
+}
+
+
 size_t BufferedSource::read(unsigned char * data, size_t len)
 {
     if (!buffer) buffer = decltype(buffer)(new unsigned char[bufSize]);
@@ -163,10 +217,15 @@ std::unique_ptr<Source> sinkToSource(std::function<void(Sink &)> fun)
     {
         typedef boost::coroutines2::coroutine<std::string> coro_t;
 
+        /* Note: this must outlive the constructor, since the
+           coroutine keeps running 'fun' after the first yield. */
+        std::function<void(Sink &)> fun;
+
         coro_t::pull_type coro;
 
-        SinkToSource(std::function<void(Sink &)> fun)
-            : coro([&](coro_t::push_type & yield) {
+        SinkToSource(std::function<void(Sink &)> _fun)
+            : fun(_fun)
+            , coro([this](coro_t::push_type & yield) {
                 LambdaSink sink([&](const unsigned char * data, size_t len) {
                     if (len) yield(std::string((const char *) data, len));
                 });
@@ -201,6 +260,95 @@ std::unique_ptr<Source> sinkToSource(std::function<void(Sink &)> fun)
 }
 
 
+std::unique_ptr<Source> sinkToSourceAsync(std::function<void(Sink &)> fun,
+    size_t bufferSize)
+{
+    struct SinkToSourceAsync : Source
+    {
+        struct State
+        {
+            std::string data;
+            bool done = false;
+            bool cancelled = false;
+            std::exception_ptr exc;
+        };
+
+        Sync<State> state_;
+        std::condition_variable avail, space;
+        size_t bufferSize;
+        std::thread thread;
+
+        std::string cur;
+        size_t pos = 0;
+
+        SinkToSourceAsync(std::function<void(Sink &)> fun, size_t bufferSize)
+            : bufferSize(bufferSize)
+        {
+            thread = std::thread([this, fun]() {
+                std::exception_ptr exc;
+
+                try {
+                    LambdaSink sink([&](const unsigned char * data, size_t len) {
+                        if (!len) return;
+                        auto state(state_.lock());
+                        while (!state->cancelled && state->data.size() >= this->bufferSize)
+                            state.wait(space);
+                        if (state->cancelled)
+                            throw Error("reader of asynchronous source has gone away");
+                        state->data.append((const char *) data, len);
+                        avail.notify_one();
+                    });
+                    fun(sink);
+                } catch (...) {
+                    exc = std::current_exception();
+                }
+
+                auto state(state_.lock());
+                state->done = true;
+                state->exc = exc;
+                avail.notify_one();
+            });
+        }
+
+        ~SinkToSourceAsync()
+        {
+            {
+                auto state(state_.lock());
+                state->cancelled = true;
+                space.notify_one();
+            }
+            thread.join();
+        }
+
+        size_t read(unsigned char * data, size_t len) override
+        {
+            if (pos == cur.size()) {
+                auto state(state_.lock());
+                while (state->data.empty()) {
+                    if (state->done) {
+                        if (state->exc) std::rethrow_exception(state->exc);
+                        throw EndOfFile("asynchronous source has finished");
+                    }
+                    state.wait(avail);
+                }
+                cur = std::move(state->data);
+                state->data.clear();
+                pos = 0;
+                space.notify_one();
+            }
+
+            auto n = std::min(cur.size() - pos, len);
+            memcpy(data, (unsigned char *) cur.data() + pos, n);
+            pos += n;
+
+            return n;
+        }
+    };
+
+    return std::make_unique<SinkToSourceAsync>(fun, bufferSize);
+}
+
+
 void writePadding(size_t len, Sink & sink)
 {
     if (len % 8) {
@@ -63,6 +63,9 @@ struct Source
     virtual bool good() { return true; }
 
     std::string drain();
+
+    /* Copy all remaining data to 'sink'. */
+    void drainInto(Sink & sink);
 };
 
 
@@ -109,6 +112,11 @@ struct FdSink : BufferedSink
 
     void write(const unsigned char * data, size_t len) override;
 
+    /* Write 'size' bytes read from 'srcFd' (typically a regular
+       file). Where the platform supports it, the kernel copies the
+       data directly, without going through a userspace buffer. */
+    void writeFromFd(int srcFd, size_t size);
+
     bool good() override;
 
 private:
@@ -213,6 +221,13 @@ struct LambdaSource : Source
    Source executes the function as a coroutine. */
 std::unique_ptr<Source> sinkToSource(std::function<void(Sink &)> fun);
 
+/* Like sinkToSource(), but run the function in a separate thread, so
+   that producing and consuming the data can proceed in parallel. At
+   most (roughly) 'bufferSize' bytes are buffered between them.
+   Exceptions thrown by the function are rethrown by read(). */
+std::unique_ptr<Source> sinkToSourceAsync(std::function<void(Sink &)> fun,
+    size_t bufferSize);
+
 
 void writePadding(size_t len, Sink & sink);
 void writeString(const unsigned char * buf, size_t len, Sink & sink);
@@ -9,8 +9,14 @@
 #include "monitor-fd.hh"
 #include "derivations.hh"
 #include "finally.hh"
+#include "multiplexer.hh"
 
 #include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+#include <shared_mutex>
+#include <thread>
 
 #include <cstring>
 #include <unistd.h>
@@ -25,6 +31,7 @@
 #include <grp.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <poll.h>
 
 #if __APPLE__ || __FreeBSD__
 #include <sys/ucred.h>
@@ -84,9 +91,12 @@ struct TunnelLogger : public Logger
 
     Sync<State> state_;
 
+    FdSink & to;
+
     unsigned int clientVersion;
 
-    TunnelLogger(unsigned int clientVersion) : clientVersion(clientVersion) { }
+    TunnelLogger(FdSink & to, unsigned int clientVersion)
+        : to(to), clientVersion(clientVersion) { }
 
     void enqueueMsg(const std::string & s)
     {
@@ -196,7 +206,8 @@ struct TunnelSink : Sink
 struct TunnelSource : BufferedSource
 {
     Source & from;
-    TunnelSource(Source & from) : from(from) { }
+    FdSink & to;
+    TunnelSource(Source & from, FdSink & to) : from(from), to(to) { }
     size_t readUnbuffered(unsigned char * data, size_t len)
     {
         to << STDERR_READ << len;
@@ -234,9 +245,118 @@ struct RetrieveRegularNARSink : ParseSink
 };
 
 
+/* The options that a client sets with wopSetOptions. */
+struct ClientSettings
+{
+    bool keepFailed;
+    bool keepGoing;
+    bool tryFallback;
+    Verbosity verbosity;
+    unsigned int maxBuildJobs;
+    time_t maxSilentTime;
+    bool verboseBuild;
+    unsigned int buildCores;
+    bool useSubstitutes;
+    StringMap overrides;
+
+    void read(Source & from, unsigned int clientVersion)
+    {
+        keepFailed = readInt(from);
+        keepGoing = readInt(from);
+        tryFallback = readInt(from);
+        verbosity = (Verbosity) readInt(from);
+        maxBuildJobs = readInt(from);
+        maxSilentTime = readInt(from);
+        readInt(from); // obsolete useBuildHook
+        verboseBuild = lvlError == (Verbosity) readInt(from);
+        readInt(from); // obsolete logType
+        readInt(from); // obsolete printBuildTrace
+        buildCores = readInt(from);
+        useSubstitutes  = readInt(from);
+
+        if (GET_PROTOCOL_MINOR(clientVersion) >= 12) {
+            unsigned int n = readInt(from);
+            for (unsigned int i = 0; i < n; i++) {
+                string name = readString(from);
+                string value = readString(from);
+                overrides.emplace(name, value);
+            }
+        }
+    }
+
+    /* Write the settings in the format expected by read() for the
+       current protocol version. */
+    void write(Sink & to)
+    {
+        to << keepFailed << keepGoing << tryFallback << verbosity
+           << maxBuildJobs << maxSilentTime
+           << 1
+           << (verboseBuild ? lvlError : lvlVomit)
+           << 0 // obsolete log type
+           << 0 // obsolete print build trace
+           << buildCores << useSubstitutes
+           << overrides.size();
+        for (auto & i : overrides)
+            to << i.first << i.second;
+    }
+
+    void apply(bool trusted)
+    {
+        settings.keepFailed = keepFailed;
+        settings.keepGoing = keepGoing;
+        settings.tryFallback = tryFallback;
+        nix::verbosity = verbosity;
+        settings.maxBuildJobs.assign(maxBuildJobs);
+        settings.maxSilentTime = maxSilentTime;
+        settings.verboseBuild = verboseBuild;
+        settings.buildCores = buildCores;
+        settings.useSubstitutes = useSubstitutes;
+
+        for (auto & i : overrides) {
+            auto & name(i.first);
+            auto & value(i.second);
+
+            auto setSubstituters = [&](Setting<Strings> & res) {
+                if (name != res.name && res.aliases.count(name) == 0)
+                    return false;
+                StringSet trusted = settings.trustedSubstituters;
+                for (auto & s : settings.substituters.get())
+                    trusted.insert(s);
+                Strings subs;
+                auto ss = tokenizeString<Strings>(value);
+                for (auto & s : ss)
+                    if (trusted.count(s))
+                        subs.push_back(s);
+                    else
+                        warn("ignoring untrusted substituter '%s'", s);
+                res = subs;
+                return true;
+            };
+
+            try {
+                if (name == "ssh-auth-sock") // obsolete
+                    ;
+                else if (trusted
+                    || name == settings.buildTimeout.name
+                    || name == settings.connectTimeout.name)
+                    settings.set(name, value);
+                else if (setSubstituters(settings.substituters))
+                    ;
+                else if (setSubstituters(settings.extraSubstituters))
+                    ;
+                else
+                    debug("ignoring untrusted setting '%s'", name);
+            } catch (UsageError & e) {
+                warn(e.what());
+            }
+        }
+    }
+};
+
+
 static void performOp(TunnelLogger * logger, ref<LocalStore> store,
     bool trusted, unsigned int clientVersion,
-    Source & from, Sink & to, unsigned int op)
+    Source & from, FdSink & to, unsigned int op)
 {
     switch (op) {
 
@@ -310,6 +430,20 @@ static void performOp(TunnelLogger * logger, ref<LocalStore> store,
         break;
     }
 
+    case wopQueryMultipleReferrers:
+    case wopQueryMultipleDerivationOutputs: {
+        auto paths = readStorePaths<PathSet>(*store, from);
+        logger->startWork();
+        auto res = op == wopQueryMultipleReferrers
+            ? store->queryMultipleReferrers(paths)
+            : store->queryMultipleDerivationOutputs(paths);
+        logger->stopWork();
+        to << res.size();
+        for (auto & i : res)
+            to << i.first << i.second;
+        break;
+    }
+
     case wopQueryDerivationOutputNames: {
         Path path = readStorePath(*store, from);
         logger->startWork();
@@ -338,6 +472,42 @@ static void performOp(TunnelLogger * logger, ref<LocalStore> store,
         break;
     }
 
+    case wopQueryPathsFromHashParts: {
+        auto hashParts = readStrings<StringSet>(from);
+        logger->startWork();
+        auto paths = store->queryPathsFromHashParts(hashParts);
+        logger->stopWork();
+        to << paths.size();
+        for (auto & i : paths)
+            to << i.first << i.second;
+        break;
+    }
+
+    case wopScanValidPaths: {
+        ValidPathFilter filter;
+        bool withInfo;
+        from >> filter.hashPrefix >> filter.namePrefix >> withInfo;
+        logger->startWork();
+        logger->stopWork();
+        /* Stream the paths rather than collecting them first. Errors
+           can no longer be sent through the logger at this point. */
+        try {
+            store->scanValidPaths(filter, withInfo,
+                [&](const Path & path, std::shared_ptr<const ValidPathInfo> info) {
+                    to << 1 << path;
+                    if (info)
+                        to << info->deriver << info->narHash.to_string(Base16, false)
+                           << info->references << info->registrationTime << info->narSize
+                           << info->ultimate << info->sigs << info->ca;
+                });
+        } catch (Error & e) {
+            to << 2 << e.msg();
+            break;
+        }
+        to << 0;
+        break;
+    }
+
     case wopAddToStore: {
         bool fixed, recursive;
         std::string s, baseName;
@@ -394,7 +564,7 @@ static void performOp(TunnelLogger * logger, ref<LocalStore> store,
 
     case wopImportPaths: {
         logger->startWork();
-        TunnelSource source(from);
+        TunnelSource source(from, to);
         Paths paths = store->importPaths(source, nullptr,
             trusted ? NoCheckSigs : CheckSigs);
         logger->stopWork();
@@ -503,70 +673,10 @@ static void performOp(TunnelLogger * logger, ref<LocalStore> store,
     }
 
     case wopSetOptions: {
-        settings.keepFailed = readInt(from);
-        settings.keepGoing = readInt(from);
-        settings.tryFallback = readInt(from);
-        verbosity = (Verbosity) readInt(from);
-        settings.maxBuildJobs.assign(readInt(from));
-        settings.maxSilentTime = readInt(from);
-        readInt(from); // obsolete useBuildHook
-        settings.verboseBuild = lvlError == (Verbosity) readInt(from);
-        readInt(from); // obsolete logType
-        readInt(from); // obsolete printBuildTrace
-        settings.buildCores = readInt(from);
-        settings.useSubstitutes  = readInt(from);
-
-        StringMap overrides;
-        if (GET_PROTOCOL_MINOR(clientVersion) >= 12) {
-            unsigned int n = readInt(from);
-            for (unsigned int i = 0; i < n; i++) {
-                string name = readString(from);
-                string value = readString(from);
-                overrides.emplace(name, value);
-            }
-        }
-
+        ClientSettings clientSettings;
+        clientSettings.read(from, clientVersion);
         logger->startWork();
-
-        for (auto & i : overrides) {
-            auto & name(i.first);
-            auto & value(i.second);
-
-            auto setSubstituters = [&](Setting<Strings> & res) {
-                if (name != res.name && res.aliases.count(name) == 0)
-                    return false;
-                StringSet trusted = settings.trustedSubstituters;
-                for (auto & s : settings.substituters.get())
-                    trusted.insert(s);
-                Strings subs;
-                auto ss = tokenizeString<Strings>(value);
-                for (auto & s : ss)
-                    if (trusted.count(s))
-                        subs.push_back(s);
-                    else
-                        warn("ignoring untrusted substituter '%s'", s);
-                res = subs;
-                return true;
-            };
-
-            try {
-                if (name == "ssh-auth-sock") // obsolete
-                    ;
-                else if (trusted
-                    || name == settings.buildTimeout.name
-                    || name == settings.connectTimeout.name)
-                    settings.set(name, value);
-                else if (setSubstituters(settings.substituters))
-                    ;
-                else if (setSubstituters(settings.extraSubstituters))
-                    ;
-                else
-                    debug("ignoring untrusted setting '%s'", name);
-            } catch (UsageError & e) {
-                warn(e.what());
-            }
-        }
-
+        clientSettings.apply(trusted);
         logger->stopWork();
         break;
     }
@@ -635,6 +745,21 @@ static void performOp(TunnelLogger * logger, ref<LocalStore> store,
         break;
     }
 
+    case wopQueryPathInfos: {
+        auto paths = readStorePaths<PathSet>(*store, from);
+        logger->startWork();
+        auto infos = store->queryPathInfos(paths);
+        logger->stopWork();
+        to << infos.size();
+        for (auto & i : infos) {
+            auto & info(i.second);
+            to << i.first << info->deriver << info->narHash.to_string(Base16, false)
+               << info->references << info->registrationTime << info->narSize
+               << info->ultimate << info->sigs << info->ca;
+        }
+        break;
+    }
+
     case wopOptimiseStore:
         logger->startWork();
         store->optimiseStore();
@@ -691,12 +816,33 @@ static void performOp(TunnelLogger * logger, ref<LocalStore> store,
         if (!trusted)
             info.ultimate = false;
 
-        TeeSink tee(from);
-        parseDump(tee, tee.source);
-
+        /* Stream the NAR straight into the store rather than reading
+           it into memory first. It's parsed on the way, so that
+           exactly the NAR is read from the connection, whatever size
+           the client claims. The store doesn't read the NAR if the
+           path is already valid or if it throws, so parse whatever it
+           left. Log messages are queued until then, since the client
+           only reads them after sending the whole NAR. */
+        auto nar = sinkToSource([&](Sink & sink) {
+            LambdaSource tee([&](unsigned char * data, size_t len) {
+                size_t n = from.read(data, len);
+                sink(data, n);
+                return n;
+            });
+            ParseSink parseSink; /* null sink; just parse the NAR */
+            parseDump(parseSink, tee);
+        });
+        std::exception_ptr ex;
+        try {
+            store.cast<Store>()->addToStore(info, *nar, (RepairFlag) repair,
+                dontCheckSigs ? NoCheckSigs : CheckSigs, nullptr);
+        } catch (Error & e) {
+            ex = std::current_exception();
+        }
+        LambdaSink discard([](const unsigned char * data, size_t len) { });
+        nar->drainInto(discard);
         logger->startWork();
-        store.cast<Store>()->addToStore(info, tee.source.data, (RepairFlag) repair,
-            dontCheckSigs ? NoCheckSigs : CheckSigs, nullptr);
+        if (ex) std::rethrow_exception(ex);
         logger->stopWork();
         break;
     }
@@ -718,21 +864,244 @@ static void performOp(TunnelLogger * logger, ref<LocalStore> store,
 }
 
 
-static void processConnection(bool trusted)
+/* The logger of the connection served by the current thread. */
+static thread_local TunnelLogger * threadLogger = nullptr;
+
+
+/* Logger that sends messages to the client of the current thread,
+   or to 'fallback' in threads not serving a connection. */
+struct ThreadLogger : Logger
+{
+    Logger * fallback;
+
+    ThreadLogger(Logger * fallback) : fallback(fallback) { }
+
+    Logger & get()
+    {
+        return threadLogger ? *threadLogger : *fallback;
+    }
+
+    void log(Verbosity lvl, const FormatOrString & fs) override
+    {
+        get().log(lvl, fs);
+    }
+
+    void startActivity(ActivityId act, Verbosity lvl, ActivityType type,
+        const std::string & s, const Fields & fields, ActivityId parent) override
+    {
+        get().startActivity(act, lvl, type, s, fields, parent);
+    }
+
+    void stopActivity(ActivityId act) override
+    {
+        get().stopActivity(act);
+    }
+
+    void result(ActivityId act, ResultType type, const Fields & fields) override
+    {
+        get().result(act, type, fields);
+    }
+};
+
+
+/* Whether 'op' can be performed by a connection thread. */
+static bool canPerformInThread(WorkerOp op)
+{
+    switch (op) {
+    case wopIsValidPath:
+    case wopQueryValidPaths:
+    case wopQueryPathHash:
+    case wopQueryReferences:
+    case wopQueryReferrers:
+    case wopQueryValidDerivers:
+    case wopQueryDerivationOutputs:
+    case wopQueryDerivationOutputNames:
+    case wopQueryDeriver:
+    case wopQueryPathFromHashPart:
+    case wopQueryAllValidPaths:
+    case wopQueryPathInfo:
+    case wopQueryPathInfos:
+    case wopQueryMultipleReferrers:
+    case wopQueryMultipleDerivationOutputs:
+    case wopQueryPathsFromHashParts:
+    case wopScanValidPaths:
+    case wopNarFromPath:
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+/* A connection that a thread of the daemon started serving and then
+   handed off to a child process (see serveConnection()). */
+struct HandedOffConnection
+{
+    unsigned int clientVersion;
+    bool haveSettings = false;
+    ClientSettings settings;
+
+    /* The operation that the thread could not perform. */
+    WorkerOp op;
+};
+
+
+/* Whether 'op' runs a Worker. A process runs one Worker at a time,
+   so such operations on different channels of a multiplexed
+   connection are serialised. */
+static bool isBuildOp(WorkerOp op)
+{
+    switch (op) {
+    case wopBuildPaths:
+    case wopEnsurePath:
+    case wopBuildDerivation:
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+/* Whether 'op' changes the settings or works on the whole store, so
+   that no other operation that modifies the store may run at the same
+   time. */
+static bool needsExclusive(WorkerOp op)
+{
+    switch (op) {
+    case wopSetOptions:
+    case wopCollectGarbage:
+    case wopOptimiseStore:
+    case wopVerifyStore:
+        return true;
+    default:
+        return false;
+    }
+}
+
+
+/* Perform the operations sent on one channel of a multiplexed
+   connection. A channel starts out where its connection was when it
+   sent wopMultiplex, so there is no handshake. Queries run
+   concurrently with everything else. Other operations hold
+   'exclusive' in shared mode, except for those that need it
+   exclusively (see needsExclusive()), and builds are additionally
+   serialised through 'building'. Since the multiplexer gives every
+   channel its own window, a channel that is waiting for a lock
+   doesn't hold up the data of the others. */
+static void serveChannel(ref<LocalStore> store, bool trusted, unsigned int clientVersion,
+    std::shared_timed_mutex & exclusive, std::mutex & building, AutoCloseFD fd)
+{
+    FdSource from(fd.get());
+    FdSink to(fd.get());
+
+    TunnelLogger tunnelLogger(to, clientVersion);
+    threadLogger = &tunnelLogger;
+    Finally resetLogger([&]() { threadLogger = nullptr; });
+
+    while (true) {
+        WorkerOp op;
+        try {
+            op = (WorkerOp) readInt(from);
+        } catch (EndOfFile & e) {
+            return;
+        }
+
+        try {
+            if (op == wopMultiplex)
+                throw Error("cannot multiplex a channel of a multiplexed connection");
+            if (canPerformInThread(op))
+                performOp(&tunnelLogger, store, trusted, clientVersion, from, to, op);
+            else if (needsExclusive(op)) {
+                std::unique_lock<std::shared_timed_mutex> lock(exclusive);
+                performOp(&tunnelLogger, store, trusted, clientVersion, from, to, op);
+            } else {
+                std::shared_lock<std::shared_timed_mutex> lock(exclusive);
+                std::unique_lock<std::mutex> buildLock(building, std::defer_lock);
+                if (isBuildOp(op)) buildLock.lock();
+                performOp(&tunnelLogger, store, trusted, clientVersion, from, to, op);
+            }
+        } catch (Error & e) {
+            bool errorAllowed = tunnelLogger.state_.lock()->canSendStderr;
+            tunnelLogger.stopWork(false, e.msg(), e.status);
+            if (!errorAllowed) throw;
+        } catch (std::bad_alloc & e) {
+            tunnelLogger.stopWork(false, "Nix daemon out of memory", 1);
+            throw;
+        }
+
+        to.flush();
+
+        assert(!tunnelLogger.state_.lock()->canSendStderr);
+    }
+}
+
+
+/* Serve the connection on 'from'/'to' as a multiplexed connection
+   (see multiplexer.hh) until the client closes it. Every channel is
+   served by its own thread. */
+static void serveMultiplexed(ref<LocalStore> store, bool trusted, unsigned int clientVersion,
+    Logger * prevLogger)
+{
+    if (from.hasData())
+        throw Error("client sent data before multiplexing was acknowledged");
+
+    /* Messages from threads other than the channel threads must not
+       go to the connection, since it no longer speaks the plain
+       protocol. */
+    ThreadLogger channelLogger(prevLogger);
+    auto connLogger = logger;
+    logger = &channelLogger;
+    Finally restoreLogger([&]() { logger = connLogger; });
+
+    std::shared_timed_mutex exclusive;
+    std::mutex building;
+    Sync<std::list<std::thread>> threads_;
+
+    {
+        Multiplexer mux(from.fd, to.fd, [&](AutoCloseFD && fd) {
+            auto channel = std::make_shared<AutoCloseFD>(std::move(fd));
+            threads_.lock()->emplace_back([&, channel]() {
+                try {
+                    serveChannel(store, trusted, clientVersion, exclusive, building, std::move(*channel));
+                } catch (Interrupted & e) {
+                } catch (std::exception & e) {
+                    printError("error processing channel: %s", e.what());
+                }
+            });
+        });
+
+        mux.wait();
+    }
+
+    /* The multiplexer has closed all channels, so the threads will
+       finish their current operation and exit. */
+    for (auto & thread : *threads_.lock())
+        thread.join();
+}
+
+
+static void processConnection(bool trusted, HandedOffConnection * handedOff = nullptr)
 {
     MonitorFdHup monitor(from.fd);
 
-    /* Exchange the greeting. */
-    unsigned int magic = readInt(from);
-    if (magic != WORKER_MAGIC_1) throw Error("protocol mismatch");
-    to << WORKER_MAGIC_2 << PROTOCOL_VERSION;
-    to.flush();
-    unsigned int clientVersion = readInt(from);
+    unsigned int clientVersion;
+
+    if (handedOff)
+        clientVersion = handedOff->clientVersion;
+
+    else {
+        /* Exchange the greeting. */
+        unsigned int magic = readInt(from);
+        if (magic != WORKER_MAGIC_1) throw Error("protocol mismatch");
+        to << WORKER_MAGIC_2 << PROTOCOL_VERSION;
+        to.flush();
+        clientVersion = readInt(from);
 
-    if (clientVersion < 0x10a)
-        throw Error("the Nix client version is too old");
+        if (clientVersion < 0x10a)
+            throw Error("the Nix client version is too old");
+    }
 
-    auto tunnelLogger = new TunnelLogger(clientVersion);
+    auto tunnelLogger = new TunnelLogger(to, clientVersion);
     auto prevLogger = nix::logger;
     logger = tunnelLogger;
 
@@ -743,13 +1112,15 @@ static void processConnection(bool trusted)
         prevLogger->log(lvlDebug, fmt("%d operations", opCount));
     });
 
-    if (GET_PROTOCOL_MINOR(clientVersion) >= 14 && readInt(from))
-        setAffinityTo(readInt(from));
+    if (!handedOff) {
+        if (GET_PROTOCOL_MINOR(clientVersion) >= 14 && readInt(from))
+            setAffinityTo(readInt(from));
 
-    readInt(from); // obsolete reserveSpace
+        readInt(from); // obsolete reserveSpace
 
-    /* Send startup error messages to the client. */
-    tunnelLogger->startWork();
+        /* Send startup error messages to the client. */
+        tunnelLogger->startWork();
+    }
 
     try {
 
@@ -769,22 +1140,42 @@ static void processConnection(bool trusted)
         params["path-info-cache-size"] = "0";
         auto store = make_ref<LocalStore>(params);
 
-        tunnelLogger->stopWork();
-        to.flush();
+        if (handedOff) {
+            /* Any messages produced here are sent along with the
+               result of the first operation. */
+            if (handedOff->haveSettings)
+                handedOff->settings.apply(trusted);
+        } else {
+            tunnelLogger->stopWork();
+            to.flush();
+        }
 
         /* Process client requests. */
         while (true) {
             WorkerOp op;
-            try {
-                op = (WorkerOp) readInt(from);
-            } catch (Interrupted & e) {
-                break;
-            } catch (EndOfFile & e) {
-                break;
+            if (handedOff) {
+                op = handedOff->op;
+                handedOff = nullptr;
+            } else {
+                try {
+                    op = (WorkerOp) readInt(from);
+                } catch (Interrupted & e) {
+                    break;
+                } catch (EndOfFile & e) {
+                    break;
+                }
             }
 
             opCount++;
 
+            if (op == wopMultiplex) {
+                tunnelLogger->startWork();
+                tunnelLogger->stopWork();
+                to.flush();
+                serveMultiplexed(store, trusted, clientVersion, prevLogger);
+                break;
+            }
+
             try {
                 performOp(tunnelLogger, store, trusted, clientVersion, from, to, op);
             } catch (Error & e) {
@@ -898,6 +1289,425 @@ static PeerInfo getPeerInfo(int remote)
 }
 
 
+/* In multi-threaded mode ('daemon-threads' > 0), connections are
+   served by a pool of threads sharing a single LocalStore, which
+   avoids forking, opening the database and starting with a cold path
+   info cache for every connection. Only queries are performed in
+   these threads. Operations that depend on per-process state, such
+   as the client's options, temporary GC roots or the build machinery,
+   cause the connection to be handed off to a child process, which
+   then carries on like in the forking daemon. Since other threads may
+   hold locks at any time, the children are not forked by the daemon
+   itself but by a "forker" process started before any threads. */
+
+
+struct PendingConnection
+{
+    AutoCloseFD fd;
+    bool trusted;
+    PeerInfo peer;
+};
+
+
+/* Send 'fd' and 'data' over the Unix domain socket 'sock'. */
+static void sendConnection(int sock, int fd, const std::string & data)
+{
+    struct iovec iov;
+    iov.iov_base = (void *) data.data();
+    iov.iov_len = data.size();
+
+    char control[CMSG_SPACE(sizeof(int))];
+    memset(control, 0, sizeof(control));
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    if (sendmsg(sock, &msg, 0) == -1)
+        throw SysError("handing off connection");
+}
+
+
+/* Receive a file descriptor and data sent by sendConnection().
+   Return false if the other side has closed the socket. */
+static bool receiveConnection(int sock, AutoCloseFD & fd, std::string & data)
+{
+    std::vector<char> buf(1024 * 1024);
+
+    struct iovec iov;
+    iov.iov_base = buf.data();
+    iov.iov_len = buf.size();
+
+    char control[CMSG_SPACE(sizeof(int))];
+
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    ssize_t n;
+    while ((n = recvmsg(sock, &msg, 0)) == -1) {
+        checkInterrupt();
+        if (errno != EINTR) throw SysError("receiving handed-off connection");
+    }
+
+    if (n == 0) return false;
+
+    struct cmsghdr * cmsg = CMSG_FIRSTHDR(&msg);
+    if (!cmsg || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+        throw Error("handed-off connection lacks a file descriptor");
+    int fd2;
+    memcpy(&fd2, CMSG_DATA(cmsg), sizeof(int));
+    fd = fd2;
+    closeOnExec(fd.get());
+
+    data = std::string(buf.data(), n);
+    return true;
+}
+
+
+/* Fork a child process for every connection received on 'sock'. */
+static void runForker(int sock, char * * argv)
+{
+    while (true) {
+        try {
+            AutoCloseFD remote;
+            std::string data;
+            if (!receiveConnection(sock, remote, data)) return;
+
+            StringSource source(data);
+            bool trusted = readInt(source);
+            pid_t peerPid = readInt(source);
+            HandedOffConnection handedOff;
+            handedOff.clientVersion = readInt(source);
+            handedOff.haveSettings = readInt(source);
+            if (handedOff.haveSettings)
+                handedOff.settings.read(source, PROTOCOL_VERSION);
+            handedOff.op = (WorkerOp) readInt(source);
+            auto buffered = readString(source);
+
+            ProcessOptions options;
+            options.errorPrefix = "unexpected Nix daemon error: ";
+            options.dieWithParent = false;
+            options.runExitHandlers = true;
+            options.allowVfork = false;
+            startProcess([&]() {
+                close(sock);
+
+                if (setsid() == -1)
+                    throw SysError(format("creating a new session"));
+
+                setSigChldAction(false);
+
+                if (peerPid && argv[1]) {
+                    string processName = std::to_string(peerPid);
+                    strncpy(argv[1], processName.c_str(), strlen(argv[1]));
+                }
+
+                from.fd = remote.get();
+                to.fd = remote.get();
+
+                /* Pass on the data that the connection thread had
+                   already read from the client. */
+                if (!buffered.empty()) {
+                    from.buffer = decltype(from.buffer)(
+                        new unsigned char[std::max(from.bufSize, buffered.size())]);
+                    memcpy(from.buffer.get(), buffered.data(), buffered.size());
+                    from.bufPosIn = buffered.size();
+                    from.bufPosOut = 0;
+                }
+
+                processConnection(trusted, &handedOff);
+
+                exit(0);
+            }, options);
+
+        } catch (Interrupted & e) {
+            return;
+        } catch (Error & e) {
+            printError(format("error handing off connection: %1%") % e.msg());
+        }
+    }
+}
+
+
+/* Set the timeout of blocking reads and writes on the socket 'fd'
+   (0 for no timeout). */
+static void setSocketTimeout(int fd, unsigned int seconds)
+{
+    struct timeval tv;
+    tv.tv_sec = seconds;
+    tv.tv_usec = 0;
+    if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) == -1 ||
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) == -1)
+        throw SysError("setting socket timeout");
+}
+
+
+/* Threads are handed a connection only once it has become readable,
+   and give it back after every request, so idle clients don't tie up
+   threads. This is how long a thread waits for a client that has
+   started sending the greeting or a request to send the rest of it,
+   or to accept the reply. */
+static const unsigned int clientTimeout = 60;
+
+
+struct ThreadedDaemon
+{
+    struct Connection
+    {
+        PendingConnection conn;
+        FdSource from;
+        FdSink to;
+        bool greeted = false;
+        HandedOffConnection state;
+        std::unique_ptr<TunnelLogger> logger;
+
+        Connection(PendingConnection && conn)
+            : conn(std::move(conn))
+            , from(this->conn.fd.get())
+            , to(this->conn.fd.get())
+        { }
+    };
+
+    AutoCloseFD forker;
+
+    ref<LocalStore> store;
+
+    /* Connections with a request (or the greeting) to be read. */
+    Sync<std::queue<std::shared_ptr<Connection>>> queue_;
+    std::condition_variable wakeup;
+
+    /* Connections waiting for the client to send something, indexed
+       by file descriptor, and a pipe to make the poller thread
+       notice new ones. */
+    Sync<std::map<int, std::shared_ptr<Connection>>> idle_;
+    Pipe pollerWakeup;
+
+    ThreadedDaemon(AutoCloseFD && forker)
+        : forker(std::move(forker))
+        , store(make_ref<LocalStore>(Store::Params()))
+    {
+        logger = new ThreadLogger(logger);
+
+        pollerWakeup.create();
+        fcntl(pollerWakeup.readSide.get(), F_SETFL, O_NONBLOCK);
+        fcntl(pollerWakeup.writeSide.get(), F_SETFL, O_NONBLOCK);
+
+        std::thread([this]() { pollerThread(); }).detach();
+
+        for (unsigned int n = 0; n < settings.daemonThreads; n++)
+            std::thread([this]() { workerThread(); }).detach();
+    }
+
+    void enqueue(PendingConnection && conn)
+    {
+        setSocketTimeout(conn.fd.get(), clientTimeout);
+        makeIdle(std::make_shared<Connection>(std::move(conn)));
+    }
+
+    void makeReady(std::shared_ptr<Connection> conn)
+    {
+        queue_.lock()->push(conn);
+        wakeup.notify_one();
+    }
+
+    void makeIdle(std::shared_ptr<Connection> conn)
+    {
+        /* Requests that the client sent before it received our
+           previous reply may already be buffered. */
+        if (conn->from.hasData()) {
+            makeReady(conn);
+            return;
+        }
+        idle_.lock()->emplace(conn->conn.fd.get(), conn);
+        /* If the pipe is full, the poller has a wakeup pending
+           anyway. */
+        if (write(pollerWakeup.writeSide.get(), "x", 1) == -1 && errno != EAGAIN)
+            throw SysError("waking up the poller thread");
+    }
+
+    void pollerThread()
+    {
+        while (true) {
+            std::vector<struct pollfd> fds;
+            fds.push_back({pollerWakeup.readSide.get(), POLLIN, 0});
+            for (auto & i : *idle_.lock())
+                fds.push_back({i.first, POLLIN, 0});
+
+            if (poll(fds.data(), fds.size(), -1) == -1) {
+                if (errno == EINTR) continue;
+                printError("error polling daemon connections: %s", strerror(errno));
+                return;
+            }
+
+            if (fds[0].revents) {
+                char buf[1024];
+                while (read(pollerWakeup.readSide.get(), buf, sizeof(buf)) > 0) ;
+            }
+
+            for (size_t n = 1; n < fds.size(); n++) {
+                if (!fds[n].revents) continue;
+                std::shared_ptr<Connection> conn;
+                {
+                    auto idle(idle_.lock());
+                    auto i = idle->find(fds[n].fd);
+                    assert(i != idle->end());
+                    conn = i->second;
+                    idle->erase(i);
+                }
+                makeReady(conn);
+            }
+        }
+    }
+
+    void workerThread()
+    {
+        while (true) {
+            std::shared_ptr<Connection> conn;
+            {
+                auto queue(queue_.lock());
+                while (queue->empty()) queue.wait(wakeup);
+                conn = queue->front();
+                queue->pop();
+            }
+
+            try {
+                if (serveRequest(*conn))
+                    makeIdle(conn);
+            } catch (Interrupted & e) {
+                return;
+            } catch (std::exception & e) {
+                printError("error processing connection: %s", e.what());
+            }
+        }
+    }
+
+    void greet(Connection & conn)
+    {
+        unsigned int magic = readInt(conn.from);
+        if (magic != WORKER_MAGIC_1) throw Error("protocol mismatch");
+        conn.to << WORKER_MAGIC_2 << PROTOCOL_VERSION;
+        conn.to.flush();
+
+        conn.state.clientVersion = readInt(conn.from);
+
+        if (conn.state.clientVersion < 0x10a)
+            throw Error("the Nix client version is too old");
+
+        /* CPU affinity is per process, so ignore it. */
+        if (GET_PROTOCOL_MINOR(conn.state.clientVersion) >= 14 && readInt(conn.from))
+            readInt(conn.from);
+
+        readInt(conn.from); // obsolete reserveSpace
+
+        conn.logger = std::make_unique<TunnelLogger>(conn.to, conn.state.clientVersion);
+        conn.logger->startWork();
+        conn.logger->stopWork();
+        conn.to.flush();
+
+        conn.greeted = true;
+    }
+
+    /* Read and perform the next request from 'conn'. Return false if
+       the connection is finished, either because the client closed
+       it or because it has been handed off. */
+    bool serveRequest(Connection & conn)
+    {
+        if (!conn.greeted) {
+            greet(conn);
+            return true;
+        }
+
+        auto & state(conn.state);
+        auto & tunnelLogger(*conn.logger);
+
+        threadLogger = &tunnelLogger;
+        Finally resetLogger([&]() { threadLogger = nullptr; });
+
+        try {
+            state.op = (WorkerOp) readInt(conn.from);
+        } catch (EndOfFile & e) {
+            return false;
+        }
+
+        if (state.op == wopSetOptions) {
+            /* Options are global, so just remember them for
+               when the connection is handed off. */
+            state.settings = ClientSettings();
+            state.settings.read(conn.from, state.clientVersion);
+            state.haveSettings = true;
+            tunnelLogger.startWork();
+            tunnelLogger.stopWork();
+        }
+
+        else if (!canPerformInThread(state.op)) {
+            handOff(conn);
+            return false;
+        }
+
+        else {
+            store->clearPathInfoCacheIfStale();
+
+            try {
+                performOp(&tunnelLogger, store, conn.conn.trusted, state.clientVersion, conn.from, conn.to, state.op);
+            } catch (Error & e) {
+                bool errorAllowed = tunnelLogger.state_.lock()->canSendStderr;
+                tunnelLogger.stopWork(false, e.msg(), e.status);
+                if (!errorAllowed) throw;
+            } catch (std::bad_alloc & e) {
+                tunnelLogger.stopWork(false, "Nix daemon out of memory", 1);
+                throw;
+            }
+        }
+
+        conn.to.flush();
+
+        assert(!tunnelLogger.state_.lock()->canSendStderr);
+
+        return true;
+    }
+
+    void handOff(Connection & conn)
+    {
+        auto & state(conn.state);
+
+        debug("handing off connection to a child process for operation %d", state.op);
+
+        /* The child may wait for the client indefinitely (e.g.
+           between requests). */
+        setSocketTimeout(conn.conn.fd.get(), 0);
+
+        StringSink sink;
+        sink
+            << conn.conn.trusted
+            << (conn.conn.peer.pidKnown ? conn.conn.peer.pid : 0)
+            << state.clientVersion
+            << state.haveSettings;
+        if (state.haveSettings)
+            state.settings.write(sink);
+        sink << state.op;
+        if (conn.from.hasData())
+            writeString(conn.from.buffer.get() + conn.from.bufPosOut, conn.from.bufPosIn - conn.from.bufPosOut, sink);
+        else
+            sink << "";
+
+        sendConnection(forker.get(), conn.conn.fd.get(), *sink.s);
+    }
+};
+
+
 #define SD_LISTEN_FDS_START 3
 
 
@@ -964,6 +1774,34 @@ static void daemonLoop(char * * argv)
 
     closeOnExec(fdSocket.get());
 
+    /* Never freed, since its threads run until we exit. */
+    ThreadedDaemon * threadedDaemon = nullptr;
+
+    if (settings.daemonThreads) {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) == -1)
+            throw SysError("creating socket pair");
+        AutoCloseFD forkerSide(fds[0]), daemonSide(fds[1]);
+        closeOnExec(daemonSide.get());
+
+        ProcessOptions options;
+        options.allowVfork = false;
+        startProcess([&]() {
+            fdSocket = -1;
+            daemonSide = -1;
+            runForker(forkerSide.get(), argv);
+            _exit(0);
+        }, options);
+
+        forkerSide = -1;
+
+        threadedDaemon = new ThreadedDaemon(std::move(daemonSide));
+    }
+
+    /* Make accept() return when we're interrupted; otherwise we'd
+       only notice at the next connection. */
+    ReceiveInterrupts receiveInterrupts;
+
     /* Loop accepting connections. */
     while (1) {
 
@@ -1004,6 +1842,11 @@ static void daemonLoop(char * * argv)
                 % (peer.pidKnown ? std::to_string(peer.pid) : "<unknown>")
                 % (peer.uidKnown ? user : "<unknown>"));
 
+            if (threadedDaemon) {
+                threadedDaemon->enqueue({std::move(remote), trusted, peer});
+                continue;
+            }
+
             /* Fork a child to handle the connection. */
             ProcessOptions options;
             options.errorPrefix = "unexpected Nix daemon error: ";
@@ -1,7 +1,9 @@
 #include "archive.hh"
 #include "derivations.hh"
 #include "dotgraph.hh"
+#include "finally.hh"
 #include "globals.hh"
+#include "json.hh"
 #include "local-store.hh"
 #include "monitor-fd.hh"
 #include "serve-protocol.hh"
@@ -13,6 +15,7 @@
 #include <iostream>
 #include <algorithm>
 #include <cstdio>
+#include <mutex>
 
 #include <sys/types.h>
 #include <sys/stat.h>
@@ -483,12 +486,18 @@ static void opReadLog(Strings opFlags, Strings opArgs)
 
 static void opDumpDB(Strings opFlags, Strings opArgs)
 {
-    if (!opFlags.empty()) throw UsageError("unknown flag");
+    ValidPathFilter filter;
+
+    for (auto i = opFlags.begin(); i != opFlags.end(); ++i)
+        if (*i == "--hash-prefix") filter.hashPrefix = getArg(*i, i, opFlags.end());
+        else if (*i == "--name-prefix") filter.namePrefix = getArg(*i, i, opFlags.end());
+        else throw UsageError(format("unknown flag '%1%'") % *i);
+
     if (!opArgs.empty())
         throw UsageError("no arguments expected");
-    PathSet validPaths = store->queryAllValidPaths();
-    for (auto & i : validPaths)
-        cout << store->makeValidityRegistration({i}, true, true);
+    store->scanValidPaths(filter, false, [&](const Path & path, std::shared_ptr<const ValidPathInfo> info) {
+        cout << store->makeValidityRegistration({path}, true, true);
+    });
 }
 
 
@@ -525,6 +534,15 @@ static void opLoadDB(Strings opFlags, Strings opArgs)
 }
 
 
+static void opMigrateDB(Strings opFlags, Strings opArgs)
+{
+    if (!opFlags.empty()) throw UsageError("unknown flag");
+    if (opArgs.size() != 1)
+        throw UsageError("'--migrate-db' requires one argument ('sqlite' or 'log')");
+    ensureLocalStore()->migrateDB(opArgs.front());
+}
+
+
 static void opRegisterValidity(Strings opFlags, Strings opArgs)
 {
     bool reregister = false; // !!! maybe this should be the default
@@ -687,6 +705,72 @@ static void opInit(Strings opFlags, Strings opArgs)
 }
 
 
+/* Forwards everything to another logger, but records the outcome of
+   'nix-store --verify' for printing as JSON. The store may report
+   results from several threads. */
+struct VerifyLogger : Logger
+{
+    Logger & next;
+
+    std::mutex lock;
+
+    std::map<ActivityId, ActivityType> activities;
+
+    uint64_t checked = 0, failed = 0;
+    PathSet corrupted, missing;
+
+    VerifyLogger(Logger & next) : next(next) { }
+
+    void log(Verbosity lvl, const FormatOrString & fs) override
+    {
+        next.log(lvl, fs);
+    }
+
+    void warn(const std::string & msg) override
+    {
+        next.warn(msg);
+    }
+
+    void startActivity(ActivityId act, Verbosity lvl, ActivityType type,
+        const std::string & s, const Fields & fields, ActivityId parent) override
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            activities[act] = type;
+        }
+        next.startActivity(act, lvl, type, s, fields, parent);
+    }
+
+    void stopActivity(ActivityId act) override
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            activities.erase(act);
+        }
+        next.stopActivity(act);
+    }
+
+    void result(ActivityId act, ResultType type, const Fields & fields) override
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (type == resCorruptedPath && !fields.empty())
+                corrupted.insert(fields[0].s);
+            else if (type == resMissingPath && !fields.empty())
+                missing.insert(fields[0].s);
+            else if (type == resProgress && fields.size() >= 4) {
+                auto i = activities.find(act);
+                if (i != activities.end() && i->second == actVerifyPaths) {
+                    checked = std::max(checked, fields[0].i);
+                    failed = std::max(failed, fields[3].i);
+                }
+            }
+        }
+        next.result(act, type, fields);
+    }
+};
+
+
 /* Verify the consistency of the Nix environment. */
 static void opVerify(Strings opFlags, Strings opArgs)
 {
@@ -694,17 +778,49 @@ static void opVerify(Strings opFlags, Strings opArgs)
         throw UsageError("no arguments expected");
 
     bool checkContents = false;
+    bool json = false;
     RepairFlag repair = NoRepair;
 
     for (auto & i : opFlags)
         if (i == "--check-contents") checkContents = true;
         else if (i == "--repair") repair = Repair;
+        else if (i == "--json") json = true;
         else throw UsageError(format("unknown flag '%1%'") % i);
 
-    if (store->verifyStore(checkContents, repair)) {
-        printError("warning: not all errors were fixed");
-        throw Exit(1);
+    if (!json) {
+        if (store->verifyStore(checkContents, repair)) {
+            printError("warning: not all errors were fixed");
+            throw Exit(1);
+        }
+        return;
+    }
+
+    auto prevLogger = logger;
+    VerifyLogger verifyLogger(*prevLogger);
+    logger = &verifyLogger;
+    bool errors;
+    {
+        Finally restoreLogger([&]() { logger = prevLogger; });
+        errors = store->verifyStore(checkContents, repair);
     }
+
+    {
+        JSONObject res(cout, true);
+        res.attr("ok", !errors);
+        res.attr("checked", verifyLogger.checked);
+        res.attr("failed", verifyLogger.failed);
+        {
+            auto list = res.list("corrupted");
+            for (auto & i : verifyLogger.corrupted) list.elem(i);
+        }
+        {
+            auto list = res.list("missing");
+            for (auto & i : verifyLogger.missing) list.elem(i);
+        }
+    }
+    cout << "\n";
+
+    if (errors) throw Exit(1);
 }
 
 
@@ -1006,6 +1122,8 @@ int main(int argc, char * * argv)
                 op = opDumpDB;
             else if (*arg == "--load-db")
                 op = opLoadDB;
+            else if (*arg == "--migrate-db")
+                op = opMigrateDB;
             else if (*arg == "--register-validity")
                 op = opRegisterValidity;
             else if (*arg == "--check-validity")
@@ -1042,7 +1160,8 @@ int main(int argc, char * * argv)
                 noOutput = true;
             else if (*arg != "" && arg->at(0) == '-') {
                 opFlags.push_back(*arg);
-                if (*arg == "--max-freed" || *arg == "--max-links" || *arg == "--max-atime") /* !!! hack */
+                if (*arg == "--max-freed" || *arg == "--max-links" || *arg == "--max-atime"
+                    || *arg == "--hash-prefix" || *arg == "--name-prefix") /* !!! hack */
                     opFlags.push_back(getArg(*arg, arg, end));
             }
             else
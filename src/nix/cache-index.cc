@@ -0,0 +1,38 @@
+#include "command.hh"
+#include "shared.hh"
+#include "binary-cache-store.hh"
+
+using namespace nix;
+
+struct CmdMakeCacheIndex : StoreCommand
+{
+    std::string name() override
+    {
+        return "make-cache-index";
+    }
+
+    std::string description() override
+    {
+        return "write an index of the paths in a binary cache";
+    }
+
+    Examples examples() override
+    {
+        return {
+            Example{
+                "To let clients skip lookups of paths that aren't in a binary cache:",
+                "nix make-cache-index --store file:///tmp/cache"
+            },
+        };
+    }
+
+    void run(ref<Store> store) override
+    {
+        auto binaryCache = store.dynamic_pointer_cast<BinaryCacheStore>();
+        if (!binaryCache)
+            throw Error("store '%s' is not a binary cache", store->getUri());
+        binaryCache->writeCacheIndex();
+    }
+};
+
+static RegisterCommand r1(make_ref<CmdMakeCacheIndex>());
@@ -124,8 +124,11 @@ void StorePathsCommand::run(ref<Store> store)
     if (all) {
         if (installables.size())
             throw UsageError("'--all' does not expect arguments");
-        for (auto & p : store->queryAllValidPaths())
-            storePaths.push_back(p);
+        store->scanValidPaths({}, false, [&](const Path & path, std::shared_ptr<const ValidPathInfo> info) {
+            storePaths.push_back(path);
+        });
+        /* Not every store returns the paths in sorted order. */
+        storePaths.sort();
     }
 
     else {
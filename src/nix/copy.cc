@@ -40,6 +40,12 @@ struct CmdCopy : StorePathsCommand
             .shortName('s')
             .description("whether to try substitutes on the destination store (only supported by SSH)")
             .set(&substitute, Substitute);
+
+        mkFlag()
+            .longName("jobs")
+            .label("n")
+            .description("number of paths to copy in parallel")
+            .handler([](std::string s) { settings.set("copy-jobs", s); });
     }
 
     std::string name() override
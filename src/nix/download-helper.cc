@@ -0,0 +1,42 @@
+#include "command.hh"
+#include "shared.hh"
+#include "download-helper.hh"
+
+using namespace nix;
+
+struct CmdDownloadHelper : Command
+{
+    unsigned int idleTimeout = 600;
+
+    CmdDownloadHelper()
+    {
+        mkIntFlag(0, "idle-timeout", "exit after this many seconds without requests", &idleTimeout);
+    }
+
+    std::string name() override
+    {
+        return "download-helper";
+    }
+
+    std::string description() override
+    {
+        return "perform downloads on behalf of other Nix processes";
+    }
+
+    Examples examples() override
+    {
+        return {
+            Example{
+                "To keep binary cache connections open for an hour after the last download:",
+                "nix download-helper --idle-timeout 3600"
+            },
+        };
+    }
+
+    void run() override
+    {
+        runDownloadHelper(idleTimeout);
+    }
+};
+
+static RegisterCommand r1(make_ref<CmdDownloadHelper>());
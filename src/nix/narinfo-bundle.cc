@@ -0,0 +1,38 @@
+#include "command.hh"
+#include "shared.hh"
+#include "binary-cache-store.hh"
+
+using namespace nix;
+
+struct CmdMakeNarInfoBundle : StoreCommand
+{
+    std::string name() override
+    {
+        return "make-narinfo-bundle";
+    }
+
+    std::string description() override
+    {
+        return "write a bundle of all .narinfo files in a binary cache";
+    }
+
+    Examples examples() override
+    {
+        return {
+            Example{
+                "To let clients fetch all path info from a binary cache in one request:",
+                "nix make-narinfo-bundle --store file:///tmp/cache"
+            },
+        };
+    }
+
+    void run(ref<Store> store) override
+    {
+        auto binaryCache = store.dynamic_pointer_cast<BinaryCacheStore>();
+        if (!binaryCache)
+            throw Error("store '%s' is not a binary cache", store->getUri());
+        binaryCache->writeNarInfoBundle();
+    }
+};
+
+static RegisterCommand r1(make_ref<CmdMakeNarInfoBundle>());
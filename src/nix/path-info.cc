@@ -64,6 +64,10 @@ struct CmdPathInfo : StorePathsCommand, MixJSON
         for (auto & storePath : storePaths)
             pathLen = std::max(pathLen, storePath.size());
 
+        /* Fill the path info cache with a single query rather than
+           one per path. */
+        store->queryPathInfos(PathSet(storePaths.begin(), storePaths.end()));
+
         if (json) {
             JSONPlaceholder jsonRoot(std::cout);
             store->pathInfoToJSON(jsonRoot,
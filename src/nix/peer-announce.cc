@@ -0,0 +1,52 @@
+#include "command.hh"
+#include "shared.hh"
+#include "globals.hh"
+#include "peer-store.hh"
+
+using namespace nix;
+
+struct CmdPeerAnnounce : Command
+{
+    std::string address = settings.peerDiscoveryAddress;
+    std::vector<std::string> uris;
+
+    CmdPeerAnnounce()
+    {
+        mkFlag()
+            .longName("address")
+            .labels({"address"})
+            .description("IPv4 address and port on which to answer discovery queries")
+            .dest(&address);
+
+        expectArgs("uris", &uris);
+    }
+
+    std::string name() override
+    {
+        return "peer-announce";
+    }
+
+    std::string description() override
+    {
+        return "make stores on this machine discoverable by the peer:// substituter";
+    }
+
+    Examples examples() override
+    {
+        return {
+            Example{
+                "To announce a binary cache served by nix-serve on this machine:",
+                "nix peer-announce http://machine1.local:5000"
+            },
+        };
+    }
+
+    void run() override
+    {
+        if (uris.empty())
+            throw UsageError("no store URIs to announce");
+        runPeerAnnouncer(address, Strings(uris.begin(), uris.end()));
+    }
+};
+
+static RegisterCommand r1(make_ref<CmdPeerAnnounce>());
@@ -8,6 +8,11 @@ outPath=$(nix-build dependencies.nix --no-out-link)
 
 nix copy --to file://$cacheDir $outPath
 
+# Copying with a single job and without pipelining gives the same result.
+rm -rf $TEST_ROOT/binary-cache-2
+nix copy --jobs 1 --option copy-buffer-size 0 --option copy-compression-buffer-size 0 --to file://$TEST_ROOT/binary-cache-2 $outPath
+diff <(cd $cacheDir && ls nar) <(cd $TEST_ROOT/binary-cache-2 && ls nar)
+
 
 basicTests() {
 
@@ -52,6 +57,70 @@ export _NIX_FORCE_HTTP_BINARY_CACHE_STORE=1
 basicTests
 
 
+# Test HttpBinaryCacheStore with the memory-mapped NAR info disk cache.
+echo "narinfo-cache-backend = mmap" >> $NIX_CONF_DIR/nix.conf
+basicTests
+[[ -e $TEST_HOME/.cache/nix/narinfo-cache-v1/index ]]
+sed -i '/^narinfo-cache-backend/d' $NIX_CONF_DIR/nix.conf
+
+
+# Test substitution with a single download slot, one build slot and
+# a rate-limited cache.
+clearStore
+clearCacheCache
+nix-store --substituters "file://$cacheDir?max-download-rate=100000" --no-require-sigs \
+    --option max-active-downloads 1 -j1 -r $outPath
+nix-store --check-validity $outPath
+
+
+# Test substitution of a NAR that is much larger than the buffer
+# between the download thread and the decompressor, so the download
+# has to wait for the NAR to be unpacked.
+bigCache=$TEST_ROOT/binary-cache-big
+rm -rf $bigCache
+clearStore
+bigPath=$(echo 'with import ./config.nix; mkDerivation { name = "big"; builder = builtins.toFile "builder" "mkdir $out; seq 1 1000000 > $out/big"; }' | nix-build - --no-out-link)
+bigHash=$(nix hash-path $bigPath)
+nix copy --to "file://$bigCache?compression=none" $bigPath
+
+clearStore
+clearCacheCache
+nix-store --substituters "file://$bigCache" --no-require-sigs -r $bigPath
+[[ $(nix hash-path $bigPath) = $bigHash ]]
+
+# A NAR that ends halfway is rejected, and the path doesn't become
+# valid.
+clearStore
+clearCacheCache
+nar=$(ls $bigCache/nar/*.nar)
+head -c 3000000 $nar > $nar.tmp
+mv $nar.tmp $nar
+(! nix-store --substituters "file://$bigCache" --no-require-sigs -r $bigPath)
+(! nix-store --check-validity $bigPath)
+
+# Downloads are resumed from the partial download kept in
+# ~/.cache/nix/partial-nars, also if it already holds the whole file.
+rm -rf $bigCache
+bigPath=$(echo 'with import ./config.nix; mkDerivation { name = "big"; builder = builtins.toFile "builder" "mkdir $out; seq 1 1000000 > $out/big"; }' | nix-build - --no-out-link)
+nix copy --to "file://$bigCache" $bigPath
+nar=$(ls $bigCache/nar/*.nar.xz)
+fileHash=$(basename $nar .nar.xz)
+narSize=$(wc -c < $nar)
+partialNars=$TEST_HOME/.cache/nix/partial-nars
+
+for size in $((narSize / 2)) $narSize; do
+    clearStore
+    clearCacheCache
+    mkdir -p $partialNars
+    head -c $size $nar > $partialNars/$fileHash.part
+    echo "$size sha256:$(nix hash-file --type sha256 --base16 $partialNars/$fileHash.part)" > $partialNars/$fileHash.checkpoint
+    nix-store --substituters "file://$bigCache" --no-require-sigs -r $bigPath 2> $TEST_ROOT/log
+    grep -q "resuming download of '.*' at byte $size" $TEST_ROOT/log
+    [[ $(nix hash-path $bigPath) = $bigHash ]]
+    [[ ! -e $partialNars/$fileHash.part ]]
+done
+
+
 unset _NIX_FORCE_HTTP_BINARY_CACHE_STORE
 
 
@@ -103,6 +172,55 @@ nix-build --substituters "file://$cacheDir" --no-require-sigs dependencies.nix -
 grep -q "copying path" $TEST_ROOT/log
 
 
+# Concurrent substitutions register their paths in one transaction. If
+# one of the registrations fails, only that substitution should fail.
+if [ -n "$(type -p sqlite3)" ]; then
+
+clearStore
+clearCacheCache
+
+cacheDir3=$TEST_ROOT/binary-cache-3
+rm -rf $cacheDir3
+
+goodPaths=
+for i in $(seq 1 8); do
+    echo $i > $TEST_ROOT/good-$i
+    goodPaths+=" $(nix-store --add $TEST_ROOT/good-$i)"
+done
+nix copy --to file://$cacheDir3 $goodPaths
+
+# A derivation that can't be parsed is rejected when it is registered.
+echo garbage > $TEST_ROOT/bad.drv
+nix-store --dump $TEST_ROOT/bad.drv > $cacheDir3/nar/bad.nar
+narHash=$(nix hash-file --type sha256 --base32 $cacheDir3/nar/bad.nar)
+badPath=$(nix-store --print-fixed-path --recursive sha256 $narHash bad.drv)
+cat > $cacheDir3/$(basename $badPath | cut -c1-32).narinfo <<EOF
+StorePath: $badPath
+URL: nar/bad.nar
+Compression: none
+NarHash: sha256:$narHash
+NarSize: $(wc -c < $cacheDir3/nar/bad.nar)
+References:
+EOF
+
+clearStore
+
+# Hold the database lock for a while, so that the registrations queue
+# up behind the first one.
+(echo 'begin exclusive;'; sleep 2; echo 'commit;') | sqlite3 $NIX_STATE_DIR/db/db.sqlite &
+sleep 0.5
+
+(! nix-store -r -j 16 -k --debug --substituters "file://$cacheDir3" --no-require-sigs $goodPaths $badPath 2> $TEST_ROOT/log)
+wait
+
+grep -q "registering .* paths from .* callers" $TEST_ROOT/log
+[[ $(grep -c "error parsing derivation" $TEST_ROOT/log) = 1 ]]
+nix-store --check-validity $goodPaths
+(! nix-store --check-validity $badPath)
+
+fi
+
+
 if [ -n "$HAVE_SODIUM" ]; then
 
 # Create a signed binary cache.
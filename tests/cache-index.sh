@@ -0,0 +1,45 @@
+source common.sh
+
+clearStore
+clearCache
+
+outPath=$(nix-build dependencies.nix --no-out-link)
+
+nix copy --to file://$cacheDir $outPath
+
+nix make-cache-index --store file://$cacheDir
+
+grep -q '^CacheIndex: nix-cache-index$' $cacheDir/nix-cache-info
+[[ $(grep -c -v '^#' $cacheDir/nix-cache-index) = $(ls $cacheDir/*.narinfo | wc -l) ]]
+
+# Paths added to the cache are appended to the index.
+clearCacheCache
+outPath2=$(nix-store --add ./cache-index.sh)
+nix copy --to file://$cacheDir $outPath2
+grep -q "^$(basename $outPath2 | cut -c1-32)$" $cacheDir/nix-cache-index
+
+clearStore
+clearCacheCache
+
+nix-store --substituters "file://$cacheDir" --no-require-sigs -r $outPath
+[ -x $outPath/program ]
+
+# With cache-index=true, a .narinfo that isn't in the index is
+# reported as missing without being looked up.
+clearStore
+clearCacheCache
+grep -v "^$(basename $outPath | cut -c1-32)$" $cacheDir/nix-cache-index > $TEST_ROOT/index
+mv $TEST_ROOT/index $cacheDir/nix-cache-index
+
+(! nix path-info --store "file://$cacheDir?cache-index=true" $outPath)
+
+# HTTP binary caches fetch nix-cache-info only when they're not in the
+# NAR info disk cache yet, so the index has to be remembered there.
+clearCacheCache
+_NIX_FORCE_HTTP_BINARY_CACHE_STORE=1 nix path-info --store "file://$cacheDir?cache-index=true" $outPath2
+(! _NIX_FORCE_HTTP_BINARY_CACHE_STORE=1 nix path-info --store "file://$cacheDir?cache-index=true" $outPath)
+
+# The index isn't used by default, since caches that are written to
+# over S3 or HTTP don't keep it up to date.
+clearCacheCache
+nix path-info --store file://$cacheDir $outPath
@@ -0,0 +1,53 @@
+source common.sh
+
+clearStore
+clearCache
+
+chunkCache=$TEST_ROOT/chunk-cache
+rm -rf $chunkCache
+
+cacheURI="file://$cacheDir?chunk-nars=true&chunk-size=4096&chunk-cache=$chunkCache"
+
+outPath=$(nix-build dependencies.nix --no-out-link)
+
+nix copy --to $cacheURI $outPath
+
+[[ -n $(ls $cacheDir/chunks) ]]
+
+HASH=$(nix hash-path $outPath)
+
+clearStore
+clearCacheCache
+
+nix copy --from $cacheURI $outPath --no-check-sigs
+
+HASH2=$(nix hash-path $outPath)
+
+[[ $HASH = $HASH2 ]]
+
+# Chunks should have been cached locally, so a second substitution
+# shouldn't need the binary cache's chunks.
+[[ -n $(ls $chunkCache) ]]
+
+clearStore
+clearCacheCache
+
+mv $cacheDir/chunks $cacheDir/chunks.old
+mkdir $cacheDir/chunks
+
+nix copy --from $cacheURI $outPath --no-check-sigs
+
+HASH3=$(nix hash-path $outPath)
+
+[[ $HASH = $HASH3 ]]
+
+# The chunk cache doesn't grow beyond 'chunk-cache-size'.
+rm -rf $cacheDir/chunks $chunkCache
+mv $cacheDir/chunks.old $cacheDir/chunks
+
+clearStore
+clearCacheCache
+
+nix copy --from "$cacheURI&chunk-cache-size=1024" $outPath --no-check-sigs
+
+[[ $(cat $chunkCache/* | wc -c) -le 1024 ]]
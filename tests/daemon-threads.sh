@@ -0,0 +1,40 @@
+source common.sh
+
+clearStore
+
+startDaemon --option daemon-threads 4
+
+storeCleared=1 $SHELL ./user-envs.sh
+
+# Queries are answered from a shared store, which must see the
+# changes made by the processes performing builds and deletions.
+outPath=$(nix-build dependencies.nix --no-out-link)
+nix-store --check-validity $outPath
+nix-store -q --references $outPath | grep -q input-2
+
+nix-store --delete $outPath
+(! nix-store --check-validity $outPath)
+
+nix-store --dump-db > $TEST_ROOT/d1
+NIX_REMOTE= nix-store --dump-db > $TEST_ROOT/d2
+cmp $TEST_ROOT/d1 $TEST_ROOT/d2
+
+# Idle connections, including ones that haven't finished the
+# greeting, don't tie up the daemon's threads.
+pids=()
+for ((i = 0; i < 6; i++)); do
+    sleep 30 | nix-daemon --stdio > /dev/null &
+    pids+=($!)
+done
+(printf 'cxin'; sleep 30) | nix-daemon --stdio > /dev/null &
+pids+=($!)
+sleep 1
+
+start=$SECONDS
+outPath=$(nix-build dependencies.nix --no-out-link)
+nix-store -q --references $outPath | grep -q input-2
+[[ $((SECONDS - start)) -lt 20 ]]
+
+kill -9 "${pids[@]}"
+
+killDaemon
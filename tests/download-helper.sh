@@ -0,0 +1,33 @@
+source common.sh
+
+clearStore
+
+socket=$TEST_HOME/.cache/nix/download-helper/socket
+rm -f $socket
+
+nix --debug download-helper --idle-timeout 3 2> $TEST_ROOT/download-helper.log &
+pid=$!
+
+for ((i = 0; i < 50; i++)); do
+    [[ -S $socket ]] && break
+    sleep 0.1
+done
+[[ -S $socket ]]
+
+# A second helper exits immediately.
+nix download-helper --idle-timeout 3
+
+head -c 100000 /dev/urandom > $TEST_ROOT/download-helper-file
+
+hash=$(nix-prefetch-url --option download-helper true file://$TEST_ROOT/download-helper-file)
+[[ $hash = $(nix hash-file --type sha256 --base32 $TEST_ROOT/download-helper-file) ]]
+
+# The download was done by the helper, not in-process.
+grep -q "starting download of file://$TEST_ROOT/download-helper-file" $TEST_ROOT/download-helper.log
+
+# Errors are passed back to the client.
+(! nix-prefetch-url --option download-helper true file://$TEST_ROOT/no-such-file)
+
+# The helper exits once it has been idle and removes its socket.
+wait $pid
+[[ ! -e $socket ]]
@@ -6,7 +6,8 @@ nix_tests = \
   gc.sh gc-concurrent.sh \
   referrers.sh user-envs.sh logging.sh nix-build.sh misc.sh fixed.sh \
   gc-runtime.sh check-refs.sh filter-source.sh \
-  remote-store.sh export.sh export-graph.sh \
+  remote-store.sh daemon-threads.sh multiplex.sh shared-path-info-cache.sh log-path-db.sh \
+  export.sh export-graph.sh \
   timeout.sh secure-drv-outputs.sh nix-channel.sh \
   multiple-outputs.sh import-derivation.sh fetchurl.sh optimise-store.sh \
   binary-cache.sh nix-profile.sh repair.sh dump-db.sh case-hack.sh \
@@ -22,6 +23,13 @@ nix_tests = \
   signing.sh \
   run.sh \
   brotli.sh \
+  xz-parallel.sh \
+  zstd.sh \
+  chunked-binary-cache.sh \
+  narinfo-bundle.sh \
+  cache-index.sh \
+  download-helper.sh \
+  peer-store.sh \
   pure-eval.sh \
   check.sh \
   plugins.sh \
@@ -0,0 +1,105 @@
+source common.sh
+
+clearStore
+
+outPath=$(nix-build dependencies.nix --no-out-link)
+drvPath=$(nix-instantiate dependencies.nix)
+nix-store --dump-db > $TEST_ROOT/d1
+
+nix-store --migrate-db log
+[[ -d $NIX_STATE_DIR/db/paths ]]
+[[ ! -e $NIX_STATE_DIR/db/db.sqlite ]]
+
+# The log-structured database doesn't list paths in any particular
+# order.
+nix-store --dump-db > $TEST_ROOT/d2
+cmp <(sort $TEST_ROOT/d1) <(sort $TEST_ROOT/d2)
+
+input2=$(nix-store -q --references $outPath | grep input-2)
+nix-store -q --referrers $input2 | grep -q $outPath
+nix-store -q --deriver $outPath | grep -q $drvPath
+nix-store -q --outputs $drvPath | grep -q $outPath
+
+# New registrations and deletions go to the new database.
+outPath2=$(nix-build fixed.nix -A good.0 --no-out-link)
+nix-store --check-validity $outPath2
+(! nix-store --delete $input2)
+nix-store --delete $outPath
+(! nix-store --check-validity $outPath)
+
+countInLog() {
+    grep -a -o "$1" $NIX_STATE_DIR/db/paths/log-* | wc -l
+}
+
+# A path that is registered again reuses its old referrer edge, so
+# only its own record is added to the log.
+echo referrer > $TEST_ROOT/referrer
+referrer=$(nix-store --add $TEST_ROOT/referrer)
+registerReferrer() {
+    printf '%s\n\n1\n%s\n' $referrer $input2 | nix-store --register-validity --reregister
+}
+registerReferrer
+nix-store --delete $referrer
+nix-store --add $TEST_ROOT/referrer
+n=$(countInLog $referrer)
+registerReferrer
+nix-store -q --referrers $input2 | grep -q $referrer
+[[ $(countInLog $referrer) = $((n + 1)) ]]
+nix-store --delete $referrer
+
+# A batch that was only partly written, e.g. because the writer
+# crashed, is ignored by readers and dropped by the next writer.
+nix-store --dump-db > $TEST_ROOT/d5
+printf '\100\000\000\000\000\000\000\000partial' >> $NIX_STATE_DIR/db/paths/log-*
+nix-store --dump-db | cmp - $TEST_ROOT/d5
+nix-store --add $TEST_ROOT/referrer 2> $TEST_ROOT/log
+grep -q 'discarding 15 bytes of incomplete data' $TEST_ROOT/log
+nix-store --check-validity $outPath2 $referrer
+
+# Concurrent writers. Re-registering paths over and over makes the
+# log mostly dead, so it's rebuilt in the meantime.
+oldLog=$(ls $NIX_STATE_DIR/db/paths | grep log-)
+pids=
+for i in 1 2 3 4; do
+    mkdir -p $TEST_ROOT/concurrent-$i
+    for j in $(seq 1 25); do echo $i-$j > $TEST_ROOT/concurrent-$i/$j; done
+    nix-store --add $TEST_ROOT/concurrent-$i/* > $TEST_ROOT/concurrent-$i.paths &
+    pids+=" $!"
+done
+for pid in $pids; do wait $pid; done
+nix-store --dump-db > $TEST_ROOT/d6
+pids=
+for i in 1 2 3 4; do
+    (for j in $(seq 1 10); do nix-store --load-db < $TEST_ROOT/d6; done) &
+    pids+=" $!"
+    (for j in $(seq 1 10); do nix-store -q --referrers $input2 > /dev/null; done) &
+    pids+=" $!"
+done
+for pid in $pids; do wait $pid; done
+[[ $(ls $NIX_STATE_DIR/db/paths | grep log-) != $oldLog ]]
+nix-store --check-validity $(cat $TEST_ROOT/concurrent-*.paths)
+cmp <(sort $TEST_ROOT/d6) <(nix-store --dump-db | sort)
+
+# Concurrent updates of a path don't undo each other.
+pids=
+for i in 1 2 3 4; do
+    nix-store --generate-binary-cache-key cache$i.example.org $TEST_ROOT/sk$i $TEST_ROOT/pk$i
+    nix sign-paths --key-file $TEST_ROOT/sk$i $outPath2 &
+    pids+=" $!"
+done
+for pid in $pids; do wait $pid; done
+sigs=$(nix path-info --sigs $outPath2)
+for i in 1 2 3 4; do [[ $sigs =~ cache$i.example.org ]]; done
+
+# A corrupt index is rebuilt from the log.
+nix-store --dump-db > $TEST_ROOT/d7
+echo garbage > $NIX_STATE_DIR/db/paths/index
+cmp <(sort $TEST_ROOT/d7) <(nix-store --dump-db 2> $TEST_ROOT/log | sort)
+grep -q 'rebuilding the index' $TEST_ROOT/log
+
+# Convert back.
+nix-store --dump-db > $TEST_ROOT/d3
+nix-store --migrate-db sqlite
+[[ ! -e $NIX_STATE_DIR/db/paths ]]
+nix-store --dump-db > $TEST_ROOT/d4
+cmp <(sort $TEST_ROOT/d3) <(sort $TEST_ROOT/d4)
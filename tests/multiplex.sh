@@ -0,0 +1,43 @@
+source common.sh
+
+clearStore
+
+startDaemon
+
+export NIX_REMOTE="daemon?multiplex=true&max-connections=4"
+
+storeCleared=1 $SHELL ./user-envs.sh
+
+# Build logs are sent on the channel of the operation that produced
+# them.
+outPath=$(nix-build dependencies.nix --no-out-link 2> $TEST_ROOT/multiplex.log)
+grep -q FOO $TEST_ROOT/multiplex.log
+nix-store --check-validity $outPath
+
+# Copy a closure with several operations in flight on the one
+# connection.
+cacheDir=$TEST_ROOT/multiplex-cache
+rm -rf $cacheDir
+nix copy --jobs 4 --to file://$cacheDir $outPath
+nix-store --delete $outPath
+nix copy --jobs 4 --no-check-sigs --from file://$cacheDir $outPath
+nix-store --check-validity $outPath
+
+# Upload several multi-megabyte paths at the same time. A channel
+# whose operation is waiting for a lock must not hold up the data of
+# the others.
+bigPaths=
+for i in 1 2 3 4; do
+    head -c 8000000 /dev/urandom > $TEST_ROOT/multiplex-big-$i
+    bigPaths+=" $(nix-store --add $TEST_ROOT/multiplex-big-$i)"
+done
+nix copy --to file://$cacheDir $bigPaths
+nix-store --delete $bigPaths
+timeout 60 nix copy --jobs 4 --no-check-sigs --from file://$cacheDir $bigPaths
+nix-store --verify-path $bigPaths
+
+nix-store --dump-db > $TEST_ROOT/d1
+NIX_REMOTE= nix-store --dump-db > $TEST_ROOT/d2
+cmp $TEST_ROOT/d1 $TEST_ROOT/d2
+
+killDaemon
@@ -0,0 +1,42 @@
+source common.sh
+
+clearStore
+clearCache
+
+outPath=$(nix-build dependencies.nix --no-out-link)
+
+nix copy --to file://$cacheDir $outPath
+
+nix make-narinfo-bundle --store file://$cacheDir
+
+grep -q '^NarInfoBundle: narinfo-bundle.xz$' $cacheDir/nix-cache-info
+[[ -e $cacheDir/narinfo-bundle.xz ]]
+
+dep=$(nix-store -q --references $outPath | head -n1)
+
+clearStore
+clearCacheCache
+
+# With the .narinfo files gone, path info can only come from the bundle.
+mkdir $TEST_ROOT/narinfos
+mv $cacheDir/*.narinfo $TEST_ROOT/narinfos/
+
+(! nix path-info --store file://$cacheDir $outPath)
+
+clearCacheCache
+
+nix path-info --store "file://$cacheDir?narinfo-bundle=true" $outPath
+
+nix-store --substituters "file://$cacheDir?narinfo-bundle=true" --no-require-sigs -r $outPath
+
+[ -x $outPath/program ]
+
+# HTTP binary caches fetch nix-cache-info only when they're not in the
+# NAR info disk cache yet, so the bundle has to be remembered there.
+clearCacheCache
+
+_NIX_FORCE_HTTP_BINARY_CACHE_STORE=1 nix path-info --store "file://$cacheDir?narinfo-bundle=true" $outPath
+_NIX_FORCE_HTTP_BINARY_CACHE_STORE=1 nix path-info --store "file://$cacheDir?narinfo-bundle=true" $dep
+
+mv $TEST_ROOT/narinfos/*.narinfo $cacheDir/
+rmdir $TEST_ROOT/narinfos
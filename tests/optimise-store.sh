@@ -41,3 +41,25 @@ if [ -n "$(ls $NIX_STORE_DIR/.links)" ]; then
     echo ".links directory not empty after GC"
     exit 1
 fi
+
+(! NIX_REMOTE='local?optimise-method=foo' nix-store --optimise)
+
+# Reflink mode needs a file system that can share extents between
+# files.
+echo probe > $TEST_ROOT/reflink-probe
+if cp --reflink=always $TEST_ROOT/reflink-probe $TEST_ROOT/reflink-probe2 2> /dev/null; then
+    outPath4=$(echo 'with import ./config.nix; mkDerivation { name = "foo4"; builder = builtins.toFile "builder" "mkdir $out; seq 1 200000 > $out/foo"; }' | nix-build - --no-out-link)
+    outPath5=$(echo 'with import ./config.nix; mkDerivation { name = "foo5"; builder = builtins.toFile "builder" "mkdir $out; seq 1 200000 > $out/foo"; }' | nix-build - --no-out-link)
+
+    NIX_REMOTE='local?optimise-method=reflink' nix-store --optimise 2>&1 | grep -q 'by deduplicating 1 files'
+
+    inode4="$(stat --format=%i $outPath4/foo)"
+    inode5="$(stat --format=%i $outPath5/foo)"
+    if [ "$inode4" = "$inode5" ]; then
+        echo "inodes match unexpectedly"
+        exit 1
+    fi
+
+    # Files that were deduplicated by a previous run are skipped.
+    NIX_REMOTE='local?optimise-method=reflink' nix-store --optimise 2>&1 | grep -q 'by deduplicating 0 files'
+fi
@@ -0,0 +1,61 @@
+source common.sh
+
+clearStore
+clearCache
+
+outPath=$(nix-build dependencies.nix --no-out-link)
+
+nix copy --to file://$cacheDir $outPath
+
+noDiscovery=(--option peer-discovery-address "")
+
+# Substitute from a configured peer.
+clearStore
+clearCacheCache
+
+nix-store --substituters peer:// --option peers file://$cacheDir "${noDiscovery[@]}" --no-require-sigs -r $outPath
+[ -x $outPath/program ]
+
+# Paths from peers must be signed.
+clearStore
+clearCacheCache
+
+(! nix-store --substituters peer:// --option peers file://$cacheDir "${noDiscovery[@]}" -r $outPath)
+
+# Fall back to the next substituter if no peer has the path.
+clearStore
+clearCacheCache
+
+nix-store --substituters "peer:// file://$cacheDir" "${noDiscovery[@]}" --no-require-sigs -r $outPath
+[ -x $outPath/program ]
+
+# Announced stores other than HTTP binary caches are ignored.
+port=$((20000 + RANDOM % 10000))
+nix peer-announce --address 127.0.0.1:$port file://$cacheDir &
+pid=$!
+trap "kill $pid" EXIT
+sleep 1
+
+clearStore
+clearCacheCache
+
+(! nix-store --substituters peer:// --option peer-discovery-address 127.0.0.1:$port --no-require-sigs -r $outPath 2> $TEST_ROOT/log)
+grep -q "ignoring announced peer store 'file://$cacheDir'" $TEST_ROOT/log
+
+# Announced stores with store parameters are ignored, since they could
+# make us write files in arbitrary places.
+kill $pid
+trap "" EXIT
+evilUri="http://localhost:1/?chunk-cache=$TEST_ROOT/evil"
+nix peer-announce --address 127.0.0.1:$port "$evilUri" &
+pid=$!
+trap "kill $pid" EXIT
+sleep 1
+
+# We also shouldn't wait for the full timeout once a peer has replied.
+start=$SECONDS
+(! nix-store --substituters peer:// --option peer-discovery-address 127.0.0.1:$port \
+    --option peer-discovery-timeout 20000 --no-require-sigs -r $outPath 2> $TEST_ROOT/log)
+grep -q "ignoring announced peer store '$evilUri'" $TEST_ROOT/log
+[[ $((SECONDS - start)) -lt 10 ]]
+[[ ! -e $TEST_ROOT/evil ]]
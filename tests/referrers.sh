@@ -26,6 +26,8 @@ echo "registering..."
 
 nix-store --register-validity < $TEST_ROOT/reg_info
 
+[ "$(nix-store -q --referrers-closure $reference | wc -l)" -eq $((max + 1)) ]
+
 echo "collecting garbage..."
 ln -sfn $reference "$NIX_STATE_DIR"/gcroots/ref
 nix-store --gc
@@ -34,3 +36,5 @@ if [ -n "$(type -p sqlite3)" -a "$(sqlite3 $NIX_STATE_DIR/db/db.sqlite 'select c
     echo "referrers not cleaned up"
     exit 1
 fi
+
+[ "$(nix-store -q --referrers-closure $reference)" = $reference ]
@@ -6,10 +6,55 @@ startDaemon
 
 storeCleared=1 $SHELL ./user-envs.sh
 
+# Closures are computed with batched queries; check that they agree
+# with the local store.
+outPath=$(nix-build dependencies.nix --no-out-link)
+[ "$(nix-store -qR $outPath)" = "$(NIX_REMOTE= nix-store -qR $outPath)" ]
+[ "$(nix-store -q --referrers-closure $outPath)" = "$(NIX_REMOTE= nix-store -q --referrers-closure $outPath)" ]
+[ "$(nix path-info -r $outPath)" = "$(NIX_REMOTE= nix path-info -r $outPath)" ]
+
+# Whole-store scans are streamed by the daemon in several batches.
+mkdir -p $TEST_ROOT/batch
+for i in $(seq 1 1100); do echo $i > $TEST_ROOT/batch/batch-$i; done
+nix-store --add $TEST_ROOT/batch/* > /dev/null
+[[ $(nix path-info --all | grep -c -- -batch-) = 1100 ]]
+[ "$(nix path-info --all)" = "$(NIX_REMOTE= nix path-info --all)" ]
+
 nix-store --dump-db > $TEST_ROOT/d1
 NIX_REMOTE= nix-store --dump-db > $TEST_ROOT/d2
 cmp $TEST_ROOT/d1 $TEST_ROOT/d2
 
+# The daemon applies prefix filters.
+[[ $(nix-store --dump-db --name-prefix batch- | grep -c -- -batch-) = 1100 ]]
+nix-store --dump-db --name-prefix dependencies-input > $TEST_ROOT/d3
+grep -q dependencies-input-2 $TEST_ROOT/d3
+(! grep -q "^$outPath\$" $TEST_ROOT/d3)
+hashPrefix=$(basename $outPath | cut -c1-3)
+nix-store --dump-db --hash-prefix $hashPrefix > $TEST_ROOT/d4
+grep -q "^$outPath\$" $TEST_ROOT/d4
+NIX_REMOTE= nix-store --dump-db --hash-prefix $hashPrefix | cmp - $TEST_ROOT/d4
+
+# A NAR that doesn't have the size that the client states is rejected
+# without the daemon hanging or reading past the end of the NAR.
+clearCache
+echo wrong-size-1 > $TEST_ROOT/wrong-size-1
+echo wrong-size-2 > $TEST_ROOT/wrong-size-2
+wrongSize1=$(nix-store --add $TEST_ROOT/wrong-size-1)
+wrongSize2=$(nix-store --add $TEST_ROOT/wrong-size-2)
+nix copy --to file://$cacheDir $wrongSize1 $wrongSize2
+nix-store --delete $wrongSize1 $wrongSize2
+narInfo=$cacheDir/$(basename $wrongSize1 | cut -c1-32).narinfo
+narSize=$(sed -n 's/^NarSize: //p' $narInfo)
+for size in $((narSize + 1000)) $((narSize - 8)); do
+    sed -i "s/^NarSize: .*/NarSize: $size/" $narInfo
+    clearCacheCache
+    (! timeout -s KILL 60 nix copy --no-check-sigs --from file://$cacheDir $wrongSize1 2> $TEST_ROOT/log)
+    grep -q "size mismatch importing path '$wrongSize1'" $TEST_ROOT/log
+    (! nix-store --check-validity $wrongSize1)
+done
+nix copy --no-check-sigs --from file://$cacheDir $wrongSize2
+nix-store --check-validity $wrongSize2
+
 nix-store --gc --max-freed 1K
 
 killDaemon
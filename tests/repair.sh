@@ -7,6 +7,19 @@ path2=$(nix-store -qR $path | grep input-2)
 
 nix-store --verify --check-contents -v
 
+# A partial run checks the paths that were verified least recently, so
+# the next one continues with the paths that weren't checked yet.
+verified=$NIX_STATE_DIR/db/verified
+rm -f $verified
+nix-store --verify --check-contents --option verify-contents-percentage 50
+cut -d ' ' -f 1 $verified | sort > $TEST_ROOT/verified-1
+nix-store --verify --check-contents --option verify-contents-percentage 50
+tail -n +$(($(wc -l < $TEST_ROOT/verified-1) + 1)) $verified | cut -d ' ' -f 1 | sort > $TEST_ROOT/verified-2
+nix-store --verify --check-contents
+cut -d ' ' -f 1 $verified | sort -u > $TEST_ROOT/verified-all
+[[ $(wc -l < $TEST_ROOT/verified-1) -lt $(wc -l < $TEST_ROOT/verified-all) ]]
+[[ -z $(comm -23 $TEST_ROOT/verified-all $TEST_ROOT/verified-1 | comm -23 - $TEST_ROOT/verified-2) ]]
+
 hash=$(nix-hash $path2)
 
 # Corrupt a path and check whether nix-build --repair can fix it.
@@ -18,6 +31,10 @@ if nix-store --verify --check-contents -v; then
     exit 1
 fi
 
+(! nix-store --verify --check-contents --json > $TEST_ROOT/verify.json)
+grep -q '"ok": false' $TEST_ROOT/verify.json
+grep -q "\"$path2\"" $TEST_ROOT/verify.json
+
 # The path can be repaired by rebuilding the derivation.
 nix-store --verify --check-contents --repair
 
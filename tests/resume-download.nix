@@ -0,0 +1,65 @@
+# Test resuming NAR downloads from a binary cache on a web server that
+# ignores Range requests (Python's http.server).
+
+{ nixpkgs, system, nix }:
+
+with import (nixpkgs + "/nixos/lib/testing.nix") { inherit system; };
+
+makeTest (let pkgA = pkgs.hello; in {
+
+  nodes =
+    { server =
+        { config, pkgs, ... }:
+        { virtualisation.writableStore = true;
+          virtualisation.pathsInNixDB = [ pkgA ];
+          nix.package = nix;
+          systemd.services.binary-cache =
+            { wantedBy = [ "multi-user.target" ];
+              script =
+                ''
+                  mkdir -p /srv/cache
+                  cd /srv/cache
+                  exec ${pkgs.python3}/bin/python3 -m http.server 8080
+                '';
+            };
+          networking.firewall.allowedTCPPorts = [ 8080 ];
+        };
+
+      client =
+        { config, pkgs, ... }:
+        { virtualisation.writableStore = true;
+          environment.systemPackages = [ pkgs.curl ];
+          nix.package = nix;
+          nix.binaryCaches = [ ];
+        };
+    };
+
+  testScript = { nodes }:
+    ''
+      startAll;
+
+      $server->succeed("nix copy --to file:///srv/cache ${pkgA}");
+      $server->waitForOpenPort(8080);
+
+      my $nar = $server->succeed("sed -n 's|^URL: nar/||p' /srv/cache/\$(basename ${pkgA} | cut -c1-32).narinfo");
+      chomp $nar;
+      my $fileHash = $nar =~ s/\.nar\.xz$//r;
+      my $size = $server->succeed("stat -c %s /srv/cache/nar/$nar");
+      chomp $size;
+
+      $client->waitForUnit("network.target");
+
+      # Pretend that an earlier download stopped halfway, or just
+      # before it would have finished.
+      foreach my $n (int($size / 2), $size) {
+          $client->succeed("mkdir -p /root/.cache/nix/partial-nars");
+          $client->succeed("cd /root/.cache/nix/partial-nars && curl -s http://server:8080/nar/$nar | head -c $n > $fileHash.part");
+          $client->succeed("cd /root/.cache/nix/partial-nars && echo \"$n sha256:\$(nix hash-file --type sha256 --base16 $fileHash.part)\" > $fileHash.checkpoint");
+          $client->succeed("nix-store -r ${pkgA} --option substituters http://server:8080 --option require-sigs false 2>&1 | tee /dev/stderr | grep 'resuming download of .* at byte $n'");
+          $client->succeed("nix-store --verify-path ${pkgA}");
+          $client->fail("test -e /root/.cache/nix/partial-nars/$fileHash.part");
+          $client->succeed("nix-store --delete ${pkgA}");
+      }
+    '';
+
+})
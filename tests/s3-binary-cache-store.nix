@@ -0,0 +1,75 @@
+# Test the S3 binary cache store against a local MinIO server,
+# including multi-part uploads and ranged parallel downloads.
+
+{ nixpkgs, system, nix }:
+
+with import (nixpkgs + "/nixos/lib/testing.nix") { inherit system; };
+
+let
+  accessKey = "BKIKJAA5BMMU2RHO6IBB";
+  secretKey = "V7f1CwQqAcwo80UEIJEjc5gVQUSSx5ohQ9GSrr12";
+  env = "AWS_ACCESS_KEY_ID=${accessKey} AWS_SECRET_ACCESS_KEY=${secretKey}";
+in
+
+makeTest (let pkgA = pkgs.firefox-unwrapped; in {
+
+  nodes =
+    { server =
+        { config, pkgs, ... }:
+        { virtualisation.writableStore = true;
+          virtualisation.pathsInNixDB = [ pkgA ];
+          virtualisation.memorySize = 1024;
+          environment.systemPackages = [ pkgs.minio-client ];
+          nix.binaryCaches = [ ];
+          nix.package = nix;
+          services.minio = {
+            enable = true;
+            region = "eu-west-1";
+            inherit accessKey secretKey;
+          };
+          networking.firewall.allowedTCPPorts = [ 9000 ];
+        };
+
+      client =
+        { config, pkgs, ... }:
+        { virtualisation.writableStore = true;
+          nix.package = nix;
+          nix.binaryCaches = [ ];
+        };
+    };
+
+  testScript = { nodes }:
+    let
+      # Small parts so that the NAR is uploaded and fetched in many parts.
+      storeUrl = "s3://my-cache?endpoint=http://server:9000&region=eu-west-1"
+        + "&buffer-size=5242880&multipart-upload-concurrency=4"
+        + "&download-part-size=1048576&download-concurrency=4";
+    in
+    ''
+      startAll;
+
+      $server->waitForUnit("minio");
+
+      $server->succeed("mc config host add minio http://localhost:9000 ${accessKey} ${secretKey} S3v4");
+      $server->succeed("mc mb minio/my-cache");
+
+      $server->succeed("${env} nix copy --to '${storeUrl}' ${pkgA}");
+
+      $client->waitForUnit("network.target");
+      $client->fail("nix-store --check-validity ${pkgA}");
+      $client->succeed("${env} nix copy --no-check-sigs --from '${storeUrl}' ${pkgA}");
+      $client->succeed("nix-store --check-validity ${pkgA}");
+      $client->succeed("nix-store --verify-path ${pkgA}");
+
+      # Disabling ranged downloads should give the same result.
+      $client->succeed("nix-store --delete ${pkgA}");
+      $client->succeed("${env} nix copy --no-check-sigs --from '${storeUrl}&download-part-size=0' ${pkgA}");
+      $client->succeed("nix-store --verify-path ${pkgA}");
+
+      # S3 rejects ranged GETs of empty objects, but they can still be
+      # fetched.
+      $server->succeed("touch /tmp/empty && mc cp /tmp/empty minio/my-cache/log/00000000000000000000000000000000-empty.drv");
+      $client->succeed("${env} nix log --store '${storeUrl}' /nix/store/00000000000000000000000000000000-empty.drv");
+    '';
+
+})
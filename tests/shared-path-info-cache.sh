@@ -0,0 +1,38 @@
+source common.sh
+
+clearStore
+
+startDaemon --option shared-path-info-cache-size 1024
+
+outPath=$(nix-build dependencies.nix --no-out-link)
+nix-store -q --references $outPath | grep -q input-2
+[[ -e $NIX_STATE_DIR/db/path-info-cache ]]
+
+# Clients read path info from the cache, which must not return
+# changed info or paths that have been deleted.
+nix-store --generate-binary-cache-key cache1.example.org $TEST_ROOT/sk1 $TEST_ROOT/pk1
+nix path-info --sigs $outPath | (! grep -q cache1.example.org)
+nix sign-paths --key-file $TEST_ROOT/sk1 $outPath
+nix path-info --sigs $outPath | grep -q cache1.example.org
+
+nix-store --delete $outPath
+(! nix-store --check-validity $outPath)
+(! nix path-info $outPath)
+
+nix-store --dump-db > $TEST_ROOT/d1
+NIX_REMOTE= nix-store --dump-db > $TEST_ROOT/d2
+cmp $TEST_ROOT/d1 $TEST_ROOT/d2
+
+killDaemon
+
+# The cache must not outlive the database it was filled from, e.g.
+# when the database is restored from a backup in place.
+export NIX_REMOTE=
+path1=$(nix-store --add dependencies.nix)
+cp $NIX_STATE_DIR/db/db.sqlite $TEST_ROOT/db.sqlite
+path2=$(nix-store --add common.sh)
+nix-store -q --hash $path2
+cp $TEST_ROOT/db.sqlite $NIX_STATE_DIR/db/db.sqlite
+rm -f $NIX_STATE_DIR/db/db.sqlite-*
+(! nix-store -q --hash $path2)
+nix-store -q --hash $path1
@@ -0,0 +1,29 @@
+source common.sh
+
+clearStore
+clearCache
+
+# At compression level 1, parallel xz compression produces blocks of
+# 1 MiB, so this NAR is split into several blocks, which are then
+# decoded in parallel.
+cacheURI="file://$cacheDir?compression=xz&parallel-compression=true&compression-level=1"
+
+outPath=$(echo 'with import ./config.nix; mkDerivation { name = "big"; builder = builtins.toFile "builder" "mkdir $out; seq 1 1000000 > $out/big"; }' | nix-build - --no-out-link)
+
+nix copy --to $cacheURI $outPath
+
+if type -p xz > /dev/null; then
+    nar=$(ls $cacheDir/nar/*.nar.xz)
+    [[ $(xz --robot --list $nar | awk -F'\t' '$1 == "totals" { print $3 }') -gt 1 ]]
+fi
+
+HASH=$(nix hash-path $outPath)
+
+clearStore
+clearCacheCache
+
+nix copy --from $cacheURI $outPath --no-check-sigs
+
+HASH2=$(nix hash-path $outPath)
+
+[[ $HASH = $HASH2 ]]
@@ -0,0 +1,48 @@
+source common.sh
+
+
+# Only test if we found the zstd library
+if [ -n "$HAVE_ZSTD" ]; then
+
+# Copy $outPath to a binary cache with the given parameters, then
+# substitute it from there and check that it's unchanged.
+testRoundTrip() {
+    cacheURI="file://$cacheDir?$1"
+
+    clearCache
+
+    nix copy --to $cacheURI $outPath
+
+    HASH=$(nix hash-path $outPath)
+
+    clearStore
+    clearCacheCache
+
+    nix copy --from $cacheURI $outPath --no-check-sigs
+
+    HASH2=$(nix hash-path $outPath)
+
+    [[ $HASH = $HASH2 ]]
+}
+
+clearStore
+
+outPath=$(nix-build dependencies.nix --no-out-link)
+
+testRoundTrip "compression=zstd&compression-level=3"
+
+# The NAR of this path (a 262032-byte file plus 112 bytes of NAR
+# framing) fills exactly two zstd output blocks.
+outPath=$(echo 'with import ./config.nix; mkDerivation { name = "zstd-boundary"; builder = builtins.toFile "builder" "head -c 262032 /dev/zero > $out"; }' | nix-build - --no-out-link)
+[[ $(nix-store -q --size $outPath) = 262144 ]]
+
+testRoundTrip "compression=zstd"
+
+# An empty file is truncated zstd data, not an empty stream.
+clearStore
+clearCacheCache
+truncate -s 0 $cacheDir/nar/*.nar.zst
+(! nix copy --from $cacheURI $outPath --no-check-sigs 2> $TEST_ROOT/log)
+grep -q 'zstd data ends prematurely' $TEST_ROOT/log
+
+fi # HAVE_ZSTD